@@ -0,0 +1,574 @@
+/*
+
+DoIP (ISO 13400-2) server over TCP, see doip_server.h
+
+*/
+
+#include "doip_server.h"
+#include "uds_service_registry.h"
+
+#include <iostream>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define DOIP_MAX_EVENTS 16
+#define DOIP_RX_CHUNK 65536     // free space in the receive buffer for each read
+#define DOIP_DIAG_HEADER_LEN 4  // source and target address in front of the UDS data
+#define DOIP_ACK_LEN (DOIP_HEADER_LEN + DOIP_DIAG_HEADER_LEN + 1)
+#define DOIP_RESPONSE_OFFSET (DOIP_ACK_LEN + DOIP_HEADER_LEN + DOIP_DIAG_HEADER_LEN)
+
+Doip_Server::Doip_Server(doip_options options) : options(options)
+{
+}
+
+Doip_Server::~Doip_Server()
+{
+  while (!connections.empty())
+  {
+    close_connection(connections.begin()->first);
+  }
+  if (listen_fd != -1)
+  {
+    close(listen_fd);
+  }
+  if (epoll_fd != -1)
+  {
+    close(epoll_fd);
+  }
+}
+
+// listens on the given IPv4 address and options.port (0 = any free port, see port()), returns -1 in case of an error
+int Doip_Server::open(const char *address)
+{
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1)
+  {
+    perror("can't create epoll");
+    return -1;
+  }
+  listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd == -1)
+  {
+    perror("can't create DoIP socket");
+    return -1;
+  }
+  int enable = 1;
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(options.port);
+  if (inet_pton(AF_INET, address, &addr.sin_addr) != 1)
+  {
+    std::cerr << "invalid DoIP address " << address << std::endl;
+    return -1;
+  }
+  if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) == -1)
+  {
+    perror("can't bind DoIP socket");
+    return -1;
+  }
+  if (listen(listen_fd, SOMAXCONN) == -1)
+  {
+    perror("can't listen on DoIP socket");
+    return -1;
+  }
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = listen_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1)
+  {
+    perror("can't watch DoIP socket");
+    return -1;
+  }
+  return 0;
+}
+
+// the port the server listens on
+int Doip_Server::port() const
+{
+  sockaddr_in addr = {};
+  socklen_t len = sizeof(addr);
+  if (listen_fd == -1 || getsockname(listen_fd, (sockaddr *)&addr, &len) == -1)
+  {
+    return -1;
+  }
+  return ntohs(addr.sin_port);
+}
+
+// the system clock, the same as the event loop
+uint64_t Doip_Server::now_ticks() const
+{
+  uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  return us / 1000 * options.ticks_per_ms + us % 1000 * options.ticks_per_ms / 1000;
+}
+
+/*
+serves the connections which have something to do, waits up to timeout_ms (-1: until something happens) for them.
+Returns the number of served events, -1 in case of an error
+*/
+int Doip_Server::poll(int timeout_ms)
+{
+  epoll_event events[DOIP_MAX_EVENTS];
+  int count = epoll_wait(epoll_fd, events, DOIP_MAX_EVENTS, timeout_ms);
+  if (count == -1)
+  {
+    if (errno == EINTR)
+    {
+      return 0;
+    }
+    perror("epoll_wait");
+    return -1;
+  }
+  for (int i = 0; i < count; i++)
+  {
+    int fd = events[i].data.fd;
+    if (fd == listen_fd)
+    {
+      accept_connections();
+      continue;
+    }
+    std::map<int, std::unique_ptr<connection>>::iterator entry = connections.find(fd);
+    if (entry == connections.end())
+    {
+      continue; // closed meanwhile
+    }
+    connection &client = *entry->second;
+    if (events[i].events & EPOLLOUT)
+    {
+      if (!flush(client))
+      {
+        close_connection(fd);
+        continue;
+      }
+      if (client.tx_start == client.tx_end && !parse(client))
+      { // the response is out, go on with the requests received meanwhile
+        continue;
+      }
+    }
+    if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    {
+      receive(client);
+    }
+  }
+  return count;
+}
+
+// for Isotp_Event_Loop::add_fd(), context is the Doip_Server
+void Doip_Server::poll_handler(void *context)
+{
+  static_cast<Doip_Server *>(context)->poll(0);
+}
+
+void Doip_Server::accept_connections()
+{
+  while (true)
+  {
+    int fd = accept4(listen_fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      {
+        perror("can't accept DoIP connection");
+      }
+      return;
+    }
+    if ((int)connections.size() >= options.max_connections)
+    {
+      close(fd);
+      continue;
+    }
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+    {
+      perror("can't watch DoIP connection");
+      close(fd);
+      continue;
+    }
+    connection *client = new connection();
+    client->fd = fd;
+    client->last_action_tick = now_ticks();
+    connections[fd].reset(client);
+    stats.connections++;
+  }
+}
+
+// reads what the connection has received and handles the complete messages
+void Doip_Server::receive(connection &client)
+{
+  if (client.tx_start != client.tx_end)
+  {
+    return; // not before the last response is out
+  }
+  size_t needed = DOIP_RX_CHUNK;
+  size_t available = client.rx_end - client.rx_start;
+  if (!client.discard && available >= DOIP_HEADER_LEN)
+  { // the header of an incomplete message, which has been accepted by parse(): room for all of it
+    const unsigned char *header = client.rx.data() + client.rx_start;
+    size_t total = DOIP_HEADER_LEN + ((uint32_t)header[4] << 24 | header[5] << 16 | header[6] << 8 | header[7]);
+    needed = total - available > needed ? total - available : needed;
+  }
+  if (client.rx.size() - client.rx_end < needed)
+  {
+    if (client.rx_start)
+    { // only the beginning of the next message is moved
+      std::memmove(client.rx.data(), client.rx.data() + client.rx_start, available);
+      client.rx_start = 0;
+      client.rx_end = available;
+    }
+    if (client.rx.size() - client.rx_end < needed)
+    {
+      client.rx.resize(client.rx_end + needed);
+    }
+  }
+  ssize_t len = read(client.fd, client.rx.data() + client.rx_end, client.rx.size() - client.rx_end);
+  if (len == 0 || (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+  { // closed by the tester
+    close_connection(client.fd);
+    return;
+  }
+  if (len > 0)
+  {
+    client.rx_end += len;
+    client.last_action_tick = now_ticks();
+    parse(client);
+  }
+}
+
+/*
+handles the complete messages in the receive buffer, until the buffer is empty or a response waits to be sent.
+Returns false if the connection has been closed
+*/
+bool Doip_Server::parse(connection &client)
+{
+  while (client.tx_start == client.tx_end)
+  {
+    size_t available = client.rx_end - client.rx_start;
+    if (client.discard)
+    { // the rest of a refused message
+      size_t skip = client.discard < available ? client.discard : available;
+      client.rx_start += skip;
+      client.discard -= skip;
+      available -= skip;
+    }
+    if (available < DOIP_HEADER_LEN)
+    {
+      break;
+    }
+    unsigned char *header = client.rx.data() + client.rx_start;
+    if (header[1] != (header[0] ^ 0xFF) || (header[0] > 3 && header[0] != 0xFF) || header[0] == 0)
+    {
+      send_generic_nack(client, DOIP_NACK_INCORRECT_PATTERN);
+      close_connection(client.fd);
+      return false;
+    }
+    int payload_type = header[2] << 8 | header[3];
+    uint32_t len = (uint32_t)header[4] << 24 | header[5] << 16 | header[6] << 8 | header[7];
+    bool valid_len;
+    switch (payload_type)
+    {
+    case DOIP_ROUTING_ACTIVATION_REQUEST:
+      valid_len = len == 7 || len == 11;
+      break;
+    case DOIP_ALIVE_CHECK_RESPONSE:
+      valid_len = len == 2;
+      break;
+    case DOIP_DIAGNOSTIC_MESSAGE:
+      valid_len = len > DOIP_DIAG_HEADER_LEN;
+      if (len > (uint32_t)options.max_message + DOIP_DIAG_HEADER_LEN)
+      {
+        send_generic_nack(client, DOIP_NACK_MESSAGE_TOO_LARGE);
+        client.rx_start += DOIP_HEADER_LEN;
+        client.discard = len;
+        continue;
+      }
+      break;
+    default:
+      send_generic_nack(client, DOIP_NACK_UNKNOWN_PAYLOAD_TYPE);
+      client.rx_start += DOIP_HEADER_LEN;
+      client.discard = len;
+      continue;
+    }
+    if (!valid_len)
+    {
+      send_generic_nack(client, DOIP_NACK_INVALID_PAYLOAD_LENGTH);
+      close_connection(client.fd);
+      return false;
+    }
+    if (available < DOIP_HEADER_LEN + len)
+    {
+      break; // receive() makes room for the rest
+    }
+    client.rx_start += DOIP_HEADER_LEN + len;
+    if (!handle_message(client, payload_type, header + DOIP_HEADER_LEN, len))
+    {
+      return false;
+    }
+  }
+  if (client.rx_start == client.rx_end)
+  {
+    client.rx_start = client.rx_end = 0;
+  }
+  return true;
+}
+
+// a complete message with a valid length, returns false if the connection has been closed
+bool Doip_Server::handle_message(connection &client, int payload_type, unsigned char *payload, uint32_t len)
+{
+  switch (payload_type)
+  {
+  case DOIP_ROUTING_ACTIVATION_REQUEST:
+    routing_activation(client, payload, len);
+    break;
+  case DOIP_DIAGNOSTIC_MESSAGE:
+    diagnostic_message(client, payload, len);
+    break;
+  default: // alive check response: the activity is enough
+    return true;
+  }
+  if (!flush(client) || client.tester_address == -1)
+  { // a refused activation or diagnostic message closes the connection
+    close_connection(client.fd);
+    return false;
+  }
+  return true;
+}
+
+void Doip_Server::routing_activation(connection &client, const unsigned char *payload, uint32_t len)
+{
+  int source_address = payload[0] << 8 | payload[1];
+  int activation_type = payload[2];
+  int code = DOIP_ROUTING_SUCCESS;
+  if (activation_type != 0x00 && activation_type != 0x01) // default, WWH-OBD
+  {
+    code = DOIP_ROUTING_UNSUPPORTED_TYPE;
+  }
+  else if (client.tester_address != -1 && client.tester_address != source_address)
+  {
+    code = DOIP_ROUTING_DIFFERENT_ADDRESS;
+  }
+  else
+  {
+    for (std::pair<const int, std::unique_ptr<connection>> &other : connections)
+    {
+      if (other.second.get() != &client && other.second->tester_address == source_address)
+      {
+        code = DOIP_ROUTING_ALREADY_ACTIVE;
+      }
+    }
+  }
+  unsigned char response[9] = {0};
+  response[0] = source_address >> 8;
+  response[1] = source_address & 0xFF;
+  response[2] = options.logical_address >> 8;
+  response[3] = options.logical_address & 0xFF;
+  response[4] = code;
+  send_message(client, DOIP_ROUTING_ACTIVATION_RESPONSE, response, sizeof(response));
+  client.tester_address = code == DOIP_ROUTING_SUCCESS ? source_address : -1;
+}
+
+/*
+acknowledges the request and answers it by the handler: the acknowledge, the response header and the response
+are written one after the other into the transmit buffer, the handler writes its response straight into it
+*/
+void Doip_Server::diagnostic_message(connection &client, unsigned char *payload, uint32_t len)
+{
+  int source_address = payload[0] << 8 | payload[1];
+  int target_address = payload[2] << 8 | payload[3];
+  unsigned char *request = payload + DOIP_DIAG_HEADER_LEN;
+  int request_len = len - DOIP_DIAG_HEADER_LEN;
+  unsigned char *out = reserve(client, DOIP_RESPONSE_OFFSET + options.max_message);
+  put_header(out, DOIP_DIAGNOSTIC_ACK, DOIP_DIAG_HEADER_LEN + 1);
+  out[8] = target_address >> 8;
+  out[9] = target_address & 0xFF;
+  out[10] = source_address >> 8;
+  out[11] = source_address & 0xFF;
+  out[12] = 0x00; // ok
+  if (source_address != client.tester_address || (target_address != options.logical_address && target_address != options.functional_address))
+  {
+    int code = source_address != client.tester_address ? DOIP_DIAG_INVALID_SOURCE : DOIP_DIAG_UNKNOWN_TARGET;
+    out[3] = DOIP_DIAGNOSTIC_NACK & 0xFF;
+    out[12] = code;
+    client.tx_end += DOIP_ACK_LEN;
+    stats.nacks++;
+    if (code == DOIP_DIAG_INVALID_SOURCE)
+    {
+      client.tester_address = -1; // closes the connection
+    }
+    return;
+  }
+  stats.requests++;
+  stats.request_bytes += request_len;
+  unsigned char *response = out + DOIP_RESPONSE_OFFSET;
+  int response_len = 0;
+  if (options.services)
+  {
+    response_len = options.services->dispatch(request, request_len, response, options.max_message);
+  }
+  else if (options.uds_handler_ctx)
+  {
+    response_len = options.uds_handler_ctx(options.handler_context, RequestType::Service, request, request_len, response);
+  }
+  else if (options.uds_handler)
+  {
+    response_len = options.uds_handler(RequestType::Service, request, request_len, response);
+  }
+  response_len = response_len > options.max_message ? options.max_message : response_len;
+  bool suppress_positive = request_len > 1 && (request[1] & 0x80) && Service::has_sub_function(request[0]);
+  if (response_len > 0 && suppress_positive && response[0] != Service::NegativeResponse)
+  {
+    response_len = 0;
+  }
+  client.tx_end += DOIP_ACK_LEN;
+  if (response_len > 0)
+  {
+    unsigned char *header = out + DOIP_ACK_LEN;
+    put_header(header, DOIP_DIAGNOSTIC_MESSAGE, DOIP_DIAG_HEADER_LEN + response_len);
+    header[8] = options.logical_address >> 8;
+    header[9] = options.logical_address & 0xFF;
+    header[10] = source_address >> 8;
+    header[11] = source_address & 0xFF;
+    client.tx_end += DOIP_HEADER_LEN + DOIP_DIAG_HEADER_LEN + response_len;
+    stats.responses++;
+    stats.response_bytes += response_len;
+  }
+}
+
+// room for len bytes at the end of the transmit buffer; the memory is only touched as far as it is written
+unsigned char *Doip_Server::reserve(connection &client, size_t len)
+{
+  if (client.tx_start == client.tx_end)
+  {
+    client.tx_start = client.tx_end = 0;
+  }
+  if (client.tx_size < client.tx_end + len)
+  {
+    size_t size = client.tx_end + len;
+    unsigned char *buffer = new unsigned char[size];
+    std::memcpy(buffer, client.tx.get() + client.tx_start, client.tx_end - client.tx_start);
+    client.tx_end -= client.tx_start;
+    client.tx_start = 0;
+    client.tx.reset(buffer);
+    client.tx_size = size;
+  }
+  return client.tx.get() + client.tx_end;
+}
+
+void Doip_Server::put_header(unsigned char *data, int payload_type, uint32_t len)
+{
+  data[0] = options.protocol_version;
+  data[1] = options.protocol_version ^ 0xFF;
+  data[2] = payload_type >> 8;
+  data[3] = payload_type & 0xFF;
+  data[4] = len >> 24;
+  data[5] = len >> 16 & 0xFF;
+  data[6] = len >> 8 & 0xFF;
+  data[7] = len & 0xFF;
+}
+
+void Doip_Server::send_message(connection &client, int payload_type, const unsigned char *payload, uint32_t len)
+{
+  unsigned char *out = reserve(client, DOIP_HEADER_LEN + len);
+  put_header(out, payload_type, len);
+  std::memcpy(out + DOIP_HEADER_LEN, payload, len);
+  client.tx_end += DOIP_HEADER_LEN + len;
+}
+
+void Doip_Server::send_generic_nack(connection &client, int code)
+{
+  unsigned char nack = code;
+  send_message(client, DOIP_GENERIC_NACK, &nack, 1);
+  stats.nacks++;
+  if (!flush(client))
+  {
+    client.tx_start = client.tx_end; // closed anyway
+  }
+}
+
+// writes as much of the transmit buffer as the connection takes, false if it is broken
+bool Doip_Server::flush(connection &client)
+{
+  while (client.tx_start != client.tx_end)
+  {
+    ssize_t len = send(client.fd, client.tx.get() + client.tx_start, client.tx_end - client.tx_start, MSG_NOSIGNAL);
+    if (len == -1)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        break;
+      }
+      return false;
+    }
+    client.tx_start += len;
+  }
+  if (client.tx_start == client.tx_end)
+  {
+    client.tx_start = client.tx_end = 0;
+  }
+  update_events(client);
+  return true;
+}
+
+// while a response waits, the connection waits for room to send instead of further requests
+void Doip_Server::update_events(connection &client)
+{
+  bool wait_writable = client.tx_start != client.tx_end;
+  if (wait_writable == client.wait_writable)
+  {
+    return;
+  }
+  epoll_event event = {};
+  event.events = wait_writable ? EPOLLOUT : EPOLLIN;
+  event.data.fd = client.fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client.fd, &event);
+  client.wait_writable = wait_writable;
+}
+
+void Doip_Server::close_connection(int fd)
+{
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, 0);
+  close(fd);
+  connections.erase(fd);
+}
+
+// closes the connections without routing activation after initial_timeout and the inactive ones
+bool Doip_Server::tick(uint64_t time_ticks)
+{
+  std::vector<int> expired;
+  for (std::pair<const int, std::unique_ptr<connection>> &entry : connections)
+  {
+    connection &client = *entry.second;
+    int timeout = client.tester_address == -1 ? options.initial_timeout : options.inactivity_timeout;
+    if (client.last_action_tick + (uint64_t)timeout * options.ticks_per_ms < time_ticks)
+    {
+      expired.push_back(entry.first);
+    }
+  }
+  for (int fd : expired)
+  {
+    close_connection(fd);
+    stats.timeouts++;
+  }
+  return false; // the timeouts are far longer than the rounds of the event loop
+}
+
+// for Isotp_Event_Loop::add_tick_handler(), context is the Doip_Server
+bool Doip_Server::tick_handler(void *context, uint64_t time_ticks)
+{
+  return static_cast<Doip_Server *>(context)->tick(time_ticks);
+}
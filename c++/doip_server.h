@@ -0,0 +1,143 @@
+#ifndef DOIP_SERVER_H
+#define DOIP_SERVER_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "isotp_listener.h"
+
+/*
+DoIP (ISO 13400-2) server: UDS diagnostics over TCP, served by the same handlers as the Isotp_Listener
+
+testers connect by TCP (port 13400), activate their routing with their logical address and then send diagnostic
+messages to options.logical_address (or options.functional_address). Each request is acknowledged and given to
+options.services, options.uds_handler_ctx or options.uds_handler, as a listener would do - just without the 4095
+byte limit of ISO-TP: messages of up to options.max_message bytes are passed, a handler can write a response of up
+to options.max_message bytes (the services get it as max_len). Handlers which are shared with listeners must stay
+within UDS_BUFFER_SIZE there.
+
+the messages are parsed in place: the data of a request is read straight behind its header into the receive buffer
+of the connection and handed to the handler from there; the handler writes its response into the transmit buffer,
+behind the already prepared acknowledge and response header, so both go out with one write() without being copied.
+A connection which can't send its response at once isn't read any further until the response is out.
+
+all connections are served by one epoll descriptor, fd(), which is readable as long as one of them has something to
+do: poll() serves it without blocking. With the event loop:
+loop.add_fd(server.fd(), &Doip_Server::poll_handler, &server);
+loop.add_tick_handler(&Doip_Server::tick_handler, &server);
+the tick handler closes the connections which stay inactive too long.
+*/
+
+#define DOIP_PORT 13400
+#define DOIP_HEADER_LEN 8
+
+// payload types
+#define DOIP_GENERIC_NACK 0x0000
+#define DOIP_ROUTING_ACTIVATION_REQUEST 0x0005
+#define DOIP_ROUTING_ACTIVATION_RESPONSE 0x0006
+#define DOIP_ALIVE_CHECK_REQUEST 0x0007
+#define DOIP_ALIVE_CHECK_RESPONSE 0x0008
+#define DOIP_DIAGNOSTIC_MESSAGE 0x8001
+#define DOIP_DIAGNOSTIC_ACK 0x8002
+#define DOIP_DIAGNOSTIC_NACK 0x8003
+
+// generic header negative acknowledge codes
+#define DOIP_NACK_INCORRECT_PATTERN 0x00
+#define DOIP_NACK_UNKNOWN_PAYLOAD_TYPE 0x01
+#define DOIP_NACK_MESSAGE_TOO_LARGE 0x02
+#define DOIP_NACK_INVALID_PAYLOAD_LENGTH 0x04
+
+// routing activation response codes
+#define DOIP_ROUTING_DIFFERENT_ADDRESS 0x02 // the connection is active with another source address
+#define DOIP_ROUTING_ALREADY_ACTIVE 0x03 // the source address is active on another connection
+#define DOIP_ROUTING_UNSUPPORTED_TYPE 0x06
+#define DOIP_ROUTING_SUCCESS 0x10
+
+// diagnostic message negative acknowledge codes
+#define DOIP_DIAG_INVALID_SOURCE 0x02
+#define DOIP_DIAG_UNKNOWN_TARGET 0x03
+
+struct doip_options
+{
+    int port = DOIP_PORT;
+    uint16_t logical_address = 0x0E80;    // of this DoIP entity
+    uint16_t functional_address = 0xE400; // functionally addressed requests, answered like the physical ones
+    int protocol_version = 2;             // sent in the headers, 2 = ISO 13400-2:2012
+    int max_message = 16 * 1024 * 1024;   // the largest request and response (UDS data, without the DoIP headers)
+    int max_connections = 16;
+    int initial_timeout = 2000;           // ms from the connect until the routing activation
+    int inactivity_timeout = 300000;      // ms without a message until a connection is closed
+    int ticks_per_ms = 1000;              // the resolution of the time given to tick()
+    int (*uds_handler)(RequestType request_type, uds_buffer receive_buffer, int recv_len, uds_buffer send_buffer) = 0;
+    void *handler_context = 0;
+    int (*uds_handler_ctx)(void *context, RequestType request_type, uds_buffer receive_buffer, int recv_len, uds_buffer send_buffer) = 0;
+    Uds_Service_Registry *services = 0; // if set, the requests are dispatched by this registry instead of the uds_handler
+};
+
+struct doip_stats
+{
+    unsigned long connections = 0;  // accepted
+    unsigned long requests = 0;     // diagnostic messages given to the handler
+    unsigned long responses = 0;
+    unsigned long long request_bytes = 0;
+    unsigned long long response_bytes = 0;
+    unsigned long nacks = 0;        // generic and diagnostic negative acknowledges
+    unsigned long timeouts = 0;     // connections closed by inactivity
+};
+
+class Doip_Server
+{
+private:
+    struct connection
+    {
+        int fd;
+        int tester_address = -1; // -1 until the routing is activated
+        std::vector<unsigned char> rx; // received bytes between rx_start and rx_end
+        size_t rx_start = 0;
+        size_t rx_end = 0;
+        size_t discard = 0;            // payload bytes still to skip of a refused message
+        std::unique_ptr<unsigned char[]> tx; // the unsent bytes between tx_start and tx_end
+        size_t tx_size = 0;
+        size_t tx_start = 0;
+        size_t tx_end = 0;
+        bool wait_writable = false;
+        uint64_t last_action_tick = 0;
+    };
+    doip_options options;
+    int listen_fd = -1;
+    int epoll_fd = -1;
+    std::map<int, std::unique_ptr<connection>> connections; // by socket descriptor
+    doip_stats stats;
+
+public:
+    Doip_Server(doip_options options = doip_options());
+    ~Doip_Server();
+    int open(const char *address = "0.0.0.0");
+    int fd() const { return epoll_fd; }
+    int port() const;
+    int poll(int timeout_ms = 0);
+    bool tick(uint64_t time_ticks);
+    int connection_count() const { return connections.size(); }
+    doip_stats get_stats() const { return stats; }
+    static void poll_handler(void *context);
+    static bool tick_handler(void *context, uint64_t time_ticks);
+
+private:
+    void accept_connections();
+    void receive(connection &client);
+    bool parse(connection &client);
+    bool handle_message(connection &client, int payload_type, unsigned char *payload, uint32_t len);
+    void routing_activation(connection &client, const unsigned char *payload, uint32_t len);
+    void diagnostic_message(connection &client, unsigned char *payload, uint32_t len);
+    unsigned char *reserve(connection &client, size_t len);
+    void put_header(unsigned char *data, int payload_type, uint32_t len);
+    void send_message(connection &client, int payload_type, const unsigned char *payload, uint32_t len);
+    void send_generic_nack(connection &client, int code);
+    bool flush(connection &client);
+    void update_events(connection &client);
+    void close_connection(int fd);
+    uint64_t now_ticks() const;
+};
+#endif
@@ -0,0 +1,302 @@
+/*
+
+pcapng capture of the listener frames, see isotp_capture.h
+
+file format: https://www.ietf.org/archive/id/draft-ietf-opsawg-pcapng-01.html
+link type 227 (LINKTYPE_CAN_SOCKETCAN): struct can_frame with the can id in network byte order
+
+bounded queue after https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+
+*/
+
+#include "isotp_capture.h"
+#include "isotp_listener.h"
+
+#include <chrono>
+#include <cstring>
+
+#define PCAPNG_SECTION_HEADER 0x0A0D0D0A
+#define PCAPNG_INTERFACE_DESCRIPTION 0x00000001
+#define PCAPNG_ENHANCED_PACKET 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define LINKTYPE_CAN_SOCKETCAN 227
+#define CAPTURE_SNAPLEN 16       // sizeof(struct can_frame)
+#define CAPTURE_WRITE_SIZE 65536 // bytes collected before they are written into the file
+
+static const char *state_name(int state)
+{
+  switch (state)
+  {
+  case (int)ActualState::Sleeping:
+    return "Sleeping";
+  case (int)ActualState::First:
+    return "First";
+  case (int)ActualState::Consecutive:
+    return "Consecutive";
+  case (int)ActualState::WaitConsecutive:
+    return "WaitConsecutive";
+  case (int)ActualState::FlowControl:
+    return "FlowControl";
+  }
+  return "?";
+}
+
+Isotp_Capture::~Isotp_Capture()
+{
+  close();
+}
+
+uint64_t Isotp_Capture::now_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// opens the first capture file and starts the writer thread, returns false if the file can't be written
+bool Isotp_Capture::open(const char *capture_path, long max_size, int files)
+{
+  close();
+  path = capture_path;
+  max_file_size = max_size;
+  max_files = files;
+  file_number = 0;
+  if (!start_file())
+  {
+    return false;
+  }
+  std::vector<cell> cells(ISOTP_CAPTURE_QUEUE_SIZE);
+  queue.swap(cells);
+  for (size_t i = 0; i < queue.size(); i++)
+  {
+    queue[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  enqueue_pos.store(0, std::memory_order_relaxed);
+  dequeue_pos = 0;
+  running.store(true, std::memory_order_release);
+  writer = std::thread(&Isotp_Capture::write_loop, this);
+  return true;
+}
+
+// writes all queued frames and closes the file
+void Isotp_Capture::close()
+{
+  if (running.exchange(false))
+  {
+    writer.join();
+  }
+  if (file)
+  {
+    fclose(file);
+    file = 0;
+  }
+}
+
+/*
+queues a frame for the writer thread, returns false if it was dropped because the queue is full
+or the capture is not open
+*/
+bool Isotp_Capture::capture(uint32_t listener_id, bool tx, int can_id, const unsigned char *data, int len, uint64_t timestamp_ns, int state_from, int state_to)
+{
+  if (!running.load(std::memory_order_relaxed))
+  {
+    return false;
+  }
+  size_t mask = queue.size() - 1;
+  size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+  cell *target;
+  for (;;)
+  {
+    target = &queue[pos & mask];
+    size_t sequence = target->sequence.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+    if (diff == 0)
+    {
+      if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+      {
+        break;
+      }
+    }
+    else if (diff < 0)
+    { // full, the writer can't keep up
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    else
+    {
+      pos = enqueue_pos.load(std::memory_order_relaxed);
+    }
+  }
+  capture_record &record = target->record;
+  record.timestamp_ns = timestamp_ns ? timestamp_ns : now_ns();
+  record.listener_id = listener_id;
+  record.can_id = can_id;
+  record.tx = tx;
+  len = len > 8 ? 8 : len < 0 ? 0 : len;
+  record.len = len;
+  record.state_from = state_from;
+  record.state_to = state_to;
+  std::memset(record.data, 0, 8);
+  std::memcpy(record.data, data, len);
+  target->sequence.store(pos + 1, std::memory_order_release);
+  captured.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+// takes the oldest frame out of the queue, only called by the writer thread
+bool Isotp_Capture::dequeue(capture_record &record)
+{
+  cell &source = queue[dequeue_pos & (queue.size() - 1)];
+  if (source.sequence.load(std::memory_order_acquire) != dequeue_pos + 1)
+  {
+    return false;
+  }
+  record = source.record;
+  source.sequence.store(dequeue_pos + queue.size(), std::memory_order_release);
+  dequeue_pos++;
+  return true;
+}
+
+void Isotp_Capture::write_loop()
+{
+  capture_record record;
+  for (;;)
+  {
+    bool stopping = !running.load(std::memory_order_acquire);
+    while (dequeue(record))
+    {
+      write_frame(record);
+      if (block.size() >= CAPTURE_WRITE_SIZE && file)
+      {
+        fwrite(&block[0], 1, block.size(), file);
+        block.clear();
+      }
+    }
+    if (!block.empty() && file)
+    {
+      fwrite(&block[0], 1, block.size(), file);
+      block.clear();
+      fflush(file);
+    }
+    if (stopping)
+    {
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+}
+
+// opens the next file of the rotation and writes its section header
+bool Isotp_Capture::start_file()
+{
+  if (file)
+  {
+    if (!block.empty())
+    {
+      fwrite(&block[0], 1, block.size(), file);
+      block.clear();
+    }
+    fclose(file);
+    file = 0;
+    file_number++;
+  }
+  std::string name = file_number ? path + "." + std::to_string(file_number) : path;
+  file = fopen(name.c_str(), "wb");
+  if (!file)
+  {
+    perror("can't open capture file");
+    return false;
+  }
+  setvbuf(file, 0, _IOFBF, CAPTURE_WRITE_SIZE);
+  if (max_files > 0 && file_number >= max_files)
+  { // remove the oldest file
+    int oldest = file_number - max_files;
+    std::remove((oldest ? path + "." + std::to_string(oldest) : path).c_str());
+  }
+  file_size = 0;
+  write_header();
+  return true;
+}
+
+static void put32(std::vector<unsigned char> &out, uint32_t value)
+{
+  out.insert(out.end(), (unsigned char *)&value, (unsigned char *)&value + 4);
+}
+
+static void put16(std::vector<unsigned char> &out, uint16_t value)
+{
+  out.insert(out.end(), (unsigned char *)&value, (unsigned char *)&value + 2);
+}
+
+// section header and the description of the one can interface, with ns time stamps
+void Isotp_Capture::write_header()
+{
+  size_t start = block.size();
+  put32(block, PCAPNG_SECTION_HEADER);
+  put32(block, 28);
+  put32(block, PCAPNG_BYTE_ORDER_MAGIC);
+  put16(block, 1); // version 1.0
+  put16(block, 0);
+  put32(block, 0xFFFFFFFF); // section length unknown
+  put32(block, 0xFFFFFFFF);
+  put32(block, 28);
+  put32(block, PCAPNG_INTERFACE_DESCRIPTION);
+  put32(block, 32);
+  put16(block, LINKTYPE_CAN_SOCKETCAN);
+  put16(block, 0);
+  put32(block, CAPTURE_SNAPLEN);
+  put16(block, 9); // if_tsresol: 10^-9
+  put16(block, 1);
+  put32(block, 9);
+  put32(block, 0); // end of options
+  put32(block, 32);
+  file_size += block.size() - start;
+}
+
+// an enhanced packet block with the frame, its direction (epb_flags) and the comment
+void Isotp_Capture::write_frame(const capture_record &record)
+{
+  if (file && max_file_size > 0 && file_size >= max_file_size && !start_file())
+  { // no more file to write into
+    block.clear();
+  }
+  if (!file)
+  {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  char comment[64];
+  int comment_len = snprintf(comment, sizeof(comment), "0x%x %s %s->%s", record.listener_id, record.tx ? "tx" : "rx",
+                             state_name(record.state_from), state_name(record.state_to));
+  if (comment_len >= (int)sizeof(comment))
+  {
+    comment_len = sizeof(comment) - 1;
+  }
+  int comment_padded = (comment_len + 3) & ~3;
+  uint32_t block_len = 28 + CAPTURE_SNAPLEN + 4 + comment_padded + 8 + 4 + 4;
+  size_t start = block.size();
+  put32(block, PCAPNG_ENHANCED_PACKET);
+  put32(block, block_len);
+  put32(block, 0); // interface
+  put32(block, (uint32_t)(record.timestamp_ns >> 32));
+  put32(block, (uint32_t)record.timestamp_ns);
+  put32(block, CAPTURE_SNAPLEN);
+  put32(block, CAPTURE_SNAPLEN);
+  // struct can_frame, can id in network byte order
+  put32(block, __builtin_bswap32(record.can_id));
+  block.push_back(record.len);
+  block.push_back(0);
+  block.push_back(0);
+  block.push_back(0);
+  block.insert(block.end(), record.data, record.data + 8);
+  // opt_comment
+  put16(block, 1);
+  put16(block, comment_len);
+  block.insert(block.end(), comment, comment + comment_len);
+  block.insert(block.end(), comment_padded - comment_len, 0);
+  // epb_flags: direction
+  put16(block, 2);
+  put16(block, 4);
+  put32(block, record.tx ? 2 : 1);
+  put32(block, 0); // end of options
+  put32(block, block_len);
+  file_size += block.size() - start;
+}
@@ -0,0 +1,78 @@
+#ifndef ISOTP_CAPTURE_H
+#define ISOTP_CAPTURE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+pcapng capture of the frames seen and sent by listeners
+
+set options.capture = &capture and each frame given to eval_msg() and each frame sent by the listener is captured
+with the SocketCAN link type, annotated by a comment with the listener id, the direction and the state transition
+of the listener, e.g. "0x7e1 rx WaitConsecutive->Sleeping".
+
+The protocol thread only copies the frame into a lock free queue (which several threads may share) and never
+waits: when the queue is full, the frame is counted as dropped. A background thread writes the queue through a
+large buffer into the file. When the file reaches max_file_size, it's closed and the next one is started:
+path, path.1, path.2 ... - with max_files > 0 the oldest ones are removed.
+*/
+
+#define ISOTP_CAPTURE_QUEUE_SIZE 65536 // frames, power of 2
+
+struct capture_record
+{
+    uint64_t timestamp_ns; // since epoch
+    uint32_t listener_id;
+    uint32_t can_id;
+    uint8_t tx;
+    uint8_t len;
+    int8_t state_from; // ActualState, -1 if unknown
+    int8_t state_to;
+    unsigned char data[8];
+};
+
+class Isotp_Capture
+{
+private:
+    struct cell
+    {
+        std::atomic<size_t> sequence;
+        capture_record record;
+    };
+    std::vector<cell> queue;
+    std::atomic<size_t> enqueue_pos{0};
+    size_t dequeue_pos = 0;
+    std::atomic<bool> running{false};
+    std::thread writer;
+    std::atomic<unsigned long> captured{0};
+    std::atomic<unsigned long> dropped{0};
+    // owned by the writer thread
+    std::string path;
+    long max_file_size = 0;
+    int max_files = 0;
+    int file_number = 0;
+    FILE *file = 0;
+    long file_size = 0;
+    std::vector<unsigned char> block;
+
+public:
+    ~Isotp_Capture();
+    bool open(const char *path, long max_file_size = 64 * 1024 * 1024, int max_files = 0);
+    void close();
+    bool capture(uint32_t listener_id, bool tx, int can_id, const unsigned char *data, int len, uint64_t timestamp_ns, int state_from, int state_to);
+    unsigned long get_captured() const { return captured.load(std::memory_order_relaxed); }
+    unsigned long get_dropped() const { return dropped.load(std::memory_order_relaxed); }
+    static uint64_t now_ns();
+
+private:
+    bool dequeue(capture_record &record);
+    void write_loop();
+    bool start_file();
+    void write_header();
+    void write_frame(const capture_record &record);
+};
+#endif
@@ -0,0 +1,257 @@
+/*
+
+epoll event loop over the sockets of several can interfaces, see isotp_event_loop.h
+
+*/
+
+#include "isotp_event_loop.h"
+
+#include <iostream>
+#include <cerrno>
+#include <chrono>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define EVENT_LOOP_MAX_EVENTS 16
+#define TIMER_TAG 0xFFFFFFFFu // epoll data of the tick timer, the interfaces use their index
+#define FD_TAG 0x80000000u    // epoll data of the other descriptors: FD_TAG | their index
+
+Isotp_Event_Loop::Isotp_Event_Loop()
+{
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1)
+  {
+    perror("can't create epoll");
+    return;
+  }
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer_fd == -1)
+  {
+    perror("can't create tick timer");
+    return;
+  }
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.u32 = TIMER_TAG;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event);
+}
+
+Isotp_Event_Loop::~Isotp_Event_Loop()
+{
+  interfaces.clear(); // closes the sockets
+  if (timer_fd != -1)
+  {
+    close(timer_fd);
+  }
+  if (epoll_fd != -1)
+  {
+    close(epoll_fd);
+  }
+}
+
+// opens the socket of an interface, returns its index or -1 in case of an error
+int Isotp_Event_Loop::add_interface(const char *interface_name, Socket_Backend backend)
+{
+  if (epoll_fd == -1)
+  {
+    return -1;
+  }
+  interface_entry entry;
+  entry.name = interface_name;
+  entry.socket.reset(new Isotp_Socket());
+  if (entry.socket->open(interface_name, backend) == -1)
+  {
+    return -1;
+  }
+  entry.socket->set_ticks_per_ms(ticks_per_ms);
+  int interface = interfaces.size();
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.u32 = interface;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, entry.socket->event_fd(), &event) == -1)
+  {
+    perror("can't watch the interface");
+    return -1;
+  }
+  interfaces.push_back(std::move(entry));
+  return interface;
+}
+
+void Isotp_Event_Loop::add_listener(int interface, Isotp_Listener *listener)
+{
+  interfaces[interface].socket->add_listener(listener);
+}
+
+// the resolution of the time given to the listeners, needs to match options.ticks_per_ms of them
+void Isotp_Event_Loop::set_ticks_per_ms(int ticks)
+{
+  ticks_per_ms = ticks;
+  for (interface_entry &entry : interfaces)
+  {
+    entry.socket->set_ticks_per_ms(ticks);
+  }
+}
+
+// called after each round with the actual time
+void Isotp_Event_Loop::add_tick_handler(bool (*handler)(void *context, uint64_t time_ticks), void *context)
+{
+  tick_handler entry = {handler, context};
+  tick_handlers.push_back(entry);
+}
+
+// calls the handler each time fd is readable, returns -1 in case of an error
+int Isotp_Event_Loop::add_fd(int fd, void (*handler)(void *context), void *context)
+{
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.u32 = FD_TAG | fds.size();
+  if (epoll_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+  {
+    perror("can't watch the descriptor");
+    return -1;
+  }
+  fd_entry entry = {fd, handler, context};
+  fds.push_back(entry);
+  return 0;
+}
+
+// the system clock, the same as the kernel receive timestamps of the sockets
+uint64_t Isotp_Event_Loop::now_ticks()
+{
+  uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  return us / 1000 * ticks_per_ms + us % 1000 * ticks_per_ms / 1000;
+}
+
+void Isotp_Event_Loop::arm_timer(bool arm)
+{
+  if (arm == timer_armed)
+  {
+    return;
+  }
+  itimerspec interval = {};
+  if (arm)
+  {
+    interval.it_interval.tv_sec = tick_interval_us / 1000000;
+    interval.it_interval.tv_nsec = tick_interval_us % 1000000 * 1000;
+    interval.it_value = interval.it_interval;
+  }
+  timerfd_settime(timer_fd, 0, &interval, 0);
+  timer_armed = arm;
+}
+
+/*
+waits for room in the socket buffer only while frames are queued because of it (EAGAIN). Frames refused by a full
+device queue (ENOBUFS) are sent again by the rounds of the tick timer instead, as EPOLLOUT would stay ready
+*/
+void Isotp_Event_Loop::update_events(int interface)
+{
+  interface_entry &entry = interfaces[interface];
+  bool wait_writable = entry.socket->tx_wait_writable();
+  if (wait_writable == entry.wait_writable)
+  {
+    return;
+  }
+  epoll_event event = {};
+  event.events = wait_writable ? EPOLLIN | EPOLLOUT : EPOLLIN;
+  event.data.u32 = interface;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, entry.socket->event_fd(), &event);
+  entry.wait_writable = wait_writable;
+}
+
+/*
+waits up to timeout_ms (-1: until something happens) for frames or the next tick, then does one round:
+each ready interface processes up to budget frames, then all listeners are ticked.
+Returns the number of processed frames, -1 in case of an error
+*/
+int Isotp_Event_Loop::run_once(int timeout_ms)
+{
+  bool left = false;
+  for (interface_entry &entry : interfaces)
+  {
+    left |= entry.readable;
+  }
+  epoll_event events[EVENT_LOOP_MAX_EVENTS];
+  int count = epoll_wait(epoll_fd, events, EVENT_LOOP_MAX_EVENTS, left ? 0 : timeout_ms);
+  if (count == -1)
+  {
+    if (errno != EINTR)
+    {
+      perror("epoll_wait");
+      return -1;
+    }
+    count = 0;
+  }
+  for (int i = 0; i < count; i++)
+  {
+    if (events[i].data.u32 == TIMER_TAG)
+    {
+      uint64_t expirations;
+      if (read(timer_fd, &expirations, sizeof(expirations)) < 0)
+      { // nothing to do, the tick follows anyway
+      }
+      continue;
+    }
+    if (events[i].data.u32 & FD_TAG)
+    {
+      fd_entry &entry = fds[events[i].data.u32 & ~FD_TAG];
+      entry.handler(entry.context);
+      continue;
+    }
+    interface_entry &entry = interfaces[events[i].data.u32];
+    if (events[i].events & EPOLLOUT)
+    {
+      entry.socket->flush();
+    }
+    if (events[i].events & EPOLLIN)
+    {
+      entry.readable = true;
+    }
+  }
+  int frames = 0;
+  for (interface_entry &entry : interfaces)
+  {
+    if (entry.readable)
+    {
+      int received = entry.socket->poll(budget);
+      // with more frames than the budget, the rest is taken in the next round (the io_uring backend keeps
+      // them in user space, where epoll doesn't see them)
+      entry.readable = received >= budget;
+      entry.budget_hits += entry.readable;
+      frames += received;
+    }
+  }
+  uint64_t now = now_ticks();
+  bool busy = false;
+  for (interface_entry &entry : interfaces)
+  {
+    entry.socket->tick(now);
+    busy |= entry.socket->busy();
+  }
+  for (tick_handler &entry : tick_handlers)
+  {
+    busy |= entry.handler(entry.context, now);
+  }
+  for (int interface = 0; interface < (int)interfaces.size(); interface++)
+  {
+    Isotp_Socket *socket = interfaces[interface].socket.get();
+    if (!tick_handlers.empty() || socket->tx_pending())
+    { // the frames sent by the handlers, and one more try for the frames the interface couldn't take
+      socket->flush();
+    }
+    busy |= socket->tx_pending(); // the timer keeps trying
+    update_events(interface);
+  }
+  arm_timer(busy);
+  return frames;
+}
+
+// runs until stop() is called, e.g. by a signal handler or another thread
+void Isotp_Event_Loop::run()
+{
+  running = true;
+  while (running && run_once(100) != -1)
+  {
+  }
+}
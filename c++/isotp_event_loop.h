@@ -0,0 +1,83 @@
+#ifndef ISOTP_EVENT_LOOP_H
+#define ISOTP_EVENT_LOOP_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "isotp_socket.h"
+
+/*
+one event loop for the Isotp_Sockets of several can interfaces
+
+the listeners are bound to their interface by add_listener(interface, listener); their options.send_frame_ctx
+needs to be &Isotp_Socket::send_frame and options.send_context = loop.socket(interface), so each interface sends
+through its own socket and its own tx queue: a congested bus only delays its own frames.
+
+run_once() waits by epoll until one of the interfaces has frames or the tick timer expires. Each ready interface
+then gets at most budget frames per round, so a flooded bus can't starve the diagnostics on the other ones: the
+rest of its frames are taken in the next rounds. After each round, all listeners are ticked. The tick timer
+(a timerfd with tick_interval_us) only runs while a listener is within a transfer. Others which need the ticks too,
+like the gateway or the tx scheduler, register a tick handler, which returns true as long as it needs further ticks.
+Other file descriptors, e.g. the one of the DoIP server, are served by the same loop with add_fd(): their handler is
+called each time the descriptor is readable.
+*/
+class Isotp_Event_Loop
+{
+private:
+    struct interface_entry
+    {
+        std::string name;
+        std::unique_ptr<Isotp_Socket> socket;
+        bool wait_writable = false;   // EPOLLOUT registered, the tx queue waits for room
+        bool readable = false;        // frames left for the next round
+        unsigned long budget_hits = 0; // rounds in which the interface had more frames than its budget
+    };
+    std::vector<interface_entry> interfaces;
+    int epoll_fd = -1;
+    int timer_fd = -1;
+    bool timer_armed = false;
+    int budget = 32;
+    int tick_interval_us = 1000;
+    int ticks_per_ms = 1000;
+    std::atomic<bool> running{false};
+    struct tick_handler
+    {
+        bool (*handler)(void *context, uint64_t time_ticks);
+        void *context;
+    };
+    std::vector<tick_handler> tick_handlers;
+    struct fd_entry
+    {
+        int fd;
+        void (*handler)(void *context);
+        void *context;
+    };
+    std::vector<fd_entry> fds;
+
+public:
+    Isotp_Event_Loop();
+    ~Isotp_Event_Loop();
+    int add_interface(const char *interface_name, Socket_Backend backend = Socket_Backend::Plain);
+    int interface_count() const { return interfaces.size(); }
+    Isotp_Socket *socket(int interface) { return interfaces[interface].socket.get(); }
+    const std::string &interface_name(int interface) const { return interfaces[interface].name; }
+    unsigned long budget_hits(int interface) const { return interfaces[interface].budget_hits; }
+    void add_listener(int interface, Isotp_Listener *listener);
+    void set_budget(int frames) { budget = frames > 0 ? frames : 1; }
+    void set_tick_interval(int us) { tick_interval_us = us > 0 ? us : 1; }
+    void set_ticks_per_ms(int ticks);
+    void add_tick_handler(bool (*handler)(void *context, uint64_t time_ticks), void *context);
+    int add_fd(int fd, void (*handler)(void *context), void *context);
+    int run_once(int timeout_ms = -1);
+    void run();
+    void stop() { running = false; }
+    uint64_t now_ticks(); // the time given to the tick handlers
+
+private:
+    void arm_timer(bool arm);
+    void update_events(int interface);
+};
+#endif
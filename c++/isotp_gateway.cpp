@@ -0,0 +1,360 @@
+/*
+
+ISO-TP routing between buses with cut-through forwarding, see isotp_gateway.h
+
+*/
+
+#include "isotp_gateway.h"
+
+#include <chrono>
+#include <cstring>
+
+#include <linux/can.h>
+
+Isotp_Gateway::Isotp_Gateway(isotp_gateway_options options) : options(options)
+{
+}
+
+// the system clock, the same as the event loop and the kernel receive timestamps of the sockets
+uint64_t Isotp_Gateway::now_ticks() const
+{
+  uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  return us / 1000 * options.ticks_per_ms + us % 1000 * options.ticks_per_ms / 1000;
+}
+
+// lets the gateway receive the frames of the socket, which are not taken by a listener
+void Isotp_Gateway::attach(Isotp_Socket *socket)
+{
+  for (std::unique_ptr<port> &entry : ports)
+  {
+    if (entry->socket == socket)
+    {
+      return;
+    }
+  }
+  ports.emplace_back(new port{this, socket});
+  socket->set_frame_handler(&Isotp_Gateway::port_frame, ports.back().get());
+}
+
+Isotp_Gateway::relay *Isotp_Gateway::add_relay(Isotp_Socket *in_socket, uint32_t in_id, uint32_t in_fc_id, Isotp_Socket *out_socket, uint32_t out_id, bool cut_through)
+{
+  relays.emplace_back(new relay());
+  relay *route = relays.back().get();
+  route->in_socket = in_socket;
+  route->in_id = in_id;
+  route->in_fc_id = in_fc_id;
+  route->out_socket = out_socket;
+  route->out_id = out_id;
+  route->cut_through = cut_through;
+  return route;
+}
+
+/*
+routes the requests of a tester to an ECU and its responses back: the ECU gets the messages of the tester with the
+ecu_request_id, the tester gets the responses of the ECU with the tester_response_id
+*/
+void Isotp_Gateway::add_route(Isotp_Socket *tester_socket, uint32_t tester_request_id, uint32_t tester_response_id,
+                              Isotp_Socket *ecu_socket, uint32_t ecu_request_id, uint32_t ecu_response_id, bool cut_through)
+{
+  attach(tester_socket);
+  attach(ecu_socket);
+  tester_socket->add_filter_range(tester_request_id, CAN_EFF_MASK);
+  ecu_socket->add_filter_range(ecu_response_id, CAN_EFF_MASK);
+  relay *request = add_relay(tester_socket, tester_request_id, tester_response_id, ecu_socket, ecu_request_id, cut_through);
+  relay *response = add_relay(ecu_socket, ecu_response_id, ecu_request_id, tester_socket, tester_response_id, cut_through);
+  data_routes[std::make_pair(tester_socket, tester_request_id)] = request;
+  fc_routes[std::make_pair(ecu_socket, ecu_response_id)] = request;
+  data_routes[std::make_pair(ecu_socket, ecu_response_id)] = response;
+  fc_routes[std::make_pair(tester_socket, tester_request_id)] = response;
+}
+
+// the frames of the attached sockets which belong to no route
+void Isotp_Gateway::set_frame_handler(void (*handler)(void *context, int can_id, unsigned char *data, int len), void *context)
+{
+  frame_handler = handler;
+  frame_handler_context = context;
+}
+
+void Isotp_Gateway::port_frame(void *context, int can_id, unsigned char *data, int len)
+{
+  port *source = static_cast<port *>(context);
+  source->gateway->receive(source->socket, can_id, data, len);
+}
+
+void Isotp_Gateway::receive(Isotp_Socket *socket, int can_id, unsigned char *data, int len)
+{
+  uint64_t now = now_ticks();
+  if (now > this_tick)
+  {
+    this_tick = now;
+  }
+  if (len > 0)
+  {
+    bool flow_control = (data[0] >> 4) == 3;
+    std::map<std::pair<Isotp_Socket *, uint32_t>, relay *> &routes = flow_control ? fc_routes : data_routes;
+    std::map<std::pair<Isotp_Socket *, uint32_t>, relay *>::iterator route = routes.find(std::make_pair(socket, (uint32_t)can_id));
+    if (route != routes.end())
+    {
+      if (flow_control)
+      {
+        receiver_flow_control(*route->second, data, len);
+      }
+      else
+      {
+        sender_frame(*route->second, data, len);
+      }
+      return;
+    }
+  }
+  if (frame_handler)
+  {
+    frame_handler(frame_handler_context, can_id, data, len);
+  }
+}
+
+void Isotp_Gateway::send(Isotp_Socket *socket, uint32_t can_id, unsigned char *data, int len)
+{
+  Isotp_Socket::send_frame(socket, can_id, data, len);
+}
+
+void Isotp_Gateway::send_flow_control(relay &route, int status, int bs, int stmin)
+{
+  unsigned char frame[8];
+  std::memset(frame, options.padding_byte, sizeof(frame));
+  frame[0] = 0x30 | status;
+  frame[1] = bs;
+  frame[2] = stmin;
+  send(route.in_socket, route.in_fc_id, frame, 8);
+}
+
+// opens the transfer to the receiver with the first 6 bytes of the message
+void Isotp_Gateway::send_first_frame(relay &route)
+{
+  unsigned char frame[8];
+  frame[0] = 0x10 | route.len >> 8;
+  frame[1] = route.len & 0xFF;
+  std::memcpy(frame + 2, route.payload, 6);
+  send(route.out_socket, route.out_id, frame, 8);
+  route.sent = 6;
+  route.out_sequence = 1;
+  route.out_block_left = 0;
+  route.last_out_tick = 0;
+  route.state = Relay_State::WaitFlowControl;
+}
+
+// a frame of the sender: single, first or consecutive frame
+void Isotp_Gateway::sender_frame(relay &route, unsigned char *data, int len)
+{
+  int frame_type = data[0] >> 4;
+  if (frame_type != 2 && route.state != Relay_State::Idle)
+  { // the sender starts a new message, the actual one is lost
+    abort(route, false);
+  }
+  route.last_action_tick = this_tick;
+  if (frame_type == 0)
+  { // nothing to segment, a single frame is forwarded as it is
+    send(route.out_socket, route.out_id, data, len);
+    stats.single_frames++;
+    return;
+  }
+  if (frame_type == 1)
+  {
+    if (len < 8)
+    {
+      return; // illegal format
+    }
+    route.len = (data[0] & 0x0F) << 8 | data[1];
+    if (route.len == 0)
+    { // escape sequence with a 32 bit length: more than the gateway can buffer, the sender gets an overflow
+      uint32_t escape_len = (uint32_t)data[2] << 24 | data[3] << 16 | data[4] << 8 | data[5];
+      if (escape_len > UDS_BUFFER_SIZE)
+      {
+        send_flow_control(route, 2, 0, 0);
+      }
+      stats.aborted++;
+      return;
+    }
+    if (route.len < 8)
+    { // would have fit into a single frame, illegal format
+      stats.aborted++;
+      return;
+    }
+    std::memcpy(route.payload, data + 2, 6);
+    route.received = 6;
+    route.in_sequence = 1;
+    route.fell_back = false;
+    if (route.cut_through)
+    { // the sender gets its flow control, when the receiver has sent its one
+      route.own_flow_control = false;
+      route.in_block_left = 0;
+      send_first_frame(route);
+    }
+    else
+    {
+      route.own_flow_control = true;
+      route.state = Relay_State::Store;
+      send_flow_control(route, 0, options.bs, options.stmin);
+      route.in_block_left = options.bs ? options.bs : -1;
+    }
+    return;
+  }
+  if (frame_type != 2 || route.state == Relay_State::Idle || route.received >= route.len)
+  {
+    return; // no transfer of the sender is running
+  }
+  if ((data[0] & 0x0F) != route.in_sequence)
+  {
+    abort(route, false);
+    return;
+  }
+  int bytes = route.len - route.received < 7 ? route.len - route.received : 7;
+  bytes = len - 1 < bytes ? len - 1 : bytes;
+  std::memcpy(route.payload + route.received, data + 1, bytes);
+  route.received += bytes;
+  route.in_sequence = (route.in_sequence + 1) & 0x0F;
+  if (route.in_block_left > 0)
+  {
+    route.in_block_left--;
+  }
+  if (route.received < route.len && route.in_block_left == 0 && route.own_flow_control)
+  { // the gateway itself lets the sender continue
+    send_flow_control(route, 0, options.bs, options.stmin);
+    route.in_block_left = options.bs ? options.bs : -1;
+  }
+  if (route.state == Relay_State::Store && route.received >= route.len)
+  { // the whole message is there
+    send_first_frame(route);
+    return;
+  }
+  forward(route);
+}
+
+// a flow control of the receiver: translated to the sender in cut-through mode
+void Isotp_Gateway::receiver_flow_control(relay &route, unsigned char *data, int len)
+{
+  if (route.state != Relay_State::WaitFlowControl && route.state != Relay_State::Relay)
+  {
+    return;
+  }
+  route.last_action_tick = this_tick;
+  int status = data[0] & 0x0F;
+  int bs = len > 1 ? data[1] : 0;
+  int stmin = len > 2 ? data[2] : 0;
+  if (status == 0)
+  { // clear to send
+    route.out_block_left = bs ? bs : -1;
+    route.out_stmin = (uint64_t)isotp_stmin_to_us(stmin) * options.ticks_per_ms / 1000;
+    route.state = Relay_State::Relay;
+    if (!route.own_flow_control && route.in_block_left == 0 && route.received < route.len)
+    { // let the sender continue in the pace of the receiver
+      int stmin_us = isotp_stmin_to_us(stmin);
+      int stmin_min_us = isotp_stmin_to_us(options.stmin_min);
+      send_flow_control(route, 0, bs, isotp_us_to_stmin(stmin_us > stmin_min_us ? stmin_us : stmin_min_us));
+      route.in_block_left = bs ? bs : -1;
+    }
+    forward(route);
+    return;
+  }
+  if (status == 1)
+  { // wait: the gateway takes the rest of the message itself, so the sender doesn't have to wait
+    if (!route.own_flow_control)
+    {
+      route.own_flow_control = true;
+      route.fell_back = true;
+      if (route.in_block_left == 0 && route.received < route.len)
+      {
+        send_flow_control(route, 0, options.bs, options.stmin);
+        route.in_block_left = options.bs ? options.bs : -1;
+      }
+    }
+    route.state = Relay_State::WaitFlowControl;
+    return;
+  }
+  // overflow or invalid: the sender gets the overflow
+  if (route.received < route.len)
+  {
+    send_flow_control(route, 2, 0, 0);
+  }
+  abort(route, false);
+}
+
+// sends the received CFs to the receiver, as far as its flow control and STmin allow
+void Isotp_Gateway::forward(relay &route)
+{
+  while (route.state == Relay_State::Relay && route.sent < route.received && route.out_block_left != 0 &&
+         route.last_out_tick + route.out_stmin <= this_tick)
+  {
+    if (route.sent + 7 > route.received && route.received < route.len)
+    {
+      return; // only full CFs, until the last one
+    }
+    unsigned char frame[8];
+    std::memset(frame, options.padding_byte, sizeof(frame));
+    int bytes = route.received - route.sent < 7 ? route.received - route.sent : 7;
+    frame[0] = 0x20 | route.out_sequence;
+    std::memcpy(frame + 1, route.payload + route.sent, bytes);
+    send(route.out_socket, route.out_id, frame, 8);
+    route.sent += bytes;
+    route.out_sequence = (route.out_sequence + 1) & 0x0F;
+    route.last_out_tick = this_tick;
+    route.last_action_tick = this_tick;
+    if (route.sent >= route.len)
+    { // done
+      route.cut_through && !route.fell_back ? stats.cut_through++ : stats.store_forward++;
+      route.state = Relay_State::Idle;
+      return;
+    }
+    if (route.out_block_left > 0 && --route.out_block_left == 0)
+    {
+      route.state = Relay_State::WaitFlowControl;
+    }
+  }
+}
+
+void Isotp_Gateway::abort(relay &route, bool timeout)
+{
+  timeout ? stats.timeouts++ : stats.aborted++;
+  route.state = Relay_State::Idle;
+}
+
+// paces the CFs and gives up the relays without progress, true while a relay is active
+bool Isotp_Gateway::tick(uint64_t time_ticks)
+{
+  if (time_ticks > this_tick)
+  {
+    this_tick = time_ticks;
+  }
+  uint64_t timeout = (uint64_t)options.frame_timeout * options.ticks_per_ms;
+  for (std::unique_ptr<relay> &route : relays)
+  {
+    if (route->state == Relay_State::Idle)
+    {
+      continue;
+    }
+    if (route->last_action_tick + timeout < this_tick)
+    {
+      abort(*route, true);
+      continue;
+    }
+    forward(*route);
+  }
+  return busy();
+}
+
+bool Isotp_Gateway::busy() const
+{
+  for (const std::unique_ptr<relay> &route : relays)
+  {
+    if (route->state != Relay_State::Idle)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// for Isotp_Event_Loop::add_tick_handler(), context is the Isotp_Gateway
+bool Isotp_Gateway::tick_handler(void *context, uint64_t time_ticks)
+{
+  return static_cast<Isotp_Gateway *>(context)->tick(time_ticks);
+}
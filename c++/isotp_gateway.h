@@ -0,0 +1,129 @@
+#ifndef ISOTP_GATEWAY_H
+#define ISOTP_GATEWAY_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "isotp_listener.h"
+#include "isotp_socket.h"
+
+/*
+ISO-TP routing between a tester bus and ECU buses
+
+a route connects the address pair of a tester (request id in, response id out) on one socket with the address pair
+of an ECU on another socket. Each direction of a route is a relay, which in cut-through mode forwards the message
+while it's still coming in:
+
+  - the first frame of the sender is forwarded at once, which opens the transfer on the next segment
+  - the flow control of the receiver is translated to the sender: the sender gets the same block size and
+    (at least options.stmin_min) the same STmin, so both segments run in step
+  - each CF is forwarded as soon as it is received and the flow control of the receiver allows it
+
+so a multi-kilobyte transfer takes about as long as over a single segment. Routes added with cut_through = false
+are relayed store-and-forward: the gateway receives the whole message with its own flow controls (options.bs,
+options.stmin) and sends it afterwards. A relay also falls back to store-and-forward, when the receiver answers
+with a flow control WAIT: the gateway then takes the rest of the message from the sender itself and passes it on
+when the receiver is ready.
+
+the gateway receives the frames of the attached sockets by their frame handler (so the route ids must not be
+used by listeners); frames of no route are passed on to the handler given by set_frame_handler(). It needs to be
+ticked for the STmin pacing and the timeouts: gateway.tick(time) or, by the event loop,
+loop.add_tick_handler(&Isotp_Gateway::tick_handler, &gateway)
+*/
+
+struct isotp_gateway_options
+{
+    int bs = 0;              // block size of the flow controls of the gateway itself (store-and-forward)
+    int stmin = 0;           // STmin of these flow controls
+    int stmin_min = 0;       // the shortest STmin sent to a tester in cut-through mode
+    int frame_timeout = 1000; // maximal time in ms without progress of a relay, before it is given up
+    int padding_byte = 0;
+    int ticks_per_ms = 1000; // the resolution of the time given to tick()
+};
+
+struct isotp_gateway_stats
+{
+    unsigned long cut_through = 0;   // messages relayed cut-through
+    unsigned long store_forward = 0; // messages relayed store-and-forward
+    unsigned long single_frames = 0;
+    unsigned long aborted = 0; // wrong sequence numbers, overflow, invalid first frames, or a new message of the sender
+    unsigned long timeouts = 0;
+};
+
+class Isotp_Gateway
+{
+private:
+    enum class Relay_State
+    {
+        Idle,
+        WaitFlowControl, // the first frame is forwarded, the receiver's flow control is missing
+        Relay,           // the CFs are forwarded
+        Store            // store-and-forward: receiving the whole message before the first frame is forwarded
+    };
+    // one direction of a route
+    struct relay
+    {
+        Isotp_Socket *in_socket;
+        uint32_t in_id;    // the sender sends on it
+        uint32_t in_fc_id; // the flow controls to the sender
+        Isotp_Socket *out_socket;
+        uint32_t out_id;   // to the receiver
+        bool cut_through;
+        Relay_State state = Relay_State::Idle;
+        bool own_flow_control = false; // the sender gets the flow controls of the gateway, not the translated ones
+        bool fell_back = false;        // from cut-through to store-and-forward
+        uds_buffer payload;
+        int len = 0;             // of the whole message
+        int received = 0;        // bytes from the sender
+        int sent = 0;            // bytes to the receiver
+        int in_sequence = 1;     // expected sequence number of the next CF of the sender
+        int out_sequence = 1;    // of the next CF to the receiver
+        int in_block_left = -1;  // CFs the sender may send before the next flow control, -1 = no limit
+        int out_block_left = -1; // CFs the receiver takes before its next flow control
+        uint64_t out_stmin = 0;  // ticks between two CFs to the receiver
+        uint64_t last_out_tick = 0;
+        uint64_t last_action_tick = 0;
+    };
+    struct port
+    {
+        Isotp_Gateway *gateway;
+        Isotp_Socket *socket;
+    };
+    isotp_gateway_options options;
+    std::vector<std::unique_ptr<relay>> relays;
+    std::vector<std::unique_ptr<port>> ports;
+    std::map<std::pair<Isotp_Socket *, uint32_t>, relay *> data_routes; // frames of senders
+    std::map<std::pair<Isotp_Socket *, uint32_t>, relay *> fc_routes;   // flow controls of receivers
+    void (*frame_handler)(void *context, int can_id, unsigned char *data, int len) = 0;
+    void *frame_handler_context = 0;
+    isotp_gateway_stats stats;
+    uint64_t this_tick = 0;
+
+public:
+    Isotp_Gateway(isotp_gateway_options options = isotp_gateway_options());
+    void add_route(Isotp_Socket *tester_socket, uint32_t tester_request_id, uint32_t tester_response_id,
+                   Isotp_Socket *ecu_socket, uint32_t ecu_request_id, uint32_t ecu_response_id, bool cut_through = true);
+    void set_frame_handler(void (*handler)(void *context, int can_id, unsigned char *data, int len), void *context);
+    bool tick(uint64_t time_ticks);
+    bool busy() const;
+    isotp_gateway_stats get_stats() const { return stats; }
+    static bool tick_handler(void *context, uint64_t time_ticks);
+
+private:
+    void attach(Isotp_Socket *socket);
+    relay *add_relay(Isotp_Socket *in_socket, uint32_t in_id, uint32_t in_fc_id, Isotp_Socket *out_socket, uint32_t out_id, bool cut_through);
+    static void port_frame(void *context, int can_id, unsigned char *data, int len);
+    void receive(Isotp_Socket *socket, int can_id, unsigned char *data, int len);
+    void sender_frame(relay &route, unsigned char *data, int len);
+    void receiver_flow_control(relay &route, unsigned char *data, int len);
+    void send_flow_control(relay &route, int status, int bs, int stmin);
+    void send_first_frame(relay &route);
+    void forward(relay &route);
+    void abort(relay &route, bool timeout);
+    void send(Isotp_Socket *socket, uint32_t can_id, unsigned char *data, int len);
+    uint64_t now_ticks() const;
+};
+#endif
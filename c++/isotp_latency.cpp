@@ -0,0 +1,142 @@
+/*
+
+per address latency percentiles of the listener transfers, see isotp_latency.h
+
+*/
+
+#include "isotp_latency.h"
+
+#include <algorithm>
+
+Isotp_Latency::Isotp_Latency(size_t max_samples) : max_samples(max_samples > 0 ? max_samples : 1)
+{
+}
+
+const char *Isotp_Latency::metric_name(Latency_Metric metric)
+{
+  switch (metric)
+  {
+  case Latency_Metric::FfToFc:
+    return "ff_to_fc";
+  case Latency_Metric::CfGap:
+    return "cf_gap";
+  case Latency_Metric::CfGapExcess:
+    return "cf_gap-stmin";
+  case Latency_Metric::Handler:
+    return "handler";
+  case Latency_Metric::FirstResponse:
+    return "first_response";
+  case Latency_Metric::Tx:
+    return "tx";
+  case Latency_Metric::FcWait:
+    return "fc_wait";
+  default:
+    return "?";
+  }
+}
+
+// keeps the last max_samples values of a metric
+void Isotp_Latency::add_sample(address_samples &entry, Latency_Metric metric, int value)
+{
+  if (value < 0)
+  {
+    return;
+  }
+  std::vector<int> &samples = entry.samples[(int)metric];
+  if (samples.size() < max_samples)
+  {
+    samples.push_back(value);
+    return;
+  }
+  size_t &next = entry.next[(int)metric];
+  samples[next] = value;
+  next = (next + 1) % max_samples;
+}
+
+// adds the timing of one finished transfer, called by the listener
+void Isotp_Latency::add(uint32_t address, const isotp_transfer_timing &timing, const std::vector<int> &cf_gaps_us)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  address_samples &entry = addresses[address];
+  entry.transfers++;
+  add_sample(entry, Latency_Metric::FfToFc, timing.ff_to_fc_us);
+  for (int gap : cf_gaps_us)
+  {
+    add_sample(entry, Latency_Metric::CfGap, gap);
+    add_sample(entry, Latency_Metric::CfGapExcess, gap > timing.stmin_us ? gap - timing.stmin_us : 0);
+  }
+  add_sample(entry, Latency_Metric::Handler, timing.handler_us);
+  add_sample(entry, Latency_Metric::FirstResponse, timing.first_response_us);
+  add_sample(entry, Latency_Metric::Tx, timing.tx_us);
+  if (timing.tx_us >= 0)
+  {
+    add_sample(entry, Latency_Metric::FcWait, timing.fc_wait_us);
+  }
+}
+
+// the value in µs below which percent of the samples are, -1 if there are no samples
+int Isotp_Latency::percentile(uint32_t address, Latency_Metric metric, double percent)
+{
+  std::vector<int> samples;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    std::unordered_map<uint32_t, address_samples>::iterator entry = addresses.find(address);
+    if (entry == addresses.end())
+    {
+      return -1;
+    }
+    samples = entry->second.samples[(int)metric];
+  }
+  if (samples.empty())
+  {
+    return -1;
+  }
+  size_t rank = (size_t)(percent / 100.0 * (samples.size() - 1) + 0.5);
+  rank = rank < samples.size() ? rank : samples.size() - 1;
+  std::nth_element(samples.begin(), samples.begin() + rank, samples.end());
+  return samples[rank];
+}
+
+unsigned long Isotp_Latency::transfers(uint32_t address)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  std::unordered_map<uint32_t, address_samples>::iterator entry = addresses.find(address);
+  return entry == addresses.end() ? 0 : entry->second.transfers;
+}
+
+std::vector<uint32_t> Isotp_Latency::get_addresses()
+{
+  std::vector<uint32_t> result;
+  std::lock_guard<std::mutex> guard(lock);
+  for (std::unordered_map<uint32_t, address_samples>::iterator entry = addresses.begin(); entry != addresses.end(); ++entry)
+  {
+    result.push_back(entry->first);
+  }
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+// one table per address: p50, p90, p99 and max of each metric in µs
+void Isotp_Latency::report(std::ostream &out)
+{
+  for (uint32_t address : get_addresses())
+  {
+    out << "0x" << std::hex << address << std::dec << ": " << transfers(address) << " transfers\n";
+    for (int metric = 0; metric < (int)Latency_Metric::Count; metric++)
+    {
+      if (percentile(address, (Latency_Metric)metric, 100) < 0)
+      {
+        continue;
+      }
+      out << "  " << metric_name((Latency_Metric)metric) << " us: p50 " << percentile(address, (Latency_Metric)metric, 50)
+          << " p90 " << percentile(address, (Latency_Metric)metric, 90) << " p99 " << percentile(address, (Latency_Metric)metric, 99)
+          << " max " << percentile(address, (Latency_Metric)metric, 100) << '\n';
+    }
+  }
+}
+
+void Isotp_Latency::clear()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  addresses.clear();
+}
@@ -0,0 +1,76 @@
+#ifndef ISOTP_LATENCY_H
+#define ISOTP_LATENCY_H
+
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+/*
+timing of one transfer (request and response), all times in microseconds, -1 if not applicable
+
+the gaps of the tester (CF gaps, flow control waits, tx duration) are measured in the time ticks given to the
+listener, so they are as precise as the (kernel receive) time stamps. The flow control reaction counts from the
+arrival time of the first frame, if it was given to eval_msg(), otherwise from its evaluation. The other local
+times (handler, first response frame) are measured with the steady clock
+*/
+struct isotp_transfer_timing
+{
+    int request_len = 0;
+    int response_len = 0;
+    int ff_to_fc_us = -1;        // from the arrival of the first frame until our flow control is sent
+    int cf_count = 0;            // received consecutive frames
+    int cf_gap_mean_us = -1;     // mean gap between two received CFs, gaps over a flow control not counted
+    int cf_gap_max_us = -1;      // longest of these gaps
+    int cf_gaps_below_stmin = 0; // gaps shorter than the advertised STmin: the tester sends too fast
+    int stmin_us = 0;            // the advertised STmin
+    int handler_us = -1;         // time spent in the service registry or uds_handler
+    int first_response_us = -1;  // from the complete request until our first response frame is sent
+    int tx_us = -1;              // from the first until the last response frame, incl. waiting for flow controls
+    int fc_wait_us = 0;          // part of tx_us spent waiting for the flow controls of the tester
+};
+
+enum class Latency_Metric
+{
+    FfToFc,
+    CfGap,       // each single CF gap
+    CfGapExcess, // each CF gap minus the advertised STmin: near 0 = our STmin paces the tester
+    Handler,
+    FirstResponse,
+    Tx,
+    FcWait,
+    Count
+};
+
+/*
+collects the timings of the transfers of the listeners which point to it by options.latency, per source address,
+and computes percentiles over the last max_samples samples of each metric
+*/
+class Isotp_Latency
+{
+private:
+    struct address_samples
+    {
+        unsigned long transfers = 0;
+        std::vector<int> samples[(int)Latency_Metric::Count];
+        size_t next[(int)Latency_Metric::Count] = {0}; // ring position, once max_samples are reached
+    };
+    std::mutex lock;
+    std::unordered_map<uint32_t, address_samples> addresses;
+    size_t max_samples;
+
+public:
+    Isotp_Latency(size_t max_samples = 4096);
+    void add(uint32_t address, const isotp_transfer_timing &timing, const std::vector<int> &cf_gaps_us);
+    int percentile(uint32_t address, Latency_Metric metric, double percent);
+    unsigned long transfers(uint32_t address);
+    std::vector<uint32_t> get_addresses();
+    void report(std::ostream &out);
+    void clear();
+    static const char *metric_name(Latency_Metric metric);
+
+private:
+    void add_sample(address_samples &entry, Latency_Metric metric, int value);
+};
+#endif
@@ -7,18 +7,108 @@ see also: https://www.embeddeers.com/knowledge-area/jro-can-isotp-einfach-erklae
 */
 
 #include "isotp_listener.h"
+#include "uds_service_registry.h"
+#include "uds_response_cache.h"
+#include "isotp_trace.h"
+#include "isotp_capture.h"
+#include "uds_ipc.h"
+
+#include <cstring>
+#include <chrono>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <iostream>
 
+static inline uint64_t steady_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// the clock of the kernel receive time stamps and of the time ticks given by Isotp_Socket
+static inline uint64_t system_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// converts a flow control stmin value into microseconds
+int isotp_stmin_to_us(int stmin)
+{
+  if (stmin >= 0xF1 && stmin <= 0xF9)
+  {
+    return (stmin - 0xF0) * 100;
+  }
+  if (stmin > 127 || stmin < 0)
+  { // reserved values are treated as the longest possible time
+    return 127000;
+  }
+  return stmin * 1000;
+}
+
+// converts microseconds into the flow control stmin value which is not shorter than the given time
+int isotp_us_to_stmin(int us)
+{
+  if (us <= 0)
+  {
+    return 0;
+  }
+  if (us <= 900)
+  {
+    return 0xF0 + (us + 99) / 100;
+  }
+  int ms = (us + 999) / 1000;
+  return ms > 127 ? 127 : ms;
+}
+
 // Isotp_Listener constructor
 Isotp_Listener::Isotp_Listener(isotp_options options) : options(options)
 {
+  stats.fc_bs = options.bs;
+  stats.fc_stmin = options.stmin;
+  padding_word = 0x0101010101010101ULL * (unsigned char)options.padding_byte;
 }
 
-void Isotp_Listener::update_options(isotp_options new_options){
-  options=new_options;
+Isotp_Listener::~Isotp_Listener()
+{
+  delete pending_options.load();
+}
+
+/*
+hands new options over to the listener, also from another thread while transfers are running
+
+the options are published as a snapshot, which the listener takes over with its next eval_msg(), tick() or
+send_telegram() when no transfer is running: a running transfer finishes with the options it started with, the
+next one starts with all new options at once. A snapshot which is replaced before the listener took it over is
+freed here, as the listener never saw it; a snapshot taken over is freed by the listener once it is copied.
+options_pending() tells if the last options are not taken over yet.
+*/
+void Isotp_Listener::update_options(isotp_options new_options)
+{
+  delete pending_options.exchange(new isotp_options(new_options), std::memory_order_acq_rel);
 }
 
+// takes over the options given by update_options(), between two transfers only
+inline void Isotp_Listener::take_new_options()
+{
+  if (actual_state != ActualState::Sleeping || ipc_waiting || in_batch || !pending_options.load(std::memory_order_relaxed))
+  {
+    return;
+  }
+  isotp_options *snapshot = pending_options.exchange(nullptr, std::memory_order_acquire);
+  if (!snapshot)
+  {
+    return;
+  }
+  options = *snapshot;
+  delete snapshot;
+  // a new configuration restarts the adaptive flow control with its start values
+  stats.fc_bs = options.bs;
+  stats.fc_stmin = options.stmin;
+  padding_word = 0x0101010101010101ULL * (unsigned char)options.padding_byte;
+}
+
+// the options in use
 isotp_options Isotp_Listener::get_options(){
   return options;
 }
@@ -33,10 +123,22 @@ return once true, if a timeout is reached, otherways always false
 bool Isotp_Listener::tick(uint64_t time_ticks)
 {
   this_tick = time_ticks;
+  take_new_options();
+  if (!options.capture)
+  {
+    return process_tick();
+  }
+  capture_begin();
+  bool timeout = process_tick();
+  capture_end();
+  return timeout;
+}
+
+bool Isotp_Listener::process_tick()
+{
   if (actual_state == ActualState::Consecutive)
   {
-    // DEBUG("Tick consecutive\n");
-    if (last_action_tick + consecutive_frame_delay < this_tick)
+    if (last_action_tick + consecutive_frame_delay <= this_tick)
     { // it is time to send the next CF
       send_cf_telegram();
     }
@@ -44,9 +146,18 @@ bool Isotp_Listener::tick(uint64_t time_ticks)
   if ( // are we waiting for something?
       actual_state == ActualState::FlowControl || actual_state == ActualState::WaitConsecutive)
   {
-    if (last_frame_received_tick + options.frame_timeout < this_tick)
+    if (wait_start() + (uint64_t)options.frame_timeout * options.ticks_per_ms < this_tick)
     { // waited too long
-    DEBUG("Tick timeout\n");
+      isotp_trace(Trace_Event::Timeout, options.source_address, (int)actual_state);
+      if (actual_state == ActualState::WaitConsecutive)
+      {
+        stats.rx_timeouts++;
+        end_rx_session(true);
+      }
+      if (latency_active)
+      { // the transfer is incomplete
+        latency_finish();
+      }
       actual_state = ActualState::Sleeping;
       return true;
     }
@@ -54,55 +165,151 @@ bool Isotp_Listener::tick(uint64_t time_ticks)
   return false;
 }
 
-// transfers data from the send buffer into the can message and set all data accordingly
+/*
+transfers data from the send buffer into the can message and set all data accordingly
+
+the frame is composed in a register: padding bytes, the already set PCI bytes and the payload block,
+and then written into the telegram buffer with one store. The bounds are checked once per frame
+*/
 int Isotp_Listener::copy_to_telegram_buffer()
 {
-  int nr_of_bytes = 0;
-  while (actual_telegram_pos < 8 && actual_send_pos < actual_send_buffer_size)
+  int nr_of_bytes = actual_send_buffer_size - actual_send_pos;
+  if (nr_of_bytes > 8 - actual_telegram_pos)
   {
-    telegrambuffer[actual_telegram_pos] = send_buffer[actual_send_pos];
-    nr_of_bytes++;
-    actual_telegram_pos++;
-    actual_send_pos++;
+    nr_of_bytes = 8 - actual_telegram_pos;
   }
-  for (int i = actual_telegram_pos; i < 8; i++)
+  if (nr_of_bytes < 0)
   {
-    telegrambuffer[i] = 0; // fill padding bytes
+    nr_of_bytes = 0;
   }
+  uint64_t frame = padding_word;
+  std::memcpy(&frame, telegrambuffer, actual_telegram_pos);
+  std::memcpy((unsigned char *)&frame + actual_telegram_pos, send_buffer + actual_send_pos, nr_of_bytes);
+  std::memcpy(telegrambuffer, &frame, 8);
+  actual_telegram_pos += nr_of_bytes;
+  actual_send_pos += nr_of_bytes;
   return nr_of_bytes;
 }
 
 // read data from the can message into the receive buffer and set all data accordingly
 int Isotp_Listener::read_from_can_msg(unsigned char data[8], int start, int len)
 {
-  int nr_of_bytes = 0;
-  while (len > 0 && actual_receive_pos < UDS_BUFFER_SIZE && start < 8)
+  int nr_of_bytes = 8 - start;
+  if (nr_of_bytes > len)
   {
-    receive_buffer[actual_receive_pos] = data[start];
-    nr_of_bytes++;
-    start++;
-    actual_receive_pos++;
-    len--;
+    nr_of_bytes = len;
   }
+  if (nr_of_bytes > UDS_BUFFER_SIZE - actual_receive_pos)
+  {
+    nr_of_bytes = UDS_BUFFER_SIZE - actual_receive_pos;
+  }
+  if (nr_of_bytes <= 0)
+  {
+    return 0;
+  }
+  std::memcpy(receive_buffer + actual_receive_pos, data + start, nr_of_bytes);
+  actual_receive_pos += nr_of_bytes;
   return nr_of_bytes;
 }
 
+/*
+number of frames needed to transfer a message of len bytes in frames of frame_len (8 for CAN, up to 64 for CAN FD) bytes
+*/
+int isotp_frame_count(int len, int frame_len)
+{
+  if (len <= 7 || len <= frame_len - 2)
+  { // single frame, with escape sequence for CAN FD
+    return 1;
+  }
+  int first_frame_payload = len > 4095 ? frame_len - 6 : frame_len - 2;
+  return 1 + (len - first_frame_payload + frame_len - 2) / (frame_len - 1); // rounded up
+}
+
+/*
+segments a whole message in one pass into its frames, one after the other in frames (each frame_len bytes):
+either a single frame or a first frame followed by all consecutive frames. The frames are padded with padding,
+first_frame_len receives the number of bytes to send of the first frame (unpadded single frames), all other frames are full.
+
+frames needs to hold isotp_frame_count(len, frame_len) * frame_len bytes. returns the number of frames
+*/
+int isotp_segment_message(const unsigned char *message, int len, unsigned char *frames, int frame_len, unsigned char padding, int *first_frame_len)
+{
+  int frame_count = isotp_frame_count(len, frame_len);
+  std::memset(frames, padding, frame_count * frame_len);
+  int pos;
+  if (len <= 7)
+  { // classic single frame
+    frames[0] = len;
+    std::memcpy(frames + 1, message, len);
+    pos = len;
+    *first_frame_len = len + 1;
+  }
+  else if (frame_count == 1)
+  { // CAN FD single frame with escape sequence
+    frames[0] = 0;
+    frames[1] = len;
+    std::memcpy(frames + 2, message, len);
+    pos = len;
+    *first_frame_len = len + 2;
+  }
+  else if (len <= 4095)
+  {
+    frames[0] = 0x10 | len >> 8;
+    frames[1] = len & 0xFF;
+    std::memcpy(frames + 2, message, frame_len - 2);
+    pos = frame_len - 2;
+    *first_frame_len = frame_len;
+  }
+  else
+  { // first frame with escape sequence and 32 bit length
+    frames[0] = 0x10;
+    frames[1] = 0;
+    frames[2] = len >> 24;
+    frames[3] = len >> 16;
+    frames[4] = len >> 8;
+    frames[5] = len;
+    std::memcpy(frames + 6, message, frame_len - 6);
+    pos = frame_len - 6;
+    *first_frame_len = frame_len;
+  }
+  for (int i = 1; i < frame_count; i++)
+  {
+    unsigned char *frame = frames + i * frame_len;
+    int nr_of_bytes = len - pos < frame_len - 1 ? len - pos : frame_len - 1;
+    frame[0] = 0x20 | (i & 0x0F);
+    std::memcpy(frame + 1, message + pos, nr_of_bytes);
+    pos += nr_of_bytes;
+  }
+  return frame_count;
+}
+
 // sent next consecutive frame and set all data accordingly
 void Isotp_Listener::send_cf_telegram()
 {
-  telegrambuffer[0] = 0x20 | actual_cf_count; // single frame
-  actual_cf_count = ++actual_cf_count & 0x0F;
-  int nr_of_bytes = 1;
-  actual_telegram_pos = 1; // the first byte is already used
-  int bytes_of_message = copy_to_telegram_buffer();
-  nr_of_bytes = nr_of_bytes + bytes_of_message;
-  options.send_frame(options.target_address, telegrambuffer, 8);
+  if (tx_cached)
+  { // the frame is already prebuilt
+    std::memcpy(telegrambuffer, tx_cached->frame((actual_send_pos - 6) / 7 + 1), 8);
+    actual_send_pos = actual_send_pos + 7 < actual_send_buffer_size ? actual_send_pos + 7 : actual_send_buffer_size;
+  }
+  else
+  {
+    telegrambuffer[0] = 0x20 | actual_cf_count; // single frame
+    actual_cf_count = ++actual_cf_count & 0x0F;
+    actual_telegram_pos = 1; // the first byte is already used
+    copy_to_telegram_buffer();
+  }
+  transmit_frame(8);
   last_action_tick = this_tick; // remember the time of this action
   if (actual_send_pos >= actual_send_buffer_size)
   { // buffer is fully send, job done
-    DEBUG(actual_send_buffer_size);
-    DEBUG(" Bytes sent\n");
+    isotp_trace(Trace_Event::TxComplete, options.source_address, actual_send_buffer_size);
     actual_state = ActualState::Sleeping; // stop all activities
+    tx_cached.reset();
+    if (latency_active)
+    {
+      timing.tx_us = ticks_to_us(this_tick - latency_tx_tick);
+      latency_finish();
+    }
     return;
   }
   if (flow_control_block_size > -1)
@@ -111,23 +318,24 @@ void Isotp_Listener::send_cf_telegram()
     if (flow_control_block_size < 1)
     { // number of allowed CFs sent, waiting for another flow control to continue
       actual_state = ActualState::FlowControl;
+      latency_fc_wait_tick = this_tick;
     }
   }
 }
 
 void Isotp_Listener::send_telegram(uds_buffer data, int nr_of_bytes)
 {
+  take_new_options();
   if (nr_of_bytes > UDS_BUFFER_SIZE)
   {
-    DEBUG("ERROR: data size too big with ");
-    DEBUG(nr_of_bytes);
-    DEBUG(" Bytes");
+    isotp_trace(Trace_Event::TxTooBig, options.source_address, nr_of_bytes);
   }
   for (int i = 0; i < nr_of_bytes; i++)
   {
     send_buffer[i] = data[i];
     actual_send_buffer_size = nr_of_bytes;
   }
+  tx_cached.reset();
   buffer_tx();
 }
 
@@ -142,41 +350,518 @@ void Isotp_Listener::buffer_tx()
       actual_telegram_pos = 1; // the first byte is already used
       actual_send_pos = 0;
       nr_of_bytes = nr_of_bytes + copy_to_telegram_buffer();
-      options.send_frame(options.target_address, telegrambuffer, nr_of_bytes);
+      transmit_frame(nr_of_bytes);
+      if (latency_active)
+      {
+        latency_first_frame(true);
+      }
     }
     else
     { // generate first frame...
       telegrambuffer[0] = 0x10 | actual_send_buffer_size >> 8;
       telegrambuffer[1] = actual_send_buffer_size & 0xFF;
+      actual_cf_count = 1; // the sequence number continues over all blocks
       int nr_of_bytes = 2;
       actual_telegram_pos = 2; // the first two bytes are already used
       actual_send_pos = 0;
       nr_of_bytes = nr_of_bytes + copy_to_telegram_buffer();
-      options.send_frame(options.target_address, telegrambuffer, nr_of_bytes);
+      transmit_frame(nr_of_bytes);
       actual_state = ActualState::FlowControl; // wait for flow control
+      if (latency_active)
+      {
+        latency_first_frame(false);
+      }
     }
   }
 }
 
+// sends a response out of the prebuilt frames of the cache
+void Isotp_Listener::send_cached(std::shared_ptr<const Cached_Response> cached)
+{
+  actual_send_buffer_size = cached->response_len;
+  std::memcpy(telegrambuffer, cached->frame(0), 8);
+  transmit_frame(cached->first_frame_len);
+  if (cached->frame_count() > 1)
+  { // the CFs follow after the flow control
+    tx_cached = cached;
+    actual_send_pos = 6;
+    actual_state = ActualState::FlowControl; // wait for flow control
+  }
+  if (latency_active)
+  {
+    latency_first_frame(cached->frame_count() == 1);
+  }
+}
+
 /*
+answers a complete request, either by the listener itself (TesterPresent), out of the response cache, by calling
+the handler or by a worker process (options.ipc, the response comes later by ipc_response()).
+Positive responses to requests with the suppressPosRspMsgIndicationBit set are not sent
  */
 void Isotp_Listener::handle_received_message(int len)
 {
-  DEBUG(len);
-  DEBUG(" Bytes received\n");
+  isotp_trace(Trace_Event::RxComplete, options.source_address, len);
+  if (latency_active)
+  {
+    latency_request_ns = steady_ns();
+  }
   actual_state = ActualState::Sleeping; // actual not more to be done
-  actual_send_buffer_size = options.uds_handler(RequestType::Service, receive_buffer, len, send_buffer);
-  DEBUG("Answer with ");
-  DEBUG(actual_send_buffer_size);
-  DEBUG(" Bytes\n");
+  tx_cached.reset();
+  ipc_waiting = false; // a new request replaces the one at the workers
+  bool suppress_positive = len > 1 && (receive_buffer[1] & 0x80) && Service::has_sub_function(receive_buffer[0]);
+  if (options.fast_tester_present && len == 2 && receive_buffer[0] == Service::TesterPresent && (receive_buffer[1] & 0x7F) == 0)
+  {
+    if (!suppress_positive)
+    {
+      send_buffer[0] = Service::TesterPresent + 0x40;
+      send_buffer[1] = 0;
+      actual_send_buffer_size = 2;
+      buffer_tx();
+    }
+    return;
+  }
+  if (options.response_cache)
+  {
+    std::shared_ptr<const Cached_Response> cached = options.response_cache->lookup(options.source_address, options.target_address, receive_buffer, len, this_tick / options.ticks_per_ms, options.padding_byte);
+    if (cached)
+    {
+      if (!suppress_positive || !cached->positive)
+      {
+        send_cached(cached);
+      }
+      return;
+    }
+  }
+  if (options.ipc)
+  {
+    ipc_submit_ns = latency_active ? steady_ns() : 0;
+    if (options.ipc->submit(this, ++ipc_request, receive_buffer, len))
+    {
+      ipc_waiting = true;
+      ipc_request_len = len;
+      return;
+    }
+    // all workers busy
+    actual_send_buffer_size = Uds_Service_Registry::negative_response(receive_buffer[0], Nrc::BusyRepeatRequest, send_buffer);
+    send_answer(receive_buffer, len);
+    return;
+  }
+  uint64_t handler_start = latency_active ? steady_ns() : 0;
+  if (options.services)
+  {
+    actual_send_buffer_size = options.services->dispatch(receive_buffer, len, send_buffer);
+  }
+  else
+  {
+    actual_send_buffer_size = options.uds_handler_ctx ? options.uds_handler_ctx(options.handler_context, RequestType::Service, receive_buffer, len, send_buffer)
+                                                      : options.uds_handler(RequestType::Service, receive_buffer, len, send_buffer);
+  }
+  if (latency_active)
+  {
+    timing.handler_us = (int)((steady_ns() - handler_start) / 1000);
+  }
+  send_answer(receive_buffer, len);
+}
+
+// sends the response in the send buffer to the request, stores it in the response cache
+void Isotp_Listener::send_answer(const unsigned char *request, int len)
+{
+  bool suppress_positive = len > 1 && (request[1] & 0x80) && Service::has_sub_function(request[0]);
+  bool positive = actual_send_buffer_size > 0 && send_buffer[0] != Service::NegativeResponse;
+  if (options.response_cache && positive)
+  {
+    options.response_cache->invalidate_affected(request[0]);
+    options.response_cache->store(options.source_address, options.target_address, request, len, send_buffer, actual_send_buffer_size, this_tick / options.ticks_per_ms, options.padding_byte);
+  }
+  if (suppress_positive && positive)
+  {
+    actual_send_buffer_size = 0;
+  }
+  isotp_trace(Trace_Event::Answer, options.source_address, actual_send_buffer_size, positive);
   buffer_tx();
 }
 
+// the response of a worker process (options.ipc), called by Uds_Ipc_Server::poll()
+void Isotp_Listener::ipc_response(uint32_t request, const unsigned char *response, int response_len)
+{
+  if (!ipc_waiting || request != ipc_request || actual_state != ActualState::Sleeping)
+  {
+    return; // the tester has sent a new request meanwhile
+  }
+  ipc_waiting = false;
+  if (latency_active)
+  {
+    timing.handler_us = (int)((steady_ns() - ipc_submit_ns) / 1000);
+  }
+  actual_send_buffer_size = response_len > UDS_BUFFER_SIZE || response_len < 0 ? 0 : response_len;
+  std::memcpy(send_buffer, response, actual_send_buffer_size);
+  // the request is taken from the receive buffer, not from the shared memory a worker could change
+  send_answer(receive_buffer, ipc_request_len);
+  if (latency_active && timing.first_response_us < 0)
+  { // no response sent
+    latency_finish();
+  }
+}
+
+// sends the first len bytes of the telegram buffer to the target address
+void Isotp_Listener::transmit_frame(int len)
+{
+  last_frame_sent_tick = this_tick;
+  if (options.capture)
+  {
+    if (capture_scope && capture_tx_count < 4)
+    {
+      std::memcpy(capture_tx[capture_tx_count].data, telegrambuffer, 8);
+      capture_tx[capture_tx_count].len = len;
+      capture_tx[capture_tx_count].state = (int)actual_state;
+      capture_tx[capture_tx_count].timestamp_ns = Isotp_Capture::now_ns();
+      capture_tx_count++;
+    }
+    else
+    {
+      options.capture->capture(options.source_address, true, options.target_address, telegrambuffer, len, 0, (int)actual_state, (int)actual_state);
+    }
+  }
+  if (options.send_frame_ctx)
+  {
+    options.send_frame_ctx(options.send_context, options.target_address, telegrambuffer, len);
+  }
+  else
+  {
+    options.send_frame(options.target_address, telegrambuffer, len);
+  }
+}
+
+// sends a clear-to-send flow control with the actual block size and separation time
+void Isotp_Listener::send_flow_control()
+{
+  telegrambuffer[0] = 0x30;           // FS Flow Status 0= CLear to Send
+  telegrambuffer[1] = stats.fc_bs;    // BS Block Size
+  telegrambuffer[2] = stats.fc_stmin; // ST min. Separation Time
+  transmit_frame(3);
+  receive_flow_control_block_count = stats.fc_bs;
+  if (receive_flow_control_block_count == 0)
+  {
+    receive_flow_control_block_count = -1;
+  }
+  last_cf_interval = -1; // the gap caused by the flow control is no CF jitter
+  cf_after_fc = true;    // and no CF gap for the latency
+}
+
+// resets the measurements for a new multi frame reception
+void Isotp_Listener::start_rx_session()
+{
+  session_cf_count = 0;
+  session_jitter_sum = 0;
+  session_interval_max = 0;
+  session_queue_depth = 0;
+  session_lost = false;
+  last_cf_interval = -1;
+}
+
+/*
+finishes a multi frame reception and, if enabled, adapts the flow control values for the next session:
+an overloaded session (lost frames, deep receive queue or high jitter) doubles stmin and halves bs,
+a clean session shortens stmin and enlarges bs by one step, always within the configured bounds
+*/
+void Isotp_Listener::end_rx_session(bool lost)
+{
+  stats.rx_queue_depth = session_queue_depth;
+  int64_t jitter = session_cf_count > 1 ? session_jitter_sum / (session_cf_count - 1) : 0;
+  stats.cf_jitter = (int)(jitter / options.ticks_per_ms);
+  stats.cf_jitter_us = (int)(jitter * 1000 / options.ticks_per_ms);
+  stats.cf_interval_max_us = (int)(session_interval_max * 1000 / options.ticks_per_ms);
+  if (!options.adaptive_fc)
+  {
+    return;
+  }
+  bool overloaded = lost || session_queue_depth > options.rx_queue_limit || stats.cf_jitter > options.cf_jitter_limit;
+  int stmin_us = isotp_stmin_to_us(stats.fc_stmin);
+  int bs = stats.fc_bs;
+  if (overloaded)
+  {
+    stmin_us = stmin_us == 0 ? 100 : stmin_us * 2;
+    bs = (bs == 0 ? 255 : bs) / 2;
+    int bs_floor = options.bs_min > 1 ? options.bs_min : 1;
+    if (bs < bs_floor)
+    { // 0 would mean "no limit", the opposite of what an overload needs
+      bs = bs_floor;
+    }
+  }
+  else
+  {
+    if (stmin_us <= 100)
+    {
+      stmin_us = 0;
+    }
+    else if (stmin_us <= 1000)
+    {
+      stmin_us -= 100;
+    }
+    else
+    {
+      stmin_us -= 1000;
+    }
+    if (bs > 0)
+    {
+      bs += bs / 4 > 1 ? bs / 4 : 1;
+      if (bs > 255)
+      {
+        bs = 0; // beyond the largest block size there's only "no limit"
+      }
+    }
+  }
+  // keep the values within the configured bounds
+  int stmin_min_us = isotp_stmin_to_us(options.stmin_min);
+  int stmin_max_us = isotp_stmin_to_us(options.stmin_max);
+  stmin_us = stmin_us < stmin_min_us ? stmin_min_us : stmin_us > stmin_max_us ? stmin_max_us : stmin_us;
+  if (options.bs_max > 0 && (bs == 0 || bs > options.bs_max))
+  {
+    bs = options.bs_max;
+  }
+  if (bs != 0 && bs < options.bs_min)
+  {
+    bs = options.bs_min;
+  }
+  stats.fc_stmin = isotp_us_to_stmin(stmin_us);
+  stats.fc_bs = bs;
+}
+
+/*
+tells the listener how many frames are waiting in the applications receive queue, e.g. the number
+of frames read in one go from the socket. Used by the adaptive flow control to detect overload
+*/
+void Isotp_Listener::report_rx_queue_depth(int frames)
+{
+  if (frames > session_queue_depth)
+  {
+    session_queue_depth = frames;
+  }
+}
+
+// starts the timing of a new transfer with the first (or single) frame of the request
+void Isotp_Listener::latency_begin(int request_len)
+{
+  timing = isotp_transfer_timing();
+  timing.request_len = request_len;
+  cf_gaps_us.clear();
+  cf_after_fc = true;
+  latency_active = true;
+}
+
+// the first response frame is sent, a single frame ends the transfer
+void Isotp_Listener::latency_first_frame(bool single)
+{
+  timing.first_response_us = (int)((steady_ns() - latency_request_ns) / 1000);
+  timing.response_len = actual_send_buffer_size;
+  latency_tx_tick = this_tick;
+  latency_fc_wait_tick = this_tick;
+  if (single)
+  {
+    timing.tx_us = 0;
+    latency_finish();
+  }
+}
+
+// summarizes the CF gaps and hands the timing of the transfer over to options.latency
+void Isotp_Listener::latency_finish()
+{
+  latency_active = false;
+  if (!cf_gaps_us.empty())
+  {
+    int64_t sum = 0;
+    timing.cf_gap_max_us = 0;
+    for (int gap : cf_gaps_us)
+    {
+      sum += gap;
+      timing.cf_gap_max_us = gap > timing.cf_gap_max_us ? gap : timing.cf_gap_max_us;
+      if (gap < timing.stmin_us)
+      {
+        timing.cf_gaps_below_stmin++;
+      }
+    }
+    timing.cf_gap_mean_us = (int)(sum / (int64_t)cf_gaps_us.size());
+  }
+  last_timing = timing;
+  if (options.latency)
+  {
+    options.latency->add(options.source_address, timing, cf_gaps_us);
+  }
+}
+
+int Isotp_Listener::ticks_to_us(uint64_t ticks)
+{
+  return (int)(ticks * 1000 / options.ticks_per_ms);
+}
+
+// the timing of the last finished transfer
+isotp_transfer_timing Isotp_Listener::get_timing()
+{
+  return last_timing;
+}
+
+isotp_stats Isotp_Listener::get_stats()
+{
+  return stats;
+}
+
 /* checks, if the given can message is a isotp message.
 
 returns MSG_xx error codes
 */
 int Isotp_Listener::eval_msg(int can_id, unsigned char data[8], int len)
+{
+  take_new_options();
+  return eval_received(can_id, data, len, 0);
+}
+
+/*
+the same with the arrival time of the frame (e.g. the kernel receive timestamp) in the unit of tick(), so the
+frame timeout and the CF timing are measured against the real arrival instead of the last tick() call
+*/
+int Isotp_Listener::eval_msg(int can_id, unsigned char data[8], int len, uint64_t time_ticks)
+{
+  take_new_options();
+  return eval_received(can_id, data, len, &time_ticks);
+}
+
+// eval_msg() with the options in use, time_ticks is 0 for the actual time
+int Isotp_Listener::eval_received(int can_id, unsigned char data[8], int len, const uint64_t *time_ticks)
+{
+  frame_rx_ns = 0;
+  if (time_ticks && (options.capture || options.latency))
+  {
+    frame_rx_ns = *time_ticks / options.ticks_per_ms * 1000000 + *time_ticks % options.ticks_per_ms * 1000000 / options.ticks_per_ms;
+  }
+  if (options.capture && can_id == options.source_address)
+  { // without arrival time the frame is captured with the actual time
+    return eval_captured(can_id, data, len, time_ticks ? *time_ticks : this_tick, frame_rx_ns);
+  }
+  return eval_frame(can_id, data, len, time_ticks ? *time_ticks : this_tick);
+}
+
+/*
+evaluates a whole batch of received frames, e.g. as read by recvmmsg(), in their order
+
+on a busy bus most frames are not for this listener: the ids and PCI types of four frames at a time are compared in
+one go (SSE2, scalar without it), only the frames with our id are evaluated one by one like by eval_msg(). The
+result code of each frame is written to results (if not null), time_ticks optionally gives the arrival time of
+each frame. New options are only taken before the batch, as the ids were compared with the old ones.
+
+returns the number of frames which were not MSG_NO_UDS
+*/
+int Isotp_Listener::eval_msgs(const isotp_frame *frames, size_t n, int *results, const uint64_t *time_ticks)
+{
+  take_new_options(); // the ids are compared with the options of the whole batch
+  in_batch = true;     // not even taken by a send_telegram() of the uds_handler
+  int handled = 0;
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128i source = _mm_set1_epi32(options.source_address);
+  const __m128i pci_type_mask = _mm_set1_epi32(0xC0); // PCI types above 3 (Flow Control) are out of spec
+  const __m128i len_mask = _mm_set1_epi32(0xFF);
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 4 <= n; i += 4)
+  {
+    __m128i f0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(frames + i));
+    __m128i f1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(frames + i + 1));
+    __m128i f2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(frames + i + 2));
+    __m128i f3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(frames + i + 3));
+    // transpose: ids, lens and the first data bytes of the four frames side by side
+    __m128i low01 = _mm_unpacklo_epi32(f0, f1);
+    __m128i low23 = _mm_unpacklo_epi32(f2, f3);
+    __m128i ids = _mm_unpacklo_epi64(low01, low23);
+    int ours = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(ids, source)));
+    if (results)
+    {
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(results + i), zero); // MSG_NO_UDS
+    }
+    if (!ours)
+    {
+      continue;
+    }
+    __m128i lens = _mm_unpackhi_epi64(low01, low23);
+    __m128i pcis = _mm_unpacklo_epi64(_mm_unpackhi_epi32(f0, f1), _mm_unpackhi_epi32(f2, f3));
+    __m128i valid = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(lens, len_mask), zero),
+                                     _mm_cmpeq_epi32(_mm_and_si128(pcis, pci_type_mask), zero));
+    int wrong_format = ours & ~_mm_movemask_ps(_mm_castsi128_ps(valid));
+    for (int k = 0; k < 4; k++)
+    {
+      if (!(ours >> k & 1))
+      {
+        continue;
+      }
+      int result;
+      if ((wrong_format >> k & 1) && !options.capture)
+      { // refused like eval_frame() would do, a capture still needs to see the frame
+        result = MSG_UDS_WRONG_FORMAT;
+      }
+      else
+      {
+        const isotp_frame &frame = frames[i + k];
+        unsigned char data[8];
+        std::memcpy(data, frame.data, 8);
+        result = eval_received(frame.can_id, data, frame.len, time_ticks ? time_ticks + i + k : 0);
+      }
+      handled++;
+      if (results)
+      {
+        results[i + k] = result;
+      }
+    }
+  }
+#endif
+  for (; i < n; i++)
+  {
+    const isotp_frame &frame = frames[i];
+    int result = MSG_NO_UDS;
+    if (frame.can_id == (uint32_t)options.source_address)
+    {
+      unsigned char data[8];
+      std::memcpy(data, frame.data, 8);
+      result = eval_received(frame.can_id, data, frame.len, time_ticks ? time_ticks + i : 0);
+      handled += result != MSG_NO_UDS;
+    }
+    if (results)
+    {
+      results[i] = result;
+    }
+  }
+  in_batch = false;
+  return handled;
+}
+
+// evaluates a frame and captures it together with the frames sent in reaction
+int Isotp_Listener::eval_captured(int can_id, unsigned char data[8], int len, uint64_t time_ticks, uint64_t timestamp_ns)
+{
+  capture_begin();
+  int result = eval_frame(can_id, data, len, time_ticks);
+  options.capture->capture(options.source_address, false, can_id, data, len, timestamp_ns, capture_state_from, (int)actual_state);
+  capture_end();
+  return result;
+}
+
+// from now on sent frames are held back until capture_end()
+void Isotp_Listener::capture_begin()
+{
+  capture_scope = true;
+  capture_state_from = (int)actual_state;
+  capture_tx_count = 0;
+}
+
+// captures the frames held back, with the state the listener is in now
+void Isotp_Listener::capture_end()
+{
+  capture_scope = false;
+  for (int i = 0; i < capture_tx_count; i++)
+  {
+    options.capture->capture(options.source_address, true, options.target_address, capture_tx[i].data, capture_tx[i].len, capture_tx[i].timestamp_ns,
+                             capture_tx[i].state, (int)actual_state);
+  }
+  capture_tx_count = 0;
+}
+
+int Isotp_Listener::eval_frame(int can_id, unsigned char data[8], int len, uint64_t time_ticks)
 {
   if (can_id != options.source_address)
   {
@@ -194,37 +879,52 @@ int Isotp_Listener::eval_msg(int can_id, unsigned char data[8], int len)
     return MSG_UDS_WRONG_FORMAT; // illegal format
   }
   // remember that a valid frame came in
-  last_frame_received_tick = this_tick; // remember the time of this action
+  if (time_ticks > this_tick)
+  { // the frame is newer than the last tick()
+    this_tick = time_ticks;
+  }
+  last_frame_received_tick = time_ticks; // remember the time of this action
   FrameType frametype = static_cast<FrameType>(frame_identifier);
 
   if (frametype == FrameType::First)
   {
-    DEBUG("First Frame\n");
     dl = ((int)data[0] & 0x0F) * 256 + (int)data[1];
+    uint64_t ff_eval_ns = options.latency ? steady_ns() : 0;
+    isotp_trace(Trace_Event::FirstFrame, options.source_address, dl);
     // initialize receive parameters
     actual_receive_pos = 0;
     receive_cf_count = 1;
+    ipc_waiting = false; // the receive buffer is overwritten, the response to the old request is dropped
     expected_receive_buffer_size = dl;
 
     // store the first received bytes in the receive buffer
     read_from_can_msg(data, 2, dl > 6 ? 6 : dl); // just in case of a spec. violation, but a first frame could contain only a short msg, so check the dl here
 
-    // send flow control
-    telegrambuffer[0] = 0x30;          // FS Flow Status 0= CLear to Send
-    telegrambuffer[1] = options.bs;    // BS Block Size
-    telegrambuffer[2] = options.stmin; // ST min. Separation Time
-    options.send_frame(options.target_address, telegrambuffer, 3);
-    receive_flow_control_block_count = options.bs;
-    if (receive_flow_control_block_count == 0)
+    if (actual_state == ActualState::WaitConsecutive)
+    { // the previous reception was dropped by the sender
+      end_rx_session(true);
+    }
+    start_rx_session();
+    if (options.latency)
     {
-      receive_flow_control_block_count = -1;
+      latency_begin(dl);
+      send_flow_control();
+      // from the arrival of the first frame, so the time it waited in the receive queue is included
+      uint64_t now_ns = frame_rx_ns ? system_ns() : 0;
+      timing.ff_to_fc_us = now_ns >= frame_rx_ns && frame_rx_ns ? (int)((now_ns - frame_rx_ns) / 1000) : (int)((steady_ns() - ff_eval_ns) / 1000);
+      timing.stmin_us = isotp_stmin_to_us(stats.fc_stmin);
+    }
+    else
+    {
+      send_flow_control();
     }
     actual_state = ActualState::WaitConsecutive; // wait for Consecutive Frames
+    return MSG_UDS_OK;
   }
   if (frametype == FrameType::FlowControl)
   {
     unsigned char flow_status = data[0] & 0x0F;
-    DEBUG("Flow Control\n");
+    isotp_trace(Trace_Event::FlowControl, options.source_address, flow_status, data[1], data[2]);
     if (flow_status == 1)
     {                    // wait
       return MSG_UDS_OK; // do nothing
@@ -232,12 +932,20 @@ int Isotp_Listener::eval_msg(int can_id, unsigned char data[8], int len)
     if (flow_status == 2)
     {                                       // Overflow - transmission crashed, go back into sleep mode
       actual_state = ActualState::Sleeping; // stop all activities
-      return MSG_UDS_OK;                    // do nothing
+      if (latency_active)
+      {
+        latency_finish();
+      }
+      return MSG_UDS_OK; // do nothing
     }
     if (flow_status == 3)
     {                                       // undefined
       actual_state = ActualState::Sleeping; // stop all activities
-      return MSG_UDS_WRONG_FORMAT;          // do nothing
+      if (latency_active)
+      {
+        latency_finish();
+      }
+      return MSG_UDS_WRONG_FORMAT; // do nothing
     }
     // the flow status is 0 = Clear to send
     // store parameters
@@ -246,45 +954,87 @@ int Isotp_Listener::eval_msg(int can_id, unsigned char data[8], int len)
     { // we use -1 as indicator that there's no block size given
       flow_control_block_size = -1;
     }
-    consecutive_frame_delay = data[2]; // what's the time unit? For now assuming milliseconds..
-    actual_cf_count = 1;
+    consecutive_frame_delay = (int)((int64_t)isotp_stmin_to_us(data[2]) * options.ticks_per_ms / 1000);
+    if (latency_active && actual_state == ActualState::FlowControl)
+    {
+      timing.fc_wait_us += ticks_to_us(time_ticks - latency_fc_wait_tick);
+    }
     // and start sending with the next tick
     actual_state = ActualState::Consecutive;
     return MSG_UDS_OK;
   }
   if (frametype == FrameType::Single)
   {
-    DEBUG("Single Frame\n");
+    isotp_trace(Trace_Event::SingleFrame, options.source_address, dl);
     actual_receive_pos = 0;
+    if (options.latency)
+    {
+      latency_begin(dl);
+    }
     if (read_from_can_msg(data, 1, dl))
     {
       handle_received_message(dl);
     }
+    if (latency_active && timing.first_response_us < 0 && !ipc_waiting)
+    { // no response sent
+      latency_finish();
+    }
     actual_state = ActualState::Sleeping; // stop all activities
     return MSG_UDS_OK;                    // message handled
   }
   if (frametype == FrameType::Consecutive)
   {
-    // DEBUG("Consecutive Frame\n");
+    isotp_trace(Trace_Event::ConsecutiveFrame, options.source_address, data[0] & 0x0F, actual_receive_pos);
     if (actual_state == ActualState::WaitConsecutive)
     {
       if (receive_cf_count != (data[0] & 0x0F))
       {
-        DEBUG("wrong CF sequence number\n");
+        isotp_trace(Trace_Event::WrongSequence, options.source_address, receive_cf_count, data[0] & 0x0F);
+        stats.rx_sequence_errors++;
+        session_lost = true;
         // send cancelation flow control
         telegrambuffer[0] = 0x32; // FS Flow Status 2= Overflow
         telegrambuffer[1] = 0;
         telegrambuffer[2] = 0;
-        options.send_frame(options.target_address, telegrambuffer, 3);
+        transmit_frame(3);
         return MSG_UDS_UNEXPECTED_CF;
       }
       receive_cf_count = ++receive_cf_count & 0x0F;
+      // measure the variation of the CF inter-arrival times
+      stats.rx_cf_frames++;
+      if (session_cf_count > 0)
+      {
+        int64_t interval = (int64_t)(time_ticks - last_cf_received_tick);
+        if (last_cf_interval > -1)
+        {
+          session_jitter_sum += interval > last_cf_interval ? interval - last_cf_interval : last_cf_interval - interval;
+        }
+        if (interval > session_interval_max)
+        {
+          session_interval_max = interval;
+        }
+        last_cf_interval = interval;
+        if (latency_active && !cf_after_fc)
+        {
+          cf_gaps_us.push_back(ticks_to_us(interval));
+        }
+      }
+      session_cf_count++;
+      timing.cf_count++;
+      cf_after_fc = false;
+      last_cf_received_tick = time_ticks;
       if (read_from_can_msg(data, 1, expected_receive_buffer_size - actual_receive_pos))
       {
         if (actual_receive_pos == expected_receive_buffer_size) // full message received
         {
           actual_state = ActualState::Sleeping; // stop all activities
+          stats.rx_transfers++;
+          end_rx_session(session_lost);
           handle_received_message(expected_receive_buffer_size);
+          if (latency_active && timing.first_response_us < 0 && !ipc_waiting)
+          { // no response sent
+            latency_finish();
+          }
           return MSG_UDS_OK; // message handled
         }
         if (receive_flow_control_block_count > -1)
@@ -293,18 +1043,11 @@ int Isotp_Listener::eval_msg(int can_id, unsigned char data[8], int len)
           if (receive_flow_control_block_count == 0)
           {
             // send another flow control
-            telegrambuffer[0] = 0x30;          // FS Flow Status 0= CLear to Send
-            telegrambuffer[1] = options.bs;    // BS Block Size
-            telegrambuffer[2] = options.stmin; // ST min. Separation Time
-            options.send_frame(options.target_address, telegrambuffer, 3);
-            receive_flow_control_block_count = options.bs;
-            if (receive_flow_control_block_count == 0)
-            {
-              receive_flow_control_block_count = -1;
-            }
+            send_flow_control();
           }
           return MSG_UDS_OK; // message handled
         }
+        return MSG_UDS_OK; // no block size limit, wait for the next CF
       }
       else // something went wrong...
       {
@@ -314,12 +1057,12 @@ int Isotp_Listener::eval_msg(int can_id, unsigned char data[8], int len)
     }
     else
     {
-      DEBUG("unexpected CF\n");
+      isotp_trace(Trace_Event::UnexpectedCf, options.source_address, data[0] & 0x0F, (int)actual_state);
       // send cancelation flow control
       telegrambuffer[0] = 0x32; // FS Flow Status 2= Overflow
       telegrambuffer[1] = 0;
       telegrambuffer[2] = 0;
-      options.send_frame(options.target_address, telegrambuffer, 3);
+      transmit_frame(3);
       return MSG_UDS_UNEXPECTED_CF;
     }
   }
@@ -333,3 +1076,30 @@ bool Isotp_Listener::busy()
 {
   return actual_state != ActualState::Sleeping;
 }
+
+/*
+the time (in ticks) from which on tick() has something to do: the next CF is due or the transfer times out.
+UINT64_MAX as long as nothing is going on
+*/
+uint64_t Isotp_Listener::next_deadline() const
+{
+  if (actual_state == ActualState::Consecutive)
+  {
+    return last_action_tick + consecutive_frame_delay;
+  }
+  if (actual_state == ActualState::FlowControl || actual_state == ActualState::WaitConsecutive)
+  {
+    return wait_start() + (uint64_t)options.frame_timeout * options.ticks_per_ms + 1;
+  }
+  return UINT64_MAX;
+}
+
+/*
+the time from which on the listener waits for the other side: the last frame received or sent, whichever is later.
+So the wait for a flow control (N_Bs) starts with the last CF of a block or the FF, the wait for the next CF (N_Cr)
+with the last CF received or the flow control sent
+*/
+uint64_t Isotp_Listener::wait_start() const
+{
+  return last_frame_sent_tick > last_frame_received_tick ? last_frame_sent_tick : last_frame_received_tick;
+}
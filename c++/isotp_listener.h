@@ -1,17 +1,15 @@
 #ifndef ISOTP_LISTENER_H
 #define ISOTP_LISTENER_H
 
+#include <atomic>
 #include <cstdint>
+#include <memory>
+#include <vector>
 
-// DEBUG output - (un)comment as needed
-#define DEBUG(x)        \
-    do                  \
-    {                   \
-        std::cerr << x; \
-    } while (0)
-// #define DEBUG(x)
+#include "isotp_latency.h"
 
 #define UDS_BUFFER_SIZE 4095
+#define ISOTP_MAX_FRAME_LEN 64 // the largest frame, CAN FD
 typedef unsigned char uds_buffer[UDS_BUFFER_SIZE];
 
 enum class RequestType
@@ -42,6 +40,12 @@ enum class ActualState
 #define MSG_UDS_UNEXPECTED_CF -2 // not wating for a CF
 #define MSG_UDS_ERROR -3         // unclear error
 
+class Uds_Service_Registry;
+class Uds_Response_Cache;
+struct Cached_Response;
+class Isotp_Capture;
+class Uds_Ipc_Server;
+
 // structure to initialize the isotp_listener constructor
 struct isotp_options
 {
@@ -51,8 +55,43 @@ struct isotp_options
     int stmin = 0;  // The minimum separation time sent in the flow control message. Indicates the amount of time to wait between 2 consecutive frame. This value will be sent as is over CAN. Values from 1 to 127 means milliseconds. Values from 0xF1 to 0xF9 means 100us to 900us. 0 Means no timing requirements
     int wftmax = 0; // Maximum number of wait frame (flow control message with flow status=1) allowed before dropping a message. 0 means that wait frame are not allowed
     int frame_timeout = 100; // maximal allowed time in ms between two received frames to keep the transfer active
+    int ticks_per_ms = 1;    // resolution of the time_ticks given to tick() and eval_msg(), e.g. 1000 for microseconds
+    int padding_byte = 0;    // value of the unused bytes of a frame, e.g. 0xCC or 0xAA
+    bool adaptive_fc = false; // if set, bs and stmin are only the start values and the listener tunes the values of each new flow control from the observed receive load
+    int bs_min = 1;           // lowest block size the adaptive flow control may fall back to
+    int bs_max = 0;           // highest block size the adaptive flow control may advertise, 0 allows to go up to "no limit"
+    int stmin_min = 0;        // shortest separation time (in flow control encoding) the adaptive flow control may advertise
+    int stmin_max = 127;      // longest separation time (in flow control encoding) the adaptive flow control may fall back to
+    int rx_queue_limit = 16;  // a reported receive queue depth above this counts as overload
+    int cf_jitter_limit = 2;  // a mean variation of the CF inter-arrival times (in ms) above this counts as overload
     int (*send_frame)(int, unsigned char[8], int len) = 0;
     int (*uds_handler)(RequestType request_type, uds_buffer receive_buffer, int recv_len, uds_buffer send_buffer) = 0;
+    // alternatives to send_frame and uds_handler for callbacks which need their own object, which is given as context
+    void *send_context = 0;
+    int (*send_frame_ctx)(void *context, int can_id, unsigned char data[8], int len) = 0;
+    void *handler_context = 0;
+    int (*uds_handler_ctx)(void *context, RequestType request_type, uds_buffer receive_buffer, int recv_len, uds_buffer send_buffer) = 0;
+    Uds_Service_Registry *services = 0; // if set, received messages are dispatched by this registry instead of the uds_handler
+    Uds_Response_Cache *response_cache = 0; // if set, cached responses are sent without calling the handler
+    bool fast_tester_present = false;       // if set, TesterPresent (3E 00 / 3E 80) is answered by the listener itself
+    Isotp_Capture *capture = 0;             // if set, all received and sent frames are captured into a pcapng file
+    Isotp_Latency *latency = 0;             // if set, the timing of each transfer is measured and collected there
+    Uds_Ipc_Server *ipc = 0;                // if set, the requests are answered by worker processes instead of the handler
+};
+
+// statistics of the receive path, incl. the flow control values actual in use
+struct isotp_stats
+{
+    int fc_bs = 0;              // block size advertised in the last flow control
+    int fc_stmin = 0;           // separation time advertised in the last flow control
+    int rx_transfers = 0;       // number of completed multi frame receptions
+    int rx_cf_frames = 0;       // number of received consecutive frames
+    int rx_sequence_errors = 0; // number of CFs with a wrong sequence number
+    int rx_timeouts = 0;        // number of receptions aborted by timeout
+    int rx_queue_depth = 0;     // highest receive queue depth reported in the last session
+    int cf_jitter = 0;          // mean variation of the CF inter-arrival times in the last session (in ms)
+    int cf_jitter_us = 0;       // the same in microseconds, as precise as the given time ticks
+    int cf_interval_max_us = 0; // longest gap between two CFs in the last session
 };
 
 // a (growing) list of UDS services
@@ -61,8 +100,93 @@ class Service
 public:
     static unsigned char const ClearDTCs = 0x14;
     static unsigned char const ReadDTC = 0x19;
+    static unsigned char const ReadDataByIdentifier = 0x22;
+    static unsigned char const WriteDataByIdentifier = 0x2E;
+    static unsigned char const RequestDownload = 0x34;
+    static unsigned char const TransferData = 0x36;
+    static unsigned char const RequestTransferExit = 0x37;
+    static unsigned char const TesterPresent = 0x3E;
+    static unsigned char const NegativeResponse = 0x7F;
+
+    // true for services with a sub function byte, which carries the suppressPosRspMsgIndicationBit (0x80)
+    static bool has_sub_function(unsigned char sid)
+    {
+        switch (sid)
+        {
+        case 0x10: // DiagnosticSessionControl
+        case 0x11: // ECUReset
+        case 0x19: // ReadDTCInformation
+        case 0x27: // SecurityAccess
+        case 0x28: // CommunicationControl
+        case 0x29: // Authentication
+        case 0x2C: // DynamicallyDefineDataIdentifier
+        case 0x31: // RoutineControl
+        case 0x3E: // TesterPresent
+        case 0x83: // AccessTimingParameter
+        case 0x84: // SecuredDataTransmission
+        case 0x85: // ControlDTCSetting
+        case 0x86: // ResponseOnEvent
+        case 0x87: // LinkControl
+            return true;
+        }
+        return false;
+    }
+
+    // true for services which only read and change nothing in the ECU, so their responses may be cached
+    static bool is_read_only(unsigned char sid)
+    {
+        switch (sid)
+        {
+        case 0x19: // ReadDTCInformation
+        case 0x22: // ReadDataByIdentifier
+        case 0x23: // ReadMemoryByAddress
+        case 0x24: // ReadScalingDataByIdentifier
+            return true;
+        }
+        return false;
+    }
 };
 
+// negative response codes, see https://www.rfwireless-world.com/Terminology/UDS-NRC-codes.html
+class Nrc
+{
+public:
+    static unsigned char const GeneralReject = 0x10;
+    static unsigned char const ServiceNotSupported = 0x11;
+    static unsigned char const SubFunctionNotSupported = 0x12;
+    static unsigned char const IncorrectMessageLength = 0x13;
+    static unsigned char const ResponseTooLong = 0x14;
+    static unsigned char const BusyRepeatRequest = 0x21;
+    static unsigned char const ConditionsNotCorrect = 0x22;
+    static unsigned char const RequestSequenceError = 0x24;
+    static unsigned char const RequestOutOfRange = 0x31;
+    static unsigned char const UploadDownloadNotAccepted = 0x70;
+    static unsigned char const TransferDataSuspended = 0x71;
+    static unsigned char const GeneralProgrammingFailure = 0x72;
+    static unsigned char const WrongBlockSequenceCounter = 0x73;
+};
+
+/*
+a received frame for Isotp_Listener::eval_msgs(), with the same layout as the socketcan can_frame, so a batch read
+by recvmmsg() can be passed as it is: 16 bytes, the id in the first 4, the data in the last 8 bytes
+*/
+struct isotp_frame
+{
+    uint32_t can_id;
+    uint8_t len;
+    uint8_t pad[3];
+    unsigned char data[8];
+};
+static_assert(sizeof(isotp_frame) == 16, "isotp_frame must match the socketcan can_frame");
+
+// segmentation of a whole message into frames, see isotp_listener.cpp
+int isotp_frame_count(int len, int frame_len = 8);
+int isotp_segment_message(const unsigned char *message, int len, unsigned char *frames, int frame_len, unsigned char padding, int *first_frame_len);
+
+// conversion of the flow control STmin encoding (ms, 0xF1 - 0xF9 = 100 - 900µs) from and into microseconds
+int isotp_stmin_to_us(int stmin);
+int isotp_us_to_stmin(int us);
+
 // the Isotp_Listener class
 class Isotp_Listener
 {
@@ -70,7 +194,9 @@ private:
     isotp_options options;
     uint64_t last_action_tick = 0;
     uint64_t last_frame_received_tick = 0;
+    uint64_t last_frame_sent_tick = 0; // with the last received frame, the start of the N_Bs / N_Cr timeout
     uint64_t this_tick = 0;
+    uint64_t frame_rx_ns = 0; // arrival time of the frame in evaluation (system clock, like the time ticks), 0 if not given
     ActualState actual_state = ActualState::Sleeping;
     uds_buffer receive_buffer;
     uds_buffer send_buffer;
@@ -84,22 +210,89 @@ private:
     int receive_cf_count;
     int flow_control_block_size;
     int receive_flow_control_block_count;
-    int consecutive_frame_delay;
+    int consecutive_frame_delay; // in ticks
+    isotp_stats stats;
+    // adaptive flow control: measurements of the actual receive session
+    uint64_t last_cf_received_tick = 0;
+    int64_t last_cf_interval = -1;
+    int session_cf_count = 0;
+    int64_t session_jitter_sum = 0; // in ticks
+    int64_t session_interval_max = 0;
+    int session_queue_depth = 0;
+    bool session_lost = false;
+    uint64_t padding_word = 0; // padding_byte repeated over a whole frame
+    std::shared_ptr<const Cached_Response> tx_cached; // the prebuilt frames actual in transfer, if the answer came from the cache
+    // capture: frames sent within eval_msg() or tick() are captured after the received frame, with the state reached
+    bool capture_scope = false;
+    int capture_state_from = 0;
+    int capture_tx_count = 0;
+    struct
+    {
+        unsigned char data[8];
+        int len;
+        int state;
+        uint64_t timestamp_ns;
+    } capture_tx[4];
+    // latency measurement of the actual transfer, only with options.latency
+    bool latency_active = false;
+    isotp_transfer_timing timing;
+    isotp_transfer_timing last_timing;
+    std::vector<int> cf_gaps_us;
+    uint64_t latency_request_ns = 0;   // steady clock, when the request was complete
+    uint64_t latency_tx_tick = 0;      // first response frame sent
+    uint64_t latency_fc_wait_tick = 0; // since then waiting for a flow control
+    bool cf_after_fc = false;          // the next CF gap spans our flow control
+    // requests answered by worker processes, only with options.ipc
+    uint32_t ipc_request = 0;  // number of the last request given to the workers
+    int ipc_request_len = 0;   // its length, the request stays in the receive buffer meanwhile
+    bool ipc_waiting = false;  // for the response to it
+    uint64_t ipc_submit_ns = 0;
+    // options given by update_options(), taken over when no transfer is running
+    std::atomic<isotp_options *> pending_options{nullptr};
+    bool in_batch = false; // within eval_msgs(), which keeps the options of the whole batch
 
 public:
     Isotp_Listener(isotp_options options);
+    ~Isotp_Listener();
     bool tick(uint64_t time_ticks);
     int eval_msg(int can_id, unsigned char data[8], int len);
+    int eval_msg(int can_id, unsigned char data[8], int len, uint64_t time_ticks);
+    int eval_msgs(const isotp_frame *frames, size_t n, int *results, const uint64_t *time_ticks = 0);
     void send_telegram(uds_buffer data, int nr_of_bytes);
     void update_options(isotp_options options);
     isotp_options get_options();
+    bool options_pending() const { return pending_options.load(std::memory_order_relaxed) != nullptr; }
     bool busy();
+    ActualState get_state() const { return actual_state; }
+    uint64_t next_deadline() const;
+    isotp_stats get_stats();
+    void report_rx_queue_depth(int frames);
+    isotp_transfer_timing get_timing();
+    void ipc_response(uint32_t request, const unsigned char *response, int response_len);
 
 private:
+    bool process_tick();
+    int eval_received(int can_id, unsigned char data[8], int len, const uint64_t *time_ticks);
+    int eval_frame(int can_id, unsigned char data[8], int len, uint64_t time_ticks);
+    int eval_captured(int can_id, unsigned char data[8], int len, uint64_t time_ticks, uint64_t timestamp_ns);
+    void capture_begin();
+    void capture_end();
     int copy_to_telegram_buffer();
     int read_from_can_msg(unsigned char data[8], int start, int len);
     void send_cf_telegram();
     void buffer_tx();
     void handle_received_message(int len);
+    void send_answer(const unsigned char *request, int len);
+    void transmit_frame(int len);
+    void send_flow_control();
+    void send_cached(std::shared_ptr<const Cached_Response> cached);
+    void latency_begin(int request_len);
+    void latency_first_frame(bool single);
+    void latency_finish();
+    int ticks_to_us(uint64_t ticks);
+    void take_new_options();
+    uint64_t wait_start() const;
+    void start_rx_session();
+    void end_rx_session(bool lost);
 };
 #endif
\ No newline at end of file
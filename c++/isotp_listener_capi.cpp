@@ -0,0 +1,161 @@
+/*
+
+C ABI of the Isotp_Listener, see isotp_listener_capi.h
+
+*/
+
+#include "isotp_listener_capi.h"
+#include "isotp_listener.h"
+
+#include <cstring>
+#include <deque>
+
+struct outbox_frame
+{
+  int can_id;
+  int len;
+  unsigned char data[8];
+};
+
+struct isotp_handle
+{
+  Isotp_Listener *listener;
+  isotp_c_uds_handler uds_handler;
+  void *user;
+  std::deque<outbox_frame> outbox;
+  int pending_frames; // = outbox.size(), readable from outside by isotp_pending_frames_ptr()
+};
+
+// the send_frame_ctx callback: collect the frame in the outbox
+static int collect_frame(void *context, int can_id, unsigned char data[8], int len)
+{
+  isotp_handle *handle = static_cast<isotp_handle *>(context);
+  outbox_frame frame;
+  frame.can_id = can_id;
+  frame.len = len > 8 ? 8 : len;
+  std::memcpy(frame.data, data, 8);
+  handle->outbox.push_back(frame);
+  handle->pending_frames++;
+  return 0;
+}
+
+// the uds_handler_ctx callback: pass the message to the C handler
+static int call_handler(void *context, RequestType request_type, uds_buffer receive_buffer, int recv_len, uds_buffer send_buffer)
+{
+  isotp_handle *handle = static_cast<isotp_handle *>(context);
+  if (!handle->uds_handler)
+  {
+    return 0;
+  }
+  return handle->uds_handler(handle->user, (int)request_type, receive_buffer, recv_len, send_buffer);
+}
+
+static isotp_options make_options(isotp_handle *handle, int source_address, int target_address, int bs, int stmin, int frame_timeout)
+{
+  isotp_options options;
+  options.source_address = source_address;
+  options.target_address = target_address;
+  options.bs = bs;
+  options.stmin = stmin;
+  options.frame_timeout = frame_timeout;
+  options.send_context = handle;
+  options.handler_context = handle;
+  options.send_frame_ctx = &collect_frame;
+  options.uds_handler_ctx = &call_handler;
+  return options;
+}
+
+isotp_handle *isotp_create(int source_address, int target_address, int bs, int stmin, int frame_timeout, isotp_c_uds_handler uds_handler, void *user)
+{
+  isotp_handle *handle = new isotp_handle;
+  handle->uds_handler = uds_handler;
+  handle->user = user;
+  handle->pending_frames = 0;
+  handle->listener = new Isotp_Listener(make_options(handle, source_address, target_address, bs, stmin, frame_timeout));
+  return handle;
+}
+
+void isotp_destroy(isotp_handle *handle)
+{
+  delete handle->listener;
+  delete handle;
+}
+
+void isotp_update_options(isotp_handle *handle, int source_address, int target_address, int bs, int stmin, int frame_timeout)
+{
+  handle->listener->update_options(make_options(handle, source_address, target_address, bs, stmin, frame_timeout));
+}
+
+int isotp_eval_msg(isotp_handle *handle, int can_id, const unsigned char *data, int len)
+{
+  unsigned char frame[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  std::memcpy(frame, data, len > 8 ? 8 : len < 0 ? 0 : len);
+  return handle->listener->eval_msg(can_id, frame, len);
+}
+
+int isotp_eval_msgs(isotp_handle *handle, const int *can_ids, const unsigned char *data, const int *lens, int n, int *results)
+{
+  // the frames are given in separate arrays, they are put together in chunks for the batch evaluation
+  isotp_frame frames[64];
+  int handled = 0;
+  for (int start = 0; start < n; start += 64)
+  {
+    int count = n - start < 64 ? n - start : 64;
+    for (int i = 0; i < count; i++)
+    {
+      int len = lens[start + i];
+      frames[i].can_id = can_ids[start + i];
+      frames[i].len = len < 0 ? 0 : len > 8 ? 8 : len;
+      std::memset(frames[i].data, 0, 8);
+      std::memcpy(frames[i].data, data + (start + i) * 8, len > 8 ? 8 : len < 0 ? 0 : len);
+    }
+    handled += handle->listener->eval_msgs(frames, count, results ? results + start : 0);
+  }
+  return handled;
+}
+
+int isotp_tick(isotp_handle *handle, uint64_t time_ticks)
+{
+  return handle->listener->tick(time_ticks);
+}
+
+void isotp_send_telegram(isotp_handle *handle, const unsigned char *data, int nr_of_bytes)
+{
+  if (nr_of_bytes > UDS_BUFFER_SIZE)
+  {
+    nr_of_bytes = UDS_BUFFER_SIZE;
+  }
+  // send_telegram() only reads the data, it copies them into its own send buffer
+  handle->listener->send_telegram(const_cast<unsigned char *>(data), nr_of_bytes);
+}
+
+int isotp_busy(isotp_handle *handle)
+{
+  return handle->listener->busy();
+}
+
+int isotp_pending_frames(isotp_handle *handle)
+{
+  return handle->pending_frames;
+}
+
+const int *isotp_pending_frames_ptr(isotp_handle *handle)
+{
+  return &handle->pending_frames;
+}
+
+int isotp_take_frames(isotp_handle *handle, int *can_ids, unsigned char *data, int *lens, int max_frames)
+{
+  int count = 0;
+  while (count < max_frames && !handle->outbox.empty())
+  {
+    outbox_frame &frame = handle->outbox.front();
+    can_ids[count] = frame.can_id;
+    lens[count] = frame.len;
+    std::memcpy(data + count * 8, frame.data, 8);
+    handle->outbox.pop_front();
+    handle->pending_frames--;
+    count++;
+  }
+  return count;
+}
@@ -0,0 +1,47 @@
+#ifndef ISOTP_LISTENER_CAPI_H
+#define ISOTP_LISTENER_CAPI_H
+
+/*
+stable C ABI of the C++ Isotp_Listener, e.g. to load it by Python ctypes (see isotp_listener_native.py)
+
+sent frames are not passed by a callback, but collected in an outbox, which the caller drains in batches
+by isotp_take_frames(). Only complete messages are announced by a callback.
+
+build:
+
+  g++ -std=c++17 -O2 -shared -fPIC isotp_listener.cpp isotp_listener_capi.cpp uds_service_registry.cpp uds_response_cache.cpp isotp_capture.cpp isotp_latency.cpp uds_ipc.cpp -o libisotp_listener.so
+*/
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    typedef struct isotp_handle isotp_handle;
+
+    // called with each complete message, returns the number of bytes written into send_buffer
+    typedef int (*isotp_c_uds_handler)(void *user, int request_type, unsigned char *receive_buffer, int recv_len, unsigned char *send_buffer);
+
+    isotp_handle *isotp_create(int source_address, int target_address, int bs, int stmin, int frame_timeout, isotp_c_uds_handler uds_handler, void *user);
+    void isotp_destroy(isotp_handle *handle);
+    void isotp_update_options(isotp_handle *handle, int source_address, int target_address, int bs, int stmin, int frame_timeout);
+
+    int isotp_eval_msg(isotp_handle *handle, int can_id, const unsigned char *data, int len);
+    // evaluates n frames, data holds 8 bytes per frame. The eval_msg result of each frame is written into results (if not 0)
+    int isotp_eval_msgs(isotp_handle *handle, const int *can_ids, const unsigned char *data, const int *lens, int n, int *results);
+    int isotp_tick(isotp_handle *handle, uint64_t time_ticks);
+    void isotp_send_telegram(isotp_handle *handle, const unsigned char *data, int nr_of_bytes);
+    int isotp_busy(isotp_handle *handle);
+
+    int isotp_pending_frames(isotp_handle *handle);
+    // address of the number of frames in the outbox, to check it without a call
+    const int *isotp_pending_frames_ptr(isotp_handle *handle);
+    // moves up to max_frames sent frames out of the outbox, data receives 8 bytes per frame. returns the number of frames
+    int isotp_take_frames(isotp_handle *handle, int *can_ids, unsigned char *data, int *lens, int max_frames);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -4,14 +4,16 @@ isotp_listener Demo
 https://github.com/stko/isotp_listener
 
 
-a little application listening on socketcan on vcan0. Each received can message is passed to isotp_listener, so
-that isotp_listener can handle all incoming uds messages.
+a little application listening on socketcan on vcan0 (or the given interfaces). Each received can message is passed
+to the isotp_listener of its interface, so that isotp_listener can handle all incoming uds messages.
 
-To allow isotp_listener the whole message handling, udslisten.tick(timeSinceEpochMillisec()) need to be called all
-few milliseconds.
+To allow isotp_listener the whole message handling, its tick() needs to be called all few milliseconds during a transfer.
+The event loop does both: it waits for the frames of all interfaces and ticks the listeners, with microsecond ticks of
+the same clock as the kernel receive timestamps of the sockets. With "doip", the same services are also served over
+Ethernet by a DoIP server on TCP port 13400, in the same event loop.
 
-Whenever isotp_listener finds an incoming uds request, it calls the callback function to let the application react on
-the request and to provide an answer
+Whenever isotp_listener finds an incoming uds request, it passes it to the service registry, which calls the handler of
+the requested service to let the application react on the request and to provide an answer
 
 Credits:
 cansocket routines taken from https://github.com/craigpeacock/CAN-Examples
@@ -25,172 +27,133 @@ most uds stuff are taken over from https://github.com/stko/oobd/
 #include <iomanip>
 #include <cstring>
 #include <memory>
-
-// network socket stuff
-#include <net/if.h>
-#include <sys/ioctl.h>
-#include <sys/socket.h>
-#include <fcntl.h>
-#include <unistd.h>
-
-// timing
-#include <chrono>
-#include <thread>
-
-// socketcan
-#include <linux/can.h>
-#include <linux/can/raw.h>
+#include <string>
+#include <vector>
 
 // isotp_listener itself
 #include "isotp_listener.h"
-
-// the global socket
-int can_socket = -1;
-
-// little helper for error handling
-int guard(int n, const char *err)
+#include "isotp_socket.h"
+#include "isotp_event_loop.h"
+#include "uds_service_registry.h"
+#include "uds_response_cache.h"
+#include "uds_dtc_store.h"
+#include "uds_download.h"
+#include "isotp_trace.h"
+#include "isotp_capture.h"
+#include "isotp_latency.h"
+#include "doip_server.h"
+
+// all frames which are not handled by isotp_listener end here
+int last_can_id = 0;
+
+void application_frame(void *context, int can_id, unsigned char *data, int len)
 {
-  if (n == -1)
-  {
-    perror(err);
-    exit(1);
-  }
-  return n;
+  last_can_id = can_id;
+  // e.g. do the normal application stuff here
 }
 
-// get the actual system ticks as milliseconda
-uint64_t timeSinceEpochMillisec()
-{
-  using namespace std::chrono;
-  return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
-}
+/*
+the service handlers which are called by the service registry when isotp_listener has received a complete uds message
 
-// creates the can socket
-int create_can_socket(const char *name, int timeout_ms)
-{
-  int sockfd;
-  struct sockaddr_can addr;
-  struct ifreq ifr;
 
-  sockfd = guard(socket(PF_CAN, SOCK_RAW, CAN_RAW), "can't open Socket");
-  int flags = guard(fcntl(sockfd, F_GETFL), "could not get flags on TCP listening socket");
-  guard(fcntl(sockfd, F_SETFL, flags | O_NONBLOCK), "could not set TCP listening socket to be non-blocking");
+the registry selects the handler by the service ID (byte 0 of the request), answers unknown services, sub functions and DIDs
+itself and handles ReadDataByIdentifier (0x22) and WriteDataByIdentifier (0x2E) by the registered DID table
 
-  std::strcpy(ifr.ifr_name, name);
-  ioctl(sockfd, SIOCGIFINDEX, &ifr);
+  the response buffer shall be set as follow:
+    * Byte 0 = SIDPR (SIDRQ + 0x40) (= Byte 0 of request)
+    * Byte 1 = Sub fn  (= Byte 1 of request)
+    * Byte 2 = DID  (= Byte 2 of request)
+    * Byte 3 .. Byte n : data
+  if an General Responce error shall be reported, the handler just returns the negative response code as negative number,
+  the registry then creates the answer: (https://www.rfwireless-world.com/Terminology/UDS-NRC-codes.html)
+  * Byte 0 : 0x7F ( NR_SID General Response Error)
+  * Byte 1: SIDRQ (= Byte 0 of request)
+  * Byte 2: NRC : Negative response code
 
-  memset(&addr, 0, sizeof(addr));
-  addr.can_family = AF_CAN;
-  addr.can_ifindex = ifr.ifr_ifindex;
 
-  guard(bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)), "Bind error");
+a service handler returns the size of the response to be send, 0 if no answer is wanted or possible
 
-  return sockfd;
-}
+*/
+// the DTC services (0x19 and 0x14) are answered by a Uds_Dtc_Store, so the demo itself only needs to provide its DIDs
 
-// returns a tuple of a received frame and True, if valid
-std::pair<can_frame, bool> receive(int socket)
+// DID F190: the vehicle identification number
+int read_vin(void *context, uint16_t did, unsigned char *data, int max_len)
 {
-  struct can_frame frame;
-  int count;
-  int i;
-
-  count = read(socket, &frame, sizeof(struct can_frame));
-  return std::pair<can_frame, bool>(frame, count >= 0);
+  static const char vin[] = "WISOTPLISTENER001";
+  int len = sizeof(vin) - 1;
+  if (len > max_len)
+  {
+    return -Nrc::ResponseTooLong;
+  }
+  std::memcpy(data, vin, len);
+  return len;
 }
 
-// callback function for istotp_listener to allow to send own can messages
-int msg_send(int can_id, unsigned char data[8], int len)
+// DID 0100: a little read/write test value
+unsigned char test_value[4] = {0, 0, 0, 0};
+
+int read_test_value(void *context, uint16_t did, unsigned char *data, int max_len)
 {
-  struct can_frame frame;
-  frame.can_id = can_id;
-  len = len > 8 ? 8 : len;
-  frame.can_dlc = len;
-  for (int i = 0; i < len; i++)
-  {
-    frame.data[i] = data[i];
-  };
+  std::memcpy(data, test_value, sizeof(test_value));
+  return sizeof(test_value);
+}
 
-  if (write(can_socket, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame))
+int write_test_value(void *context, uint16_t did, const unsigned char *data, int len)
+{
+  if (len != sizeof(test_value))
   {
-    perror("Can't write to socket");
-    return 1;
+    return -Nrc::IncorrectMessageLength;
   }
+  std::memcpy(test_value, data, len);
   return 0;
 }
 
-/*
-the callback function which is called when isotp_listener has received a complete uds message
-
-
-uds_handler gets either a flow control request (not supported yet) or a service request, if a complete message has been received
-
-  in case of flow control request the send buffer shall be set as follow:
-    * Byte 0 lower Nibble: FS = Flow Status (0 = Clear to send, 1 = Wait, 2 = Overflow)
-    * Byte 1: BS = Block Size of maximal continious CFs (max. = 255), 0= no limit
-    * Byte 3:ST = min. Separation Time between continious CFs
-  in case of service request the send buffer shall be set as follow:
-    * Byte 0 = SIDPR (SIDRQ + 0x40) (= Byte 0 of receive buffer)
-    * Byte 1 = Sub fn  (= Byte 1 of receive buffer)
-    * Byte 2 = DID  (= Byte 2 of receive buffer)
-    * Byte 3 .. Byte n : data
-  send_len= total len of bytes to send
-  if an General Responce error shall be reported, the send buffer shall be set as follow: (https://www.rfwireless-world.com/Terminology/UDS-NRC-codes.html)
-  * Byte 0 : 0x7F ( NR_SID General Response Error)
-  * Byte 1: SIDRQ (= Byte 0 of receive buffer)
-  * Byte 2: NRC : Negative response code
-  send_len= 3
-
+// the DIDs of the demo, sorted by DID
+constexpr uds_did_entry demo_dids[] = {
+    {0x0100, &read_test_value, &write_test_value, 0},
+    {0xF190, &read_vin, 0, 0},
+};
+static_assert(uds_did_table_sorted(demo_dids), "the DID table needs to be sorted");
 
-uds_handler returns the size of the buffer to be send, 0 if no answer is wanted or possible
-
-*/
-int uds_handler(RequestType request_type, uds_buffer receive_buffer, int receive_len, uds_buffer send_buffer)
+int main(int argc, char *argv[])
 {
-  int send_len = 0;
-  if (request_type == RequestType::Service)
+  std::cout << "Welcome to the isotp_listender demo\n";
+  // "isotp_listener_demo [uring] [doip] [interface ...]" uses the io_uring backend instead of read() / write(), serves
+  // DoIP testers too, and the given can interfaces instead of vcan0
+  Socket_Backend backend = Socket_Backend::Plain;
+  bool doip = false;
+  std::vector<std::string> interface_names;
+  for (int i = 1; i < argc; i++)
   {
-    if (receive_buffer[0] == Service::ReadDTC)
+    if (std::string(argv[i]) == "uring")
+    {
+      backend = Socket_Backend::Uring;
+    }
+    else if (std::string(argv[i]) == "doip")
     {
-      if (receive_buffer[1] == 0x01)
-      { // get number of DTCs
-        // count DTCs and send back
-        // format see here: https://github.com/stko/oobd/blob/master/lua-scripts/CarDTCs.epd/cardtcs.lua#L36
-        std::cout << "get number of DTC\n";
-      }
-      else
-      { // report DTCs
-        // create an answer as described e.g. in https://piembsystech.com/report-dtc-by-status-mask0x02-0x19-service/
-        std::cout << "read DTC\n";
-        send_buffer[0] = receive_buffer[0] + 0x40;
-        send_buffer[1] = receive_buffer[1];
-        send_buffer[2] = receive_buffer[2];
-        // for testing purposes, the incoming message is returned here
-        send_len = receive_len;
-        for (int i = 3; i < send_len; i++)
-        {
-          send_buffer[i] = receive_buffer[i];
-        }
-        return send_len;
-      }
+      doip = true;
     }
-    if (receive_buffer[0] == Service::ClearDTCs)
+    else
     {
-      std::cout << "Clear DTC\n";
-      // clear Errors
+      interface_names.push_back(argv[i]);
     }
   }
-  return send_len; // something went wrong, we should never be here..
-}
-
-int main()
-{
-  int i;
-  int last_can_id = 0;
-  struct can_frame frame;
-
-  std::cout << "Welcome to the isotp_listender demo\n";
-  can_socket = create_can_socket("vcan0", 5000);
+  if (interface_names.empty())
+  {
+    interface_names.push_back("vcan0");
+  }
+  Isotp_Event_Loop loop; // one socket per interface, each only receives the frames of its listeners and of the added filter ranges
+  loop.set_ticks_per_ms(1000); // time stamps in microseconds
+  for (const std::string &name : interface_names)
+  {
+    int interface = loop.add_interface(name.c_str(), backend);
+    if (interface == -1)
+    {
+      return 1;
+    }
+    loop.socket(interface)->add_filter_range(0x7FF, CAN_SFF_MASK); // let the end-of-demo frame pass
+    loop.socket(interface)->set_frame_handler(&application_frame, 0);
+  }
 
   // prepare the options for uds_listener
   isotp_options options;
@@ -198,32 +161,91 @@ int main()
   options.target_address = options.source_address | 8; // uds answer address
   options.bs = 100;                                    // The block size sent in the flow control message. Indicates the number of consecutive frame a sender can send before the socket sends a new flow control. A block size of 0 means that no additional flow control message will be sent (block size of infinity)
   options.stmin = 5;                                   // time to wait
-  options.send_frame = &msg_send;                   // assign callback function to allow isotp_listener to send messages
-  options.uds_handler = &uds_handler;                  // assign callback function to allow isotp_listener to announce incoming requests
+  options.adaptive_fc = true;                          // let isotp_listener tune bs and stmin from the observed load, starting with the values above
+  options.bs_min = 8;                                  // but never go below this block size..
+  options.stmin_max = 20;                              // .. or above this separation time
+  options.ticks_per_ms = 1000;                         // tick() gets microseconds
+  options.send_frame_ctx = &Isotp_Socket::send_frame;  // assign callback function to allow isotp_listener to send messages, send_context is set per interface below
+
+  // the services the demo supports
+  Uds_Service_Registry services;
+  Uds_Dtc_Store dtcs;
+  dtcs.add(0x012345, 0x09); // testFailed | confirmedDTC
+  dtcs.add(0x0ABCDE, 0x08); // confirmedDTC
+  dtcs.add(0xC10100, 0x50); // cleared
+  dtcs.register_services(services);
+  services.register_dids(demo_dids);
+  Uds_Download download; // downloads (plain or LZSS compressed) into a 1MB image file from address 0 on
+  if (download.open("isotp_download.bin", 0, 1024 * 1024) == 0)
+  {
+    download.register_services(services);
+  }
+  options.services = &services; // let the registry answer all incoming requests
 
-  Isotp_Listener udslisten(options); // create the isotp_listener object
-  unsigned char data[]="ABCDEFGHIJKLM";
-  udslisten.send_telegram(data,sizeof(data));
-  while (last_can_id != 0x7ff) // for testing purposes: Loop until a 0x7FF mesage comes in
+  // polled DIDs are answered out of the cache for one second, TesterPresent by isotp_listener itself
+  Uds_Response_Cache response_cache;
+  response_cache.set_ttl(Service::ReadDataByIdentifier, 1000);
+  options.response_cache = &response_cache;
+  options.fast_tester_present = true;
+
+  // all frames of the listener are captured for wireshark, in files of up to 16MB, keeping the last 4
+  Isotp_Capture capture;
+  if (capture.open("isotp_capture.pcapng", 16 * 1024 * 1024, 4))
   {
-    std::pair<can_frame, bool> received_frame = receive(can_socket);
-    if (received_frame.second) // if a message comes in
-    {
-      last_can_id = received_frame.first.can_id;
-      if (!udslisten.eval_msg(received_frame.first.can_id, received_frame.first.data, received_frame.first.can_dlc))
-      {
-        // e.g. do the normal application stuff here
-      }
-    }
-    else
+    options.capture = &capture;
+  }
+  Isotp_Latency latency; // the timing percentiles of the transfers, printed at the end
+  options.latency = &latency;
+
+  isotp_trace_enable(true); // record the listener events, written into isotp_trace.bin at the end
+  // one emulated ECU on each bus: an isotp_listener object, fed by the socket of its interface and sending through it
+  std::vector<std::unique_ptr<Isotp_Listener>> udslisteners;
+  for (int interface = 0; interface < loop.interface_count(); interface++)
+  {
+    options.send_context = loop.socket(interface);
+    udslisteners.emplace_back(new Isotp_Listener(options));
+    loop.add_listener(interface, udslisteners.back().get());
+  }
+  // the same services for the testers on Ethernet
+  doip_options server_options;
+  server_options.services = &services;
+  Doip_Server doip_server(server_options);
+  if (doip)
+  {
+    if (doip_server.open() == -1)
     {
-      udslisten.tick(timeSinceEpochMillisec()); // tell isotp_listener that some time passed by..
+      return 1;
     }
-    std::this_thread::sleep_for(std::chrono::milliseconds(5)); // sleep a few (5) milliseconds
+    loop.add_fd(doip_server.fd(), &Doip_Server::poll_handler, &doip_server);
+    loop.add_tick_handler(&Doip_Server::tick_handler, &doip_server);
+  }
+  unsigned char data[]="ABCDEFGHIJKLM";
+  udslisteners[0]->send_telegram(data,sizeof(data));
+  while (last_can_id != 0x7ff) // for testing purposes: Loop until a 0x7FF mesage comes in
+  {
+    loop.run_once(100); // wait for frames, process them and tell isotp_listener that some time passed by..
+  }
+  isotp_trace_save("isotp_trace.bin"); // to be read by tools/isotp_trace_decode
+  for (int interface = 0; interface < loop.interface_count(); interface++)
+  {
+    Isotp_Socket *socket = loop.socket(interface);
+    socket_stats stats = socket->get_stats();
+    std::cout << loop.interface_name(interface) << " " << (socket->backend() == Socket_Backend::Uring ? "io_uring" : "plain") << ": "
+              << stats.rx_frames << " frames received, " << stats.tx_frames << " sent, " << stats.syscalls << " system calls, 99% processed within "
+              << stats.latency_percentile(99) << " ns\n";
+  }
+  latency.report(std::cout);
+  if (doip)
+  {
+    doip_stats stats = doip_server.get_stats();
+    std::cout << "DoIP: " << stats.connections << " connections, " << stats.requests << " requests, " << stats.responses << " responses\n";
+  }
+  uds_download_stats download_stats = download.get_stats();
+  if (download_stats.downloads)
+  {
+    std::cout << "downloads: " << download_stats.downloads << ", " << download_stats.transferred_bytes << " bytes transferred, "
+              << download_stats.written_bytes << " written\n";
   }
-
-  // close the socket
-  guard(close(can_socket), "Error on closing the socket");
 
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,130 @@
+/*
+
+session table with the tick state of all listeners in dense arrays, see isotp_session_table.h
+
+*/
+
+#include "isotp_session_table.h"
+
+#define SWEEP_BLOCK 64 // sessions compared into one bit mask
+
+// adds a listener, returns its session number or -1 if the source address is already in the table
+int Isotp_Session_Table::add(isotp_options options)
+{
+  if (sessions.count((uint32_t)options.source_address))
+  {
+    return -1;
+  }
+  int session = listeners.size();
+  listeners.emplace_back(new Isotp_Listener(options));
+  deadlines.push_back(UINT64_MAX);
+  states.push_back((uint8_t)ActualState::Sleeping);
+  sessions[(uint32_t)options.source_address] = session;
+  return session;
+}
+
+// the session of a source address, -1 if there's none
+int Isotp_Session_Table::find(uint32_t source_address) const
+{
+  std::unordered_map<uint32_t, int>::const_iterator session = sessions.find(source_address);
+  return session == sessions.end() ? -1 : session->second;
+}
+
+// takes the deadline and the state of a session over into the arrays
+void Isotp_Session_Table::update(int session)
+{
+  uint64_t deadline = listeners[session]->next_deadline();
+  deadlines[session] = deadline;
+  states[session] = (uint8_t)listeners[session]->get_state();
+  if (deadline < earliest)
+  {
+    earliest = deadline;
+  }
+}
+
+// gives a received frame to the session of its can id, at the time of the last tick()
+int Isotp_Session_Table::eval_msg(int can_id, unsigned char data[8], int len)
+{
+  return eval_msg(can_id, data, len, now);
+}
+
+int Isotp_Session_Table::eval_msg(int can_id, unsigned char data[8], int len, uint64_t time_ticks)
+{
+  int session = find((uint32_t)can_id);
+  if (session < 0)
+  {
+    return MSG_NO_UDS;
+  }
+  int result = listeners[session]->eval_msg(can_id, data, len, time_ticks);
+  update(session);
+  return result;
+}
+
+void Isotp_Session_Table::send_telegram(int session, uds_buffer data, int nr_of_bytes)
+{
+  // a sleeping session isn't ticked, so it gets the actual time first
+  listeners[session]->tick(now);
+  listeners[session]->send_telegram(data, nr_of_bytes);
+  update(session);
+}
+
+// ticks the sessions whose deadline is reached, true while a session has a transfer going on
+bool Isotp_Session_Table::tick(uint64_t time_ticks)
+{
+  now = time_ticks;
+  if (time_ticks < earliest)
+  {
+    return earliest != UINT64_MAX;
+  }
+  sweeps++;
+  uint64_t next = UINT64_MAX;
+  int count = deadlines.size();
+  const uint64_t *deadline = deadlines.data();
+  for (int block = 0; block < count; block += SWEEP_BLOCK)
+  {
+    int end = block + SWEEP_BLOCK < count ? block + SWEEP_BLOCK : count;
+    uint64_t due = 0;
+    for (int i = block; i < end; i++)
+    { // without a branch, to be vectorised
+      due |= (uint64_t)(deadline[i] <= time_ticks) << (i - block);
+    }
+    while (due)
+    {
+      int session = block + __builtin_ctzll(due);
+      due &= due - 1;
+      timeouts += listeners[session]->tick(time_ticks);
+      deadlines[session] = listeners[session]->next_deadline();
+      states[session] = (uint8_t)listeners[session]->get_state();
+      ticked++;
+    }
+    for (int i = block; i < end; i++)
+    {
+      next = deadline[i] < next ? deadline[i] : next;
+    }
+  }
+  earliest = next;
+  return earliest != UINT64_MAX;
+}
+
+// the number of sessions with an ongoing transfer
+int Isotp_Session_Table::busy_count() const
+{
+  int busy = 0;
+  for (uint8_t state : states)
+  {
+    busy += state != (uint8_t)ActualState::Sleeping;
+  }
+  return busy;
+}
+
+// for Isotp_Event_Loop::add_tick_handler(), context is the Isotp_Session_Table
+bool Isotp_Session_Table::tick_handler(void *context, uint64_t time_ticks)
+{
+  return static_cast<Isotp_Session_Table *>(context)->tick(time_ticks);
+}
+
+// for Isotp_Socket::set_frame_handler(): the frames which no listener of the socket took
+void Isotp_Session_Table::frame_handler(void *context, int can_id, unsigned char *data, int len)
+{
+  static_cast<Isotp_Session_Table *>(context)->eval_msg(can_id, data, len);
+}
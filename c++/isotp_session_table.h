@@ -0,0 +1,64 @@
+#ifndef ISOTP_SESSION_TABLE_H
+#define ISOTP_SESSION_TABLE_H
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "isotp_listener.h"
+
+/*
+a table of many listeners (sessions), which ticks only the sessions which have something to do
+
+a listener is about 8 KB, mostly its receive and send buffer: ticking thousands of them one by one touches a cache
+line (and often a page) per listener, just to find out that it sleeps. The table keeps what the tick sweep needs in
+dense arrays apart from the listeners: the time each session needs its next tick() (Isotp_Listener::next_deadline())
+and its state. tick() compares the deadlines block by block without a branch per session, so the compiler
+vectorises it, and ticks only the sessions which are due - 10000 sessions are 80 KB of deadlines instead of 80 MB of
+listeners. The earliest deadline of all sessions is kept, so a tick before it doesn't sweep at all.
+
+the arrays are updated after each call the table makes into a listener. Received frames and new transfers therefore
+go through the table (eval_msg(), send_telegram()); after calling a listener directly (e.g. by the ipc_response() of
+a Uds_Ipc_Server) call update() with its session. All sessions use the same ticks as the time given to tick().
+
+with the socket and the event loop:
+can_socket.add_filter_range(first_address, mask);
+can_socket.set_frame_handler(&Isotp_Session_Table::frame_handler, &table);
+loop.add_tick_handler(&Isotp_Session_Table::tick_handler, &table);
+*/
+class Isotp_Session_Table
+{
+private:
+    // hot: swept by tick(), one entry per session
+    std::vector<uint64_t> deadlines; // next_deadline() of the session
+    std::vector<uint8_t> states;     // ActualState of the session
+    uint64_t earliest = UINT64_MAX;  // no deadline is before
+    uint64_t now = 0;                // the time of the last tick()
+    // cold
+    std::vector<std::unique_ptr<Isotp_Listener>> listeners;
+    std::unordered_map<uint32_t, int> sessions; // by source address
+    unsigned long sweeps = 0;
+    unsigned long ticked = 0;
+    unsigned long timeouts = 0;
+
+public:
+    int add(isotp_options options);
+    int find(uint32_t source_address) const;
+    int size() const { return listeners.size(); }
+    Isotp_Listener &listener(int session) { return *listeners[session]; }
+    ActualState state(int session) const { return static_cast<ActualState>(states[session]); }
+    int eval_msg(int can_id, unsigned char data[8], int len);
+    int eval_msg(int can_id, unsigned char data[8], int len, uint64_t time_ticks);
+    void send_telegram(int session, uds_buffer data, int nr_of_bytes);
+    void update(int session);
+    bool tick(uint64_t time_ticks);
+    uint64_t next_deadline() const { return earliest; }
+    int busy_count() const;
+    unsigned long get_sweeps() const { return sweeps; } // tick() calls which had to look at the deadlines
+    unsigned long get_ticked() const { return ticked; } // sessions ticked by them
+    unsigned long get_timeouts() const { return timeouts; }
+    static bool tick_handler(void *context, uint64_t time_ticks);
+    static void frame_handler(void *context, int can_id, unsigned char *data, int len);
+};
+#endif
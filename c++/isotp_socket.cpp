@@ -0,0 +1,517 @@
+/*
+
+socketcan raw socket with kernel side filtering of the registered listeners, see isotp_socket.h
+
+cansocket routines taken from https://github.com/craigpeacock/CAN-Examples
+
+*/
+
+#include "isotp_socket.h"
+
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <unordered_set>
+
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/can/raw.h>
+
+#ifndef CAN_RAW_FILTER_MAX
+#define CAN_RAW_FILTER_MAX 512
+#endif
+
+Isotp_Socket::~Isotp_Socket()
+{
+  close();
+}
+
+// the same clock as the kernel receive timestamps
+static inline uint64_t now_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// the upper bound of the latency histogram bucket, in which the given percentage of all frames lies
+unsigned long socket_stats::latency_percentile(double percent) const
+{
+  unsigned long total = 0;
+  for (int bucket = 0; bucket < 32; bucket++)
+  {
+    total += latency_histogram[bucket];
+  }
+  unsigned long count = 0;
+  for (int bucket = 0; bucket < 32; bucket++)
+  {
+    count += latency_histogram[bucket];
+    if (total && count * 100.0 >= total * percent)
+    {
+      return 1ul << bucket;
+    }
+  }
+  return 0;
+}
+
+// opens and binds the socket, returns the socket or -1 in case of an error
+int Isotp_Socket::open(const char *interface_name, Socket_Backend backend)
+{
+  struct sockaddr_can addr;
+  struct ifreq ifr;
+
+  sockfd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if (sockfd == -1)
+  {
+    perror("can't open Socket");
+    return -1;
+  }
+  int flags = fcntl(sockfd, F_GETFL);
+  fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+
+  std::memset(&ifr, 0, sizeof(ifr));
+  std::strncpy(ifr.ifr_name, interface_name, IFNAMSIZ - 1);
+  if (ioctl(sockfd, SIOCGIFINDEX, &ifr) == -1)
+  {
+    perror("unknown can interface");
+    close();
+    return -1;
+  }
+
+  std::memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifr.ifr_ifindex;
+  if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+  {
+    perror("Bind error");
+    close();
+    return -1;
+  }
+  update_filters();
+  int enable = 1;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) == -1)
+  {
+    perror("can't enable receive timestamps");
+  }
+  if (backend == Socket_Backend::Uring && !uring.open(sockfd, sizeof(struct can_frame), 256, 256, true))
+  {
+    std::cerr << "io_uring not available, using the plain socket\n";
+  }
+  return sockfd;
+}
+
+void Isotp_Socket::close()
+{
+  flush();
+  uring.close();
+  if (sockfd != -1)
+  {
+    ::close(sockfd);
+    sockfd = -1;
+  }
+}
+
+// the source address of the listener is read once here, so after changing it the listener needs to be added again
+void Isotp_Socket::add_listener(Isotp_Listener *listener)
+{
+  listeners[(uint32_t)listener->get_options().source_address].push_back(listener);
+  update_filters();
+}
+
+void Isotp_Socket::remove_listener(Isotp_Listener *listener)
+{
+  for (std::unordered_map<uint32_t, std::vector<Isotp_Listener *>>::iterator address = listeners.begin(); address != listeners.end(); ++address)
+  {
+    std::vector<Isotp_Listener *> &list = address->second;
+    list.erase(std::remove(list.begin(), list.end(), listener), list.end());
+    if (list.empty())
+    {
+      listeners.erase(address);
+      break;
+    }
+  }
+  update_filters();
+}
+
+/*
+lets the socket receive additional frames, e.g. a range of functional addresses or application frames,
+which are then given to the frame handler. mask selects the relevant bits of the can id (without flags)
+*/
+void Isotp_Socket::add_filter_range(uint32_t can_id, uint32_t mask)
+{
+  can_filter range;
+  range.can_id = can_id;
+  range.can_mask = mask;
+  extra_ranges.push_back(range);
+  update_filters();
+}
+
+// the handler gets all frames, which are not handled by a listener
+void Isotp_Socket::set_frame_handler(void (*handler)(void *context, int can_id, unsigned char *data, int len), void *context)
+{
+  frame_handler = handler;
+  frame_handler_context = context;
+}
+
+/*
+computes a minimal set of id/mask filters, which lets exactly the given ids pass
+
+11 and 29 bit ids are handled separately: first all prime implicants are found by merging ids which differ in just
+one bit (Quine-McCluskey), then the ids are covered greedily by the implicants covering most of the still uncovered ids
+*/
+std::vector<can_filter> Isotp_Socket::compute_filters(const std::vector<uint32_t> &can_ids)
+{
+  std::vector<can_filter> filters;
+  for (int extended = 0; extended < 2; extended++)
+  {
+    int bits = extended ? 29 : 11;
+    uint32_t id_mask = extended ? CAN_EFF_MASK : CAN_SFF_MASK;
+    std::vector<uint32_t> ids;
+    for (uint32_t can_id : can_ids)
+    {
+      if (((can_id & CAN_EFF_FLAG) != 0) == (extended != 0))
+      {
+        ids.push_back(can_id & id_mask);
+      }
+    }
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    if (ids.empty())
+    {
+      continue;
+    }
+    // implicants as value + don't care bits, packed into one 64 bit key
+    std::unordered_set<uint64_t> current;
+    for (uint32_t id : ids)
+    {
+      current.insert(id);
+    }
+    std::vector<uint64_t> primes;
+    while (!current.empty())
+    {
+      std::unordered_set<uint64_t> merged;
+      std::unordered_set<uint64_t> used;
+      for (uint64_t implicant : current)
+      {
+        uint32_t value = (uint32_t)implicant;
+        uint32_t dont_care = (uint32_t)(implicant >> 32);
+        for (int bit = 0; bit < bits; bit++)
+        {
+          uint32_t b = 1u << bit;
+          if ((dont_care & b) || (value & b))
+          {
+            continue;
+          }
+          uint64_t partner = (uint64_t)dont_care << 32 | (value | b);
+          if (current.count(partner))
+          {
+            merged.insert((uint64_t)(dont_care | b) << 32 | value);
+            used.insert(implicant);
+            used.insert(partner);
+          }
+        }
+      }
+      for (uint64_t implicant : current)
+      {
+        if (!used.count(implicant))
+        {
+          primes.push_back(implicant);
+        }
+      }
+      current.swap(merged);
+    }
+    // greedy cover
+    std::vector<bool> covered(ids.size(), false);
+    size_t uncovered = ids.size();
+    while (uncovered)
+    {
+      size_t best = 0;
+      int best_count = -1;
+      for (size_t p = 0; p < primes.size(); p++)
+      {
+        uint32_t care = ~(uint32_t)(primes[p] >> 32) & id_mask;
+        int count = 0;
+        for (size_t i = 0; i < ids.size(); i++)
+        {
+          count += !covered[i] && (ids[i] & care) == ((uint32_t)primes[p] & care);
+        }
+        if (count > best_count)
+        {
+          best = p;
+          best_count = count;
+        }
+      }
+      uint32_t care = ~(uint32_t)(primes[best] >> 32) & id_mask;
+      uint32_t value = (uint32_t)primes[best] & care;
+      for (size_t i = 0; i < ids.size(); i++)
+      {
+        if (!covered[i] && (ids[i] & care) == value)
+        {
+          covered[i] = true;
+          uncovered--;
+        }
+      }
+      can_filter filter;
+      filter.can_id = value | (extended ? CAN_EFF_FLAG : 0);
+      filter.can_mask = care | CAN_EFF_FLAG | CAN_RTR_FLAG;
+      filters.push_back(filter);
+      primes.erase(primes.begin() + best);
+    }
+  }
+  return filters;
+}
+
+// installs the filters of all listeners and extra ranges into the kernel
+void Isotp_Socket::update_filters()
+{
+  std::vector<uint32_t> can_ids;
+  for (std::unordered_map<uint32_t, std::vector<Isotp_Listener *>>::iterator address = listeners.begin(); address != listeners.end(); ++address)
+  {
+    can_ids.push_back(address->first);
+  }
+  installed_filters = compute_filters(can_ids);
+  for (can_filter range : extra_ranges)
+  {
+    bool extended = range.can_id & CAN_EFF_FLAG;
+    range.can_mask = (range.can_mask & (extended ? CAN_EFF_MASK : CAN_SFF_MASK)) | CAN_EFF_FLAG | CAN_RTR_FLAG;
+    installed_filters.push_back(range);
+  }
+  if (sockfd == -1)
+  {
+    return;
+  }
+  if (installed_filters.size() > CAN_RAW_FILTER_MAX)
+  { // too many, so better receive all
+    std::cerr << "too many can filters, receive all frames\n";
+    can_filter all = {0, 0};
+    installed_filters.assign(1, all);
+  }
+  // an empty filter list lets the socket receive nothing at all
+  if (setsockopt(sockfd, SOL_CAN_RAW, CAN_RAW_FILTER, installed_filters.empty() ? 0 : &installed_filters[0], installed_filters.size() * sizeof(can_filter)) == -1)
+  {
+    perror("can't set can filter");
+  }
+}
+
+// passes a frame to the listeners of its can id or, if not handled there, to the frame handler
+int Isotp_Socket::dispatch(int can_id, unsigned char data[8], int len, uint64_t time_ticks)
+{
+  std::unordered_map<uint32_t, std::vector<Isotp_Listener *>>::iterator address = listeners.find((uint32_t)can_id);
+  if (address != listeners.end())
+  {
+    for (Isotp_Listener *listener : address->second)
+    {
+      int result = time_ticks ? listener->eval_msg(can_id, data, len, time_ticks) : listener->eval_msg(can_id, data, len);
+      if (result != MSG_NO_UDS)
+      {
+        return result;
+      }
+    }
+  }
+  if (frame_handler)
+  {
+    frame_handler(frame_handler_context, can_id, data, len);
+  }
+  return MSG_NO_UDS;
+}
+
+// dispatches a received frame with its receive time, measures its latency
+void Isotp_Socket::receive_frame(can_frame &frame, uint64_t timestamp_ns)
+{
+  uint64_t start = timestamp_ns ? timestamp_ns : now_ns();
+  rx_depth++;
+  stats.rx_frames++;
+  std::unordered_map<uint32_t, std::vector<Isotp_Listener *>>::iterator address = listeners.find(frame.can_id);
+  if (address != listeners.end())
+  {
+    for (Isotp_Listener *listener : address->second)
+    { // frames read in a row = depth of the receive queue
+      listener->report_rx_queue_depth(rx_depth);
+    }
+  }
+  uint64_t time_ticks = timestamp_ns / 1000000 * ticks_per_ms + timestamp_ns % 1000000 * ticks_per_ms / 1000000;
+  dispatch(frame.can_id, frame.data, frame.can_dlc, time_ticks);
+  uint64_t now = now_ns();
+  uint64_t duration = now > start ? now - start : 0;
+  int bucket = duration ? 64 - __builtin_clzll(duration) : 0;
+  stats.latency_histogram[bucket > 31 ? 31 : bucket]++;
+}
+
+// the frame handler of the io_uring backend
+void Isotp_Socket::uring_frame(void *context, unsigned char *frame, int len, uint64_t timestamp_ns)
+{
+  if (len == sizeof(struct can_frame))
+  {
+    can_frame received;
+    std::memcpy(&received, frame, sizeof(received));
+    static_cast<Isotp_Socket *>(context)->receive_frame(received, timestamp_ns);
+  }
+}
+
+// reads and dispatches up to max_frames waiting frames, returns the number of frames read
+int Isotp_Socket::poll(int max_frames)
+{
+  rx_depth = 0;
+  if (uring.is_open())
+  { // the completions are in shared memory, only if there are none the kernel is asked for them
+    int count = uring.reap(&Isotp_Socket::uring_frame, this, max_frames);
+    if (!count)
+    {
+      uring.submit(true);
+      count = uring.reap(&Isotp_Socket::uring_frame, this, max_frames);
+    }
+    flush();
+    return count;
+  }
+  flush(); // the frames the interface couldn't take before
+  struct can_frame frame;
+  iovec frame_iov = {&frame, sizeof(frame)};
+  unsigned char control[CMSG_SPACE(sizeof(timespec))];
+  msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &frame_iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  int count = 0;
+  while (count < max_frames)
+  {
+    msg.msg_controllen = sizeof(control);
+    stats.syscalls++;
+    if (recvmsg(sockfd, &msg, 0) != sizeof(struct can_frame))
+    {
+      break;
+    }
+    count++;
+    uint64_t timestamp = 0;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+      {
+        timespec stamp;
+        std::memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+        timestamp = (uint64_t)stamp.tv_sec * 1000000000ULL + stamp.tv_nsec;
+      }
+    }
+    receive_frame(frame, timestamp);
+  }
+  return count;
+}
+
+// sends the frames queued by the io_uring backend
+void Isotp_Socket::flush()
+{
+  if (uring.is_open())
+  {
+    uring.submit();
+  }
+  while (!tx_queue.empty())
+  {
+    stats.syscalls++;
+    if (write(sockfd, &tx_queue.front(), sizeof(struct can_frame)) != sizeof(struct can_frame))
+    {
+      if (errno == EAGAIN || errno == ENOBUFS)
+      { // still full, try again later
+        tx_no_buffers = errno == ENOBUFS;
+        return;
+      }
+      stats.tx_errors++;
+      perror("Can't write to socket");
+    }
+    tx_queue.pop_front();
+  }
+}
+
+socket_stats Isotp_Socket::get_stats() const
+{
+  socket_stats result = stats;
+  result.syscalls += uring.syscalls;
+  result.tx_errors += uring.write_errors;
+  result.tx_deferred += uring.write_retries;
+  return result;
+}
+
+// ticks all listeners, returns true if one of them had a timeout
+bool Isotp_Socket::tick(uint64_t time_ticks)
+{
+  bool timeout = false;
+  for (std::unordered_map<uint32_t, std::vector<Isotp_Listener *>>::iterator address = listeners.begin(); address != listeners.end(); ++address)
+  {
+    for (Isotp_Listener *listener : address->second)
+    {
+      timeout |= listener->tick(time_ticks);
+    }
+  }
+  flush();
+  return timeout;
+}
+
+// true if one of the listeners is within a transfer and needs to be ticked
+bool Isotp_Socket::busy() const
+{
+  for (std::unordered_map<uint32_t, std::vector<Isotp_Listener *>>::const_iterator address = listeners.begin(); address != listeners.end(); ++address)
+  {
+    for (Isotp_Listener *listener : address->second)
+    {
+      if (listener->busy())
+      {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// the send_frame_ctx callback for the listeners, context is the Isotp_Socket
+int Isotp_Socket::send_frame(void *context, int can_id, unsigned char data[8], int len)
+{
+  Isotp_Socket *self = static_cast<Isotp_Socket *>(context);
+  struct can_frame frame;
+  std::memset(&frame, 0, sizeof(frame));
+  frame.can_id = can_id;
+  len = len > 8 ? 8 : len;
+  frame.can_dlc = len;
+  std::memcpy(frame.data, data, len);
+  self->stats.tx_frames++;
+  if (self->uring.is_open())
+  { // consecutive frames queued until the next flush are linked, so they keep their order
+    if (!self->uring.queue_write(&frame))
+    {
+      self->stats.tx_errors++;
+      return 1;
+    }
+    return 0;
+  }
+  if (!self->tx_queue.empty())
+  { // keep the order behind the waiting frames
+    return self->defer_frame(frame);
+  }
+  self->stats.syscalls++;
+  if (write(self->sockfd, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame))
+  {
+    if (errno == EAGAIN || errno == ENOBUFS)
+    { // the tx queue of the interface is full
+      self->tx_no_buffers = errno == ENOBUFS;
+      return self->defer_frame(frame);
+    }
+    self->stats.tx_errors++;
+    perror("Can't write to socket");
+    return 1;
+  }
+  return 0;
+}
+
+// queues a frame the interface can't take now, returns 1 if the queue is full too
+int Isotp_Socket::defer_frame(const can_frame &frame)
+{
+  if (tx_queue.size() >= ISOTP_SOCKET_TX_QUEUE)
+  {
+    stats.tx_errors++;
+    return 1;
+  }
+  tx_queue.push_back(frame);
+  stats.tx_deferred++;
+  return 0;
+}
@@ -0,0 +1,104 @@
+#ifndef ISOTP_SOCKET_H
+#define ISOTP_SOCKET_H
+
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+#include <linux/can.h>
+
+#include "isotp_listener.h"
+#include "isotp_uring.h"
+
+enum class Socket_Backend
+{
+    Plain, // one read() / write() per frame
+    Uring  // io_uring: multishot receive into a buffer ring, linked writes of registered buffers
+};
+
+// counters to compare the backends
+struct socket_stats
+{
+    unsigned long syscalls = 0; // system calls for receiving and sending frames
+    unsigned long rx_frames = 0;
+    unsigned long tx_frames = 0;
+    unsigned long tx_errors = 0;
+    unsigned long tx_deferred = 0; // frames queued because the interface had no room, sent later
+    unsigned long latency_histogram[32] = {0}; // per received frame: ns from its kernel receive time until it is processed, log2 buckets
+    unsigned long latency_percentile(double percent) const;
+};
+
+/*
+a socketcan raw socket on one can interface, which feeds the received frames to its registered listeners
+
+the kernel only passes the frames of the registered listeners (and of extra ranges added by add_filter_range())
+to the socket: the socket computes a minimal set of CAN_RAW_FILTER id/mask pairs which covers exactly the source
+addresses of all listeners and installs it each time a listener is added or removed.
+
+29 bit addresses are given with CAN_EFF_FLAG set, as socketcan delivers them.
+To let a listener send through the socket, set its options.send_frame_ctx = &Isotp_Socket::send_frame and
+options.send_context = &socket
+
+the frames are given to the listeners with their kernel receive time (SO_TIMESTAMPNS), converted into ticks of
+the system clock (CLOCK_REALTIME) with the resolution set by set_ticks_per_ms(), which needs to match
+options.ticks_per_ms of the listeners and the time given to tick()
+
+the plain backend keeps the frames which the interface can't take at the moment (EAGAIN / ENOBUFS of a full
+tx queue) in its own queue of up to ISOTP_SOCKET_TX_QUEUE frames and writes them, in order, with the next
+flush(), poll() or tick() - so a congested bus doesn't block the caller. tx_pending() tells if frames wait.
+
+the io_uring backend (open(name, Socket_Backend::Uring)) falls back to the plain one, if io_uring is not available.
+It sends the frames queued during poll() and tick() with one system call at their end; frames sent from
+somewhere else (e.g. by send_telegram()) go out with the next poll(), tick() or flush()
+*/
+#define ISOTP_SOCKET_TX_QUEUE 1024
+
+class Isotp_Socket
+{
+private:
+    int sockfd = -1;
+    std::unordered_map<uint32_t, std::vector<Isotp_Listener *>> listeners; // by source address
+    std::vector<can_filter> extra_ranges;
+    std::vector<can_filter> installed_filters;
+    void (*frame_handler)(void *context, int can_id, unsigned char *data, int len) = 0;
+    void *frame_handler_context = 0;
+    Isotp_Uring uring;
+    socket_stats stats;
+    std::deque<can_frame> tx_queue; // plain backend: frames not taken by the interface yet
+    bool tx_no_buffers = false;     // the last write failed by ENOBUFS: the device queue is full, not the socket buffer
+    int rx_depth = 0;
+    int ticks_per_ms = 1;
+
+public:
+    ~Isotp_Socket();
+    int open(const char *interface_name, Socket_Backend backend = Socket_Backend::Plain);
+    void close();
+    int fd() const { return sockfd; }
+    int event_fd() const { return uring.is_open() ? uring.fd() : sockfd; } // to wait for received frames by poll / epoll
+    bool tx_pending() const { return !tx_queue.empty() || uring.tx_waiting(); }
+    // EPOLLOUT only tells about room in the socket buffer, with a full device queue (ENOBUFS) it would be ready all the time
+    bool tx_wait_writable() const { return !tx_queue.empty() && !tx_no_buffers; }
+    Socket_Backend backend() const { return uring.is_open() ? Socket_Backend::Uring : Socket_Backend::Plain; }
+    socket_stats get_stats() const;
+    void add_listener(Isotp_Listener *listener);
+    void remove_listener(Isotp_Listener *listener);
+    void add_filter_range(uint32_t can_id, uint32_t mask);
+    void set_frame_handler(void (*handler)(void *context, int can_id, unsigned char *data, int len), void *context);
+    const std::vector<can_filter> &filters() const { return installed_filters; }
+    int poll(int max_frames = 64);
+    bool tick(uint64_t time_ticks);
+    bool busy() const;
+    void flush();
+    void set_ticks_per_ms(int ticks) { ticks_per_ms = ticks; }
+    int dispatch(int can_id, unsigned char data[8], int len, uint64_t time_ticks = 0);
+    static int send_frame(void *context, int can_id, unsigned char data[8], int len);
+    static std::vector<can_filter> compute_filters(const std::vector<uint32_t> &can_ids);
+
+private:
+    void update_filters();
+    void receive_frame(can_frame &frame, uint64_t timestamp_ns);
+    int defer_frame(const can_frame &frame);
+    static void uring_frame(void *context, unsigned char *frame, int len, uint64_t timestamp_ns);
+};
+#endif
@@ -0,0 +1,175 @@
+/*
+
+decoding of the binary listener trace, see isotp_trace.h
+
+*/
+
+#include "isotp_trace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+
+#define TRACE_FILE_MAGIC "ISOTPTRC"
+#define TRACE_FILE_VERSION 1
+
+// the clock values at the first enable, to convert the raw clock into ns since epoch
+static uint64_t clock_base = 0;
+static uint64_t ns_base = 0;
+
+static uint64_t realtime_ns()
+{
+  timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// names and argument names of the events
+static const struct
+{
+  const char *name;
+  const char *args[4];
+} event_formats[] = {
+    {"SingleFrame", {"len"}},
+    {"FirstFrame", {"len"}},
+    {"ConsecutiveFrame", {"sn", "pos"}},
+    {"FlowControl", {"fs", "bs", "stmin"}},
+    {"WrongSequence", {"expected", "sn"}},
+    {"UnexpectedCf", {"sn", "state"}},
+    {"RxComplete", {"len"}},
+    {"Answer", {"len", "positive"}},
+    {"TxComplete", {"len"}},
+    {"TxTooBig", {"len"}},
+    {"Timeout", {"state"}},
+};
+static_assert(sizeof(event_formats) / sizeof(event_formats[0]) == (size_t)Trace_Event::Count, "each trace event needs its format");
+
+// switches the trace on or off, switching it on registers the calling thread
+void isotp_trace_enable(bool enable)
+{
+  if (enable && !clock_base)
+  {
+    ns_base = realtime_ns();
+    clock_base = isotp_trace_clock();
+  }
+  if (enable)
+  {
+    isotp_trace_register_thread();
+  }
+  isotp_trace_enabled.store(enable, std::memory_order_release);
+}
+
+/*
+copies the records of all threads, oldest first, with their timestamps converted into ns since epoch.
+Records which are overwritten by their thread while being copied are dropped
+*/
+std::vector<trace_record> isotp_trace_snapshot()
+{
+  std::vector<trace_record> records;
+  double ns_per_tick = 1.0;
+#if defined(__x86_64__) || defined(__i386__)
+  uint64_t clock_now = isotp_trace_clock();
+  uint64_t ns_now = realtime_ns();
+  if (clock_now > clock_base && ns_now > ns_base)
+  {
+    ns_per_tick = (double)(ns_now - ns_base) / (clock_now - clock_base);
+  }
+#endif
+  for (Trace_Ring *ring = isotp_trace_rings.load(std::memory_order_acquire); ring; ring = ring->next)
+  {
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    uint64_t start = head > ISOTP_TRACE_RING_SIZE ? head - ISOTP_TRACE_RING_SIZE : 0;
+    size_t first = records.size();
+    for (uint64_t i = start; i < head; i++)
+    {
+      records.push_back(ring->records[i & (ISOTP_TRACE_RING_SIZE - 1)]);
+    }
+    // the writer may have gone on meanwhile: its actual slot and all before are not reliable anymore
+    uint64_t new_head = ring->head.load(std::memory_order_acquire);
+    if (new_head >= ISOTP_TRACE_RING_SIZE && new_head - ISOTP_TRACE_RING_SIZE + 1 > start)
+    {
+      uint64_t valid_start = new_head - ISOTP_TRACE_RING_SIZE + 1;
+      size_t dropped = (size_t)std::min(valid_start - start, head - start);
+      records.erase(records.begin() + first, records.begin() + first + dropped);
+    }
+  }
+  for (trace_record &record : records)
+  {
+    int64_t delta = (int64_t)(record.timestamp - clock_base);
+    record.timestamp = ns_base + (int64_t)(delta * ns_per_tick);
+  }
+  std::stable_sort(records.begin(), records.end(), [](const trace_record &a, const trace_record &b)
+                   { return a.timestamp < b.timestamp; });
+  return records;
+}
+
+const char *isotp_trace_event_name(uint16_t event)
+{
+  return event < (uint16_t)Trace_Event::Count ? event_formats[event].name : "Unknown";
+}
+
+// one line per record: time, thread, listener id, event and its arguments
+void isotp_trace_format(std::ostream &out, const trace_record &record)
+{
+  std::ios_base::fmtflags flags = out.flags();
+  out << record.timestamp / 1000000000ULL << '.' << std::setw(6) << std::setfill('0') << record.timestamp % 1000000000ULL / 1000
+      << std::setfill(' ') << " T" << record.thread << " 0x" << std::hex << record.listener_id << std::dec << ' ' << isotp_trace_event_name(record.event);
+  for (int i = 0; i < 4; i++)
+  {
+    const char *arg = record.event < (uint16_t)Trace_Event::Count ? event_formats[record.event].args[i] : "arg";
+    if (arg)
+    {
+      out << ' ' << arg << '=' << record.args[i];
+    }
+  }
+  out << '\n';
+  out.flags(flags);
+}
+
+void isotp_trace_dump(std::ostream &out)
+{
+  for (const trace_record &record : isotp_trace_snapshot())
+  {
+    isotp_trace_format(out, record);
+  }
+}
+
+// writes a snapshot into a file, returns false in case of an error
+bool isotp_trace_save(const char *path)
+{
+  std::vector<trace_record> records = isotp_trace_snapshot();
+  FILE *file = fopen(path, "wb");
+  if (!file)
+  {
+    perror("can't write trace file");
+    return false;
+  }
+  uint32_t header[2] = {TRACE_FILE_VERSION, (uint32_t)records.size()};
+  bool ok = fwrite(TRACE_FILE_MAGIC, 8, 1, file) == 1 && fwrite(header, sizeof(header), 1, file) == 1 &&
+            (records.empty() || fwrite(&records[0], sizeof(trace_record), records.size(), file) == records.size());
+  fclose(file);
+  return ok;
+}
+
+// reads a file written by isotp_trace_save(), returns false if it's no trace file
+bool isotp_trace_load(const char *path, std::vector<trace_record> &records)
+{
+  FILE *file = fopen(path, "rb");
+  if (!file)
+  {
+    perror("can't read trace file");
+    return false;
+  }
+  char magic[8];
+  uint32_t header[2];
+  bool ok = fread(magic, 8, 1, file) == 1 && std::memcmp(magic, TRACE_FILE_MAGIC, 8) == 0 &&
+            fread(header, sizeof(header), 1, file) == 1 && header[0] == TRACE_FILE_VERSION;
+  if (ok)
+  {
+    records.resize(header[1]);
+    ok = records.empty() || fread(&records[0], sizeof(trace_record), records.size(), file) == records.size();
+  }
+  fclose(file);
+  return ok;
+}
@@ -0,0 +1,149 @@
+#ifndef ISOTP_TRACE_H
+#define ISOTP_TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <ostream>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+binary trace of the listener events
+
+each thread writes compact records into its own ring, so writing takes no lock, never blocks and never allocates.
+The ring is allocated up front: isotp_trace_enable(true) registers the calling thread, each other thread which
+should be traced calls isotp_trace_register_thread() once, before its first event. Events of threads without a
+ring are not recorded. When the ring is full, the oldest records are overwritten.
+Tracing is switched on and off at runtime by isotp_trace_enable(), when off it costs one relaxed load per event.
+
+isotp_trace_snapshot() collects the records of all threads, isotp_trace_dump() renders them as text and
+isotp_trace_save() writes them into a file for the offline decoder tools/isotp_trace_decode.cpp
+*/
+
+#define ISOTP_TRACE_RING_SIZE 4096 // records per thread, power of 2
+
+enum class Trace_Event : uint16_t
+{
+    SingleFrame,      // length
+    FirstFrame,       // length
+    ConsecutiveFrame, // sequence number, receive position
+    FlowControl,      // flow status, block size, stmin
+    WrongSequence,    // expected, received sequence number
+    UnexpectedCf,     // sequence number, state
+    RxComplete,       // length
+    Answer,           // length, positive
+    TxComplete,       // length
+    TxTooBig,         // length
+    Timeout,          // state
+    Count
+};
+
+struct trace_record
+{
+    uint64_t timestamp;   // raw clock while in the ring, ns since epoch in a snapshot
+    uint32_t listener_id; // the source address of the listener
+    uint16_t event;       // Trace_Event
+    uint16_t thread;      // number of the writing thread's ring
+    int32_t args[4];
+};
+
+struct Trace_Ring
+{
+    std::atomic<uint64_t> head{0}; // number of records ever written
+    std::atomic<bool> in_use{true};
+    Trace_Ring *next = 0;
+    uint16_t number = 0;
+    trace_record records[ISOTP_TRACE_RING_SIZE];
+};
+
+// the rings of all threads which ever traced. Rings of ended threads are taken over by new threads, never freed
+inline std::atomic<Trace_Ring *> isotp_trace_rings{nullptr};
+inline std::atomic<bool> isotp_trace_enabled{false};
+
+// the time source of the records: the cpu time stamp counter where available, the decoder converts it into ns
+inline uint64_t isotp_trace_clock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+// gives the ring back, when the thread ends
+struct Trace_Thread
+{
+    Trace_Ring *ring = 0;
+    ~Trace_Thread()
+    {
+        if (ring)
+        {
+            ring->in_use.store(false, std::memory_order_release);
+        }
+    }
+};
+inline thread_local Trace_Thread isotp_trace_thread;
+
+// gives the calling thread its ring: finds a free one or allocates a new one. Not for the hot path
+inline Trace_Ring *isotp_trace_register_thread()
+{
+    if (isotp_trace_thread.ring)
+    {
+        return isotp_trace_thread.ring;
+    }
+    for (Trace_Ring *ring = isotp_trace_rings.load(std::memory_order_acquire); ring; ring = ring->next)
+    {
+        bool free = false;
+        if (ring->in_use.compare_exchange_strong(free, true))
+        {
+            return isotp_trace_thread.ring = ring;
+        }
+    }
+    Trace_Ring *ring = new Trace_Ring;
+    ring->next = isotp_trace_rings.load(std::memory_order_relaxed);
+    do
+    {
+        ring->number = ring->next ? ring->next->number + 1 : 0;
+    } while (!isotp_trace_rings.compare_exchange_weak(ring->next, ring, std::memory_order_acq_rel));
+    return isotp_trace_thread.ring = ring;
+}
+
+inline void isotp_trace(Trace_Event event, uint32_t listener_id, int32_t a = 0, int32_t b = 0, int32_t c = 0, int32_t d = 0)
+{
+    if (!isotp_trace_enabled.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+    Trace_Ring *ring = isotp_trace_thread.ring;
+    if (!ring)
+    {
+        return; // the thread is not registered
+    }
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    trace_record &record = ring->records[head & (ISOTP_TRACE_RING_SIZE - 1)];
+    record.timestamp = isotp_trace_clock();
+    record.listener_id = listener_id;
+    record.event = (uint16_t)event;
+    record.thread = ring->number;
+    record.args[0] = a;
+    record.args[1] = b;
+    record.args[2] = c;
+    record.args[3] = d;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+// see isotp_trace.cpp
+void isotp_trace_enable(bool enable);
+std::vector<trace_record> isotp_trace_snapshot();
+const char *isotp_trace_event_name(uint16_t event);
+void isotp_trace_format(std::ostream &out, const trace_record &record);
+void isotp_trace_dump(std::ostream &out);
+bool isotp_trace_save(const char *path);
+bool isotp_trace_load(const char *path, std::vector<trace_record> &records);
+#endif
@@ -0,0 +1,239 @@
+/*
+
+shared transmit queue with CAN id priority and a bus load budget, see isotp_tx_scheduler.h
+
+*/
+
+#include "isotp_tx_scheduler.h"
+
+#include <chrono>
+#include <cstring>
+
+#include <linux/can.h>
+
+#define CAN_FRAME_END_BITS 13 // CRC delimiter, ACK slot and delimiter, end of frame, interframe space
+#define TX_MAX_GAP_MS 127      // the longest STmin
+#define CAN_MAX_FRAME_BITS 160 // an extended frame with 8 bytes and all stuff bits
+
+Isotp_Tx_Scheduler::Isotp_Tx_Scheduler(int (*send)(void *context, int can_id, unsigned char data[8], int len), void *send_context, int ticks_per_ms)
+    : send(send), send_context(send_context), ticks_per_ms(ticks_per_ms)
+{
+}
+
+/*
+the budget of the scheduled frames: max_load (0 - 1) of the bitrate, up to burst_bits may be sent at once.
+A bitrate of 0 removes the budget, the burst holds at least one frame
+*/
+void Isotp_Tx_Scheduler::set_budget(int bitrate, double max_load, int burst)
+{
+  bits_per_tick = bitrate > 0 ? bitrate * max_load / 1000.0 / ticks_per_ms : 0;
+  burst_bits = burst > CAN_MAX_FRAME_BITS ? burst : CAN_MAX_FRAME_BITS;
+  tokens = burst_bits;
+  last_refill = now_ticks();
+}
+
+// the system clock, the same as the event loop and the kernel receive timestamps of the sockets
+uint64_t Isotp_Tx_Scheduler::now_ticks() const
+{
+  uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  return us / 1000 * ticks_per_ms + us % 1000 * ticks_per_ms / 1000;
+}
+
+/*
+the bits of a classic CAN data frame on the bus: SOF, arbitration and control field, data and CRC with the stuff
+bits of this content, then the fixed frame end
+*/
+int Isotp_Tx_Scheduler::frame_bits(uint32_t can_id, const unsigned char *data, int len)
+{
+  len = len > 8 ? 8 : len < 0 ? 0 : len;
+  unsigned char bits[128];
+  int count = 0;
+  bits[count++] = 0; // SOF
+  if (can_id & CAN_EFF_FLAG)
+  {
+    uint32_t id = can_id & CAN_EFF_MASK;
+    for (int i = 28; i >= 18; i--)
+    {
+      bits[count++] = id >> i & 1;
+    }
+    bits[count++] = 1; // SRR
+    bits[count++] = 1; // IDE
+    for (int i = 17; i >= 0; i--)
+    {
+      bits[count++] = id >> i & 1;
+    }
+    bits[count++] = 0; // RTR
+    bits[count++] = 0; // r1
+    bits[count++] = 0; // r0
+  }
+  else
+  {
+    uint32_t id = can_id & CAN_SFF_MASK;
+    for (int i = 10; i >= 0; i--)
+    {
+      bits[count++] = id >> i & 1;
+    }
+    bits[count++] = 0; // RTR
+    bits[count++] = 0; // IDE
+    bits[count++] = 0; // r0
+  }
+  for (int i = 3; i >= 0; i--)
+  {
+    bits[count++] = len >> i & 1;
+  }
+  for (int byte = 0; byte < len; byte++)
+  {
+    for (int i = 7; i >= 0; i--)
+    {
+      bits[count++] = data[byte] >> i & 1;
+    }
+  }
+  unsigned crc = 0;
+  for (int i = 0; i < count; i++)
+  {
+    unsigned next = bits[i] ^ (crc >> 14 & 1);
+    crc = (crc << 1) & 0x7FFF;
+    if (next)
+    {
+      crc ^= 0x4599;
+    }
+  }
+  for (int i = 14; i >= 0; i--)
+  {
+    bits[count++] = crc >> i & 1;
+  }
+  // after 5 equal bits a complementary one is stuffed, which counts for the next run
+  int stuffed = 0;
+  int run = 1;
+  unsigned char last = bits[0];
+  for (int i = 1; i < count; i++)
+  {
+    if (bits[i] == last)
+    {
+      if (++run == 5)
+      {
+        stuffed++;
+        last = !last;
+        run = 1;
+      }
+    }
+    else
+    {
+      last = bits[i];
+      run = 1;
+    }
+  }
+  return count + stuffed + CAN_FRAME_END_BITS;
+}
+
+/*
+orders the ids like the bus arbitration: the 11 base id bits first, then an 11 bit id wins against a 29 bit id with
+the same base (its RTR bit is dominant where the 29 bit frame has the recessive SRR), then the 18 extension bits
+*/
+uint32_t Isotp_Tx_Scheduler::arbitration_key(uint32_t can_id)
+{
+  if (can_id & CAN_EFF_FLAG)
+  {
+    uint32_t id = can_id & CAN_EFF_MASK;
+    return (id >> 18) << 19 | 1 << 18 | (id & 0x3FFFF);
+  }
+  return (can_id & CAN_SFF_MASK) << 19;
+}
+
+void Isotp_Tx_Scheduler::refill(uint64_t now)
+{
+  if (now > last_refill)
+  {
+    tokens += (now - last_refill) * bits_per_tick;
+    tokens = tokens > burst_bits ? burst_bits : tokens;
+    last_refill = now;
+  }
+}
+
+bool Isotp_Tx_Scheduler::transmit(uint32_t can_id, queued_frame &frame)
+{
+  if (bits_per_tick > 0)
+  {
+    if (tokens < frame.bits)
+    {
+      return false;
+    }
+    tokens -= frame.bits;
+  }
+  if (send(send_context, can_id, frame.data, frame.len))
+  {
+    stats.send_errors++;
+  }
+  stats.frames++;
+  stats.bits += frame.bits;
+  return true;
+}
+
+// the send_frame_ctx callback for the listeners, context is the Isotp_Tx_Scheduler
+int Isotp_Tx_Scheduler::send_frame(void *context, int can_id, unsigned char data[8], int len)
+{
+  Isotp_Tx_Scheduler *self = static_cast<Isotp_Tx_Scheduler *>(context);
+  uint64_t now = self->now_ticks();
+  self->refill(now);
+  self->dispatch(now); // the frames already waiting go first, if they have priority or not
+  id_queue &queue = self->queues[arbitration_key((uint32_t)can_id)];
+  queue.can_id = (uint32_t)can_id;
+  queued_frame frame;
+  std::memset(frame.data, 0, sizeof(frame.data));
+  frame.len = len > 8 ? 8 : len;
+  std::memcpy(frame.data, data, frame.len);
+  frame.bits = frame_bits(can_id, frame.data, frame.len);
+  // the same gap to the previous frame of the id as the listener had, even if that one had to wait - up to
+  // the longest STmin, a longer gap is the start of a new transfer
+  uint64_t gap = now - queue.last_handover;
+  frame.release_tick = gap <= (uint64_t)TX_MAX_GAP_MS * self->ticks_per_ms && queue.last_release + gap > now ? queue.last_release + gap : now;
+  queue.last_handover = now;
+  queue.last_release = frame.release_tick;
+  if (!self->queued && frame.release_tick <= now && self->transmit(can_id, frame))
+  { // nothing waits and budget left, no need to queue
+    return 0;
+  }
+  queue.frames.push_back(frame);
+  self->queued++;
+  self->stats.delayed++;
+  self->stats.max_queued = self->queued > (int)self->stats.max_queued ? self->queued : self->stats.max_queued;
+  self->dispatch(now);
+  return 0;
+}
+
+// sends the waiting frames by priority, as long as the budget allows
+void Isotp_Tx_Scheduler::dispatch(uint64_t now)
+{
+  while (queued)
+  {
+    std::map<uint32_t, id_queue>::iterator best = queues.end();
+    for (std::map<uint32_t, id_queue>::iterator queue = queues.begin(); queue != queues.end(); ++queue)
+    { // the lowest id with a frame due wins
+      if (!queue->second.frames.empty() && queue->second.frames.front().release_tick <= now)
+      {
+        best = queue;
+        break;
+      }
+    }
+    if (best == queues.end() || !transmit(best->second.can_id, best->second.frames.front()))
+    {
+      return;
+    }
+    best->second.frames.pop_front();
+    queued--;
+  }
+}
+
+// sends what the refilled budget allows, true while frames wait
+bool Isotp_Tx_Scheduler::tick(uint64_t time_ticks)
+{
+  refill(time_ticks);
+  dispatch(time_ticks);
+  return queued > 0;
+}
+
+// for Isotp_Event_Loop::add_tick_handler(), context is the Isotp_Tx_Scheduler
+bool Isotp_Tx_Scheduler::tick_handler(void *context, uint64_t time_ticks)
+{
+  return static_cast<Isotp_Tx_Scheduler *>(context)->tick(time_ticks);
+}
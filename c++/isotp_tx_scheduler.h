@@ -0,0 +1,80 @@
+#ifndef ISOTP_TX_SCHEDULER_H
+#define ISOTP_TX_SCHEDULER_H
+
+#include <cstdint>
+#include <deque>
+#include <map>
+
+/*
+a shared transmit queue for all listeners of one bus, which keeps their frames within a bus load budget
+
+the listeners send through the scheduler (options.send_frame_ctx = &Isotp_Tx_Scheduler::send_frame,
+options.send_context = &scheduler), the scheduler sends through the given function, e.g. Isotp_Socket::send_frame.
+
+each frame costs its real bit time on the bus: the bits of the frame incl. the stuff bits of its actual content,
+the CRC and the frame end. A token bucket, filled with max_load * bitrate bits per second up to burst_bits, limits
+the frames sent: as long as it has enough tokens, frames are sent at once, otherwise they wait in the queue.
+Waiting frames are sent by priority like the bus arbitration does: the lowest can id first (the 11 base id bits
+first, so a 29 bit id competes with the 11 bit ids of the same base), in their order within the same id. A new
+frame only bypasses the queue when no frame waits at all. The gaps a listener keeps between its frames (its STmin pacing) are kept when its frames had to wait,
+so a delayed CF doesn't go out closer to the next one than the receiver allows.
+
+tick() sends the waiting frames when the bucket has refilled, it gets the time in ticks of the system clock (like
+the event loop and the socket timestamps); with the event loop:
+loop.add_tick_handler(&Isotp_Tx_Scheduler::tick_handler, &scheduler)
+*/
+class Isotp_Tx_Scheduler
+{
+private:
+    struct queued_frame
+    {
+        unsigned char data[8];
+        int len;
+        int bits;
+        uint64_t release_tick; // not before, to keep the gap to the previous frame of the same id
+    };
+    struct id_queue
+    {
+        uint32_t can_id = 0; // with CAN_EFF_FLAG for 29 bit ids
+        std::deque<queued_frame> frames;
+        uint64_t last_handover = 0; // when the listener gave the last frame
+        uint64_t last_release = 0;  // when the last frame was allowed to go
+    };
+    int (*send)(void *context, int can_id, unsigned char data[8], int len);
+    void *send_context;
+    std::map<uint32_t, id_queue> queues; // by arbitration_key() = priority
+    int queued = 0;
+    int ticks_per_ms = 1000;
+    double bits_per_tick = 0; // 0 = no budget
+    double burst_bits = 0;
+    double tokens = 0;
+    uint64_t last_refill = 0;
+
+public:
+    struct tx_stats
+    {
+        unsigned long frames = 0;
+        unsigned long long bits = 0;
+        unsigned long delayed = 0;   // frames which had to wait for tokens or their gap
+        unsigned long max_queued = 0;
+        unsigned long send_errors = 0;
+    };
+
+    Isotp_Tx_Scheduler(int (*send)(void *context, int can_id, unsigned char data[8], int len), void *send_context, int ticks_per_ms = 1000);
+    void set_budget(int bitrate, double max_load, int burst_bits = 1000);
+    static int send_frame(void *context, int can_id, unsigned char data[8], int len);
+    bool tick(uint64_t time_ticks);
+    int pending() const { return queued; }
+    tx_stats get_stats() const { return stats; }
+    static bool tick_handler(void *context, uint64_t time_ticks);
+    static int frame_bits(uint32_t can_id, const unsigned char *data, int len);
+    static uint32_t arbitration_key(uint32_t can_id);
+
+private:
+    tx_stats stats;
+    uint64_t now_ticks() const;
+    void refill(uint64_t now);
+    void dispatch(uint64_t now);
+    bool transmit(uint32_t can_id, queued_frame &frame);
+};
+#endif
@@ -0,0 +1,573 @@
+/*
+
+io_uring frame transport, see isotp_uring.h
+
+ring setup as described in https://unixism.net/loti/low_level.html
+
+*/
+
+#include "isotp_uring.h"
+
+#include <cstdio>
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// user_data of the requests: writes use their tx slot
+#define URING_RECV_TAG 0xFFFFFFFFFFFFFFFFULL
+#define URING_PROVIDE_TAG 0xFFFFFFFFFFFFFFFEULL
+#define URING_BUFFER_GROUP 0
+
+#ifndef IORING_UNREGISTER_PBUF_RING
+#define IORING_UNREGISTER_PBUF_RING 23
+#endif
+
+Isotp_Uring::~Isotp_Uring()
+{
+  close();
+}
+
+// true if the kernel knows the opcode (probing needs 5.6)
+bool Isotp_Uring::probe_opcode(int opcode)
+{
+  std::vector<unsigned char> memory(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+  io_uring_probe *probe = (io_uring_probe *)&memory[0];
+  syscalls++;
+  if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+  {
+    return false;
+  }
+  return opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+}
+
+/*
+the multishot receive came with kernel 6.0, the opcode alone doesn't tell about it: an older kernel refuses the
+armed receive at once with EINVAL, so its completion is already there after the submit()
+*/
+bool Isotp_Uring::recv_refused()
+{
+  unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  for (unsigned head = *cq_head; head != tail; head++)
+  { // only looked at, reap() takes them
+    io_uring_cqe *cqe = &cqes[head & cq_mask];
+    if (cqe->user_data == URING_RECV_TAG && cqe->res < 0 && cqe->res != -ENOBUFS && !(cqe->flags & IORING_CQE_F_MORE))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+sets up the ring for sockfd, registers the send and receive buffers and arms the multishot receive.
+With timestamps, the frames are received by recvmsg to get their SO_TIMESTAMPNS receive time, which needs to be
+enabled on the socket
+
+returns false, if io_uring (or one of the needed features, e.g. the multishot receive) is not available
+*/
+bool Isotp_Uring::open(int fd, int size, unsigned entries, unsigned rx_buffers_wanted, bool timestamps)
+{
+  sockfd = fd;
+  frame_size = size;
+  rx_buffer_size = size;
+  with_timestamps = timestamps;
+  if (with_timestamps)
+  { // recvmsg puts a header and the control message with the timestamp in front of the frame
+    std::memset(&recv_msg, 0, sizeof(recv_msg));
+    recv_msg.msg_controllen = CMSG_SPACE(sizeof(timespec));
+    rx_buffer_size = sizeof(io_uring_recvmsg_out) + recv_msg.msg_controllen + frame_size;
+  }
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring_fd < 0)
+  {
+    perror("io_uring_setup");
+    ring_fd = -1;
+    return false;
+  }
+  // map the submission and completion queue
+  sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+  }
+  sq_ptr = mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ptr == MAP_FAILED)
+  {
+    perror("io_uring mmap");
+    sq_ptr = 0;
+    close();
+    return false;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    cq_ptr = sq_ptr;
+  }
+  else
+  {
+    cq_ptr = mmap(0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ptr == MAP_FAILED)
+    {
+      perror("io_uring mmap");
+      cq_ptr = 0;
+      close();
+      return false;
+    }
+  }
+  sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  sqes = (io_uring_sqe *)mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+  {
+    perror("io_uring mmap");
+    sqes = 0;
+    close();
+    return false;
+  }
+  unsigned char *sq = (unsigned char *)sq_ptr;
+  sq_head = (unsigned *)(sq + params.sq_off.head);
+  sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+  sq_array = (unsigned *)(sq + params.sq_off.array);
+  sq_local_tail = *sq_tail;
+  unsigned char *cq = (unsigned char *)cq_ptr;
+  cq_head = (unsigned *)(cq + params.cq_off.head);
+  cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+  cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+  if (!probe_opcode(with_timestamps ? IORING_OP_RECVMSG : IORING_OP_RECV) || !probe_opcode(IORING_OP_WRITE_FIXED))
+  {
+    std::cerr << "io_uring without the needed operations" << std::endl;
+    close();
+    return false;
+  }
+
+  // register the send buffers: one slot per completion queue entry, as they are freed by their completion
+  tx_buffers.assign(params.cq_entries * frame_size, 0);
+  for (int slot = params.cq_entries - 1; slot >= 0; slot--)
+  {
+    free_tx_slots.push_back(slot);
+  }
+  tx_retry.assign(params.cq_entries, 0);
+  tx_backlog_limit = params.cq_entries * 4;
+  iovec tx_area = {&tx_buffers[0], tx_buffers.size()};
+  syscalls++;
+  if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, &tx_area, 1) < 0)
+  {
+    perror("io_uring register buffers");
+    close();
+    return false;
+  }
+
+  // provide the receive buffers by a buffer ring, the ring size needs to be a power of 2
+  rx_buffer_count = 1;
+  while (rx_buffer_count < rx_buffers_wanted && rx_buffer_count < 32768)
+  {
+    rx_buffer_count <<= 1;
+  }
+  rx_buffers.assign(rx_buffer_count * rx_buffer_size, 0);
+  buf_ring_size = rx_buffer_count * sizeof(io_uring_buf);
+  buf_ring = (io_uring_buf_ring *)mmap(0, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf_ring == MAP_FAILED)
+  {
+    perror("buffer ring mmap");
+    buf_ring = 0;
+    close();
+    return false;
+  }
+  io_uring_buf_reg reg;
+  std::memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+  reg.ring_entries = rx_buffer_count;
+  reg.bgid = URING_BUFFER_GROUP;
+  syscalls++;
+  if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+  { // kernel before 5.19
+    munmap(buf_ring, buf_ring_size);
+    buf_ring = 0;
+    if (!provide_buffers(0, rx_buffer_count))
+    {
+      close();
+      return false;
+    }
+  }
+  else
+  {
+    buf_ring->tail = 0;
+    for (unsigned bid = 0; bid < rx_buffer_count; bid++)
+    {
+      recycle_buffer(bid);
+    }
+  }
+  if (!arm_recv() || submit() < 0 || recv_refused())
+  {
+    std::cerr << "io_uring without multishot receive (needs kernel 6.0)" << std::endl;
+    close();
+    return false;
+  }
+  return true;
+}
+
+void Isotp_Uring::close()
+{
+  if (sqes)
+  {
+    munmap(sqes, sqes_size);
+    sqes = 0;
+  }
+  if (cq_ptr && cq_ptr != sq_ptr)
+  {
+    munmap(cq_ptr, cq_size);
+  }
+  cq_ptr = 0;
+  if (sq_ptr)
+  {
+    munmap(sq_ptr, sq_size);
+    sq_ptr = 0;
+  }
+  if (ring_fd != -1)
+  {
+    ::close(ring_fd);
+    ring_fd = -1;
+  }
+  if (buf_ring)
+  { // after the ring is closed, the kernel doesn't use the buffer ring anymore
+    munmap(buf_ring, buf_ring_size);
+    buf_ring = 0;
+  }
+  free_tx_slots.clear();
+  deferred.clear();
+  tx_backlog.clear();
+  tx_chain.clear();
+  tx_in_flight = 0;
+  recv_armed = false;
+  recv_failed = false;
+  ring_delivered = false;
+}
+
+// returns the next free submission queue entry or 0, if the queue is full
+io_uring_sqe *Isotp_Uring::get_sqe()
+{
+  unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  if (sq_local_tail - head > sq_mask)
+  {
+    return 0;
+  }
+  unsigned index = sq_local_tail & sq_mask;
+  io_uring_sqe *sqe = &sqes[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sq_array[index] = index;
+  sq_local_tail++;
+  return sqe;
+}
+
+// provides receive buffers by a request instead of the buffer ring, done with the next submit()
+bool Isotp_Uring::provide_buffers(unsigned short bid, int count)
+{
+  io_uring_sqe *sqe = get_sqe();
+  if (!sqe)
+  {
+    submit();
+    sqe = get_sqe();
+    if (!sqe)
+    {
+      return false;
+    }
+  }
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = count;
+  sqe->addr = (uint64_t)(uintptr_t)&rx_buffers[bid * rx_buffer_size];
+  sqe->len = rx_buffer_size;
+  sqe->off = bid;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = URING_PROVIDE_TAG;
+  return true;
+}
+
+/*
+the buffer ring was registered, but the kernel doesn't take buffers from it (seen on some kernels, where every
+receive ends with ENOBUFS although all buffers are in the ring and none was ever used), so the buffers are provided
+by requests instead
+*/
+void Isotp_Uring::drop_buffer_ring()
+{
+  std::cerr << "io_uring buffer ring not usable, providing the buffers by requests\n";
+  io_uring_buf_reg reg;
+  std::memset(&reg, 0, sizeof(reg));
+  reg.bgid = URING_BUFFER_GROUP;
+  syscalls++;
+  syscall(__NR_io_uring_register, ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  munmap(buf_ring, buf_ring_size);
+  buf_ring = 0;
+  provide_buffers(0, rx_buffer_count);
+}
+
+// gives a receive buffer (back) to the kernel
+void Isotp_Uring::recycle_buffer(unsigned short bid)
+{
+  if (!buf_ring)
+  {
+    provide_buffers(bid, 1);
+    return;
+  }
+  unsigned short tail = buf_ring->tail;
+  io_uring_buf *buf = &buf_ring->bufs[tail & (rx_buffer_count - 1)];
+  buf->addr = (uint64_t)(uintptr_t)&rx_buffers[bid * rx_buffer_size];
+  buf->len = rx_buffer_size;
+  buf->bid = bid;
+  __atomic_store_n(&buf_ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+// queues the multishot receive, which stays active until the kernel runs out of buffers
+bool Isotp_Uring::arm_recv()
+{
+  io_uring_sqe *sqe = get_sqe();
+  if (!sqe)
+  {
+    return false;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = sockfd;
+  if (with_timestamps)
+  {
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->addr = (uint64_t)(uintptr_t)&recv_msg;
+    sqe->len = 1;
+  }
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = URING_RECV_TAG;
+  recv_armed = true;
+  return true;
+}
+
+// queues a frame for sending with the next submit()
+bool Isotp_Uring::queue_write(const void *frame)
+{
+  if (tx_backlog.size() >= tx_backlog_limit * frame_size)
+  {
+    return false;
+  }
+  const unsigned char *bytes = (const unsigned char *)frame;
+  tx_backlog.insert(tx_backlog.end(), bytes, bytes + frame_size);
+  return true;
+}
+
+/*
+moves the queued frames into the registered buffers as a chain of linked writes.
+
+Only one chain is in flight at a time, so the frames keep their order: a write, which can't be done at once
+(ENOBUFS when the tx queue of the interface is full, EAGAIN on the non-blocking socket) fails and cancels the
+writes linked behind it. These frames are put back in front of the backlog by requeue_writes() and go out with
+a later submit(), after all completions of the chain are reaped.
+*/
+void Isotp_Uring::queue_writes()
+{
+  if (tx_in_flight)
+  { // collect the finished writes, the received frames are kept for the next reap()
+    reap(0, 0, 0);
+    if (tx_in_flight)
+    {
+      return;
+    }
+  }
+  size_t done = 0;
+  io_uring_sqe *last_write = 0;
+  while (done < tx_backlog.size() && !free_tx_slots.empty())
+  {
+    io_uring_sqe *sqe = get_sqe();
+    if (!sqe)
+    {
+      break;
+    }
+    int slot = free_tx_slots.back();
+    free_tx_slots.pop_back();
+    std::memcpy(&tx_buffers[slot * frame_size], &tx_backlog[done], frame_size);
+    done += frame_size;
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = sockfd;
+    sqe->addr = (uint64_t)(uintptr_t)&tx_buffers[slot * frame_size];
+    sqe->len = frame_size;
+    sqe->buf_index = 0;
+    sqe->user_data = slot;
+    tx_chain.push_back(slot);
+    if (last_write)
+    {
+      last_write->flags |= IOSQE_IO_LINK;
+    }
+    last_write = sqe;
+    tx_in_flight++;
+  }
+  tx_backlog.erase(tx_backlog.begin(), tx_backlog.begin() + done);
+}
+
+// puts the frames of the finished chain, which were not sent, back in front of the backlog in their order
+void Isotp_Uring::requeue_writes()
+{
+  std::vector<unsigned char> frames;
+  for (int slot : tx_chain)
+  {
+    if (tx_retry[slot])
+    {
+      frames.insert(frames.end(), &tx_buffers[slot * frame_size], &tx_buffers[(slot + 1) * frame_size]);
+      tx_retry[slot] = 0;
+      write_retries++;
+    }
+  }
+  tx_chain.clear();
+  tx_backlog.insert(tx_backlog.begin(), frames.begin(), frames.end());
+}
+
+/*
+submits the queued frames and all other prepared requests with one system call. With get_events also pending
+completions are collected by the kernel, even if nothing is to submit.
+
+returns the number of submitted requests or -1
+*/
+int Isotp_Uring::submit(bool get_events)
+{
+  if (!tx_backlog.empty())
+  {
+    queue_writes();
+  }
+  unsigned to_submit = sq_local_tail - *sq_tail;
+  if (!to_submit && !get_events)
+  {
+    return 0;
+  }
+  __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+  syscalls++;
+  int submitted = syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, get_events ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+  if (submitted < 0 && errno != EINTR && errno != EBUSY)
+  {
+    perror("io_uring_enter");
+  }
+  return submitted;
+}
+
+// passes a received buffer to the handler and recycles it
+void Isotp_Uring::deliver(rx_handler handler, void *context, unsigned short bid, int len)
+{
+  unsigned char *buffer = &rx_buffers[bid * rx_buffer_size];
+  uint64_t timestamp = 0;
+  if (with_timestamps)
+  {
+    io_uring_recvmsg_out *out = (io_uring_recvmsg_out *)buffer;
+    msghdr control;
+    std::memset(&control, 0, sizeof(control));
+    control.msg_control = buffer + sizeof(io_uring_recvmsg_out);
+    control.msg_controllen = out->controllen;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&control); cmsg; cmsg = CMSG_NXTHDR(&control, cmsg))
+    {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+      {
+        timespec stamp;
+        std::memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+        timestamp = (uint64_t)stamp.tv_sec * 1000000000ULL + stamp.tv_nsec;
+      }
+    }
+    len = out->payloadlen;
+    buffer += sizeof(io_uring_recvmsg_out) + recv_msg.msg_controllen;
+  }
+  handler(context, buffer, len, timestamp);
+  recycle_buffer(bid);
+}
+
+/*
+collects all completions and passes up to max_frames received frames to the handler. Frames beyond max_frames
+(or all, if there's no handler) are kept with their buffer until the next call
+
+returns the number of frames passed to the handler
+*/
+int Isotp_Uring::reap(rx_handler handler, void *context, int max_frames)
+{
+  if (reaping)
+  { // the completions up to the stored cq_head are already being handled
+    return 0;
+  }
+  reaping = true;
+  int frames = 0;
+  size_t done = 0;
+  for (; handler && done < deferred.size() && frames < max_frames; done++, frames++)
+  {
+    deliver(handler, context, deferred[done].bid, deferred[done].len);
+  }
+  deferred.erase(deferred.begin(), deferred.begin() + done);
+  unsigned head = *cq_head;
+  unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++)
+  {
+    io_uring_cqe *cqe = &cqes[head & cq_mask];
+    if (cqe->user_data == URING_PROVIDE_TAG)
+    {
+      continue;
+    }
+    if (cqe->user_data != URING_RECV_TAG)
+    {
+      int slot = (int)cqe->user_data;
+      if (cqe->res == -ENOBUFS || cqe->res == -EAGAIN || cqe->res == -ECANCELED)
+      {
+        tx_retry[slot] = 1;
+      }
+      else if (cqe->res < 0)
+      {
+        write_errors++;
+      }
+      free_tx_slots.push_back(slot);
+      if (!--tx_in_flight)
+      { // the slots are not reused before, so their frames are still there
+        requeue_writes();
+      }
+      continue;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    { // the multishot receive ended (e.g. no buffers left), so it needs to be armed again
+      recv_armed = false;
+      if ((cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) && !recv_failed)
+      { // refused: armed again it would fail the same way at once, the ring fd would be ready all the time
+        errno = -cqe->res;
+        perror("io_uring receive");
+        recv_failed = true;
+      }
+    }
+    if (cqe->res == -ENOBUFS && buf_ring && !ring_delivered && deferred.empty())
+    { // all buffers are in the ring, but the kernel never found one. Otherwise the buffers were just used up
+      // by a burst, the receive is armed again below
+      drop_buffer_ring();
+    }
+    if (cqe->res <= 0 || !(cqe->flags & IORING_CQE_F_BUFFER))
+    {
+      continue;
+    }
+    if (buf_ring)
+    {
+      ring_delivered = true;
+    }
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (handler && frames < max_frames && deferred.empty())
+    {
+      deliver(handler, context, bid, cqe->res);
+      frames++;
+    }
+    else
+    {
+      deferred.push_back({bid, cqe->res});
+    }
+  }
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  reaping = false;
+  if (!recv_armed && !recv_failed && deferred.size() < rx_buffer_count)
+  { // with all buffers deferred, the receive would end with ENOBUFS at once
+    arm_recv();
+  }
+  return frames;
+}
@@ -0,0 +1,102 @@
+#ifndef ISOTP_URING_H
+#define ISOTP_URING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/*
+io_uring transport of fixed size frames (e.g. struct can_frame) on a socket, without liburing
+
+receiving: one multishot recv fills a ring of provided buffers, the completions are reaped from the shared
+completion queue without any system call and the buffers are recycled directly into the buffer ring.
+Where the buffer ring is not available, the buffers are provided (and recycled) by IORING_OP_PROVIDE_BUFFERS
+requests, which go to the kernel together with the next submit().
+sending: frames are copied into a registered buffer area and submitted as linked WRITE_FIXED requests, so all frames
+queued between two submit() calls (e.g. a train of consecutive frames) go out in order with one system call
+*/
+class Isotp_Uring
+{
+public:
+    // gets each received frame with its receive time in ns (CLOCK_REALTIME), 0 if not known
+    typedef void (*rx_handler)(void *context, unsigned char *frame, int len, uint64_t timestamp_ns);
+
+private:
+    int ring_fd = -1;
+    int sockfd = -1;
+    int frame_size = 0;
+    // submission queue
+    void *sq_ptr = 0;
+    size_t sq_size = 0;
+    unsigned *sq_head = 0;
+    unsigned *sq_tail = 0;
+    unsigned sq_mask = 0;
+    unsigned *sq_array = 0;
+    io_uring_sqe *sqes = 0;
+    size_t sqes_size = 0;
+    unsigned sq_local_tail = 0;
+    // completion queue
+    void *cq_ptr = 0;
+    size_t cq_size = 0;
+    unsigned *cq_head = 0;
+    unsigned *cq_tail = 0;
+    unsigned cq_mask = 0;
+    io_uring_cqe *cqes = 0;
+    // receive buffers
+    io_uring_buf_ring *buf_ring = 0;
+    size_t buf_ring_size = 0;
+    unsigned rx_buffer_count = 0;
+    int rx_buffer_size = 0;
+    bool with_timestamps = false;
+    msghdr recv_msg; // template of the multishot recvmsg
+    std::vector<unsigned char> rx_buffers;
+    bool recv_armed = false;
+    bool recv_failed = false;    // the receive was refused by the kernel, it is not armed again
+    bool ring_delivered = false; // a buffer of the buffer ring was used, so the kernel supports it
+    bool reaping = false;        // reap() is running, it's not entered again (e.g. by provide_buffers())
+    struct received
+    {
+        unsigned short bid;
+        int len;
+    };
+    std::vector<received> deferred; // frames reaped, but not yet passed to the handler
+    // registered send buffers
+    std::vector<unsigned char> tx_buffers;
+    std::vector<int> free_tx_slots;
+    int tx_in_flight = 0;
+    std::vector<int> tx_chain;          // the slots of the chain in flight, in order
+    std::vector<unsigned char> tx_retry; // per slot: failed for now or cancelled, so sent again
+    std::vector<unsigned char> tx_backlog; // frames waiting for the next submit()
+    size_t tx_backlog_limit = 0;          // in frames
+
+public:
+    unsigned long syscalls = 0; // number of io_uring_enter() calls
+    unsigned long write_errors = 0;  // frames lost
+    unsigned long write_retries = 0; // frames sent again, after the tx queue of the interface was full
+
+    ~Isotp_Uring();
+    bool open(int sockfd, int frame_size, unsigned entries = 256, unsigned rx_buffers = 256, bool timestamps = false);
+    void close();
+    bool is_open() const { return ring_fd != -1; }
+    bool tx_waiting() const { return !tx_backlog.empty(); } // frames for the next submit(), e.g. to send again
+    int fd() const { return ring_fd; } // readable when completions are waiting
+    bool queue_write(const void *frame);
+    int submit(bool get_events = false);
+    int reap(rx_handler handler, void *context, int max_frames);
+
+private:
+    io_uring_sqe *get_sqe();
+    void queue_writes();
+    void requeue_writes();
+    bool probe_opcode(int opcode);
+    bool recv_refused();
+    bool arm_recv();
+    bool provide_buffers(unsigned short bid, int count);
+    void drop_buffer_ring();
+    void recycle_buffer(unsigned short bid);
+    void deliver(rx_handler handler, void *context, unsigned short bid, int len);
+};
+#endif
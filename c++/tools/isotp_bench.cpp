@@ -0,0 +1,233 @@
+/*
+
+isotp_listener benchmark
+
+measures the payload path of isotp_listener without any bus: sending and receiving of 4095 byte messages
+frame by frame through the listener, the segmentation of whole messages into classic CAN and CAN FD frames and the
+cost of the frames of a busy bus which are not for the listener, frame by frame and batched by eval_msgs(), and the
+tick sweep over 10000 sessions, as an array of listeners and as an Isotp_Session_Table, and a LZSS compressed
+download of a calibration-like image through the TransferData handler
+
+build & run:
+
+  g++ -std=c++17 -O2 -I.. isotp_bench.cpp ../isotp_listener.cpp ../uds_service_registry.cpp ../uds_response_cache.cpp ../isotp_capture.cpp ../isotp_latency.cpp ../uds_ipc.cpp ../isotp_session_table.cpp ../uds_download.cpp -o isotp_bench
+  ./isotp_bench
+
+*/
+
+#include <iostream>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+#include "isotp_listener.h"
+#include "isotp_session_table.h"
+#include "uds_download.h"
+#include "uds_service_registry.h"
+
+static long frames_sent = 0;
+
+int count_frame(int can_id, unsigned char data[8], int len)
+{
+  frames_sent++;
+  return 0;
+}
+
+int ignore_message(RequestType request_type, uds_buffer receive_buffer, int recv_len, uds_buffer send_buffer)
+{
+  return 0;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void report(const char *name, int messages, int message_len, long frames, double seconds)
+{
+  std::cout << name << ": " << messages / seconds << " msg/s, " << frames / seconds / 1e6 << " Mframes/s, "
+            << (double)messages * message_len / seconds / 1e6 << " MB/s\n";
+}
+
+int main(int argc, char *argv[])
+{
+  int messages = argc > 1 ? atoi(argv[1]) : 20000;
+  isotp_options options;
+  options.source_address = 0x7E1;
+  options.target_address = 0x7E9;
+  options.padding_byte = 0xCC;
+  options.send_frame = &count_frame;
+  options.uds_handler = &ignore_message;
+  Isotp_Listener listener(options);
+
+  static uds_buffer message;
+  for (int i = 0; i < UDS_BUFFER_SIZE; i++)
+  {
+    message[i] = i;
+  }
+
+  // send 4095 bytes: first frame, flow control, then all CFs by tick()
+  unsigned char flow_control[8] = {0x30, 0, 0};
+  uint64_t tick = 0;
+  frames_sent = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < messages; i++)
+  {
+    listener.send_telegram(message, UDS_BUFFER_SIZE);
+    listener.eval_msg(options.source_address, flow_control, 3);
+    while (listener.busy())
+    {
+      listener.tick(tick += 2);
+    }
+  }
+  report("listener tx 4095", messages, UDS_BUFFER_SIZE, frames_sent, seconds_since(start));
+
+  // receive 4095 bytes, the frames are prepared once
+  static unsigned char frames[600 * ISOTP_MAX_FRAME_LEN];
+  int first_frame_len;
+  int frame_count = isotp_segment_message(message, UDS_BUFFER_SIZE, frames, 8, 0xCC, &first_frame_len);
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < messages; i++)
+  {
+    for (int f = 0; f < frame_count; f++)
+    {
+      listener.eval_msg(options.source_address, frames + f * 8, 8);
+    }
+  }
+  report("listener rx 4095", messages, UDS_BUFFER_SIZE, (long)messages * frame_count, seconds_since(start));
+
+  // segment whole messages in one pass
+  int frame_lens[] = {8, 64};
+  for (int frame_len : frame_lens)
+  {
+    long frames_built = 0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < messages; i++)
+    {
+      frames_built += isotp_segment_message(message, UDS_BUFFER_SIZE, frames, frame_len, 0xCC, &first_frame_len);
+    }
+    report(frame_len == 8 ? "segment 4095 CAN" : "segment 4095 CAN FD", messages, UDS_BUFFER_SIZE, frames_built, seconds_since(start));
+  }
+
+  // reject the traffic of a busy bus, the ids of other ECUs
+  std::vector<isotp_frame> bus(4096);
+  std::vector<int> results(bus.size());
+  for (size_t f = 0; f < bus.size(); f++)
+  {
+    bus[f].can_id = 0x100 + f * 7 % 0x600;
+    if (bus[f].can_id == (uint32_t)options.source_address)
+    {
+      bus[f].can_id++;
+    }
+    bus[f].len = 8;
+    std::memset(bus[f].data, 0x55, 8);
+  }
+  int rounds = messages / 10;
+  long rejected = 0;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++)
+  {
+    for (isotp_frame &frame : bus)
+    {
+      rejected += listener.eval_msg(frame.can_id, frame.data, frame.len) == MSG_NO_UDS;
+    }
+  }
+  std::cout << "reject eval_msg: " << seconds_since(start) * 1e9 / rejected << " ns/frame\n";
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++)
+  {
+    listener.eval_msgs(bus.data(), bus.size(), results.data());
+  }
+  std::cout << "reject eval_msgs: " << seconds_since(start) * 1e9 / ((long)rounds * bus.size()) << " ns/frame\n";
+
+  // tick 10000 sessions, of which every 100th sends a 4095 byte message
+  const int sessions = 10000;
+  std::vector<std::unique_ptr<Isotp_Listener>> array;
+  Isotp_Session_Table table;
+  for (int i = 0; i < sessions; i++)
+  {
+    options.source_address = 0x10000 + i;
+    options.target_address = 0x20000 + i;
+    array.emplace_back(new Isotp_Listener(options));
+    table.add(options);
+  }
+  for (int pass = 0; pass < 2; pass++)
+  {
+    long sweeps = 0;
+    start = std::chrono::steady_clock::now();
+    for (int round = 0; round < 10; round++)
+    {
+      for (int i = 0; i < sessions; i += 100)
+      {
+        if (pass == 0)
+        {
+          array[i]->send_telegram(message, UDS_BUFFER_SIZE);
+          array[i]->eval_msg(0x10000 + i, flow_control, 3);
+        }
+        else
+        {
+          table.send_telegram(i, message, UDS_BUFFER_SIZE);
+          table.eval_msg(0x10000 + i, flow_control, 3);
+        }
+      }
+      bool busy = true;
+      while (busy)
+      {
+        tick += 1;
+        sweeps++;
+        if (pass == 0)
+        {
+          busy = false;
+          for (std::unique_ptr<Isotp_Listener> &listener : array)
+          {
+            listener->tick(tick);
+            busy |= listener->busy();
+          }
+        }
+        else
+        {
+          busy = table.tick(tick);
+        }
+      }
+    }
+    std::cout << (pass == 0 ? "tick 10000 listeners: " : "tick 10000 table sessions: ") << seconds_since(start) * 1e6 / sweeps << " us/sweep\n";
+  }
+
+  // download 1MB of calibration tables, repeating structures with some noise, LZSS compressed in 4093 byte blocks
+  std::vector<unsigned char> image(1024 * 1024);
+  for (size_t b = 0; b < image.size(); b++)
+  {
+    image[b] = b % 4096 < 1024 ? 0xFF : b % 64 < 32 ? (b / 64) & 0xFF : (b * 7 % 13) ^ (b % 997 == 0);
+  }
+  std::vector<unsigned char> compressed;
+  uds_lzss_compress(image.data(), image.size(), compressed);
+  std::vector<unsigned char> target(image.size());
+  Uds_Service_Registry download_services;
+  Uds_Download download;
+  download.set_memory(target.data(), 0, target.size());
+  download.register_services(download_services);
+  unsigned char request[UDS_BUFFER_SIZE];
+  unsigned char response[UDS_BUFFER_SIZE];
+  int downloads = messages / 1000 > 0 ? messages / 1000 : 1;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < downloads; i++)
+  {
+    unsigned char request_download[] = {Service::RequestDownload, UDS_COMPRESSION_LZSS << 4, 0x44, 0, 0, 0, 0, 0, 0x10, 0, 0};
+    download_services.dispatch(request_download, sizeof(request_download), response);
+    uint8_t counter = 1;
+    for (size_t pos = 0; pos < compressed.size(); pos += UDS_BUFFER_SIZE - 2)
+    {
+      int len = compressed.size() - pos < UDS_BUFFER_SIZE - 2 ? compressed.size() - pos : UDS_BUFFER_SIZE - 2;
+      request[0] = Service::TransferData;
+      request[1] = counter++;
+      std::memcpy(request + 2, compressed.data() + pos, len);
+      download_services.dispatch(request, len + 2, response);
+    }
+    unsigned char transfer_exit[] = {Service::RequestTransferExit};
+    download_services.dispatch(transfer_exit, 1, response);
+  }
+  double seconds = seconds_since(start);
+  std::cout << "download 1MB LZSS: " << (double)image.size() / compressed.size() << "x smaller, decoded "
+            << (double)downloads * image.size() / seconds / 1e6 << " MB/s" << (target == image ? "" : ", WRONG IMAGE") << "\n";
+  return 0;
+}
@@ -0,0 +1,641 @@
+/*
+
+isotp_listener load generator
+
+emulates many testers at once: each session sends requests of random size to its own address pair and verifies
+the answer. The sessions are spread over all given can interfaces. The requests use the supplier specific service
+0xBA, which an echo ECU answers with 0xFA and the request payload - such ECUs are emulated by "--serve" in the same
+process (on own sockets) or by "--ecu" in another process or on another machine.
+
+each session is an Isotp_Listener itself: it sends the request by send_telegram(), follows the flow controls of
+the ECU and receives the response with its own bs and stmin, so the generator puts the listener under the same
+load as the ECUs.
+
+at the end it reports the sustained transfers/s, failed and timed out transfers, lost frames and the end-to-end
+latency percentiles, measured from the arrival of the request until the response is complete
+
+build & run:
+
+  g++ -std=c++17 -O2 -I.. isotp_loadgen.cpp ../isotp_listener.cpp ../isotp_socket.cpp ../isotp_uring.cpp ../uds_service_registry.cpp ../uds_response_cache.cpp ../isotp_capture.cpp ../isotp_latency.cpp ../uds_ipc.cpp -lpthread -o isotp_loadgen
+  ./isotp_loadgen --serve --sessions 200 --size 1-4095 --duration 10 vcan0 vcan1
+
+options:
+
+  --sessions n      concurrent testers, default 100
+  --duration s      run time in seconds, default 10
+  --size spec       request sizes: "n", uniform "min-max", exponential "exp:mean" or a list "a,b,c", default 1-4095
+  --rate r          requests per second and session, poisson distributed, 0 = each next one right after the answer
+  --bs n            block size of the flow controls sent by the testers, default 0
+  --stmin n         separation time of the flow controls sent by the testers, default 0
+  --ecu-bs n        block size of the flow controls sent by the emulated ECUs, default 0
+  --ecu-stmin n     separation time of the flow controls sent by the emulated ECUs, default 0
+  --request-id id   can id of the requests of the first session, the next ones count up, default 0x400
+  --response-id id  can id of the responses of the first session, default 0x600; ids with bit 31 set are 29 bit ids.
+                    The ids of all sessions must stay in the 11 or 29 bit range, the two ranges must not overlap
+  --timeout ms      a request without complete answer in this time counts as timed out, default 1000
+  --serve           emulate the echo ECUs in this process
+  --ecu             only emulate the echo ECUs, until stopped
+  --breakdown       with --serve: print the latency breakdown of the ECU side per address
+  --ipc path        the emulated ECUs hand the requests to uds_ipc_worker processes on this unix socket
+  --uring           use the io_uring socket backend
+  --seed n          random seed, default 1
+
+*/
+
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+
+#include "isotp_listener.h"
+#include "isotp_socket.h"
+#include "isotp_latency.h"
+#include "uds_ipc.h"
+
+#define ECHO_REQUEST 0xBA  // system supplier specific service
+#define ECHO_RESPONSE 0xFA // its positive response
+#define MAX_BACKLOG 1000   // queued requests per session, more arrivals are counted as dropped
+
+static std::atomic<bool> running{true};
+static std::atomic<bool> ecus_ready{false}; // all emulated ECUs listen
+
+static void stop(int signal)
+{
+  running = false;
+}
+
+uint64_t timeSinceEpochMicrosec()
+{
+  using namespace std::chrono;
+  return duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+// the distribution of the request sizes
+struct size_distribution
+{
+  enum
+  {
+    Fixed,
+    Uniform,
+    Exponential,
+    List
+  } kind = Uniform;
+  int min = 1;
+  int max = UDS_BUFFER_SIZE;
+  double mean = 0;
+  std::vector<int> values;
+
+  bool parse(const std::string &spec);
+  int sample(std::mt19937 &random) const;
+};
+
+bool size_distribution::parse(const std::string &spec)
+{
+  if (spec.compare(0, 4, "exp:") == 0)
+  {
+    kind = Exponential;
+    mean = atof(spec.c_str() + 4);
+    return mean >= 1;
+  }
+  if (spec.find(',') != std::string::npos)
+  {
+    kind = List;
+    size_t start = 0;
+    while (start < spec.size())
+    {
+      size_t end = spec.find(',', start);
+      end = end == std::string::npos ? spec.size() : end;
+      values.push_back(atoi(spec.substr(start, end - start).c_str()));
+      start = end + 1;
+    }
+    for (int value : values)
+    {
+      if (value < 1 || value > UDS_BUFFER_SIZE)
+      {
+        return false;
+      }
+    }
+    return !values.empty();
+  }
+  size_t dash = spec.find('-');
+  kind = dash == std::string::npos ? Fixed : Uniform;
+  min = atoi(spec.c_str());
+  max = dash == std::string::npos ? min : atoi(spec.c_str() + dash + 1);
+  return min >= 1 && max >= min && max <= UDS_BUFFER_SIZE;
+}
+
+int size_distribution::sample(std::mt19937 &random) const
+{
+  switch (kind)
+  {
+  case Fixed:
+    return min;
+  case Exponential:
+  {
+    int size = (int)std::exponential_distribution<double>(1.0 / mean)(random) + 1;
+    return size > UDS_BUFFER_SIZE ? UDS_BUFFER_SIZE : size;
+  }
+  case List:
+    return values[std::uniform_int_distribution<size_t>(0, values.size() - 1)(random)];
+  default:
+    return std::uniform_int_distribution<int>(min, max)(random);
+  }
+}
+
+struct loadgen_options
+{
+  int sessions = 100;
+  int duration = 10;
+  size_distribution sizes;
+  double rate = 0;
+  int bs = 0;
+  int stmin = 0;
+  int ecu_bs = 0;
+  int ecu_stmin = 0;
+  uint32_t request_id = 0x400;
+  uint32_t response_id = 0x600;
+  int timeout = 1000;
+  bool serve = false;
+  bool ecu_only = false;
+  bool breakdown = false;
+  std::string ipc_path;
+  Socket_Backend backend = Socket_Backend::Plain;
+  unsigned seed = 1;
+  std::vector<std::string> interfaces;
+};
+
+// one emulated tester
+struct tester_session
+{
+  std::unique_ptr<Isotp_Listener> listener;
+  uds_buffer request;
+  int request_len = 0;
+  uint32_t number = 0;           // of the actual request, carried in its payload
+  bool waiting = false;          // for the response
+  uint64_t started = 0;          // µs, when the actual request arrived
+  uint64_t next_arrival = 0;     // µs
+  std::deque<uint64_t> backlog;  // arrival times of the requests not sent yet
+};
+
+struct loadgen_results
+{
+  unsigned long transfers = 0; // verified responses
+  unsigned long failed = 0;    // wrong responses
+  unsigned long late = 0;      // responses of timed out requests
+  unsigned long timeouts = 0;
+  unsigned long dropped = 0; // arrivals which didn't fit into the backlog
+  unsigned long long request_bytes = 0;
+  std::vector<int> latency_us;
+};
+
+static loadgen_results results;
+static socket_stats ecu_stats; // the frames of the emulated ECUs, written when their thread ends
+static uint64_t now_us = 0;
+
+// the response of a tester session is complete
+int verify_response(void *context, RequestType request_type, uds_buffer receive_buffer, int recv_len, uds_buffer send_buffer)
+{
+  tester_session *session = static_cast<tester_session *>(context);
+  if (!session->waiting || (session->request_len >= 5 && recv_len >= 5 && std::memcmp(receive_buffer + 1, &session->number, 4) != 0))
+  { // answer of a request which already timed out
+    results.late++;
+    return 0;
+  }
+  session->waiting = false;
+  if (recv_len != session->request_len || receive_buffer[0] != ECHO_RESPONSE ||
+      std::memcmp(receive_buffer + 1, session->request + 1, recv_len - 1) != 0)
+  {
+    results.failed++;
+    return 0;
+  }
+  results.transfers++;
+  results.request_bytes += recv_len;
+  results.latency_us.push_back((int)(now_us - session->started));
+  return 0; // no answer to the answer
+}
+
+// the echo ECU: the request payload comes back with the positive response id
+int echo_request(RequestType request_type, uds_buffer receive_buffer, int recv_len, uds_buffer send_buffer)
+{
+  if (receive_buffer[0] != ECHO_REQUEST)
+  {
+    send_buffer[0] = Service::NegativeResponse;
+    send_buffer[1] = receive_buffer[0];
+    send_buffer[2] = Nrc::ServiceNotSupported;
+    return 3;
+  }
+  std::memcpy(send_buffer, receive_buffer, recv_len);
+  send_buffer[0] = ECHO_RESPONSE;
+  return recv_len;
+}
+
+static double next_interval_us(const loadgen_options &options, std::mt19937 &random)
+{
+  return std::exponential_distribution<double>(options.rate)(random) * 1e6;
+}
+
+static bool open_sockets(const loadgen_options &options, std::vector<std::unique_ptr<Isotp_Socket>> &sockets)
+{
+  for (const std::string &interface_name : options.interfaces)
+  {
+    sockets.emplace_back(new Isotp_Socket());
+    if (sockets.back()->open(interface_name.c_str(), options.backend) == -1)
+    {
+      return false;
+    }
+    sockets.back()->set_ticks_per_ms(1000); // time stamps in microseconds
+  }
+  return true;
+}
+
+// polls the sockets: returns as soon as one has frames, or after the timeout
+static void wait_for_frames(std::vector<std::unique_ptr<Isotp_Socket>> &sockets, int timeout_ms, int extra_fd = -1)
+{
+  std::vector<pollfd> fds(sockets.size());
+  for (size_t i = 0; i < sockets.size(); i++)
+  {
+    fds[i].fd = sockets[i]->fd();
+    fds[i].events = POLLIN;
+  }
+  if (extra_fd != -1)
+  {
+    pollfd extra = {extra_fd, POLLIN, 0};
+    fds.push_back(extra);
+  }
+  ::poll(&fds[0], fds.size(), timeout_ms);
+}
+
+/*
+the emulated ECUs, one per session address pair, on their own sockets - the sockets of the testers don't
+receive their own frames
+*/
+static void run_ecus(const loadgen_options &options, Isotp_Latency *latency)
+{
+  std::vector<std::unique_ptr<Isotp_Socket>> sockets;
+  if (!open_sockets(options, sockets))
+  {
+    running = false;
+    return;
+  }
+  Uds_Ipc_Server ipc; // the responses of the worker processes
+  if (!options.ipc_path.empty() && ipc.open(options.ipc_path.c_str(), 256) == -1)
+  {
+    running = false;
+    return;
+  }
+  std::vector<std::unique_ptr<Isotp_Listener>> ecus;
+  for (int i = 0; i < options.sessions; i++)
+  {
+    Isotp_Socket *socket = sockets[i % sockets.size()].get();
+    isotp_options ecu_options;
+    ecu_options.source_address = options.request_id + i / sockets.size();
+    ecu_options.target_address = options.response_id + i / sockets.size();
+    ecu_options.bs = options.ecu_bs;
+    ecu_options.stmin = options.ecu_stmin;
+    ecu_options.ticks_per_ms = 1000;
+    ecu_options.uds_handler = &echo_request;
+    ecu_options.send_frame_ctx = &Isotp_Socket::send_frame;
+    ecu_options.send_context = socket;
+    ecu_options.latency = latency;
+    ecu_options.ipc = options.ipc_path.empty() ? 0 : &ipc;
+    ecus.emplace_back(new Isotp_Listener(ecu_options));
+    socket->add_listener(ecus.back().get());
+  }
+  ecus_ready = true;
+  while (running)
+  {
+    int frames = 0;
+    bool busy = false;
+    uint64_t now = timeSinceEpochMicrosec();
+    for (std::unique_ptr<Isotp_Socket> &socket : sockets)
+    {
+      frames += socket->poll();
+      socket->tick(now);
+    }
+    if (!options.ipc_path.empty())
+    {
+      frames += ipc.poll();
+    }
+    for (std::unique_ptr<Isotp_Listener> &ecu : ecus)
+    {
+      busy |= ecu->busy();
+    }
+    if (!frames && !busy)
+    {
+      wait_for_frames(sockets, 1, options.ipc_path.empty() ? -1 : ipc.fd());
+    }
+  }
+  for (std::unique_ptr<Isotp_Socket> &socket : sockets)
+  {
+    socket_stats stats = socket->get_stats();
+    ecu_stats.rx_frames += stats.rx_frames;
+    ecu_stats.tx_frames += stats.tx_frames;
+    ecu_stats.tx_errors += stats.tx_errors;
+  }
+}
+
+static int percentile(std::vector<int> &samples, double percent)
+{
+  if (samples.empty())
+  {
+    return -1;
+  }
+  size_t rank = (size_t)(percent / 100.0 * (samples.size() - 1) + 0.5);
+  std::nth_element(samples.begin(), samples.begin() + rank, samples.end());
+  return samples[rank];
+}
+
+// the frames sent by the one side, but not received by the other one
+static void report_frame_loss(const socket_stats &testers)
+{
+  long requests_lost = (long)(testers.tx_frames - testers.tx_errors) - (long)ecu_stats.rx_frames;
+  long responses_lost = (long)(ecu_stats.tx_frames - ecu_stats.tx_errors) - (long)testers.rx_frames;
+  std::cout << "ECUs: " << ecu_stats.rx_frames << " frames received, " << ecu_stats.tx_frames << " sent, " << ecu_stats.tx_errors
+            << " send errors\nframes lost: " << requests_lost << " to the ECUs, " << responses_lost << " to the testers\n";
+}
+
+static int run_testers(const loadgen_options &options, std::thread &ecus)
+{
+  std::vector<std::unique_ptr<Isotp_Socket>> sockets;
+  if (!open_sockets(options, sockets))
+  {
+    return 1;
+  }
+  while (options.serve && !ecus_ready && running)
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  std::mt19937 random(options.seed);
+  std::vector<std::unique_ptr<tester_session>> sessions;
+  uint64_t start = timeSinceEpochMicrosec();
+  for (int i = 0; i < options.sessions; i++)
+  {
+    Isotp_Socket *socket = sockets[i % sockets.size()].get();
+    sessions.emplace_back(new tester_session());
+    tester_session *session = sessions.back().get();
+    isotp_options tester_options;
+    tester_options.source_address = options.response_id + i / sockets.size();
+    tester_options.target_address = options.request_id + i / sockets.size();
+    tester_options.bs = options.bs;
+    tester_options.stmin = options.stmin;
+    tester_options.ticks_per_ms = 1000;
+    tester_options.uds_handler_ctx = &verify_response;
+    tester_options.handler_context = session;
+    tester_options.send_frame_ctx = &Isotp_Socket::send_frame;
+    tester_options.send_context = socket;
+    session->listener.reset(new Isotp_Listener(tester_options));
+    socket->add_listener(session->listener.get());
+    session->next_arrival = start + (options.rate > 0 ? (uint64_t)next_interval_us(options, random) : 0);
+  }
+
+  uint64_t end = start + (uint64_t)options.duration * 1000000;
+  uint64_t next_report = start + 1000000;
+  unsigned long reported_transfers = 0;
+  bool waiting = true;
+  while (running && (now_us < end || waiting))
+  { // after the end, the answers of the open requests are still collected
+    now_us = timeSinceEpochMicrosec();
+    bool busy = false;
+    waiting = false;
+    for (std::unique_ptr<tester_session> &entry : sessions)
+    {
+      tester_session *session = entry.get();
+      if (options.rate > 0)
+      {
+        while (session->next_arrival <= now_us)
+        {
+          if (session->backlog.size() < MAX_BACKLOG)
+          {
+            session->backlog.push_back(session->next_arrival);
+          }
+          else
+          {
+            results.dropped++;
+          }
+          session->next_arrival += (uint64_t)next_interval_us(options, random) + 1;
+        }
+      }
+      if (session->waiting && now_us - session->started > (uint64_t)options.timeout * 1000)
+      {
+        results.timeouts++;
+        session->waiting = false;
+      }
+      if (now_us < end && !session->waiting && !session->listener->busy() && (options.rate <= 0 || !session->backlog.empty()))
+      { // send the next request
+        session->started = now_us;
+        if (options.rate > 0)
+        {
+          session->started = session->backlog.front();
+          session->backlog.pop_front();
+        }
+        session->number++;
+        session->request_len = options.sizes.sample(random);
+        session->request[0] = ECHO_REQUEST;
+        int counter_len = session->request_len - 1 < 4 ? session->request_len - 1 : 4;
+        std::memcpy(session->request + 1, &session->number, counter_len);
+        for (int i = 1 + counter_len; i < session->request_len; i++)
+        {
+          session->request[i] = (unsigned char)random();
+        }
+        session->waiting = true;
+        session->listener->send_telegram(session->request, session->request_len);
+      }
+      busy |= session->listener->busy();
+      waiting |= session->waiting;
+    }
+    int frames = 0;
+    for (std::unique_ptr<Isotp_Socket> &socket : sockets)
+    {
+      socket->flush(); // the requests started above
+      frames += socket->poll();
+      socket->tick(now_us);
+    }
+    if (now_us >= next_report && now_us < end)
+    {
+      std::cout << (now_us - start) / 1000000 << "s: " << results.transfers - reported_transfers << " transfers/s, "
+                << results.failed << " failed, " << results.timeouts << " timeouts\n";
+      reported_transfers = results.transfers;
+      next_report += 1000000;
+    }
+    if (!frames && !busy)
+    {
+      wait_for_frames(sockets, 1);
+    }
+  }
+
+  double seconds = (end < now_us ? end - start : now_us - start) / 1e6;
+  running = false;
+  if (ecus.joinable())
+  { // the ECUs count their frames at their end
+    ecus.join();
+  }
+  socket_stats total;
+  unsigned long sequence_errors = 0;
+  unsigned long rx_timeouts = 0;
+  for (std::unique_ptr<Isotp_Socket> &socket : sockets)
+  {
+    socket_stats stats = socket->get_stats();
+    total.rx_frames += stats.rx_frames;
+    total.tx_frames += stats.tx_frames;
+    total.tx_errors += stats.tx_errors;
+  }
+  for (std::unique_ptr<tester_session> &session : sessions)
+  {
+    isotp_stats stats = session->listener->get_stats();
+    sequence_errors += stats.rx_sequence_errors;
+    rx_timeouts += stats.rx_timeouts;
+  }
+  std::cout << options.sessions << " sessions on " << sockets.size() << " interfaces, " << seconds << " s\n"
+            << "transfers: " << results.transfers << " ok (" << results.transfers / seconds << "/s, "
+            << results.request_bytes * 2 / seconds / 1e3 << " kB/s payload), " << results.failed << " failed, "
+            << results.timeouts << " timeouts, " << results.late << " late answers, " << results.dropped << " dropped arrivals\n"
+            << "testers: " << total.tx_frames << " frames sent, " << total.rx_frames << " received, " << total.tx_errors
+            << " send errors, " << sequence_errors << " sequence errors, " << rx_timeouts << " CF timeouts\n"
+            << "latency us: p50 " << percentile(results.latency_us, 50) << " p90 " << percentile(results.latency_us, 90)
+            << " p99 " << percentile(results.latency_us, 99) << " p99.9 " << percentile(results.latency_us, 99.9)
+            << " max " << percentile(results.latency_us, 100) << '\n';
+  if (options.serve)
+  {
+    report_frame_loss(total);
+  }
+  return 0;
+}
+
+// the request and the response ids of all sessions must be valid can ids and the two ranges must not overlap,
+// as the sessions count up from the first ids, one id per session on each interface
+static bool check_ids(const loadgen_options &options, int interfaces)
+{
+  uint32_t count = (options.sessions + interfaces - 1) / interfaces;
+  const uint32_t first[2] = {options.request_id, options.response_id};
+  const char *name[2] = {"request", "response"};
+  for (int i = 0; i < 2; i++)
+  {
+    uint32_t max = first[i] & CAN_EFF_FLAG ? CAN_EFF_MASK : CAN_SFF_MASK;
+    uint32_t id = first[i] & ~CAN_EFF_FLAG;
+    if (id > max || count - 1 > max - id)
+    {
+      std::cerr << "the " << name[i] << " ids 0x" << std::hex << id << "-0x" << id + count - 1 << std::dec << " of " << options.sessions
+                << " sessions exceed the " << (max == CAN_EFF_MASK ? 29 : 11) << " bit range\n";
+      return false;
+    }
+  }
+  if ((options.request_id & CAN_EFF_FLAG) == (options.response_id & CAN_EFF_FLAG) &&
+      options.request_id < options.response_id + count && options.response_id < options.request_id + count)
+  {
+    std::cerr << "the request ids 0x" << std::hex << options.request_id << "-0x" << options.request_id + count - 1 << " and the response ids 0x"
+              << options.response_id << "-0x" << options.response_id + count - 1 << std::dec << " overlap\n";
+    return false;
+  }
+  return true;
+}
+
+static void usage(const char *name)
+{
+  std::cerr << "usage: " << name << " [--sessions n] [--duration s] [--size spec] [--rate r] [--bs n] [--stmin n] [--ecu-bs n] [--ecu-stmin n]\n"
+            << "       [--request-id id] [--response-id id] [--timeout ms] [--serve | --ecu] [--breakdown] [--ipc path] [--uring] [--seed n] interface...\n";
+}
+
+int main(int argc, char *argv[])
+{
+  loadgen_options options;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--serve")
+      options.serve = true;
+    else if (arg == "--ecu")
+      options.ecu_only = true;
+    else if (arg == "--breakdown")
+      options.breakdown = true;
+    else if (arg == "--uring")
+      options.backend = Socket_Backend::Uring;
+    else if (arg.compare(0, 2, "--") != 0)
+      options.interfaces.push_back(arg);
+    else if (!has_value)
+    {
+      usage(argv[0]);
+      return 1;
+    }
+    else if (arg == "--sessions")
+      options.sessions = atoi(argv[++i]);
+    else if (arg == "--duration")
+      options.duration = atoi(argv[++i]);
+    else if (arg == "--rate")
+      options.rate = atof(argv[++i]);
+    else if (arg == "--bs")
+      options.bs = strtol(argv[++i], 0, 0);
+    else if (arg == "--stmin")
+      options.stmin = strtol(argv[++i], 0, 0);
+    else if (arg == "--ecu-bs")
+      options.ecu_bs = strtol(argv[++i], 0, 0);
+    else if (arg == "--ecu-stmin")
+      options.ecu_stmin = strtol(argv[++i], 0, 0);
+    else if (arg == "--request-id")
+      options.request_id = strtoul(argv[++i], 0, 0);
+    else if (arg == "--response-id")
+      options.response_id = strtoul(argv[++i], 0, 0);
+    else if (arg == "--timeout")
+      options.timeout = atoi(argv[++i]);
+    else if (arg == "--seed")
+      options.seed = atoi(argv[++i]);
+    else if (arg == "--ipc")
+      options.ipc_path = argv[++i];
+    else if (arg == "--size")
+    {
+      if (!options.sizes.parse(argv[++i]))
+      {
+        std::cerr << "invalid size " << argv[i] << '\n';
+        return 1;
+      }
+    }
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (options.interfaces.empty() || options.sessions < 1)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+  if (!check_ids(options, options.interfaces.size()))
+  {
+    return 1;
+  }
+  signal(SIGINT, &stop);
+  signal(SIGTERM, &stop);
+  Isotp_Latency latency;
+  if (options.ecu_only)
+  {
+    run_ecus(options, 0);
+    return 0;
+  }
+  std::thread ecus;
+  if (options.serve)
+  {
+    ecus = std::thread(&run_ecus, std::cref(options), options.breakdown ? &latency : 0);
+  }
+  int result = run_testers(options, ecus);
+  running = false;
+  if (ecus.joinable())
+  {
+    ecus.join();
+  }
+  if (options.breakdown)
+  {
+    latency.report(std::cout);
+  }
+  return result;
+}
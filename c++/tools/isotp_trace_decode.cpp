@@ -0,0 +1,43 @@
+/*
+
+isotp_listener trace decoder
+
+renders a trace file written by isotp_trace_save() as text, optionally only the records of one listener
+
+build & run:
+
+  g++ -std=c++17 -O2 -I.. isotp_trace_decode.cpp ../isotp_trace.cpp -o isotp_trace_decode
+  ./isotp_trace_decode isotp_trace.bin [listener id, e.g. 0x7E1]
+
+*/
+
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+
+#include "isotp_trace.h"
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2)
+  {
+    std::cerr << "usage: " << argv[0] << " trace_file [listener_id]\n";
+    return 1;
+  }
+  std::vector<trace_record> records;
+  if (!isotp_trace_load(argv[1], records))
+  {
+    std::cerr << argv[1] << " is no isotp_listener trace\n";
+    return 1;
+  }
+  bool filter = argc > 2;
+  uint32_t listener_id = filter ? (uint32_t)std::strtoul(argv[2], 0, 0) : 0;
+  for (const trace_record &record : records)
+  {
+    if (!filter || record.listener_id == listener_id)
+    {
+      isotp_trace_format(std::cout, record);
+    }
+  }
+  return 0;
+}
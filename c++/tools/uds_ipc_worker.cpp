@@ -0,0 +1,140 @@
+/*
+
+UDS worker process
+
+answers the requests which the listeners of another process hand over by shared memory (isotp_options.ipc = a
+Uds_Ipc_Server): like the echo ECUs of isotp_loadgen, it answers the service 0xBA with 0xFA and the request payload,
+TesterPresent positively and all other services with ServiceNotSupported. --processes starts several workers, which
+take the requests from the same queue, --delay emulates the processing time of a real handler.
+
+build & run:
+
+  g++ -std=c++17 -O2 -I.. uds_ipc_worker.cpp ../uds_ipc.cpp ../isotp_listener.cpp ../uds_service_registry.cpp ../uds_response_cache.cpp ../isotp_capture.cpp ../isotp_latency.cpp -o uds_ipc_worker
+  ./isotp_loadgen --ecu --ipc /tmp/uds_ipc vcan0 &
+  ./uds_ipc_worker --processes 4 /tmp/uds_ipc
+
+options:
+
+  --processes n     worker processes, default 1
+  --delay us        processing time of each request, default 0
+
+*/
+
+#include <iostream>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "isotp_listener.h"
+#include "uds_ipc.h"
+
+#define ECHO_REQUEST 0xBA  // system supplier specific service
+#define ECHO_RESPONSE 0xFA // its positive response
+
+static Uds_Ipc_Worker *worker = 0;
+
+static void stop(int signal)
+{
+  if (worker)
+  {
+    worker->stop();
+  }
+}
+
+static int answer(void *context, RequestType request_type, uds_buffer receive_buffer, int recv_len, uds_buffer send_buffer)
+{
+  int delay_us = *static_cast<int *>(context);
+  if (delay_us)
+  {
+    usleep(delay_us);
+  }
+  if (receive_buffer[0] == ECHO_REQUEST)
+  {
+    std::memcpy(send_buffer, receive_buffer, recv_len);
+    send_buffer[0] = ECHO_RESPONSE;
+    return recv_len;
+  }
+  if (receive_buffer[0] == Service::TesterPresent && recv_len == 2)
+  {
+    send_buffer[0] = Service::TesterPresent + 0x40;
+    send_buffer[1] = receive_buffer[1] & 0x7F;
+    return 2;
+  }
+  send_buffer[0] = Service::NegativeResponse;
+  send_buffer[1] = receive_buffer[0];
+  send_buffer[2] = Nrc::ServiceNotSupported;
+  return 3;
+}
+
+static int run_worker(const char *socket_path, int delay_us)
+{
+  Uds_Ipc_Worker ipc;
+  if (ipc.connect(socket_path) == -1)
+  {
+    return 1;
+  }
+  ipc.set_handler(&answer, &delay_us);
+  worker = &ipc;
+  ipc.run();
+  worker = 0;
+  std::cout << "worker " << getpid() << ": " << ipc.get_served() << " requests answered\n";
+  return 0;
+}
+
+static void usage(const char *name)
+{
+  std::cerr << "usage: " << name << " [--processes n] [--delay us] socket_path\n";
+}
+
+int main(int argc, char *argv[])
+{
+  int processes = 1;
+  int delay_us = 0;
+  const char *socket_path = 0;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--processes" && i + 1 < argc)
+      processes = atoi(argv[++i]);
+    else if (arg == "--delay" && i + 1 < argc)
+      delay_us = atoi(argv[++i]);
+    else if (arg.compare(0, 2, "--") != 0)
+      socket_path = argv[i];
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!socket_path || processes < 1)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+  signal(SIGINT, &stop);
+  signal(SIGTERM, &stop);
+  std::vector<pid_t> children;
+  for (int i = 1; i < processes; i++)
+  {
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      return run_worker(socket_path, delay_us);
+    }
+    if (pid > 0)
+    {
+      children.push_back(pid);
+    }
+  }
+  int result = run_worker(socket_path, delay_us);
+  for (pid_t pid : children)
+  {
+    kill(pid, SIGTERM);
+    waitpid(pid, 0, 0);
+  }
+  return result;
+}
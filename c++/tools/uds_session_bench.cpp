@@ -0,0 +1,234 @@
+/*
+
+UDS session benchmark
+
+runs thousands of multi-step diagnostic flows as coroutines (uds_session.h): each tester flow opens the extended
+session, unlocks the ECU by SecurityAccess, starts a routine with a multi frame request and polls its result until
+it is done. Each ECU is a coroutine as well, which answers the requests in a loop. Testers and ECUs are connected by
+an in-memory bus with simulated time, so the run measures the cost of the sessions themselves.
+
+build & run:
+
+  g++ -std=c++20 -O2 -I.. uds_session_bench.cpp ../uds_session.cpp ../isotp_listener.cpp ../uds_service_registry.cpp ../uds_response_cache.cpp ../isotp_capture.cpp ../isotp_latency.cpp ../uds_ipc.cpp -o uds_session_bench
+  ./uds_session_bench 5000
+
+*/
+
+#include <iostream>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <unordered_map>
+
+#include "isotp_listener.h"
+#include "uds_session.h"
+
+#define TESTER_BASE 0x18DA0000 // tester n sends on TESTER_BASE + n, its ECU answers on ECU_BASE + n
+#define ECU_BASE 0x18DB0000
+#define SECURITY_MASK 0x5A5A5A5A
+
+struct bus_frame
+{
+  int can_id;
+  unsigned char data[8];
+  int len;
+};
+
+// all frames go through one queue, delivered to the listener of their id
+struct memory_bus
+{
+  std::deque<bus_frame> frames;
+  std::unordered_map<int, Isotp_Listener *> listeners;
+  unsigned long delivered = 0;
+};
+
+static int bus_send(void *context, int can_id, unsigned char data[8], int len)
+{
+  bus_frame frame;
+  frame.can_id = can_id;
+  std::memcpy(frame.data, data, 8);
+  frame.len = len;
+  static_cast<memory_bus *>(context)->frames.push_back(frame);
+  return 0;
+}
+
+static int completed = 0;
+static int failed = 0;
+
+static Uds_Task tester(Uds_Session &ecu, int number)
+{
+  const unsigned char extended_session[] = {0x10, 0x03};
+  co_await ecu.send(extended_session);
+  uds_message response = co_await ecu.receive(1000);
+  if (response.timeout || response.data[0] != 0x50)
+  {
+    failed++;
+    co_return;
+  }
+  const unsigned char request_seed[] = {0x27, 0x01};
+  co_await ecu.send(request_seed);
+  response = co_await ecu.receive(1000);
+  if (response.timeout || response.len != 6 || response.data[0] != 0x67)
+  {
+    failed++;
+    co_return;
+  }
+  uint32_t key = (response.data[2] << 24 | response.data[3] << 16 | response.data[4] << 8 | response.data[5]) ^ SECURITY_MASK;
+  const unsigned char send_key[] = {0x27, 0x02, (unsigned char)(key >> 24), (unsigned char)(key >> 16), (unsigned char)(key >> 8), (unsigned char)key};
+  co_await ecu.send(send_key);
+  response = co_await ecu.receive(1000);
+  if (response.timeout || response.data[0] != 0x67)
+  {
+    failed++;
+    co_return;
+  }
+  // start the routine with its parameters, a multi frame request
+  unsigned char start_routine[200] = {0x31, 0x01, 0xFF, 0x00};
+  for (int i = 4; i < (int)sizeof(start_routine); i++)
+  {
+    start_routine[i] = number + i;
+  }
+  co_await ecu.send(start_routine);
+  response = co_await ecu.receive(1000);
+  if (response.timeout || response.data[0] != 0x71)
+  {
+    failed++;
+    co_return;
+  }
+  // poll the result until the routine is done
+  const unsigned char routine_result[] = {0x31, 0x03, 0xFF, 0x00};
+  for (;;)
+  {
+    co_await ecu.sleep(10);
+    co_await ecu.send(routine_result);
+    response = co_await ecu.receive(1000);
+    if (response.timeout || response.len != 5 || response.data[0] != 0x71)
+    {
+      failed++;
+      co_return;
+    }
+    if (response.data[4] == 0)
+    {
+      break;
+    }
+  }
+  completed++;
+}
+
+static Uds_Task ecu(Uds_Session &tester, int number)
+{
+  bool unlocked = false;
+  uint32_t seed = 0;
+  int polls_left = 0;
+  for (;;)
+  {
+    uds_message request = co_await tester.receive();
+    unsigned char response[8] = {(unsigned char)(request.data[0] + 0x40)};
+    int len = 1;
+    if (request.data[0] == 0x10 && request.len == 2)
+    {
+      response[1] = request.data[1];
+      len = 2;
+    }
+    else if (request.data[0] == 0x27 && request.data[1] == 0x01)
+    {
+      seed = 0x1000 + number * 7919;
+      response[1] = 0x01;
+      response[2] = seed >> 24;
+      response[3] = seed >> 16;
+      response[4] = seed >> 8;
+      response[5] = seed;
+      len = 6;
+    }
+    else if (request.data[0] == 0x27 && request.data[1] == 0x02 && request.len == 6)
+    {
+      uint32_t key = request.data[2] << 24 | request.data[3] << 16 | request.data[4] << 8 | request.data[5];
+      unlocked = key == (seed ^ SECURITY_MASK);
+      response[1] = 0x02;
+      len = 2;
+    }
+    else if (request.data[0] == 0x31 && unlocked)
+    {
+      response[1] = request.data[1];
+      response[2] = request.data[2];
+      response[3] = request.data[3];
+      len = 4;
+      if (request.data[1] == 0x01)
+      {
+        polls_left = 1 + number % 5; // the routine runs a while
+      }
+      else
+      {
+        response[4] = polls_left > 0 ? polls_left-- : 0; // 0 = done
+        len = 5;
+      }
+    }
+    else
+    {
+      response[0] = Service::NegativeResponse;
+      response[1] = request.data[0];
+      response[2] = unlocked ? Nrc::ServiceNotSupported : Nrc::ConditionsNotCorrect;
+      len = 3;
+    }
+    co_await tester.send(std::span<const unsigned char>(response, len));
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  int flows = argc > 1 ? atoi(argv[1]) : 2000;
+  memory_bus bus;
+  Uds_Session_Scheduler scheduler(1000);
+  std::vector<std::unique_ptr<Uds_Session>> testers;
+  std::vector<std::unique_ptr<Uds_Session>> ecus;
+  isotp_options options;
+  options.ticks_per_ms = 1000;
+  options.send_frame_ctx = &bus_send;
+  options.send_context = &bus;
+  for (int i = 0; i < flows; i++)
+  {
+    options.source_address = ECU_BASE + i; // the tester listens to the answers of its ECU
+    options.target_address = TESTER_BASE + i;
+    testers.emplace_back(new Uds_Session(scheduler, options));
+    options.source_address = TESTER_BASE + i;
+    options.target_address = ECU_BASE + i;
+    ecus.emplace_back(new Uds_Session(scheduler, options));
+    bus.listeners[ECU_BASE + i] = &testers.back()->listener();
+    bus.listeners[TESTER_BASE + i] = &ecus.back()->listener();
+  }
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < flows; i++)
+  {
+    scheduler.spawn(ecu(*testers[i], i), 0);
+    scheduler.spawn(tester(*ecus[i], i), 0);
+  }
+  uint64_t now = 0;
+  while (completed + failed < flows && now < 60000000)
+  {
+    while (!bus.frames.empty())
+    {
+      bus_frame frame = bus.frames.front();
+      bus.frames.pop_front();
+      bus.delivered++;
+      std::unordered_map<int, Isotp_Listener *>::iterator listener = bus.listeners.find(frame.can_id);
+      if (listener != bus.listeners.end())
+      {
+        listener->second->eval_msg(frame.can_id, frame.data, frame.len, now);
+      }
+    }
+    for (std::unique_ptr<Uds_Session> &session : testers)
+    {
+      session->listener().tick(now);
+    }
+    for (std::unique_ptr<Uds_Session> &session : ecus)
+    {
+      session->listener().tick(now);
+    }
+    scheduler.tick(now);
+    now += 100; // 100us per round
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << flows << " flows: " << completed << " completed, " << failed << " failed, " << bus.delivered << " frames, " << now / 1000
+            << " ms simulated in " << seconds * 1000 << " ms, " << scheduler.running() << " coroutines still waiting\n";
+  return failed ? 1 : 0;
+}
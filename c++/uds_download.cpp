@@ -0,0 +1,411 @@
+/*
+
+download engine with LZSS decompression, see uds_download.h
+
+*/
+
+#include "uds_download.h"
+#include "uds_service_registry.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define LZSS_HASH_BITS 13
+#define LZSS_MAX_CHAIN 64 // candidates compared per position by the compressor
+
+static inline unsigned int lzss_hash(const unsigned char *data)
+{
+  return ((data[0] << 10) ^ (data[1] << 5) ^ data[2]) & ((1 << LZSS_HASH_BITS) - 1);
+}
+
+/*
+compresses data into the LZSS format of the download engine, e.g. for a tester which downloads with the
+compression method UDS_COMPRESSION_LZSS: greedy, the longest match within the window is taken
+
+returns the compressed length
+*/
+int uds_lzss_compress(const unsigned char *data, int len, std::vector<unsigned char> &compressed)
+{
+  compressed.clear();
+  compressed.reserve(len + len / 8 + 1);
+  std::vector<int> head(1 << LZSS_HASH_BITS, -1);
+  std::vector<int> previous(len > 0 ? len : 1); // the earlier position with the same hash
+  size_t flag_pos = 0;
+  int item = 8;
+  int pos = 0;
+  while (pos < len)
+  {
+    if (item == 8)
+    { // 8 items per flag byte
+      flag_pos = compressed.size();
+      compressed.push_back(0);
+      item = 0;
+    }
+    int best_len = 0;
+    int best_distance = 0;
+    if (pos + UDS_LZSS_MIN_MATCH <= len)
+    {
+      int max_len = len - pos < UDS_LZSS_MAX_MATCH ? len - pos : UDS_LZSS_MAX_MATCH;
+      int chain = LZSS_MAX_CHAIN;
+      for (int candidate = head[lzss_hash(data + pos)]; candidate >= 0 && pos - candidate <= UDS_LZSS_WINDOW && chain--;
+           candidate = previous[candidate])
+      {
+        int match_len = 0;
+        while (match_len < max_len && data[candidate + match_len] == data[pos + match_len])
+        {
+          match_len++;
+        }
+        if (match_len > best_len)
+        {
+          best_len = match_len;
+          best_distance = pos - candidate;
+          if (match_len == max_len)
+          {
+            break;
+          }
+        }
+      }
+    }
+    int step = 1;
+    if (best_len >= UDS_LZSS_MIN_MATCH)
+    {
+      compressed.push_back((best_distance - 1) & 0xFF);
+      compressed.push_back(((best_distance - 1) >> 8) << 4 | (best_len - UDS_LZSS_MIN_MATCH));
+      step = best_len;
+    }
+    else
+    {
+      compressed[flag_pos] |= 1 << item;
+      compressed.push_back(data[pos]);
+    }
+    item++;
+    for (int end = pos + step; pos < end; pos++)
+    {
+      if (pos + UDS_LZSS_MIN_MATCH <= len)
+      {
+        unsigned int hash = lzss_hash(data + pos);
+        previous[pos] = head[hash];
+        head[hash] = pos;
+      }
+    }
+  }
+  return compressed.size();
+}
+
+Uds_Download::~Uds_Download()
+{
+  close_image();
+}
+
+void Uds_Download::close_image()
+{
+  if (image_fd != -1)
+  {
+    munmap(memory, size);
+    ::close(image_fd);
+    image_fd = -1;
+    memory = 0;
+  }
+}
+
+/*
+downloads into a file of size bytes, which holds the memory from base_address on. The file is created or extended
+as needed and mapped into memory
+
+returns 0 or -1 on error
+*/
+int Uds_Download::open(const char *path, uint32_t base, uint32_t image_size)
+{
+  close_image();
+  int fd = ::open(path, O_RDWR | O_CREAT, 0644);
+  if (fd == -1)
+  {
+    perror("Error opening download image");
+    return -1;
+  }
+  if (ftruncate(fd, image_size) == -1)
+  {
+    perror("Error sizing download image");
+    ::close(fd);
+    return -1;
+  }
+  void *mapped = mmap(0, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapped == MAP_FAILED)
+  {
+    perror("Error mapping download image");
+    ::close(fd);
+    return -1;
+  }
+  set_memory(static_cast<unsigned char *>(mapped), base, image_size);
+  image_fd = fd;
+  return 0;
+}
+
+// downloads into memory, which holds the addresses from base_address on
+void Uds_Download::set_memory(unsigned char *target, uint32_t base, uint32_t image_size)
+{
+  close_image();
+  memory = target;
+  base_address = base;
+  size = image_size;
+  writer = 0;
+}
+
+/*
+downloads through write(), which gets the address and the decoded data, returns 0 or -1 if the data can't be
+written. The data stay valid until the next UDS_LZSS_WINDOW bytes are decoded
+*/
+void Uds_Download::set_writer(int (*write)(void *context, uint32_t address, const unsigned char *data, int len), void *context, uint32_t base,
+                              uint32_t image_size)
+{
+  close_image();
+  writer = write;
+  writer_context = context;
+  base_address = base;
+  size = image_size;
+}
+
+// lets the engine answer the download services of a registry
+void Uds_Download::register_services(Uds_Service_Registry &registry)
+{
+  registry.register_service(Service::RequestDownload, &request_download, this);
+  registry.register_service(Service::TransferData, &transfer_data, this);
+  registry.register_service(Service::RequestTransferExit, &request_transfer_exit, this);
+}
+
+// hands the filled half of the window to the writer and continues in the other one
+void Uds_Download::flush()
+{
+  if (!filled)
+  {
+    return;
+  }
+  const unsigned char *data = window + half * UDS_LZSS_WINDOW;
+  if (writer)
+  {
+    write_failed |= writer(writer_context, write_address, data, filled) != 0;
+  }
+  else
+  {
+    std::memcpy(memory + (write_address - base_address), data, filled);
+  }
+  write_address += filled;
+  half ^= 1;
+  filled = 0;
+}
+
+inline void Uds_Download::put(unsigned char byte)
+{
+  window[half * UDS_LZSS_WINDOW + filled] = byte;
+  decoded++;
+  remaining--;
+  if (++filled == UDS_LZSS_WINDOW)
+  {
+    flush();
+  }
+}
+
+// decodes the data of a TransferData block, returns 0 or -NRC
+int Uds_Download::decode(const unsigned char *data, int len)
+{
+  if (compression == UDS_COMPRESSION_NONE)
+  {
+    if ((uint32_t)len > remaining)
+    {
+      return -Nrc::TransferDataSuspended;
+    }
+    while (len > 0)
+    {
+      int count = UDS_LZSS_WINDOW - filled < len ? UDS_LZSS_WINDOW - filled : len;
+      std::memcpy(window + half * UDS_LZSS_WINDOW + filled, data, count);
+      data += count;
+      len -= count;
+      decoded += count;
+      remaining -= count;
+      filled += count;
+      if (filled == UDS_LZSS_WINDOW)
+      {
+        flush();
+      }
+    }
+    return 0;
+  }
+  for (int i = 0; i < len; i++)
+  {
+    unsigned char byte = data[i];
+    if (match_half)
+    { // the second byte of a match
+      match_half = false;
+      uint32_t distance = (match_first | (byte >> 4) << 8) + 1;
+      uint32_t match_len = (byte & 0x0F) + UDS_LZSS_MIN_MATCH;
+      if (distance > decoded || match_len > remaining)
+      {
+        return -Nrc::TransferDataSuspended;
+      }
+      for (uint32_t k = 0; k < match_len; k++)
+      {
+        put(window[(half * UDS_LZSS_WINDOW + filled - distance) & (2 * UDS_LZSS_WINDOW - 1)]);
+      }
+      continue;
+    }
+    if (flags <= 1)
+    { // a new flag byte, the bit 8 tells when its 8 items are used up
+      flags = byte | 0x100;
+      continue;
+    }
+    bool literal = flags & 1;
+    flags >>= 1;
+    if (!literal)
+    {
+      match_first = byte;
+      match_half = true;
+      continue;
+    }
+    if (!remaining)
+    {
+      return -Nrc::TransferDataSuspended;
+    }
+    put(byte);
+  }
+  return 0;
+}
+
+/*
+RequestDownload
+
+  34 DATA_FORMAT ADDRESS_AND_LENGTH_FORMAT ADDRESS.. SIZE.. -> 74 20 MAX_BLOCK_LENGTH_HI MAX_BLOCK_LENGTH_LO
+
+DATA_FORMAT: compression method (high nibble), encryption (low nibble, not supported), SIZE is the uncompressed size
+*/
+int Uds_Download::request_download(void *context, const unsigned char *request, int request_len, unsigned char *response, int max_len)
+{
+  Uds_Download *self = static_cast<Uds_Download *>(context);
+  if (request_len < 3)
+  {
+    return -Nrc::IncorrectMessageLength;
+  }
+  int size_len = request[2] >> 4;
+  int address_len = request[2] & 0x0F;
+  if (size_len < 1 || size_len > 4 || address_len < 1 || address_len > 4)
+  {
+    return -Nrc::RequestOutOfRange;
+  }
+  if (request_len != 3 + address_len + size_len)
+  {
+    return -Nrc::IncorrectMessageLength;
+  }
+  int compression = request[1] >> 4;
+  if ((request[1] & 0x0F) || (compression != UDS_COMPRESSION_NONE && compression != UDS_COMPRESSION_LZSS))
+  {
+    return -Nrc::RequestOutOfRange;
+  }
+  if (self->active)
+  {
+    return -Nrc::ConditionsNotCorrect;
+  }
+  if (!self->memory && !self->writer)
+  {
+    return -Nrc::UploadDownloadNotAccepted;
+  }
+  uint32_t address = 0;
+  uint32_t length = 0;
+  for (int i = 0; i < address_len; i++)
+  {
+    address = address << 8 | request[3 + i];
+  }
+  for (int i = 0; i < size_len; i++)
+  {
+    length = length << 8 | request[3 + address_len + i];
+  }
+  if (length == 0 || address < self->base_address || address - self->base_address > self->size || length > self->size - (address - self->base_address))
+  {
+    return -Nrc::RequestOutOfRange;
+  }
+  self->active = true;
+  self->compression = compression;
+  self->write_address = address;
+  self->remaining = length;
+  self->next_counter = 1;
+  self->block_received = false;
+  self->half = 0;
+  self->filled = 0;
+  self->decoded = 0;
+  self->write_failed = false;
+  self->flags = 0;
+  self->match_half = false;
+  response[0] = Service::RequestDownload + 0x40;
+  response[1] = 0x20; // lengthFormatIdentifier: 2 bytes maxNumberOfBlockLength
+  response[2] = self->max_block_length >> 8;
+  response[3] = self->max_block_length & 0xFF;
+  return 4;
+}
+
+// TransferData: 36 COUNTER DATA.. -> 76 COUNTER
+int Uds_Download::transfer_data(void *context, const unsigned char *request, int request_len, unsigned char *response, int max_len)
+{
+  Uds_Download *self = static_cast<Uds_Download *>(context);
+  if (request_len < 2)
+  {
+    return -Nrc::IncorrectMessageLength;
+  }
+  if (!self->active)
+  {
+    return -Nrc::RequestSequenceError;
+  }
+  uint8_t counter = request[1];
+  response[0] = Service::TransferData + 0x40;
+  response[1] = counter;
+  if (self->block_received && counter == (uint8_t)(self->next_counter - 1))
+  { // the tester didn't get our response and repeats the block
+    self->stats.repeated_blocks++;
+    return 2;
+  }
+  if (counter != self->next_counter)
+  {
+    self->stats.sequence_errors++;
+    return -Nrc::WrongBlockSequenceCounter;
+  }
+  int result = self->decode(request + 2, request_len - 2);
+  if (result == 0 && self->write_failed)
+  {
+    result = -Nrc::GeneralProgrammingFailure;
+  }
+  if (result < 0)
+  { // the image can't be completed any more
+    self->active = false;
+    return result;
+  }
+  self->next_counter++;
+  self->block_received = true;
+  self->stats.blocks++;
+  self->stats.transferred_bytes += request_len - 2;
+  return 2;
+}
+
+// RequestTransferExit: 37 -> 77, once all data are received
+int Uds_Download::request_transfer_exit(void *context, const unsigned char *request, int request_len, unsigned char *response, int max_len)
+{
+  Uds_Download *self = static_cast<Uds_Download *>(context);
+  if (!self->active || self->remaining)
+  {
+    return -Nrc::RequestSequenceError;
+  }
+  self->flush();
+  self->active = false;
+  if (self->write_failed)
+  {
+    return -Nrc::GeneralProgrammingFailure;
+  }
+  if (self->image_fd != -1)
+  {
+    msync(self->memory, self->size, MS_ASYNC);
+  }
+  self->stats.downloads++;
+  self->stats.written_bytes += self->decoded;
+  response[0] = Service::RequestTransferExit + 0x40;
+  return 1;
+}
@@ -0,0 +1,101 @@
+#ifndef UDS_DOWNLOAD_H
+#define UDS_DOWNLOAD_H
+
+#include <cstdint>
+#include <vector>
+
+class Uds_Service_Registry;
+
+/*
+download engine for RequestDownload (0x34), TransferData (0x36) and RequestTransferExit (0x37)
+
+the downloaded data are written into a target image: a file mapped into memory by open(), a memory area given by
+set_memory() or any storage behind set_writer() (e.g. a flash driver). The compression method of the
+dataFormatIdentifier (high nibble) selects how the TransferData blocks are decoded:
+
+  0 = not compressed
+  1 = LZSS, the codec below; the tester compresses the image with uds_lzss_compress()
+
+the compressed stream is decoded as it comes in, a match or a flag byte may be split across two blocks. The
+decoded data are collected in two buffers of the LZSS window size: when one is full, it is handed to the writer and
+the decoding goes on in the other one, which leaves the writer the time until that one is full as well, and the
+last window of decoded data, which the matches refer to, stays in memory without reading back from the target.
+
+the block sequence counter starts with 1 and wraps from 0xFF to 0x00; a repeated block (the counter of the last
+block again, e.g. after a lost response) is answered positively without being written again.
+*/
+
+// the LZSS codec: each flag byte (LSB first) tells for the next 8 items, if it is a literal byte (1) or a match (0)
+// of 2 bytes: 12 bit distance - 1, 4 bit length - 3, as OOOOOOOO OOOOLLLL
+#define UDS_LZSS_WINDOW 4096
+#define UDS_LZSS_MIN_MATCH 3
+#define UDS_LZSS_MAX_MATCH 18
+
+// compression methods of the dataFormatIdentifier
+#define UDS_COMPRESSION_NONE 0x0
+#define UDS_COMPRESSION_LZSS 0x1
+
+int uds_lzss_compress(const unsigned char *data, int len, std::vector<unsigned char> &compressed);
+
+struct uds_download_stats
+{
+    unsigned long downloads = 0;       // completed by RequestTransferExit
+    unsigned long blocks = 0;          // TransferData blocks accepted
+    unsigned long repeated_blocks = 0; // answered again without writing
+    unsigned long sequence_errors = 0;
+    unsigned long long transferred_bytes = 0; // block data, compressed as on the bus
+    unsigned long long written_bytes = 0;     // decoded into the image
+};
+
+class Uds_Download
+{
+private:
+    // the target image
+    unsigned char *memory = 0;
+    uint32_t base_address = 0;
+    uint32_t size = 0;
+    int image_fd = -1; // with open()
+    int (*writer)(void *context, uint32_t address, const unsigned char *data, int len) = 0;
+    void *writer_context = 0;
+    int max_block_length = 4095; // incl. SID and block sequence counter
+    // the actual download
+    bool active = false;
+    int compression = UDS_COMPRESSION_NONE;
+    uint32_t write_address = 0; // where the filled half of the window goes
+    uint32_t remaining = 0;     // bytes still to decode
+    uint8_t next_counter = 1;   // expected block sequence counter
+    bool block_received = false;
+    // two halves of UDS_LZSS_WINDOW each: the one filled now, the other one is with the writer
+    unsigned char window[2 * UDS_LZSS_WINDOW];
+    int half = 0;           // the half filled now
+    int filled = 0;         // bytes in it
+    uint32_t decoded = 0;   // bytes decoded so far, the matches can't reach further back
+    bool write_failed = false;
+    // LZSS decoder state between two blocks
+    unsigned int flags = 0; // flag byte, shifted; bit 8 marks the end
+    bool match_half = false;
+    unsigned char match_first = 0;
+    uds_download_stats stats;
+
+public:
+    Uds_Download() {}
+    ~Uds_Download();
+    int open(const char *path, uint32_t base_address, uint32_t size);
+    void set_memory(unsigned char *memory, uint32_t base_address, uint32_t size);
+    void set_writer(int (*write)(void *context, uint32_t address, const unsigned char *data, int len), void *context, uint32_t base_address, uint32_t size);
+    void set_max_block_length(int len) { max_block_length = len; }
+    bool busy() const { return active; }
+    uds_download_stats get_stats() const { return stats; }
+    void register_services(Uds_Service_Registry &registry);
+
+    static int request_download(void *context, const unsigned char *request, int request_len, unsigned char *response, int max_len);
+    static int transfer_data(void *context, const unsigned char *request, int request_len, unsigned char *response, int max_len);
+    static int request_transfer_exit(void *context, const unsigned char *request, int request_len, unsigned char *response, int max_len);
+
+private:
+    void close_image();
+    int decode(const unsigned char *data, int len);
+    void put(unsigned char byte);
+    void flush();
+};
+#endif
@@ -0,0 +1,227 @@
+/*
+
+DTC storage for ReadDTCInformation and ClearDiagnosticInformation, see uds_dtc_store.h
+
+answer formats as described e.g. in https://piembsystech.com/report-dtc-by-status-mask0x02-0x19-service/
+
+*/
+
+#include "uds_dtc_store.h"
+#include "uds_service_registry.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+Uds_Dtc_Store::Uds_Dtc_Store(uint8_t availability_mask) : availability_mask(availability_mask)
+{
+}
+
+// adds a DTC, an already known DTC just gets the new status and group
+void Uds_Dtc_Store::add(uint32_t dtc, uint8_t dtc_status, uint32_t group)
+{
+  dtc &= 0xFFFFFF;
+  std::unordered_map<uint32_t, int>::iterator known = index.find(dtc);
+  if (known != index.end())
+  {
+    status[known->second] = dtc_status;
+    groups[known->second] = group & 0xFFFFFF;
+    return;
+  }
+  index[dtc] = (int)numbers.size();
+  numbers.push_back(dtc);
+  status.push_back(dtc_status);
+  groups.push_back(group & 0xFFFFFF);
+}
+
+// returns false, if the DTC is not known
+bool Uds_Dtc_Store::set_status(uint32_t dtc, uint8_t dtc_status)
+{
+  std::unordered_map<uint32_t, int>::iterator known = index.find(dtc & 0xFFFFFF);
+  if (known == index.end())
+  {
+    return false;
+  }
+  status[known->second] = dtc_status;
+  return true;
+}
+
+// returns the status byte or -1, if the DTC is not known
+int Uds_Dtc_Store::get_status(uint32_t dtc) const
+{
+  std::unordered_map<uint32_t, int>::const_iterator known = index.find(dtc & 0xFFFFFF);
+  return known == index.end() ? -1 : status[known->second];
+}
+
+// number of DTCs with at least one of the status bits of mask set
+int Uds_Dtc_Store::count_by_status_mask(uint8_t mask) const
+{
+  int n = size();
+  int count = 0;
+  int i = 0;
+  if (!mask)
+  {
+    return 0;
+  }
+#ifdef __SSE2__
+  const __m128i mask16 = _mm_set1_epi8((char)mask);
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16)
+  {
+    __m128i status16 = _mm_loadu_si128((const __m128i *)&status[i]);
+    unsigned not_matching = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(status16, mask16), zero));
+    count += 16 - __builtin_popcount(not_matching);
+  }
+#endif
+  for (; i < n; i++)
+  {
+    count += (status[i] & mask) != 0;
+  }
+  return count;
+}
+
+/*
+writes DTC_HI DTC_MID DTC_LO STATUS of each DTC matching the mask into response
+
+returns the number of bytes written or -1, if they don't fit into max_len
+*/
+int Uds_Dtc_Store::report_by_status_mask(uint8_t mask, unsigned char *response, int max_len) const
+{
+  int n = size();
+  int len = 0;
+  int i = 0;
+  if (!mask)
+  {
+    return 0;
+  }
+#ifdef __SSE2__
+  const __m128i mask16 = _mm_set1_epi8((char)mask);
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16)
+  {
+    __m128i status16 = _mm_loadu_si128((const __m128i *)&status[i]);
+    unsigned matching = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(status16, mask16), zero)) & 0xFFFF;
+    while (matching)
+    {
+      int j = i + __builtin_ctz(matching);
+      matching &= matching - 1;
+      if (len + 4 > max_len)
+      {
+        return -1;
+      }
+      response[len] = numbers[j] >> 16;
+      response[len + 1] = numbers[j] >> 8;
+      response[len + 2] = numbers[j];
+      response[len + 3] = status[j];
+      len += 4;
+    }
+  }
+#endif
+  for (; i < n; i++)
+  {
+    if (status[i] & mask)
+    {
+      if (len + 4 > max_len)
+      {
+        return -1;
+      }
+      response[len] = numbers[i] >> 16;
+      response[len + 1] = numbers[i] >> 8;
+      response[len + 2] = numbers[i];
+      response[len + 3] = status[i];
+      len += 4;
+    }
+  }
+  return len;
+}
+
+/*
+resets the status of all DTCs of a group: AllGroups, the group given by add() or a single DTC number
+
+returns the number of cleared DTCs
+*/
+int Uds_Dtc_Store::clear_group(uint32_t group)
+{
+  int n = size();
+  int cleared = 0;
+  group &= 0xFFFFFF;
+  for (int i = 0; i < n; i++)
+  {
+    if (group == AllGroups || groups[i] == group || numbers[i] == group)
+    {
+      status[i] = ClearedStatus;
+      cleared++;
+    }
+  }
+  return cleared;
+}
+
+// lets the store answer the DTC services of a registry
+void Uds_Dtc_Store::register_services(Uds_Service_Registry &registry)
+{
+  registry.register_service(Service::ReadDTC, &read_dtc_information, this);
+  registry.register_sub_function(Service::ReadDTC, 0x01);
+  registry.register_sub_function(Service::ReadDTC, 0x02);
+  registry.register_service(Service::ClearDTCs, &clear_diagnostic_information, this);
+}
+
+/*
+ReadDTCInformation
+
+  19 01 MASK -> 59 01 AVAILABILITY_MASK FORMAT COUNT_HI COUNT_LO
+  19 02 MASK -> 59 02 AVAILABILITY_MASK [DTC_HI DTC_MID DTC_LO STATUS ..]
+*/
+int Uds_Dtc_Store::read_dtc_information(void *context, const unsigned char *request, int request_len, unsigned char *response, int max_len)
+{
+  Uds_Dtc_Store *self = static_cast<Uds_Dtc_Store *>(context);
+  if (request_len < 2)
+  {
+    return -Nrc::IncorrectMessageLength;
+  }
+  unsigned char sub_function = request[1] & 0x7F;
+  if (sub_function != 0x01 && sub_function != 0x02)
+  {
+    return -Nrc::SubFunctionNotSupported;
+  }
+  if (request_len != 3)
+  {
+    return -Nrc::IncorrectMessageLength;
+  }
+  uint8_t mask = request[2] & self->availability_mask;
+  response[0] = Service::ReadDTC + 0x40;
+  response[1] = sub_function;
+  response[2] = self->availability_mask;
+  if (sub_function == 0x01)
+  { // reportNumberOfDTCByStatusMask
+    int count = self->count_by_status_mask(mask);
+    count = count > 0xFFFF ? 0xFFFF : count;
+    response[3] = 0x01; // DTCFormatIdentifier: ISO 14229-1
+    response[4] = count >> 8;
+    response[5] = count & 0xFF;
+    return 6;
+  }
+  // reportDTCByStatusMask
+  int len = self->report_by_status_mask(mask, response + 3, max_len - 3);
+  if (len < 0)
+  {
+    return -Nrc::ResponseTooLong;
+  }
+  return 3 + len;
+}
+
+// ClearDiagnosticInformation: 14 GROUP_HI GROUP_MID GROUP_LO -> 54
+int Uds_Dtc_Store::clear_diagnostic_information(void *context, const unsigned char *request, int request_len, unsigned char *response, int max_len)
+{
+  Uds_Dtc_Store *self = static_cast<Uds_Dtc_Store *>(context);
+  if (request_len < 4)
+  {
+    return -Nrc::IncorrectMessageLength;
+  }
+  uint32_t group = request[1] << 16 | request[2] << 8 | request[3];
+  if (!self->clear_group(group) && group != AllGroups)
+  {
+    return -Nrc::RequestOutOfRange;
+  }
+  response[0] = Service::ClearDTCs + 0x40;
+  return 1;
+}
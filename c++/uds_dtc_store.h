@@ -0,0 +1,45 @@
+#ifndef UDS_DTC_STORE_H
+#define UDS_DTC_STORE_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+class Uds_Service_Registry;
+
+/*
+storage of the DTCs of an ECU, which answers ReadDTCInformation (0x19) and ClearDiagnosticInformation (0x14)
+
+DTC numbers, status bytes and groups are kept in separate contiguous arrays, so the status mask
+filtering of reportNumberOfDTCByStatusMask (0x19 0x01) and reportDTCByStatusMask (0x19 0x02) runs over the
+status bytes only, 16 at a time where SSE2 is available. The answers are written directly into the send buffer
+*/
+class Uds_Dtc_Store
+{
+private:
+    std::vector<uint32_t> numbers;           // 3 byte DTC numbers
+    std::vector<uint8_t> status;             // status byte of each DTC
+    std::vector<uint32_t> groups;            // 3 byte group of each DTC, used by ClearDiagnosticInformation
+    std::unordered_map<uint32_t, int> index; // DTC number -> array position
+    uint8_t availability_mask;
+
+public:
+    static uint32_t const AllGroups = 0xFFFFFF;
+    static uint8_t const ClearedStatus = 0x50; // testNotCompletedSinceLastClear | testNotCompletedThisOperationCycle
+
+    Uds_Dtc_Store(uint8_t availability_mask = 0xFF);
+    void add(uint32_t dtc, uint8_t dtc_status = ClearedStatus, uint32_t group = AllGroups);
+    bool set_status(uint32_t dtc, uint8_t dtc_status);
+    int get_status(uint32_t dtc) const;
+    int size() const { return (int)numbers.size(); }
+    int count_by_status_mask(uint8_t mask) const;
+    int clear_group(uint32_t group);
+    void register_services(Uds_Service_Registry &registry);
+
+    static int read_dtc_information(void *context, const unsigned char *request, int request_len, unsigned char *response, int max_len);
+    static int clear_diagnostic_information(void *context, const unsigned char *request, int request_len, unsigned char *response, int max_len);
+
+private:
+    int report_by_status_mask(uint8_t mask, unsigned char *response, int max_len) const;
+};
+#endif
@@ -0,0 +1,630 @@
+/*
+
+delivery of the complete UDS requests to worker processes by shared memory, see uds_ipc.h
+
+*/
+
+#include "uds_ipc.h"
+#include "uds_service_registry.h"
+
+#include <iostream>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <new>
+
+#include <poll.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define UDS_IPC_MAGIC 0x55495043 // "UIPC"
+#define UDS_IPC_RING_SPINS 100000 // tries of a ring operation, before the ring counts as stuck
+#define UDS_IPC_POP_TRIES 1000    // a worker waits that long for a signalled request, then leaves it to the others
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the rings in shared memory need lock-free atomics");
+
+// one entry of a ring: the slot index, valid when the sequence matches the position (Vyukov's bounded queue)
+struct uds_ipc_cell
+{
+  std::atomic<uint64_t> sequence;
+  uint32_t slot;
+};
+
+struct uds_ipc_ring
+{
+  alignas(64) std::atomic<uint64_t> head; // next position to push
+  alignas(64) std::atomic<uint64_t> tail; // next position to pop
+  alignas(64) uds_ipc_cell cells[UDS_IPC_MAX_SLOTS];
+};
+
+// a message slot: the request of a listener and the response of the worker
+struct uds_ipc_message
+{
+  uint32_t tag;          // written by the server with each request
+  uint32_t response_tag; // the tag of the answered request, written back by the worker
+  int32_t request_len;
+  int32_t response_len;
+  unsigned char request_data[UDS_BUFFER_SIZE];
+  unsigned char response_data[UDS_BUFFER_SIZE];
+};
+
+// the shared memory: the rings and behind them the message slots
+struct uds_ipc_region
+{
+  uint32_t magic;
+  uint32_t slots;
+  uds_ipc_ring free_slots;
+  uds_ipc_ring requests;
+  uds_ipc_ring responses;
+};
+
+static uds_ipc_message &ipc_message(uds_ipc_region *region, uint32_t slot)
+{
+  return reinterpret_cast<uds_ipc_message *>(region + 1)[slot];
+}
+
+static void ring_init(uds_ipc_ring &ring)
+{
+  ring.head.store(0);
+  ring.tail.store(0);
+  for (uint64_t i = 0; i < UDS_IPC_MAX_SLOTS; i++)
+  {
+    ring.cells[i].sequence.store(i);
+  }
+}
+
+/*
+each ring has room for all slots, so it is never full: a cell which is still in use can only be one which a
+consumer is just releasing, so the producer waits for it. But only for a while, as the other process may have died
+in between or written garbage into the ring. Returns false, if the ring is stuck
+*/
+static bool ring_push(uds_ipc_ring &ring, uint32_t mask, uint32_t slot)
+{
+  uint64_t pos = ring.head.load(std::memory_order_relaxed);
+  for (int spins = 0; spins < UDS_IPC_RING_SPINS; spins++)
+  {
+    uds_ipc_cell &cell = ring.cells[pos & mask];
+    int64_t diff = (int64_t)(cell.sequence.load(std::memory_order_acquire) - pos);
+    if (diff == 0)
+    {
+      if (ring.head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+      {
+        cell.slot = slot;
+        cell.sequence.store(pos + 1, std::memory_order_release);
+        return true;
+      }
+    }
+    else
+    {
+      pos = ring.head.load(std::memory_order_relaxed);
+    }
+  }
+  return false;
+}
+
+// returns 1 if a slot was taken, 0 if the ring is empty, -1 if it is stuck
+static int ring_pop(uds_ipc_ring &ring, uint32_t mask, uint32_t &slot)
+{
+  uint64_t pos = ring.tail.load(std::memory_order_relaxed);
+  for (int spins = 0; spins < UDS_IPC_RING_SPINS; spins++)
+  {
+    uds_ipc_cell &cell = ring.cells[pos & mask];
+    int64_t diff = (int64_t)(cell.sequence.load(std::memory_order_acquire) - (pos + 1));
+    if (diff == 0)
+    {
+      if (ring.tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+      {
+        slot = cell.slot;
+        cell.sequence.store(pos + mask + 1, std::memory_order_release);
+        return 1;
+      }
+    }
+    else if (diff < 0)
+    {
+      return 0; // empty
+    }
+    else
+    {
+      pos = ring.tail.load(std::memory_order_relaxed);
+    }
+  }
+  return -1;
+}
+
+static uint64_t steady_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void signal_fd(int fd)
+{
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) < 0)
+  { // the counter can't overflow in practice
+  }
+}
+
+static void drain_fd(int fd)
+{
+  uint64_t count;
+  if (read(fd, &count, sizeof(count)) < 0)
+  { // nothing signalled (EAGAIN)
+  }
+}
+
+Uds_Ipc_Server::~Uds_Ipc_Server()
+{
+  if (region)
+  {
+    munmap(region, region_size);
+  }
+  for (int fd : {memory_fd, request_fd, response_fd, listen_fd, epoll_fd})
+  {
+    if (fd != -1)
+    {
+      close(fd);
+    }
+  }
+  if (!socket_path.empty())
+  {
+    unlink(socket_path.c_str());
+  }
+}
+
+/*
+creates the shared memory with the given number of message slots (rounded up to a power of two) and listens for
+workers on the unix socket path, which gets the access mode (e.g. 0660 for workers of the same group), returns -1
+in case of an error
+*/
+int Uds_Ipc_Server::open(const char *path, int slots, int mode)
+{
+  uint32_t count = 1;
+  while (count < (uint32_t)slots && count < UDS_IPC_MAX_SLOTS)
+  {
+    count <<= 1;
+  }
+  memory_fd = memfd_create("uds_ipc", MFD_CLOEXEC);
+  if (memory_fd == -1)
+  {
+    perror("can't create shared memory");
+    return -1;
+  }
+  region_size = sizeof(uds_ipc_region) + count * sizeof(uds_ipc_message);
+  if (ftruncate(memory_fd, region_size) == -1)
+  {
+    perror("can't size shared memory");
+    return -1;
+  }
+  void *memory = mmap(0, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd, 0);
+  if (memory == MAP_FAILED)
+  {
+    perror("can't map shared memory");
+    return -1;
+  }
+  region = new (memory) uds_ipc_region();
+  region->slots = count;
+  slot_count = count;
+  pending.assign(count, pending_request());
+  ring_init(region->free_slots);
+  ring_init(region->requests);
+  ring_init(region->responses);
+  for (uint32_t slot = 0; slot < count; slot++)
+  {
+    ring_push(region->free_slots, count - 1, slot);
+  }
+  region->magic = UDS_IPC_MAGIC;
+  request_fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+  response_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (request_fd == -1 || response_fd == -1)
+  {
+    perror("can't create eventfd");
+    return -1;
+  }
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (std::strlen(path) >= sizeof(addr.sun_path))
+  {
+    std::cerr << "socket path too long: " << path << std::endl;
+    return -1;
+  }
+  std::strcpy(addr.sun_path, path);
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  unlink(path);
+  // nobody can connect before listen(), so the mode is set in time
+  if (listen_fd == -1 || bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) == -1 || chmod(path, mode) == -1 || listen(listen_fd, 16) == -1)
+  {
+    perror("can't listen for workers");
+    return -1;
+  }
+  socket_path = path;
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1)
+  {
+    perror("can't create epoll");
+    return -1;
+  }
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = response_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, response_fd, &event);
+  event.data.fd = listen_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+  return 0;
+}
+
+// passes the shared memory and the eventfds to the connecting workers
+void Uds_Ipc_Server::accept_workers()
+{
+  while (true)
+  {
+    int fd = accept4(listen_fd, 0, 0, SOCK_CLOEXEC);
+    if (fd == -1)
+    {
+      return;
+    }
+    int fds[3] = {memory_fd, request_fd, response_fd};
+    char control[CMSG_SPACE(sizeof(fds))] = {};
+    char byte = 0;
+    iovec io = {&byte, 1};
+    msghdr message = {};
+    message.msg_iov = &io;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(header), fds, sizeof(fds));
+    if (sendmsg(fd, &message, MSG_NOSIGNAL) == -1)
+    {
+      perror("can't pass the shared memory to a worker");
+    }
+    close(fd);
+  }
+}
+
+// a ring in the shared memory doesn't work any more (a worker died within a ring operation or wrote into it)
+void Uds_Ipc_Server::ring_stuck()
+{
+  if (!corrupted)
+  {
+    std::cerr << "ring of the UDS workers stuck, no more requests are given to them" << std::endl;
+  }
+  corrupted = true;
+  invalid++;
+}
+
+/*
+queues a complete request of the listener for the workers, false if all slots are in use (or the shared memory is
+corrupted). The response comes back by listener->ipc_response() within poll(), a negative response (GeneralReject)
+if no worker answers within the timeout
+*/
+bool Uds_Ipc_Server::submit(Isotp_Listener *listener, uint32_t request, const unsigned char *data, int len)
+{
+  uint32_t slot;
+  int popped = region && !corrupted ? ring_pop(region->free_slots, slot_count - 1, slot) : 0;
+  if (popped <= 0)
+  {
+    if (popped < 0)
+    {
+      ring_stuck();
+    }
+    rejected++;
+    return false;
+  }
+  if (slot >= slot_count || pending[slot].listener)
+  { // the free ring was corrupted by a worker
+    invalid++;
+    return false;
+  }
+  pending_request &entry = pending[slot];
+  entry.listener = listener;
+  entry.request = request;
+  entry.tag = ++next_tag;
+  entry.sid = len > 0 ? data[0] : 0;
+  entry.deadline_ns = steady_ns() + (uint64_t)timeout_ms * 1000000;
+  uds_ipc_message &message = ipc_message(region, slot);
+  message.tag = entry.tag;
+  message.response_tag = 0;
+  message.request_len = len;
+  message.response_len = 0;
+  std::memcpy(message.request_data, data, len);
+  if (!ring_push(region->requests, slot_count - 1, slot))
+  {
+    ring_stuck();
+    entry = pending_request();
+    rejected++;
+    return false;
+  }
+  outstanding++;
+  signal_fd(request_fd);
+  submitted++;
+  return true;
+}
+
+/*
+answers the requests which no worker answered in time (e.g. as it was killed) with a negative response and takes
+their slots back. A worker which answers later finds its slot given to another request, its tag doesn't match
+*/
+void Uds_Ipc_Server::expire_requests()
+{
+  if (!outstanding)
+  {
+    return;
+  }
+  uint64_t now = steady_ns();
+  for (uint32_t slot = 0; slot < slot_count; slot++)
+  {
+    if (!pending[slot].listener || pending[slot].deadline_ns > now)
+    {
+      continue;
+    }
+    pending_request owner = pending[slot];
+    pending[slot] = pending_request();
+    outstanding--;
+    expired++;
+    unsigned char response[3];
+    int len = Uds_Service_Registry::negative_response(owner.sid, Nrc::GeneralReject, response);
+    owner.listener->ipc_response(owner.request, response, len);
+    if (!corrupted && !ring_push(region->free_slots, slot_count - 1, slot))
+    {
+      ring_stuck();
+    }
+  }
+}
+
+/*
+hands the responses of the workers to their listeners, waits up to timeout_ms (-1: until something happens)
+for them. Returns the number of responses, -1 in case of an error
+*/
+int Uds_Ipc_Server::poll(int timeout_ms)
+{
+  epoll_event events[2];
+  int count = epoll_wait(epoll_fd, events, 2, timeout_ms);
+  if (count == -1 && errno != EINTR)
+  {
+    perror("epoll_wait");
+    return -1;
+  }
+  for (int i = 0; i < count; i++)
+  {
+    if (events[i].data.fd == listen_fd)
+    {
+      accept_workers();
+    }
+    else
+    {
+      drain_fd(response_fd);
+    }
+  }
+  int responses = 0;
+  uint32_t slot;
+  int popped;
+  while (!corrupted && (popped = ring_pop(region->responses, slot_count - 1, slot)) != 0)
+  {
+    if (popped < 0)
+    {
+      ring_stuck();
+      break;
+    }
+    if (slot >= slot_count || !pending[slot].listener)
+    { // not a slot of a request, e.g. queued twice
+      invalid++;
+      continue;
+    }
+    uds_ipc_message &message = ipc_message(region, slot);
+    if (*(volatile uint32_t *)&message.response_tag != pending[slot].tag)
+    { // the late answer of an expired request, the slot belongs to another one now
+      invalid++;
+      continue;
+    }
+    pending_request owner = pending[slot];
+    pending[slot] = pending_request();
+    outstanding--;
+    int response_len = *(volatile int32_t *)&message.response_len; // read once, the worker may still write
+    if (response_len < 0 || response_len > UDS_BUFFER_SIZE)
+    { // answered as if the worker had no response
+      invalid++;
+      response_len = 0;
+    }
+    owner.listener->ipc_response(owner.request, message.response_data, response_len);
+    if (!ring_push(region->free_slots, slot_count - 1, slot))
+    {
+      ring_stuck();
+    }
+    completed++;
+    responses++;
+  }
+  expire_requests();
+  return responses;
+}
+
+// for Isotp_Event_Loop::add_fd(), context is the Uds_Ipc_Server
+void Uds_Ipc_Server::poll_handler(void *context)
+{
+  static_cast<Uds_Ipc_Server *>(context)->poll(0);
+}
+
+// for Isotp_Event_Loop::add_tick_handler(), context is the Uds_Ipc_Server: expires the requests of dead workers
+bool Uds_Ipc_Server::tick_handler(void *context, uint64_t time_ticks)
+{
+  Uds_Ipc_Server *server = static_cast<Uds_Ipc_Server *>(context);
+  server->expire_requests();
+  return server->outstanding > 0;
+}
+
+Uds_Ipc_Worker::~Uds_Ipc_Worker()
+{
+  if (region)
+  {
+    munmap(region, region_size);
+  }
+  if (request_fd != -1)
+  {
+    close(request_fd);
+  }
+  if (response_fd != -1)
+  {
+    close(response_fd);
+  }
+}
+
+// maps the shared memory of the server listening on the unix socket path, returns -1 in case of an error
+int Uds_Ipc_Worker::connect(const char *path)
+{
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  std::strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1 || ::connect(fd, (sockaddr *)&addr, sizeof(addr)) == -1)
+  {
+    perror("can't connect to the UDS server");
+    if (fd != -1)
+    {
+      close(fd);
+    }
+    return -1;
+  }
+  int fds[3];
+  char control[CMSG_SPACE(sizeof(fds))] = {};
+  char byte;
+  iovec io = {&byte, 1};
+  msghdr message = {};
+  message.msg_iov = &io;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  ssize_t len = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+  close(fd);
+  cmsghdr *header = CMSG_FIRSTHDR(&message);
+  if (len != 1 || !header || header->cmsg_type != SCM_RIGHTS || header->cmsg_len != CMSG_LEN(sizeof(fds)))
+  {
+    std::cerr << "no shared memory from the UDS server" << std::endl;
+    return -1;
+  }
+  std::memcpy(fds, CMSG_DATA(header), sizeof(fds));
+  request_fd = fds[1];
+  response_fd = fds[2];
+  struct stat info;
+  if (fstat(fds[0], &info) == -1)
+  {
+    perror("can't size shared memory");
+    close(fds[0]);
+    return -1;
+  }
+  region_size = info.st_size;
+  void *memory = mmap(0, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+  close(fds[0]); // the mapping stays
+  if (memory == MAP_FAILED)
+  {
+    perror("can't map shared memory");
+    return -1;
+  }
+  region = static_cast<uds_ipc_region *>(memory);
+  if (region->magic != UDS_IPC_MAGIC || region_size < sizeof(uds_ipc_region) + region->slots * sizeof(uds_ipc_message))
+  {
+    std::cerr << "invalid shared memory of the UDS server" << std::endl;
+    munmap(region, region_size);
+    region = 0;
+    return -1;
+  }
+  return 0;
+}
+
+// the handler of the requests, alternatively the services of a registry (set_services())
+void Uds_Ipc_Worker::set_handler(int (*handler)(void *context, RequestType request_type, uds_buffer receive_buffer, int recv_len, uds_buffer send_buffer), void *context)
+{
+  uds_handler_ctx = handler;
+  handler_context = context;
+}
+
+/*
+answers one request, waits up to timeout_ms (-1: until one comes in) for it. Each count of the request eventfd
+belongs to one queued request, so the requests spread over all waiting workers. The handler works in place on the
+request and the response of the slot. Returns 1 if a request was answered, 0 on timeout, -1 in case of an error
+*/
+int Uds_Ipc_Worker::serve(int timeout_ms)
+{
+  if (!region)
+  {
+    return -1;
+  }
+  uint64_t count;
+  while (read(request_fd, &count, sizeof(count)) != sizeof(count))
+  {
+    if (errno == EINTR)
+    {
+      continue;
+    }
+    if (errno != EAGAIN)
+    {
+      perror("can't read request eventfd");
+      return -1;
+    }
+    pollfd wait = {request_fd, POLLIN, 0};
+    int ready = ::poll(&wait, 1, timeout_ms);
+    if (ready == -1 && errno != EINTR)
+    {
+      perror("poll");
+      return -1;
+    }
+    if (ready == 0)
+    {
+      return 0;
+    }
+  }
+  uint32_t mask = region->slots - 1;
+  uint32_t slot;
+  int popped;
+  for (int tries = 0; (popped = ring_pop(region->requests, mask, slot)) == 0; tries++)
+  { // signalled after it was queued, only a request queued in parallel before it may be unfinished
+    if (tries == UDS_IPC_POP_TRIES)
+    { // its producer doesn't get it done, the count goes back for the next serve()
+      signal_fd(request_fd);
+      return 0;
+    }
+    sched_yield();
+  }
+  if (popped < 0)
+  {
+    std::cerr << "request ring of the UDS server stuck" << std::endl;
+    return -1;
+  }
+  uds_ipc_message &message = ipc_message(region, slot);
+  uint32_t tag = message.tag;
+  int len = 0;
+  if (services)
+  {
+    len = services->dispatch(message.request_data, message.request_len, message.response_data);
+  }
+  else if (uds_handler_ctx)
+  {
+    len = uds_handler_ctx(handler_context, RequestType::Service, message.request_data, message.request_len, message.response_data);
+  }
+  message.response_len = len > UDS_BUFFER_SIZE ? UDS_BUFFER_SIZE : len > 0 ? len : 0;
+  message.response_tag = tag;
+  if (!ring_push(region->responses, mask, slot))
+  {
+    std::cerr << "response ring of the UDS server stuck" << std::endl;
+    return -1;
+  }
+  signal_fd(response_fd);
+  served++;
+  return 1;
+}
+
+// serves the requests until stop() is called, e.g. by a signal handler or another thread
+void Uds_Ipc_Worker::run()
+{
+  running = true;
+  while (running && serve(100) != -1)
+  {
+  }
+}
@@ -0,0 +1,118 @@
+#ifndef UDS_IPC_H
+#define UDS_IPC_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "isotp_listener.h"
+
+/*
+delivery of the complete UDS requests to worker processes by shared memory
+
+the can process opens a Uds_Ipc_Server and assigns it to isotp_options.ipc of its listeners: instead of calling the
+uds_handler, a listener copies each complete request into a free message slot of a shared memory region (memfd)
+and queues the slot for the workers. A worker (Uds_Ipc_Worker, in any number of other processes) takes the slot,
+its handler reads the request and writes the response both in place in the slot, and queues the slot back. The
+server hands the response to its listener, which sends it like the response of its own handler (buffer_tx()).
+
+the slot queues are lock-free multi-producer / multi-consumer rings of slot indices in the same region, so many
+listeners and many workers share them without a lock and a message is never copied between the processes. Each
+queued request is signalled by an eventfd in semaphore mode (each count is taken by one worker), the responses by a
+second eventfd, which the event loop watches: loop.add_fd(ipc.fd(), &Uds_Ipc_Server::poll_handler, &ipc)
+
+workers connect to the unix socket given to open(), which passes them the memfd and both eventfds. The socket is
+only accessible with the given mode (owner only by default), as each connected worker can write into the region.
+The server doesn't trust anything read back from it: which listener and request a slot belongs to is kept in its
+own table, slot numbers, response tags and lengths are checked. Its ring operations give up after a bounded number
+of tries: a ring stuck that way (a worker died within an operation or wrote into the ring) counts as corrupted and
+no further requests are submitted. A request which no worker answers within set_timeout() (e.g. as the worker was
+killed) is answered with GeneralReject and its slot is taken back; for that the event loop calls
+loop.add_tick_handler(&Uds_Ipc_Server::tick_handler, &ipc). A listener must not be destroyed while its request is
+at a worker.
+*/
+
+#define UDS_IPC_MAX_SLOTS 1024 // message slots of a region, a power of two
+
+struct uds_ipc_region;
+
+class Uds_Ipc_Server
+{
+private:
+    struct pending_request
+    {
+        Isotp_Listener *listener = 0; // 0 while the slot is free
+        uint32_t request = 0;
+        uint32_t tag = 0;         // also in the slot, the worker writes it back with the response
+        unsigned char sid = 0;    // for the negative response on timeout
+        uint64_t deadline_ns = 0; // steady clock
+    };
+    uds_ipc_region *region = 0;
+    size_t region_size = 0;
+    uint32_t slot_count = 0;               // the region holds a copy, which the workers could change
+    std::vector<pending_request> pending; // per slot, never in the shared memory
+    int memory_fd = -1;
+    int request_fd = -1;  // eventfd, one count per queued request
+    int response_fd = -1; // eventfd, set when responses are queued
+    int listen_fd = -1;   // unix socket the workers connect to
+    int epoll_fd = -1;
+    std::string socket_path;
+    uint32_t next_tag = 0;
+    uint32_t outstanding = 0; // requests at the workers
+    int timeout_ms = 5000;
+    bool corrupted = false;   // a ring got stuck, nothing is submitted any more
+    unsigned long submitted = 0;
+    unsigned long completed = 0;
+    unsigned long rejected = 0; // no free slot
+    unsigned long invalid = 0;  // responses of slots without a request or with an invalid length, stuck rings
+    unsigned long expired = 0;  // requests answered with GeneralReject, as no worker answered in time
+
+public:
+    Uds_Ipc_Server() {}
+    ~Uds_Ipc_Server();
+    int open(const char *socket_path, int slots = 64, int mode = 0600);
+    int fd() const { return epoll_fd; }
+    bool submit(Isotp_Listener *listener, uint32_t request, const unsigned char *data, int len);
+    int poll(int timeout_ms = 0);
+    void set_timeout(int ms) { timeout_ms = ms > 0 ? ms : 1; }
+    bool is_corrupted() const { return corrupted; }
+    unsigned long get_submitted() const { return submitted; }
+    unsigned long get_completed() const { return completed; }
+    unsigned long get_rejected() const { return rejected; }
+    unsigned long get_invalid() const { return invalid; }
+    unsigned long get_expired() const { return expired; }
+    static void poll_handler(void *context);
+    static bool tick_handler(void *context, uint64_t time_ticks);
+
+private:
+    void accept_workers();
+    void expire_requests();
+    void ring_stuck();
+};
+
+class Uds_Ipc_Worker
+{
+private:
+    uds_ipc_region *region = 0;
+    size_t region_size = 0;
+    int request_fd = -1;
+    int response_fd = -1;
+    int (*uds_handler_ctx)(void *context, RequestType request_type, uds_buffer receive_buffer, int recv_len, uds_buffer send_buffer) = 0;
+    void *handler_context = 0;
+    Uds_Service_Registry *services = 0;
+    std::atomic<bool> running{false};
+    unsigned long served = 0;
+
+public:
+    Uds_Ipc_Worker() {}
+    ~Uds_Ipc_Worker();
+    int connect(const char *socket_path);
+    void set_handler(int (*handler)(void *context, RequestType request_type, uds_buffer receive_buffer, int recv_len, uds_buffer send_buffer), void *context);
+    void set_services(Uds_Service_Registry *registry) { services = registry; }
+    int serve(int timeout_ms = -1);
+    void run();
+    void stop() { running = false; }
+    unsigned long get_served() const { return served; }
+};
+#endif
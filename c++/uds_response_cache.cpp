@@ -0,0 +1,138 @@
+/*
+
+response cache for often repeated requests, see uds_response_cache.h
+
+*/
+
+#include "uds_response_cache.h"
+#include "isotp_listener.h"
+
+#include <cstring>
+
+#define CACHE_KEY_SID 8 // the request follows the two addresses in the key
+
+Uds_Response_Cache::Uds_Response_Cache(size_t max_entries) : max_entries(max_entries)
+{
+  for (int i = 0; i < 256; i++)
+  {
+    ttls[i] = 0;
+  }
+}
+
+// the cache key is the addresses of the listener and the request with the suppress bit cleared, so both variants share one entry
+std::string Uds_Response_Cache::make_key(uint32_t source_address, uint32_t target_address, const unsigned char *request, int request_len)
+{
+  std::string key(CACHE_KEY_SID + request_len, 0);
+  std::memcpy(&key[0], &source_address, 4);
+  std::memcpy(&key[4], &target_address, 4);
+  std::memcpy(&key[CACHE_KEY_SID], request, request_len);
+  if (request_len > 1 && Service::has_sub_function(request[0]))
+  {
+    key[CACHE_KEY_SID + 1] = key[CACHE_KEY_SID + 1] & 0x7F;
+  }
+  return key;
+}
+
+// enables caching for a reading service, ttl_ms = 0 disables it again. Returns false for other services
+bool Uds_Response_Cache::set_ttl(unsigned char sid, uint64_t ttl_ms)
+{
+  if (ttl_ms && !Service::is_read_only(sid))
+  {
+    return false;
+  }
+  ttls[sid] = ttl_ms;
+  if (!ttl_ms)
+  {
+    invalidate_sid(sid);
+  }
+  return true;
+}
+
+bool Uds_Response_Cache::cacheable(unsigned char sid) const
+{
+  return ttls[sid] != 0;
+}
+
+// returns the cached response of a request or an empty pointer, if there's no valid one with the given padding
+std::shared_ptr<const Cached_Response> Uds_Response_Cache::lookup(uint32_t source_address, uint32_t target_address, const unsigned char *request, int request_len, uint64_t now_ms, unsigned char padding_byte)
+{
+  if (request_len < 1 || !ttls[request[0]])
+  {
+    return std::shared_ptr<const Cached_Response>();
+  }
+  std::unordered_map<std::string, std::shared_ptr<const Cached_Response>>::iterator entry = entries.find(make_key(source_address, target_address, request, request_len));
+  if (entry == entries.end() || entry->second->padding_byte != padding_byte)
+  { // an entry of a listener with other padding stays for that one
+    misses++;
+    return std::shared_ptr<const Cached_Response>();
+  }
+  if (entry->second->expires <= now_ms)
+  {
+    entries.erase(entry);
+    misses++;
+    return std::shared_ptr<const Cached_Response>();
+  }
+  hits++;
+  return entry->second;
+}
+
+// segments a response into its can frames (in the same way as the listener does, with its padding_byte) and stores it for the request
+void Uds_Response_Cache::store(uint32_t source_address, uint32_t target_address, const unsigned char *request, int request_len, const unsigned char *response, int response_len, uint64_t now_ms, unsigned char padding_byte)
+{
+  if (request_len < 1 || !ttls[request[0]] || !Service::is_read_only(request[0]) || response_len < 1 || response_len > UDS_BUFFER_SIZE)
+  {
+    return;
+  }
+  if (entries.size() >= max_entries)
+  { // make room by dropping the expired entries, if that's not enough the new one is not stored
+    for (std::unordered_map<std::string, std::shared_ptr<const Cached_Response>>::iterator entry = entries.begin(); entry != entries.end();)
+    {
+      entry = entry->second->expires <= now_ms ? entries.erase(entry) : ++entry;
+    }
+    if (entries.size() >= max_entries)
+    {
+      return;
+    }
+  }
+  std::shared_ptr<Cached_Response> cached = std::make_shared<Cached_Response>();
+  cached->response_len = response_len;
+  cached->positive = response[0] != Service::NegativeResponse;
+  cached->expires = now_ms + ttls[request[0]];
+  cached->padding_byte = padding_byte;
+  cached->frames.resize(isotp_frame_count(response_len) * 8);
+  isotp_segment_message(response, response_len, &cached->frames[0], 8, padding_byte, &cached->first_frame_len);
+  entries[make_key(source_address, target_address, request, request_len)] = cached;
+}
+
+void Uds_Response_Cache::invalidate(uint32_t source_address, uint32_t target_address, const unsigned char *request, int request_len)
+{
+  entries.erase(make_key(source_address, target_address, request, request_len));
+}
+
+// drops all entries of a service, of all listeners
+void Uds_Response_Cache::invalidate_sid(unsigned char sid)
+{
+  for (std::unordered_map<std::string, std::shared_ptr<const Cached_Response>>::iterator entry = entries.begin(); entry != entries.end();)
+  {
+    entry = (unsigned char)entry->first[CACHE_KEY_SID] == sid ? entries.erase(entry) : ++entry;
+  }
+}
+
+// drops the entries which are outdated by a successfully executed service, e.g. DID reads after a DID write (of
+// all listeners, as the cache doesn't know which ECUs share the data)
+void Uds_Response_Cache::invalidate_affected(unsigned char sid)
+{
+  if (sid == Service::WriteDataByIdentifier)
+  {
+    invalidate_sid(Service::ReadDataByIdentifier);
+  }
+  if (sid == Service::ClearDTCs)
+  {
+    invalidate_sid(Service::ReadDTC);
+  }
+}
+
+void Uds_Response_Cache::clear()
+{
+  entries.clear();
+}
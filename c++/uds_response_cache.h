@@ -0,0 +1,59 @@
+#ifndef UDS_RESPONSE_CACHE_H
+#define UDS_RESPONSE_CACHE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// an answer of the cache: the response, already segmented into the can frames to send
+struct Cached_Response
+{
+    int response_len = 0;
+    bool positive = false;                    // false for a negative response (0x7F ..)
+    int first_frame_len = 0;                  // length of frames[0], the single or first frame. All CFs are 8 bytes
+    std::vector<unsigned char> frames;        // all frames of the response, 8 bytes each, padded
+    unsigned char padding_byte = 0;           // the frames are padded with
+    uint64_t expires = 0;                     // ms at which the entry becomes invalid
+    int frame_count() const { return (int)frames.size() / 8; }
+    const unsigned char *frame(int index) const { return &frames[index * 8]; }
+};
+
+/*
+cache of responses to often repeated requests (e.g. ReadDataByIdentifier polls)
+
+the cache is keyed by the addresses of the listener (so the ECUs of several listeners may share one cache) and the
+request bytes, with the suppressPosRspMsgIndicationBit cleared. Only services
+with a ttl set by set_ttl() are stored, which is refused for all but the reading services (Service::is_read_only()):
+a cached answer to e.g. a write or a RoutineControl would skip its execution. The frames are padded with the
+padding_byte of the listener which stored them, a listener with another one doesn't get them. All times are in ms,
+as the listener passes them. Entries are handed out as shared pointers, so an invalidated
+entry stays valid for a transfer which is just sending it
+*/
+class Uds_Response_Cache
+{
+private:
+    std::unordered_map<std::string, std::shared_ptr<const Cached_Response>> entries;
+    uint64_t ttls[256];
+    size_t max_entries;
+    int hits = 0;
+    int misses = 0;
+
+public:
+    Uds_Response_Cache(size_t max_entries = 1024);
+    bool set_ttl(unsigned char sid, uint64_t ttl_ms);
+    bool cacheable(unsigned char sid) const;
+    std::shared_ptr<const Cached_Response> lookup(uint32_t source_address, uint32_t target_address, const unsigned char *request, int request_len, uint64_t now_ms, unsigned char padding_byte);
+    void store(uint32_t source_address, uint32_t target_address, const unsigned char *request, int request_len, const unsigned char *response, int response_len, uint64_t now_ms, unsigned char padding_byte);
+    void invalidate(uint32_t source_address, uint32_t target_address, const unsigned char *request, int request_len);
+    void invalidate_sid(unsigned char sid);
+    void invalidate_affected(unsigned char sid);
+    void clear();
+    int get_hits() const { return hits; }
+    int get_misses() const { return misses; }
+
+private:
+    static std::string make_key(uint32_t source_address, uint32_t target_address, const unsigned char *request, int request_len);
+};
+#endif
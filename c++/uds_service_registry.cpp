@@ -0,0 +1,189 @@
+/*
+
+table driven UDS service dispatch, see uds_service_registry.h
+
+*/
+
+#include "uds_service_registry.h"
+
+#include <algorithm>
+
+static bool did_less(const uds_did_entry &a, const uds_did_entry &b)
+{
+  return a.did < b.did;
+}
+
+Uds_Service_Registry::Uds_Service_Registry()
+{
+  // the DID based services are built in
+  register_service(Service::ReadDataByIdentifier, &read_data_by_identifier, this);
+  register_service(Service::WriteDataByIdentifier, &write_data_by_identifier, this);
+}
+
+// assigns a handler to a SID, overwrites a previous (or built in) one
+void Uds_Service_Registry::register_service(unsigned char sid, uds_service_handler handler, void *context)
+{
+  services[sid].handler = handler;
+  services[sid].context = context;
+}
+
+// restricts a SID to its registered sub functions, all others are answered with SubFunctionNotSupported
+void Uds_Service_Registry::register_sub_function(unsigned char sid, unsigned char sub_function)
+{
+  sub_function &= 0x7F; // the suppressPosRspMsgIndicationBit is not part of the sub function
+  services[sid].check_sub_function = true;
+  services[sid].sub_functions[sub_function >> 5] |= 1u << (sub_function & 0x1F);
+}
+
+void Uds_Service_Registry::unregister_service(unsigned char sid)
+{
+  services[sid] = service_entry();
+}
+
+void Uds_Service_Registry::register_did(uint16_t did, uds_did_read_handler read, uds_did_write_handler write, void *context)
+{
+  uds_did_entry entry = {did, read, write, context};
+  register_dids(&entry, 1);
+}
+
+// merges a DID table into the registry, already known DIDs are replaced
+void Uds_Service_Registry::register_dids(const uds_did_entry *table, int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    std::vector<uds_did_entry>::iterator pos = std::lower_bound(dids.begin(), dids.end(), table[i], did_less);
+    if (pos != dids.end() && pos->did == table[i].did)
+    {
+      *pos = table[i];
+    }
+    else
+    {
+      dids.insert(pos, table[i]);
+    }
+  }
+}
+
+// returns the entry of a DID or 0, if unknown
+const uds_did_entry *Uds_Service_Registry::find_did(uint16_t did) const
+{
+  uds_did_entry key = {did, 0, 0, 0};
+  std::vector<uds_did_entry>::const_iterator pos = std::lower_bound(dids.begin(), dids.end(), key, did_less);
+  if (pos != dids.end() && pos->did == did)
+  {
+    return &*pos;
+  }
+  return 0;
+}
+
+// writes a negative response into response and returns its length
+int Uds_Service_Registry::negative_response(unsigned char sid, unsigned char nrc, unsigned char *response)
+{
+  response[0] = Service::NegativeResponse;
+  response[1] = sid;
+  response[2] = nrc;
+  return 3;
+}
+
+/*
+routes a complete request to its service handler
+
+returns the number of bytes of the answer in response, 0 if no answer shall be sent
+*/
+int Uds_Service_Registry::dispatch(const unsigned char *request, int request_len, unsigned char *response, int max_len)
+{
+  if (request_len < 1)
+  {
+    return 0;
+  }
+  unsigned char sid = request[0];
+  service_entry &service = services[sid];
+  if (!service.handler)
+  {
+    return negative_response(sid, Nrc::ServiceNotSupported, response);
+  }
+  if (service.check_sub_function)
+  {
+    if (request_len < 2)
+    {
+      return negative_response(sid, Nrc::IncorrectMessageLength, response);
+    }
+    unsigned char sub_function = request[1] & 0x7F;
+    if (!(service.sub_functions[sub_function >> 5] & (1u << (sub_function & 0x1F))))
+    {
+      return negative_response(sid, Nrc::SubFunctionNotSupported, response);
+    }
+  }
+  int send_len = service.handler(service.context, request, request_len, response, max_len);
+  if (send_len < 0)
+  {
+    return negative_response(sid, -send_len, response);
+  }
+  return send_len;
+}
+
+/*
+built in ReadDataByIdentifier: 22 DID_HI DID_LO [DID_HI DID_LO ..]
+
+unknown DIDs are skipped, the request is only rejected if none of the DIDs is known
+*/
+int Uds_Service_Registry::read_data_by_identifier(void *context, const unsigned char *request, int request_len, unsigned char *response, int max_len)
+{
+  Uds_Service_Registry *self = static_cast<Uds_Service_Registry *>(context);
+  if (request_len < 3 || (request_len - 1) % 2)
+  {
+    return -Nrc::IncorrectMessageLength;
+  }
+  response[0] = request[0] + 0x40;
+  int send_len = 1;
+  for (int i = 1; i < request_len; i += 2)
+  {
+    uint16_t did = request[i] << 8 | request[i + 1];
+    const uds_did_entry *entry = self->find_did(did);
+    if (!entry || !entry->read)
+    {
+      continue;
+    }
+    if (send_len + 2 > max_len)
+    {
+      return -Nrc::ResponseTooLong;
+    }
+    response[send_len] = request[i];
+    response[send_len + 1] = request[i + 1];
+    int data_len = entry->read(entry->context, did, response + send_len + 2, max_len - send_len - 2);
+    if (data_len < 0)
+    {
+      return data_len;
+    }
+    send_len += 2 + data_len;
+  }
+  if (send_len == 1)
+  {
+    return -Nrc::RequestOutOfRange;
+  }
+  return send_len;
+}
+
+// built in WriteDataByIdentifier: 2E DID_HI DID_LO data..
+int Uds_Service_Registry::write_data_by_identifier(void *context, const unsigned char *request, int request_len, unsigned char *response, int max_len)
+{
+  Uds_Service_Registry *self = static_cast<Uds_Service_Registry *>(context);
+  if (request_len < 4)
+  {
+    return -Nrc::IncorrectMessageLength;
+  }
+  uint16_t did = request[1] << 8 | request[2];
+  const uds_did_entry *entry = self->find_did(did);
+  if (!entry || !entry->write)
+  {
+    return -Nrc::RequestOutOfRange;
+  }
+  int result = entry->write(entry->context, did, request + 3, request_len - 3);
+  if (result < 0)
+  {
+    return result;
+  }
+  response[0] = request[0] + 0x40;
+  response[1] = request[1];
+  response[2] = request[2];
+  return 3;
+}
@@ -0,0 +1,88 @@
+#ifndef UDS_SERVICE_REGISTRY_H
+#define UDS_SERVICE_REGISTRY_H
+
+#include <cstdint>
+#include <vector>
+
+#include "isotp_listener.h"
+
+/*
+handler of a complete UDS service request
+
+returns the number of bytes written into the response (starting with the positive response SID),
+0 if no answer shall be sent or a negative response code as -NRC (e.g. -Nrc::RequestOutOfRange)
+*/
+typedef int (*uds_service_handler)(void *context, const unsigned char *request, int request_len, unsigned char *response, int max_len);
+
+// reads the data of a DID into data, returns the number of bytes or a negative response code as -NRC
+typedef int (*uds_did_read_handler)(void *context, uint16_t did, unsigned char *data, int max_len);
+
+// writes the data of a DID, returns 0 or a negative response code as -NRC
+typedef int (*uds_did_write_handler)(void *context, uint16_t did, const unsigned char *data, int len);
+
+// one entry of a DID table, read or write might be 0 if not supported
+struct uds_did_entry
+{
+    uint16_t did;
+    uds_did_read_handler read;
+    uds_did_write_handler write;
+    void *context;
+};
+
+// compile time check for static DID tables: static_assert(uds_did_table_sorted(my_table), "..");
+template <int N>
+constexpr bool uds_did_table_sorted(const uds_did_entry (&table)[N])
+{
+    for (int i = 1; i < N; i++)
+    {
+        if (table[i - 1].did >= table[i].did)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+table driven UDS service dispatch
+
+the SID of a request selects one of 256 handler slots, ReadDataByIdentifier (0x22) and
+WriteDataByIdentifier (0x2E) are built in and look up their DIDs by binary search in a sorted DID table.
+Unknown services, sub functions and DIDs are answered with the matching negative response.
+
+The registry is assigned to isotp_options.services and then replaces the uds_handler callback
+*/
+class Uds_Service_Registry
+{
+private:
+    struct service_entry
+    {
+        uds_service_handler handler = 0;
+        void *context = 0;
+        bool check_sub_function = false;
+        uint32_t sub_functions[4] = {0, 0, 0, 0}; // bit mask of the supported sub functions (without the suppress bit)
+    };
+    service_entry services[256];
+    std::vector<uds_did_entry> dids; // sorted by did
+
+public:
+    Uds_Service_Registry();
+    void register_service(unsigned char sid, uds_service_handler handler, void *context = 0);
+    void register_sub_function(unsigned char sid, unsigned char sub_function);
+    void unregister_service(unsigned char sid);
+    void register_did(uint16_t did, uds_did_read_handler read, uds_did_write_handler write, void *context = 0);
+    void register_dids(const uds_did_entry *table, int count);
+    template <int N>
+    void register_dids(const uds_did_entry (&table)[N])
+    {
+        register_dids(table, N);
+    }
+    const uds_did_entry *find_did(uint16_t did) const;
+    int dispatch(const unsigned char *request, int request_len, unsigned char *response, int max_len = UDS_BUFFER_SIZE);
+    static int negative_response(unsigned char sid, unsigned char nrc, unsigned char *response);
+
+private:
+    static int read_data_by_identifier(void *context, const unsigned char *request, int request_len, unsigned char *response, int max_len);
+    static int write_data_by_identifier(void *context, const unsigned char *request, int request_len, unsigned char *response, int max_len);
+};
+#endif
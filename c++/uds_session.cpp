@@ -0,0 +1,178 @@
+/*
+
+coroutine API for UDS sessions, see uds_session.h
+
+*/
+
+#include "uds_session.h"
+
+#if defined(__cpp_impl_coroutine)
+
+#include <cstring>
+
+Uds_Session_Scheduler::~Uds_Session_Scheduler()
+{
+  for (void *task : tasks)
+  {
+    std::coroutine_handle<>::from_address(task).destroy();
+  }
+}
+
+// takes over a flow and runs it until its first co_await, time_ticks is the time the flow starts at
+void Uds_Session_Scheduler::spawn(Uds_Task task, uint64_t time_ticks)
+{
+  if (time_ticks > now)
+  { // the timers of earlier flows are not moved back
+    now = time_ticks;
+  }
+  std::coroutine_handle<> handle = task.handle;
+  task.handle = nullptr;
+  tasks.insert(handle.address());
+  resume(handle);
+}
+
+void Uds_Session_Scheduler::resume(std::coroutine_handle<> handle)
+{
+  handle.resume();
+  if (handle.done())
+  {
+    tasks.erase(handle.address());
+    handle.destroy();
+  }
+}
+
+void Uds_Session_Scheduler::add_timer(Uds_Session *session, int timeout_ms)
+{
+  timer entry = {now + (uint64_t)timeout_ms * ticks_per_ms, session, session->wait};
+  timers.push(entry);
+}
+
+// resumes the flows whose message came in, whose transfer is done or whose time is up; true while flows wait for one of these
+bool Uds_Session_Scheduler::tick(uint64_t time_ticks)
+{
+  now = time_ticks;
+  for (size_t i = 0; i < sending.size();)
+  {
+    Uds_Session *session = sending[i];
+    if (session->isotp->busy())
+    {
+      i++;
+      continue;
+    }
+    session->wait_for = Uds_Session::Wait::None;
+    ready.push_back(session);
+    sending[i] = sending.back();
+    sending.pop_back();
+  }
+  while (!timers.empty() && timers.top().deadline <= now)
+  {
+    timer entry = timers.top();
+    timers.pop();
+    Uds_Session *session = entry.session;
+    if (session->wait != entry.wait || session->wait_for == Uds_Session::Wait::None)
+    { // the timer of a wait which is already over
+      continue;
+    }
+    session->timed_out = session->wait_for == Uds_Session::Wait::Receive;
+    session->wait_for = Uds_Session::Wait::None;
+    ready.push_back(session);
+  }
+  // the resumed flows may make other sessions ready, these follow in the next tick()
+  std::vector<Uds_Session *> resuming;
+  resuming.swap(ready);
+  for (Uds_Session *session : resuming)
+  {
+    std::coroutine_handle<> handle = session->waiter;
+    session->waiter = nullptr;
+    resume(handle);
+  }
+  return !timers.empty() || !sending.empty() || !ready.empty();
+}
+
+// for Isotp_Event_Loop::add_tick_handler(), context is the Uds_Session_Scheduler
+bool Uds_Session_Scheduler::tick_handler(void *context, uint64_t time_ticks)
+{
+  return static_cast<Uds_Session_Scheduler *>(context)->tick(time_ticks);
+}
+
+Uds_Session::Uds_Session(Uds_Session_Scheduler &scheduler, isotp_options options) : scheduler(scheduler)
+{
+  options.services = 0;
+  options.uds_handler = 0;
+  options.uds_handler_ctx = &message_handler;
+  options.handler_context = this;
+  isotp.reset(new Isotp_Listener(options));
+}
+
+// the uds_handler of the listener: the message goes into the inbox, the flow gets it with the next tick()
+int Uds_Session::message_handler(void *context, RequestType request_type, uds_buffer receive_buffer, int recv_len, uds_buffer send_buffer)
+{
+  Uds_Session *self = static_cast<Uds_Session *>(context);
+  self->inbox.emplace_back(receive_buffer, receive_buffer + recv_len);
+  if (self->wait_for == Wait::Receive)
+  {
+    self->wait_for = Wait::None;
+    self->scheduler.ready.push_back(self);
+  }
+  return 0; // the flow answers, if at all
+}
+
+void Uds_Session::suspend(Wait what, std::coroutine_handle<> handle)
+{
+  waiter = handle;
+  wait_for = what;
+  wait++;
+  timed_out = false;
+}
+
+Uds_Session::receive_awaiter Uds_Session::receive(int timeout_ms)
+{
+  return receive_awaiter{*this, timeout_ms};
+}
+
+void Uds_Session::receive_awaiter::await_suspend(std::coroutine_handle<> handle)
+{
+  session.suspend(Wait::Receive, handle);
+  if (timeout_ms > 0)
+  {
+    session.scheduler.add_timer(&session, timeout_ms);
+  }
+}
+
+uds_message Uds_Session::receive_awaiter::await_resume()
+{
+  uds_message message;
+  if (session.inbox.empty())
+  {
+    message.timeout = session.timed_out;
+    return message;
+  }
+  session.current.swap(session.inbox.front());
+  session.inbox.pop_front();
+  message.data = session.current.data();
+  message.len = session.current.size();
+  return message;
+}
+
+// sends the message at once, the awaiter waits until the transfer is done
+Uds_Session::send_awaiter Uds_Session::send(std::span<const unsigned char> message)
+{
+  int len = message.size() > UDS_BUFFER_SIZE ? UDS_BUFFER_SIZE : message.size();
+  // send_telegram() only reads the data, it copies them into its own send buffer
+  isotp->send_telegram(const_cast<unsigned char *>(message.data()), len);
+  return send_awaiter{*this};
+}
+
+void Uds_Session::send_awaiter::await_suspend(std::coroutine_handle<> handle)
+{
+  session.suspend(Wait::Send, handle);
+  session.scheduler.sending.push_back(&session);
+}
+
+void Uds_Session::sleep_awaiter::await_suspend(std::coroutine_handle<> handle)
+{
+  session.suspend(Wait::Sleep, handle);
+  session.scheduler.add_timer(&session, ms);
+}
+
+#endif
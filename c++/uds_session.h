@@ -0,0 +1,179 @@
+#ifndef UDS_SESSION_H
+#define UDS_SESSION_H
+
+/*
+coroutine API (C++20) for multi-step diagnostic flows over an Isotp_Listener
+
+a flow is written as one coroutine which awaits the listener instead of a state machine in the uds_handler:
+
+Uds_Task unlock_and_run(Uds_Session &ecu)
+{
+  const unsigned char seed_request[] = {0x27, 0x01};
+  co_await ecu.send(seed_request);
+  uds_message seed = co_await ecu.receive(1000);
+  if (seed.timeout || seed.data[0] != 0x67)
+    co_return;
+  ...
+  co_await ecu.sleep(50);
+}
+scheduler.spawn(unlock_and_run(session), loop.now_ticks());
+
+a Uds_Session owns its listener and takes all complete messages of it (the uds_handler is replaced, nothing is
+answered automatically): receive() waits for the next one, send() sends a message by send_telegram() and waits
+until the transfer is done, sleep() waits for the given time. The same works on both sides, as tester (send a
+request, receive the response) and as ECU (receive a request, send the response).
+
+the waiting coroutines are resumed by the Uds_Session_Scheduler in its tick(), never within eval_msg() or from
+another thread - with the event loop, all sessions run in its thread:
+loop.add_listener(interface, &session.listener());
+loop.add_tick_handler(&Uds_Session_Scheduler::tick_handler, &scheduler);
+spawn() takes the current time in the ticks of the tick handlers, as the flow runs until its first co_await at once
+and its timeouts count from there.
+a suspended flow is just its coroutine frame and a session, so thousands of them are cheap.
+
+needs C++20, e.g. g++ -std=c++20; with an older standard this header declares nothing
+*/
+
+#if defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <queue>
+#include <span>
+#include <unordered_set>
+#include <vector>
+
+#include "isotp_listener.h"
+
+class Uds_Session;
+class Uds_Session_Scheduler;
+
+// a coroutine of a flow, started and destroyed by Uds_Session_Scheduler::spawn()
+class Uds_Task
+{
+public:
+    struct promise_type
+    {
+        Uds_Task get_return_object() { return Uds_Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    explicit Uds_Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    Uds_Task(Uds_Task &&other) : handle(other.handle) { other.handle = nullptr; }
+    Uds_Task(const Uds_Task &) = delete;
+    ~Uds_Task()
+    {
+        if (handle)
+        {
+            handle.destroy();
+        }
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+    friend class Uds_Session_Scheduler;
+};
+
+// a received message, the data stay valid until the next receive() of the session
+struct uds_message
+{
+    const unsigned char *data = 0;
+    int len = 0;
+    bool timeout = false; // nothing received in time, data is 0
+};
+
+class Uds_Session_Scheduler
+{
+private:
+    struct timer
+    {
+        uint64_t deadline;
+        Uds_Session *session;
+        uint64_t wait; // the wait of the session this timer belongs to
+        bool operator>(const timer &other) const { return deadline > other.deadline; }
+    };
+    std::priority_queue<timer, std::vector<timer>, std::greater<timer>> timers;
+    std::vector<Uds_Session *> ready;   // to be resumed in the next tick()
+    std::vector<Uds_Session *> sending; // waiting until their listener isn't busy any more
+    std::unordered_set<void *> tasks;   // the coroutine frames of the running flows
+    int ticks_per_ms;
+    uint64_t now = 0; // of the last tick() or spawn()
+
+public:
+    Uds_Session_Scheduler(int ticks_per_ms = 1000) : ticks_per_ms(ticks_per_ms) {}
+    ~Uds_Session_Scheduler();
+    void spawn(Uds_Task task, uint64_t time_ticks);
+    bool tick(uint64_t time_ticks);
+    int running() const { return tasks.size(); }
+    uint64_t time() const { return now; }
+    static bool tick_handler(void *context, uint64_t time_ticks);
+
+private:
+    void resume(std::coroutine_handle<> handle);
+    void add_timer(Uds_Session *session, int timeout_ms);
+    friend class Uds_Session;
+};
+
+class Uds_Session
+{
+private:
+    Uds_Session_Scheduler &scheduler;
+    std::unique_ptr<Isotp_Listener> isotp;
+    std::deque<std::vector<unsigned char>> inbox; // received, not taken by receive() yet
+    std::vector<unsigned char> current;           // the message returned by the last receive()
+    std::coroutine_handle<> waiter;               // the coroutine waiting in this session
+    enum class Wait
+    {
+        None,
+        Receive,
+        Send,
+        Sleep
+    } wait_for = Wait::None;
+    uint64_t wait = 0;      // counts the waits, to ignore the timers of earlier ones
+    bool timed_out = false;
+
+public:
+    struct receive_awaiter
+    {
+        Uds_Session &session;
+        int timeout_ms;
+        bool await_ready() const { return !session.inbox.empty(); }
+        void await_suspend(std::coroutine_handle<> handle);
+        uds_message await_resume();
+    };
+    struct send_awaiter
+    {
+        Uds_Session &session;
+        bool await_ready() const { return !session.isotp->busy(); }
+        void await_suspend(std::coroutine_handle<> handle);
+        void await_resume() {}
+    };
+    struct sleep_awaiter
+    {
+        Uds_Session &session;
+        int ms;
+        bool await_ready() const { return ms <= 0; }
+        void await_suspend(std::coroutine_handle<> handle);
+        void await_resume() {}
+    };
+
+    Uds_Session(Uds_Session_Scheduler &scheduler, isotp_options options);
+    Isotp_Listener &listener() { return *isotp; }
+    receive_awaiter receive(int timeout_ms = 0); // 0 waits without timeout
+    send_awaiter send(std::span<const unsigned char> message);
+    sleep_awaiter sleep(int ms) { return sleep_awaiter{*this, ms}; }
+    int pending() const { return inbox.size(); }
+
+private:
+    static int message_handler(void *context, RequestType request_type, uds_buffer receive_buffer, int recv_len, uds_buffer send_buffer);
+    void suspend(Wait what, std::coroutine_handle<> handle);
+    friend class Uds_Session_Scheduler;
+};
+
+#endif
+#endif
@@ -0,0 +1,182 @@
+/*
+
+interrupt demo: isotp_push_frame() in the RX interrupt, isotp_process() in the main loop
+
+on the host, SIGALRM plays the CAN RX interrupt: a periodic timer interrupts the main loop at any point, and the
+signal handler acts as the tester on the bus - each interrupt pushes the next frame of its requests (single frame
+requests and multi frame requests, which wait for the flow control of the listener) and of other ECUs into the
+listener. The main loop only calls isotp_process(), so the state machine and the handler never run in the
+interrupt. The handler answers each request with its sequence number and checksum, which the tester checks.
+
+build & run:
+
+  gcc -std=c11 -O2 -Wall isotp_isr_demo.c isotp_listener.c -o isotp_isr_demo
+  ./isotp_isr_demo 2000 > /dev/null
+
+the listener prints its trace on stdout, the result goes to stderr
+
+*/
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+
+#include "isotp_listener.h"
+
+#define ECU_ADDRESS 0x7E1
+#define OTHER_ECU_ADDRESS 0x123
+#define REQUEST_TIMEOUT 1000 // interrupts without a response until a request counts as lost
+
+extern RequestType requestType;
+
+static Isotp_Listener udslisten;
+
+// frames sent by the listener in the main loop, seen by the tester in the interrupt
+static atomic_uint flow_controls;
+static atomic_uint responses;
+static uint8_t response[8];
+
+// the tester, only used inside the interrupt
+static int requests_to_send;
+static int request_nr;
+static int tester_state; // 0 = next request, 1 = wait for the flow control, 2 = wait for the response
+static unsigned int seen_flow_controls;
+static unsigned int seen_responses;
+static uint8_t expected_sum;
+static int waited;
+static volatile sig_atomic_t ok;
+static volatile sig_atomic_t failed;
+static volatile sig_atomic_t lost;
+static volatile sig_atomic_t done;
+
+long long get_millis() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000 + (long long)tv.tv_usec / 1000;
+}
+
+// runs in the main loop, within isotp_process()
+void msg_send(uint32_t can_id, uint8_t *data, size_t len) {
+    if (data[0] == 0x30) {
+        atomic_fetch_add_explicit(&flow_controls, 1, memory_order_release);
+    } else if ((data[0] >> 4) == 0) {
+        memcpy(response, data, len < 8 ? len : 8);
+        atomic_fetch_add_explicit(&responses, 1, memory_order_release);
+    }
+}
+
+// runs in the main loop: answers 0x22 <nr> <data...> with 0x62 <nr> <checksum of the data>
+size_t uds_handler(unsigned char request_type, uint8_t *receive_buffer, size_t receive_len, uint8_t *send_buffer) {
+    uint8_t sum = 0;
+    for (size_t i = 2; i < receive_len; i++) {
+        sum += receive_buffer[i];
+    }
+    send_buffer[0] = receive_buffer[0] + 0x40;
+    send_buffer[1] = receive_buffer[1];
+    send_buffer[2] = sum;
+    return 3;
+}
+
+static void push(uint8_t *frame, int len) {
+    isotp_push_frame(&udslisten, ECU_ADDRESS, frame, len);
+}
+
+// the RX interrupt: one frame of the tester or of another ECU per call
+static void rx_interrupt(int signal) {
+    static uint8_t count;
+    uint8_t frame[8];
+    count++;
+    if (count % 3 == 0) { // traffic of other ECUs, filtered by isotp_push_frame()
+        memset(frame, count, 8);
+        isotp_push_frame(&udslisten, OTHER_ECU_ADDRESS, frame, 8);
+        return;
+    }
+    if (tester_state == 0) {
+        if (request_nr == requests_to_send) {
+            done = 1;
+            return;
+        }
+        request_nr++;
+        seen_responses = atomic_load_explicit(&responses, memory_order_acquire);
+        seen_flow_controls = atomic_load_explicit(&flow_controls, memory_order_acquire);
+        waited = 0;
+        if (request_nr % 2) { // single frame: 22 nr + 3 bytes
+            uint8_t single[8] = {0x05, 0x22, (uint8_t)request_nr, count, 2, 3};
+            expected_sum = count + 5;
+            push(single, 8);
+            tester_state = 2;
+        } else { // first frame of 12 bytes: 22 nr + 10 bytes
+            uint8_t first[8] = {0x10, 12, 0x22, (uint8_t)request_nr, 1, 2, 3, 4};
+            push(first, 8);
+            tester_state = 1;
+        }
+        return;
+    }
+    if (tester_state == 1) {
+        if (atomic_load_explicit(&flow_controls, memory_order_acquire) != seen_flow_controls) {
+            uint8_t consecutive[8] = {0x21, 5, 6, 7, 8, 9, count, 0};
+            expected_sum = 1 + 2 + 3 + 4 + 5 + 6 + 7 + 8 + 9 + count;
+            push(consecutive, 8);
+            tester_state = 2;
+            return;
+        }
+    } else if (atomic_load_explicit(&responses, memory_order_acquire) != seen_responses) {
+        if (response[0] == 3 && response[1] == 0x62 && response[2] == (uint8_t)request_nr && response[3] == expected_sum) {
+            ok++;
+        } else {
+            failed++;
+        }
+        tester_state = 0;
+        return;
+    }
+    if (++waited > REQUEST_TIMEOUT) {
+        lost++;
+        tester_state = 0;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    requests_to_send = argc > 1 ? atoi(argv[1]) : 1000;
+
+    IsoTpOptions options = {
+        .source_address = ECU_ADDRESS,
+        .target_address = ECU_ADDRESS | 8,
+        .bs = 0,
+        .stmin = 0,
+        .wftmax = 0,
+        .frame_timeout = 100,
+        .send_frame = &msg_send,
+        .uds_handler = &uds_handler,
+    };
+    Isotp_Listener_init(&udslisten, &options);
+    atomic_init(&flow_controls, 0);
+    atomic_init(&responses, 0);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &rx_interrupt;
+    sigaction(SIGALRM, &action, NULL);
+    struct itimerval timer = {{0, 50}, {0, 50}}; // every 50us
+    setitimer(ITIMER_REAL, &timer, NULL);
+
+    unsigned long loops = 0;
+    while (!done) {
+        isotp_process(&udslisten, get_millis());
+        loops++;
+        // application work, interrupted at any point
+        for (volatile int i = 0; i < (int)(loops % 200); i++) {
+        }
+    }
+    timer.it_value.tv_usec = 0;
+    timer.it_interval.tv_usec = 0;
+    setitimer(ITIMER_REAL, &timer, NULL);
+
+    fprintf(stderr, "%d requests: %d ok, %d wrong, %d lost, %u frames dropped by a full queue, %lu main loops\n",
+            requests_to_send, (int)ok, (int)failed, (int)lost, atomic_load(&udslisten.rx_dropped), loops);
+    return failed || lost ? 1 : 0;
+}
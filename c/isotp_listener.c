@@ -4,6 +4,8 @@
 
 #include "isotp_listener.h"
 
+_Static_assert((ISOTP_RX_QUEUE_SIZE & (ISOTP_RX_QUEUE_SIZE - 1)) == 0, "ISOTP_RX_QUEUE_SIZE must be a power of two");
+
 RequestType requestType = {
     .Service = 0x00,
     .FlowControl = 0x01
@@ -27,6 +29,18 @@ Service service = {
 };
 
 
+// converts a flow control stmin value into ms: 100us steps are below one tick, reserved values are the longest time
+static int stmin_to_ms(int stmin) {
+    if (stmin >= 0xF1 && stmin <= 0xF9) {
+        return 0;
+    }
+    if (stmin > 127 || stmin < 0) {
+        return 127;
+    }
+    return stmin;
+}
+
+
 // Isotp_Listener constructor
 void Isotp_Listener_init( Isotp_Listener *self,  IsoTpOptions * options) {
     self->options = options;
@@ -47,6 +61,10 @@ void Isotp_Listener_init( Isotp_Listener *self,  IsoTpOptions * options) {
     self->receive_flow_control_block_count = 0;
     self->consecutive_frame_delay = 0;
     self->last_frame_received_tick = 0;
+    self->last_frame_sent_tick = 0;
+    atomic_init(&self->rx_head, 0);
+    atomic_init(&self->rx_tail, 0);
+    atomic_init(&self->rx_dropped, 0);
 }
 
 // transfers data from the send buffer into the can message and set all data accordingly
@@ -85,6 +103,7 @@ void send_cf_telegram(struct Isotp_Listener *self) {
     self->actual_telegram_pos = 1;
     nr_of_bytes += copy_to_telegram_buffer(self);
     if (self->options->send_frame) {
+        self->last_frame_sent_tick = self->this_tick;
         self->options->send_frame(self->options->target_address, self->telegrambuffer, 8);
     }
     self->last_action_tick = self->this_tick;
@@ -122,15 +141,18 @@ void buffer_tx(struct Isotp_Listener *self) {
         self->actual_send_pos = 0;
         int nr_of_bytes = 1 + copy_to_telegram_buffer(self);
         if (self->options->send_frame) {
+            self->last_frame_sent_tick = self->this_tick;
             self->options->send_frame(self->options->target_address, self->telegrambuffer, nr_of_bytes);
         }
     } else { // generate first frame
         self->telegrambuffer[0] = 0x10 | (self->actual_send_buffer_size >> 8);
         self->telegrambuffer[1] = self->actual_send_buffer_size & 0xFF;
+        self->actual_cf_count = 1; // the sequence number continues over all blocks
         self->actual_telegram_pos = 2;
         self->actual_send_pos = 0;
         int nr_of_bytes = 2 + copy_to_telegram_buffer(self);
         if (self->options->send_frame) {
+            self->last_frame_sent_tick = self->this_tick;
             self->options->send_frame(self->options->target_address, self->telegrambuffer, nr_of_bytes);
         }
         self->actual_state = actualState.FlowControl;
@@ -182,6 +204,7 @@ int eval_msg(struct Isotp_Listener *self, uint32_t can_id, uint8_t *data, int nr
             self->telegrambuffer[0] = 0x30;
             self->telegrambuffer[1] = self->options->bs;
             self->telegrambuffer[2] = self->options->stmin;
+            self->last_frame_sent_tick = self->this_tick;
             self->options->send_frame(self->options->target_address, self->telegrambuffer, 3);
         }
         self->receive_flow_control_block_count = self->options->bs;
@@ -192,7 +215,7 @@ int eval_msg(struct Isotp_Listener *self, uint32_t can_id, uint8_t *data, int nr
         return MSG_UDS_OK;
     }
 
-    if (frametype == actualState.FlowControl) {
+    if (frametype == frameType.FlowControl) {
         int flow_status = data[0] & 0x0F;
         printf("Flow Control\n");
         if (flow_status == 1) { // Wait
@@ -211,8 +234,7 @@ int eval_msg(struct Isotp_Listener *self, uint32_t can_id, uint8_t *data, int nr
         if (self->flow_control_block_size == 0) {
             self->flow_control_block_size = -1;
         }
-        self->consecutive_frame_delay = data[2];
-        self->actual_cf_count = 1;
+        self->consecutive_frame_delay = stmin_to_ms(data[2]);
         self->actual_state = actualState.Consecutive;
         return MSG_UDS_OK;
     }
@@ -227,7 +249,7 @@ int eval_msg(struct Isotp_Listener *self, uint32_t can_id, uint8_t *data, int nr
         return MSG_UDS_OK;
     }
 
-    if (frametype == actualState.Consecutive) {
+    if (frametype == frameType.Consecutive) {
         if (self->actual_state == actualState.WaitConsecutive) {
             if (self->receive_cf_count != (data[0] & 0x0F)) {
                 printf("wrong CF sequence number\n");
@@ -235,6 +257,7 @@ int eval_msg(struct Isotp_Listener *self, uint32_t can_id, uint8_t *data, int nr
                     self->telegrambuffer[0] = 0x32;
                     self->telegrambuffer[1] = 0;
                     self->telegrambuffer[2] = 0;
+                    self->last_frame_sent_tick = self->this_tick;
                     self->options->send_frame(self->options->target_address, self->telegrambuffer, 3);
                 }
                 return MSG_UDS_UNEXPECTED_CF;
@@ -255,6 +278,7 @@ int eval_msg(struct Isotp_Listener *self, uint32_t can_id, uint8_t *data, int nr
                             self->telegrambuffer[0] = 0x30;
                             self->telegrambuffer[1] = self->options->bs;
                             self->telegrambuffer[2] = self->options->stmin;
+                            self->last_frame_sent_tick = self->this_tick;
                             self->options->send_frame(self->options->target_address, self->telegrambuffer, 3);
                         }
                         self->receive_flow_control_block_count = self->options->bs;
@@ -274,6 +298,7 @@ int eval_msg(struct Isotp_Listener *self, uint32_t can_id, uint8_t *data, int nr
                 self->telegrambuffer[0] = 0x32;
                 self->telegrambuffer[1] = 0;
                 self->telegrambuffer[2] = 0;
+                self->last_frame_sent_tick = self->this_tick;
                 self->options->send_frame(self->options->target_address, self->telegrambuffer, 3);
             }
             return MSG_UDS_UNEXPECTED_CF;
@@ -287,17 +312,24 @@ int busy(struct Isotp_Listener *self) {
     return self->actual_state != actualState.Sleeping;
 }
 
+// size of the listener, for bindings which allocate it themselves (e.g. Python ctypes)
+size_t isotp_listener_size(void) {
+    return sizeof(Isotp_Listener);
+}
+
 // Tick function
 int tick(struct Isotp_Listener *self, int time_ticks) {
     self->this_tick = time_ticks;
     if (self->actual_state == actualState.Consecutive) {
-        if (self->last_action_tick + self->consecutive_frame_delay < self->this_tick) {
+        if (self->last_action_tick + self->consecutive_frame_delay <= self->this_tick) {
             send_cf_telegram(self);
         }
         return 0; // False
     }
     if (self->actual_state == actualState.FlowControl || self->actual_state == actualState.WaitConsecutive) {
-        if (self->last_frame_received_tick + self->options->frame_timeout < self->this_tick) {
+        // the wait starts with the last frame received or sent, e.g. the last CF of a block before a flow control
+        uint64_t wait_start = self->last_frame_sent_tick > self->last_frame_received_tick ? self->last_frame_sent_tick : self->last_frame_received_tick;
+        if (wait_start + self->options->frame_timeout < self->this_tick) {
             printf("Tick Timeout\n");
             self->actual_state = actualState.Sleeping;
             return 1; // True
@@ -305,4 +337,54 @@ int tick(struct Isotp_Listener *self, int time_ticks) {
         return 0; // False
     }
     return 0; // False
-}
\ No newline at end of file
+}
+
+/*
+ queues a received frame for isotp_process(), safe to be called from the CAN RX interrupt.
+
+ the interrupt is the only writer of the queue, isotp_process() the only reader, so a frame is queued without a
+ lock and without waiting: the frame is copied into the next free slot, then the slot is released to the reader.
+ Frames of other can ids aren't queued. Nothing else of the listener is touched, the state machine, send_frame and
+ the uds_handler run later in isotp_process().
+
+ returns MSG_NO_UDS for the frames of other can ids, MSG_UDS_OK if queued, MSG_UDS_QUEUE_FULL if dropped
+ */
+int isotp_push_frame(struct Isotp_Listener *self, uint32_t can_id, const uint8_t *data, int nr_of_bytes) {
+    if (can_id != self->options->source_address) {
+        return MSG_NO_UDS;
+    }
+    unsigned int head = atomic_load_explicit(&self->rx_head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&self->rx_tail, memory_order_acquire) >= ISOTP_RX_QUEUE_SIZE) {
+        atomic_fetch_add_explicit(&self->rx_dropped, 1, memory_order_relaxed);
+        return MSG_UDS_QUEUE_FULL;
+    }
+    IsoTpFrame *frame = &self->rx_queue[head & (ISOTP_RX_QUEUE_SIZE - 1)];
+    if (nr_of_bytes > 8) {
+        nr_of_bytes = 8;
+    }
+    if (nr_of_bytes < 0) {
+        nr_of_bytes = 0;
+    }
+    frame->can_id = can_id;
+    frame->nr_of_bytes = nr_of_bytes;
+    memcpy(frame->data, data, nr_of_bytes);
+    atomic_store_explicit(&self->rx_head, head + 1, memory_order_release);
+    return MSG_UDS_OK;
+}
+
+/*
+ main loop part of isotp_push_frame(): evaluates the queued frames in their order, then calls tick()
+
+ returns the result of tick()
+ */
+int isotp_process(struct Isotp_Listener *self, int time_ticks) {
+    self->this_tick = time_ticks; // the queued frames are received now
+    unsigned int tail = atomic_load_explicit(&self->rx_tail, memory_order_relaxed);
+    while (tail != atomic_load_explicit(&self->rx_head, memory_order_acquire)) {
+        IsoTpFrame frame = self->rx_queue[tail & (ISOTP_RX_QUEUE_SIZE - 1)];
+        // the slot is free again as soon as the frame is copied
+        atomic_store_explicit(&self->rx_tail, ++tail, memory_order_release);
+        eval_msg(self, frame.can_id, frame.data, frame.nr_of_bytes);
+    }
+    return tick(self, time_ticks);
+}
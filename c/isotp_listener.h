@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
 // DEBUG output - (un)comment as needed
 #define DEBUG(x) \
@@ -57,6 +58,12 @@ typedef struct
 #define MSG_UDS_WRONG_FORMAT -1  // message format out of spec
 #define MSG_UDS_UNEXPECTED_CF -2 // not wating for a CF
 #define MSG_UDS_ERROR -3         // unclear error
+#define MSG_UDS_QUEUE_FULL -4    // isotp_push_frame(): the receive queue is full, the frame is dropped
+
+// frames the receive queue holds between two isotp_process() calls, a power of two
+#ifndef ISOTP_RX_QUEUE_SIZE
+#define ISOTP_RX_QUEUE_SIZE 16
+#endif
 
 
 // structure to initialize the isotp_listener constructor
@@ -78,12 +85,22 @@ struct sIsoTpOptions
 typedef struct sIsoTpOptions IsoTpOptions;
 
 
+// a received frame, as queued by isotp_push_frame()
+typedef struct
+{
+    uint32_t can_id;
+    uint8_t nr_of_bytes;
+    uint8_t data[8];
+} IsoTpFrame;
+
+
 // the Isotp_Listener class
 typedef struct Isotp_Listener
 {
     IsoTpOptions * options;
     uint64_t last_action_tick;
     uint64_t last_frame_received_tick ;
+    uint64_t last_frame_sent_tick;
     uint64_t this_tick ;
     unsigned char actual_state;
     uds_buffer receive_buffer;
@@ -99,6 +116,11 @@ typedef struct Isotp_Listener
     int flow_control_block_size;
     int receive_flow_control_block_count;
     int consecutive_frame_delay;
+    // receive queue: filled by isotp_push_frame() (e.g. in the CAN RX interrupt), emptied by isotp_process()
+    IsoTpFrame rx_queue[ISOTP_RX_QUEUE_SIZE];
+    atomic_uint rx_head; // written by the interrupt only
+    atomic_uint rx_tail; // written by isotp_process() only
+    atomic_uint rx_dropped; // frames lost because the queue was full
 } Isotp_Listener;
 
 
@@ -114,5 +136,8 @@ void buffer_tx(struct Isotp_Listener *self);
 void handle_received_message(struct Isotp_Listener *self, int nr_of_bytes);
 int eval_msg(struct Isotp_Listener *self, uint32_t can_id, uint8_t *data, int nr_of_bytes);
 int busy(struct Isotp_Listener *self);
+size_t isotp_listener_size(void);
+int isotp_push_frame(struct Isotp_Listener *self, uint32_t can_id, const uint8_t *data, int nr_of_bytes);
+int isotp_process(struct Isotp_Listener *self, int time_ticks);
 #endif // ISOTP_LISTENER_H
 // End of c/isotp_listener.h
\ No newline at end of file
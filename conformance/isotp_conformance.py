@@ -0,0 +1,532 @@
+'''
+conformance and throughput harness for the three engines of https://github.com/stko/isotp_listener
+
+replays the scenarios of corpus.json through the C engine (c/isotp_listener.c), the C++ engine (c++/isotp_listener.cpp,
+by isotp_listener_native.py) and the Python engine (isotp_listener.py), all in this process, and compares what each
+engine does: the eval_msg() results, the sent frames, the calls of the uds_handler and the timeouts of tick().
+Each engine is compared with the expected trace of the scenario and with the other engines, afterwards the
+throughput of each engine is measured with the bench scenarios.
+
+build the libraries of the C and the C++ engine first:
+
+  cd c
+  gcc -O2 -shared -fPIC isotp_listener.c -o libisotp_listener.so
+  cd ../c++
+  g++ -std=c++17 -O2 -shared -fPIC isotp_listener.cpp isotp_listener_capi.cpp uds_service_registry.cpp uds_response_cache.cpp isotp_capture.cpp isotp_latency.cpp uds_ipc.cpp -o libisotp_listener.so
+
+and the native replay driver, which times the C and the C++ engine without ctypes in between:
+
+  cd ../conformance
+  gcc -O2 isotp_replay.c -ldl -o isotp_replay
+
+the C library is taken from the environment variable ISOTP_LISTENER_C_LIB if set; an engine whose library can't be
+loaded is skipped
+
+usage: python3 conformance/isotp_conformance.py [-v] [--record] [--repeat N] [--engines c,c++,python] [scenario..]
+
+  -v        shows the complete trace of each engine for a failed scenario
+  --record  writes the trace of the C++ engine as expected trace into corpus.json
+  --repeat  replays of each bench scenario for the throughput (default 200)
+
+a scenario gives the options of the listener (source address 0x7E0, target address 0x7E8 by default), the responses
+of the uds_handler and the steps to replay: at each ms from 0 to "until" the engine is ticked, then the steps of that
+ms are done in their order:
+
+  {"t": 0, "rx": "10 14 22 F1 90 00 01 02"}   a received frame, the length is the number of bytes given
+  {"t": 0, "rx": "...", "id": "0x7E1"}       the same on another can id
+  {"t": 5, "rx_message": "2E F1 90 +40", "gap": 1}
+                                             a whole request by a tester: single frame or first frame, then the
+                                             consecutive frames one each gap ms, as the flow controls of the
+                                             engine allow (block size, wait, overflow)
+  {"t": 5, "send": "22 F1 90"}               send_telegram()
+
+the handler answers each request with the first response whose request prefix matches, else with nothing. In the
+payloads, "+N" fills up to N bytes with a counting pattern. The trace has one line per event, starting with the ms:
+
+  <t> eval <id> <frame> = <result>    the eval_msg() result
+  <t> send <id> <frame>               a frame sent by the engine
+  <t> handler <request>               a call of the uds_handler
+  <t> timeout                         tick() reported a timeout
+'''
+
+import contextlib
+import ctypes
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(HERE)
+sys.path.insert(0, ROOT)
+
+import isotp_listener  # noqa: E402
+
+CORPUS = os.path.join(HERE, "corpus.json")
+REPLAY = os.path.join(HERE, "isotp_replay")
+REFERENCE = "c++"
+
+
+# parses a payload: hex bytes, optionally followed by "+N" to fill up to N bytes with a counting pattern
+def payload(text):
+    data = bytearray()
+    fill = 0
+    for item in text.split():
+        if item.startswith("+"):
+            fill = int(item[1:])
+        else:
+            data += bytes.fromhex(item)
+    while len(data) < fill:
+        data.append(len(data) & 0xFF)
+    return bytes(data)
+
+
+def hexstr(data):
+    return data.hex(" ").upper()
+
+
+# the frames of a message, as the engines segment it (padding 0)
+def segment(message):
+    if len(message) < 8:
+        return [bytes([len(message)]) + message]
+    frames = [bytes([0x10 | len(message) >> 8, len(message) & 0xFF]) + message[:6]]
+    pos = 6
+    sn = 1
+    while pos < len(message):
+        frames.append((bytes([0x20 | sn]) + message[pos:pos + 7]).ljust(8, b"\0"))
+        pos += 7
+        sn = (sn + 1) & 0x0F
+    return frames
+
+
+# silences the debug output of the engines, also the one written by the libraries directly into the file descriptors
+@contextlib.contextmanager
+def silenced():
+    libc = ctypes.CDLL(None)
+    sys.stdout.flush()
+    libc.fflush(None)
+    saved = os.dup(1)
+    devnull = os.open(os.devnull, os.O_WRONLY)
+    os.dup2(devnull, 1)
+    try:
+        with open(os.devnull, "w") as null, contextlib.redirect_stdout(null):
+            yield
+    finally:
+        libc.fflush(None) # the C library buffers its output, it must go to /dev/null as well
+        os.dup2(saved, 1)
+        os.close(devnull)
+        os.close(saved)
+
+
+'''
+the engines, all with the same interface: the constructor takes the scenario options and the callbacks
+send(can_id, frame) and handler(request) -> response, then eval_msg(), tick(), send_telegram() as by the listener
+'''
+
+
+class Python_Engine:
+    name = "python"
+
+    def __init__(self, options, send, handler):
+        opts = isotp_listener.IsoTpOptions()
+        opts.source_address = options["source_address"]
+        opts.target_address = options["target_address"]
+        opts.bs = options["bs"]
+        opts.stmin = options["stmin"]
+        opts.frame_timeout = options["frame_timeout"]
+        opts.send_frame = lambda can_id, data, nr_of_bytes: send(can_id, bytes(data[:nr_of_bytes]))
+        opts.uds_handler = lambda request_type, receive_buffer, recv_len, send_buffer: self.call_handler(handler, receive_buffer, recv_len, send_buffer)
+        self.listener = isotp_listener.Isotp_Listener(opts)
+
+    @staticmethod
+    def call_handler(handler, receive_buffer, recv_len, send_buffer):
+        response = handler(bytes(receive_buffer[:recv_len]))
+        send_buffer[:len(response)] = response
+        return len(response)
+
+    def eval_msg(self, can_id, frame):
+        return self.listener.eval_msg(can_id, bytearray(frame.ljust(8, b"\0")), len(frame))
+
+    def tick(self, t):
+        return self.listener.tick(t)
+
+    def send_telegram(self, data):
+        self.listener.send_telegram(bytearray(data), len(data))
+
+
+class Cpp_Engine(Python_Engine):
+    name = "c++"
+    module = None
+    library = None
+
+    def __init__(self, options, send, handler):
+        Python_Engine.__init__(self, options, send, handler)
+        self.listener = Cpp_Engine.module.Isotp_Listener(self.listener.options)
+
+    @classmethod
+    def load(cls):
+        import isotp_listener_native
+        cls.module = isotp_listener_native
+        cls.library = isotp_listener_native.lib._name
+
+
+class C_Options(ctypes.Structure):
+    SEND_FRAME = ctypes.CFUNCTYPE(None, ctypes.c_uint32, ctypes.POINTER(ctypes.c_uint8), ctypes.c_size_t)
+    UDS_HANDLER = ctypes.CFUNCTYPE(ctypes.c_size_t, ctypes.c_ubyte, ctypes.POINTER(ctypes.c_uint8), ctypes.c_size_t, ctypes.POINTER(ctypes.c_uint8))
+    _fields_ = [
+        ("source_address", ctypes.c_uint32),
+        ("target_address", ctypes.c_uint32),
+        ("bs", ctypes.c_int),
+        ("stmin", ctypes.c_int),
+        ("wftmax", ctypes.c_int),
+        ("frame_timeout", ctypes.c_int),
+        ("send_frame", SEND_FRAME),
+        ("uds_handler", UDS_HANDLER),
+    ]
+
+
+class C_Engine:
+    name = "c"
+    lib = None
+    library = None
+
+    def __init__(self, options, send, handler):
+        # keep references to the callbacks, otherways they're garbage collected while the library still uses them
+        self.send_frame = C_Options.SEND_FRAME(lambda can_id, data, nr_of_bytes: send(can_id, ctypes.string_at(data, nr_of_bytes)))
+        self.uds_handler = C_Options.UDS_HANDLER(lambda request_type, rx_data, rx_size, tx_buffer: self.call_handler(handler, rx_data, rx_size, tx_buffer))
+        self.options = C_Options(options["source_address"], options["target_address"], options["bs"], options["stmin"], 0, options["frame_timeout"],
+                                 self.send_frame, self.uds_handler)
+        self.listener = ctypes.create_string_buffer(C_Engine.lib.isotp_listener_size())
+        C_Engine.lib.Isotp_Listener_init(self.listener, ctypes.byref(self.options))
+
+    @staticmethod
+    def call_handler(handler, rx_data, rx_size, tx_buffer):
+        response = handler(ctypes.string_at(rx_data, rx_size))
+        ctypes.memmove(tx_buffer, response, len(response))
+        return len(response)
+
+    def eval_msg(self, can_id, frame):
+        return C_Engine.lib.eval_msg(self.listener, can_id, frame.ljust(8, b"\0"), len(frame))
+
+    def tick(self, t):
+        return bool(C_Engine.lib.tick(self.listener, t))
+
+    def send_telegram(self, data):
+        C_Engine.lib.send_telegram(self.listener, bytes(data), len(data))
+
+    @classmethod
+    def load(cls):
+        path = os.environ.get("ISOTP_LISTENER_C_LIB", os.path.join(ROOT, "c", "libisotp_listener.so"))
+        lib = ctypes.CDLL(path)
+        lib.isotp_listener_size.restype = ctypes.c_size_t
+        lib.isotp_listener_size.argtypes = []
+        lib.Isotp_Listener_init.argtypes = [ctypes.c_void_p, ctypes.POINTER(C_Options)]
+        lib.eval_msg.argtypes = [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_char_p, ctypes.c_int]
+        lib.tick.argtypes = [ctypes.c_void_p, ctypes.c_int]
+        lib.send_telegram.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_int]
+        cls.lib = lib
+        cls.library = path
+
+
+ENGINES = {"c": C_Engine, "c++": Cpp_Engine, "python": Python_Engine}
+
+
+# loads the libraries of the engines, returns the engines which can be used
+def load_engines(names):
+    engines = []
+    for name in names:
+        engine = ENGINES[name]
+        try:
+            if hasattr(engine, "load"):
+                engine.load()
+            engines.append(engine)
+        except OSError as ex:
+            print(f"{name}: skipped, library not loaded ({ex})")
+    return engines
+
+
+def scenario_options(scenario):
+    options = {"source_address": 0x7E0, "target_address": 0x7E8, "bs": 0, "stmin": 0, "frame_timeout": 100}
+    for key, value in scenario.get("options", {}).items():
+        options[key] = int(value, 0) if isinstance(value, str) else value
+    return options
+
+
+# a tester which sends a request to the engine: first frame, then the consecutive frames as the flow controls allow
+class Tester:
+
+    def __init__(self, step, can_id):
+        self.frames = segment(payload(step["rx_message"]))
+        self.can_id = can_id
+        self.gap = step.get("gap", 1)
+        self.next = step["t"]
+        self.pos = 0
+        self.credit = None # frames allowed until the next flow control, None = no limit
+
+    def due(self, t):
+        return self.pos < len(self.frames) and self.next <= t and self.credit != 0
+
+    def take(self, t):
+        frame = self.frames[self.pos]
+        self.pos += 1
+        self.next = t + self.gap
+        if self.pos == 1 and len(self.frames) > 1:
+            self.credit = 0 # wait for the flow control
+        elif self.credit:
+            self.credit -= 1
+        return frame
+
+    # a flow control of the engine
+    def flow_control(self, t, frame):
+        if self.pos == 0 or self.pos >= len(self.frames):
+            return
+        flow_status = frame[0] & 0x0F
+        if flow_status == 0:
+            self.credit = frame[1] if len(frame) > 1 and frame[1] else None
+            self.next = t + self.gap
+        elif flow_status != 1:
+            self.pos = len(self.frames) # overflow or invalid: the transfer is aborted
+
+
+'''
+replays a scenario through an engine
+
+returns the trace and the number of received and sent frames; the calls of the engine are appended to calls (if
+given) as (method, arguments), to replay them without the scenario for the throughput
+'''
+def replay(engine_class, scenario, trace=True, calls=None):
+    lines = []
+    now = [0]
+    frames = [0]
+    options = scenario_options(scenario)
+    responses = [(payload(request), payload(response)) for request, response in scenario.get("responses", [])]
+    testers = []
+
+    def send(can_id, frame):
+        frames[0] += 1
+        if trace:
+            lines.append(f"{now[0]} send {can_id:X} {hexstr(frame)}")
+        if frame[:1] and frame[0] >> 4 == 3:
+            for tester in testers:
+                if can_id == options["target_address"] and tester.can_id == options["source_address"]:
+                    tester.flow_control(now[0], frame)
+
+    def handler(request):
+        if trace:
+            lines.append(f"{now[0]} handler {hexstr(request)}")
+        for prefix, response in responses:
+            if request.startswith(prefix):
+                return response
+        return b""
+
+    def receive(t, can_id, frame):
+        frames[0] += 1
+        if calls is not None:
+            calls.append(("eval_msg", (can_id, frame)))
+        result = engine.eval_msg(can_id, frame)
+        if trace:
+            lines.append(f"{t} eval {can_id:X} {hexstr(frame)} = {result}")
+
+    steps = sorted(scenario["steps"], key=lambda step: step["t"])
+    engine = engine_class(options, send, handler)
+    until = scenario.get("until", steps[-1]["t"] + 10 if steps else 10)
+    pos = 0
+    for t in range(until + 1):
+        now[0] = t
+        if calls is not None:
+            calls.append(("tick", (t,)))
+        if engine.tick(t) and trace:
+            lines.append(f"{t} timeout")
+        while pos < len(steps) and steps[pos]["t"] <= t:
+            step = steps[pos]
+            pos += 1
+            can_id = int(step["id"], 0) if "id" in step else options["source_address"]
+            if "rx" in step:
+                receive(t, can_id, bytes.fromhex(step["rx"]))
+            elif "rx_message" in step:
+                testers.append(Tester(step, can_id))
+            elif "send" in step:
+                if calls is not None:
+                    calls.append(("send_telegram", (payload(step["send"]),)))
+                engine.send_telegram(payload(step["send"]))
+        for tester in testers:
+            while tester.due(t):
+                receive(t, tester.can_id, tester.take(t))
+    return lines, frames[0]
+
+
+# the first line where two traces differ, as (line number, line of a, line of b)
+def first_difference(a, b):
+    for i in range(max(len(a), len(b))):
+        line_a = a[i] if i < len(a) else "(end)"
+        line_b = b[i] if i < len(b) else "(end)"
+        if line_a != line_b:
+            return i + 1, line_a, line_b
+    return None
+
+
+def check(engines, scenarios, verbose):
+    failed = 0
+    for scenario in scenarios:
+        traces = {}
+        with silenced():
+            for engine in engines:
+                traces[engine.name] = replay(engine, scenario)[0]
+        expected = scenario.get("expect")
+        problems = []
+        for engine in engines:
+            trace = traces[engine.name]
+            if expected is not None:
+                difference = first_difference(expected, trace)
+                if difference:
+                    problems.append(f"  {engine.name}: line {difference[0]}: expected '{difference[1]}', got '{difference[2]}'")
+                continue
+            for other in engines: # no expected trace yet, the engines must agree with each other
+                if other.name >= engine.name:
+                    continue
+                difference = first_difference(traces[other.name], trace)
+                if difference:
+                    problems.append(f"  {engine.name}: line {difference[0]}: {other.name} '{difference[1]}', {engine.name} '{difference[2]}'")
+        if not problems:
+            print(f"ok    {scenario['name']}")
+            continue
+        failed += 1
+        print(f"FAIL  {scenario['name']}")
+        print("\n".join(problems))
+        if verbose:
+            for engine in engines:
+                print(f"  --- {engine.name}")
+                print("\n".join("  " + line for line in traces[engine.name]))
+    return failed
+
+
+# writes the recorded calls of a scenario in the format of isotp_replay.c
+def write_calls(file, scenario, calls):
+    options = scenario_options(scenario)
+    file.write("options %d %d %d %d %d\n" % tuple(options[key] for key in ("source_address", "target_address", "bs", "stmin", "frame_timeout")))
+    for request, response in scenario.get("responses", []):
+        file.write(f"response {payload(request).hex()} {payload(response).hex()}\n")
+    for method, arguments in calls:
+        if method == "tick":
+            file.write(f"tick {arguments[0]}\n")
+        elif method == "eval_msg":
+            file.write(f"eval {arguments[0]} {arguments[1].hex()}\n")
+        else:
+            file.write(f"send {arguments[0].hex()}\n")
+    file.flush()
+
+
+# the seconds of the replays of the calls file by isotp_replay, None if it's not built or fails
+def replay_natively(engine_class, calls_file, repeat):
+    if not os.access(REPLAY, os.X_OK):
+        return None
+    result = subprocess.run([REPLAY, engine_class.name, engine_class.library, calls_file, str(repeat)], capture_output=True, text=True)
+    if result.returncode:
+        print(f"  {engine_class.name:8} isotp_replay failed: {result.stderr.strip()}")
+        return None
+    return float(result.stdout)
+
+
+'''
+measures the throughput of the engines: the calls of a scenario are recorded once and then replayed directly, so
+mostly the engine is measured and not the scenario. The C and the C++ engine are timed natively by isotp_replay,
+without Python, and by ctypes as the harness calls them; the difference is the cost of the binding
+'''
+def bench(engines, scenarios, repeat):
+    if any(engine.library for engine in engines if hasattr(engine, "library")) and not os.access(REPLAY, os.X_OK):
+        print(f"native timing skipped, build {os.path.relpath(REPLAY)} first (see the top of this file)")
+    for scenario in scenarios:
+        calls = []
+        with silenced():
+            nr_of_frames = replay(engines[0], scenario, False, calls)[1]
+        responses = [(payload(request), payload(response)) for request, response in scenario.get("responses", [])]
+
+        def handler(request):
+            for prefix, response in responses:
+                if request.startswith(prefix):
+                    return response
+            return b""
+
+        print(f"{scenario['name']}: {repeat} replays of {len(calls)} calls, {nr_of_frames} frames each")
+        calls_file = tempfile.NamedTemporaryFile("w", suffix=".calls")
+        write_calls(calls_file, scenario, calls)
+        for engine_class in engines:
+            native_seconds = replay_natively(engine_class, calls_file.name, repeat) if getattr(engine_class, "library", None) else None
+            if native_seconds:
+                frames_per_second = nr_of_frames * repeat / native_seconds
+                print(f"  {engine_class.name:8} {'native':8} {frames_per_second:12.0f} frames/s {1e6 / frames_per_second:8.2f} us/frame")
+            seconds = 0
+            with silenced():
+                for i in range(repeat):
+                    engine = engine_class(scenario_options(scenario), lambda can_id, frame: None, handler)
+                    bound = [(getattr(engine, method), arguments) for method, arguments in calls]
+                    start = time.perf_counter()
+                    for method, arguments in bound:
+                        method(*arguments)
+                    seconds += time.perf_counter() - start
+            frames_per_second = nr_of_frames * repeat / seconds
+            via = "ctypes" if getattr(engine_class, "library", None) else ""
+            print(f"  {engine_class.name:8} {via:8} {frames_per_second:12.0f} frames/s {1e6 / frames_per_second:8.2f} us/frame")
+            if native_seconds:
+                overhead = (seconds - native_seconds) / (nr_of_frames * repeat)
+                print(f"  {engine_class.name:8} {'binding':8} {'overhead':>12} {1e6 * overhead:17.2f} us/frame")
+        calls_file.close()
+
+
+def record(scenarios):
+    with silenced():
+        for scenario in scenarios:
+            scenario["expect"] = replay(ENGINES[REFERENCE], scenario)[0]
+
+
+# writes the corpus with one line per step, response and trace line, to keep it readable and diffable
+def write_corpus(corpus, file):
+    file.write('{\n  "description": %s,\n  "scenarios": [\n' % json.dumps(corpus["description"]))
+    for n, scenario in enumerate(corpus["scenarios"]):
+        items = []
+        for key, value in scenario.items():
+            if isinstance(value, list):
+                lines = ",\n".join("        " + json.dumps(item) for item in value)
+                items.append(f'      "{key}": [\n{lines}\n      ]')
+            else:
+                items.append(f'      "{key}": {json.dumps(value)}')
+        file.write("    {\n" + ",\n".join(items) + "\n    }" + ("," if n + 1 < len(corpus["scenarios"]) else "") + "\n")
+    file.write("  ]\n}\n")
+
+
+def main(argv):
+    verbose = "-v" in argv
+    names = list(ENGINES)
+    repeat = 200
+    selected = []
+    args = iter(argv)
+    for arg in args:
+        if arg == "--engines":
+            names = next(args).split(",")
+        elif arg == "--repeat":
+            repeat = int(next(args))
+        elif not arg.startswith("-"):
+            selected.append(arg)
+    with open(CORPUS) as file:
+        corpus = json.load(file)
+    if "--record" in argv:
+        engines = load_engines([REFERENCE])
+        if not engines:
+            return 1
+        record([scenario for scenario in corpus["scenarios"] if not selected or scenario["name"] in selected])
+        with open(CORPUS, "w") as file:
+            write_corpus(corpus, file)
+        print(f"expected traces recorded by the {REFERENCE} engine")
+        return 0
+    engines = load_engines(names)
+    scenarios = [scenario for scenario in corpus["scenarios"] if not selected or scenario["name"] in selected]
+    failed = check(engines, scenarios, verbose)
+    print(f"{len(scenarios) - failed} of {len(scenarios)} scenarios conform ({', '.join(engine.name for engine in engines)})")
+    bench(engines, [scenario for scenario in scenarios if scenario.get("bench")], repeat)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,281 @@
+/*
+
+native replay driver of the conformance harness
+
+replays the calls of a bench scenario, as recorded by isotp_conformance.py, through the C or the C++ engine
+without Python in between, so the throughput of the engine itself is measured. The library is loaded by
+dlopen(), the same one the harness uses by ctypes.
+
+build:
+
+  gcc -O2 isotp_replay.c -ldl -o isotp_replay
+
+usage: isotp_replay c|c++ <library> <calls file> <repeat>
+
+the calls file has one call per line, hex payloads without spaces:
+
+  options <source address> <target address> <bs> <stmin> <frame timeout>
+  response <request prefix> <response>       answer of the uds_handler
+  tick <t>
+  eval <can id> <frame>
+  send <data>                                send_telegram()
+
+writes the seconds of all replays to stdout; the output of the engine itself is discarded
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dlfcn.h>
+
+#include "../c/isotp_listener.h"
+#include "../c++/isotp_listener_capi.h"
+
+#define MAX_RESPONSES 64
+#define MAX_FRAMES_PER_TAKE 256
+
+enum call_type { CALL_TICK, CALL_EVAL, CALL_SEND };
+
+struct call
+{
+    int type;
+    uint32_t value; // the time of a tick, the can id of a frame
+    int len;
+    uint8_t *data;
+};
+
+struct response
+{
+    int request_len;
+    uint8_t *request;
+    int response_len;
+    uint8_t *response;
+};
+
+static struct call *calls;
+static int nr_of_calls;
+static struct response responses[MAX_RESPONSES];
+static int nr_of_responses;
+static int options_values[5] = {0x7E0, 0x7E8, 0, 0, 100};
+
+// the C engine
+static size_t (*c_size)(void);
+static void (*c_init)(struct Isotp_Listener *self, IsoTpOptions *options);
+static int (*c_tick)(struct Isotp_Listener *self, int time_ticks);
+static int (*c_eval_msg)(struct Isotp_Listener *self, uint32_t can_id, uint8_t *data, int nr_of_bytes);
+static void (*c_send_telegram)(struct Isotp_Listener *self, uint8_t *data, int nr_of_bytes);
+
+// the C++ engine
+static isotp_handle *(*cpp_create)(int source_address, int target_address, int bs, int stmin, int frame_timeout, isotp_c_uds_handler uds_handler, void *user);
+static void (*cpp_destroy)(isotp_handle *handle);
+static int (*cpp_tick)(isotp_handle *handle, uint64_t time_ticks);
+static int (*cpp_eval_msg)(isotp_handle *handle, int can_id, const unsigned char *data, int len);
+static void (*cpp_send_telegram)(isotp_handle *handle, const unsigned char *data, int nr_of_bytes);
+static const int *(*cpp_pending_frames_ptr)(isotp_handle *handle);
+static int (*cpp_take_frames)(isotp_handle *handle, int *can_ids, unsigned char *data, int *lens, int max_frames);
+
+// converts a hex string into a new buffer, returns its length
+static int parse_hex(const char *text, uint8_t **data) {
+    int len = strlen(text) / 2;
+    *data = malloc(len ? len : 1);
+    for (int i = 0; i < len; i++) {
+        sscanf(text + 2 * i, "%2hhx", &(*data)[i]);
+    }
+    return len;
+}
+
+static int read_calls(const char *file_name) {
+    FILE *file = fopen(file_name, "r");
+    char word[16];
+    char text[2 * UDS_BUFFER_SIZE + 1];
+    char text2[2 * UDS_BUFFER_SIZE + 1];
+    int size = 1024;
+
+    if (!file) {
+        perror(file_name);
+        return -1;
+    }
+    calls = malloc(size * sizeof(struct call));
+    while (fscanf(file, "%15s", word) == 1) {
+        struct call call = {0, 0, 0, NULL};
+        if (!strcmp(word, "options")) {
+            if (fscanf(file, "%i %i %i %i %i", &options_values[0], &options_values[1], &options_values[2], &options_values[3], &options_values[4]) != 5) {
+                break;
+            }
+            continue;
+        }
+        if (!strcmp(word, "response")) {
+            if (nr_of_responses == MAX_RESPONSES || fscanf(file, "%8190s %8190s", text, text2) != 2) {
+                break;
+            }
+            responses[nr_of_responses].request_len = parse_hex(text, &responses[nr_of_responses].request);
+            responses[nr_of_responses].response_len = parse_hex(text2, &responses[nr_of_responses].response);
+            nr_of_responses++;
+            continue;
+        }
+        if (!strcmp(word, "tick") && fscanf(file, "%u", &call.value) == 1) {
+            call.type = CALL_TICK;
+        } else if (!strcmp(word, "eval") && fscanf(file, "%i %8190s", (int *)&call.value, text) == 2) {
+            call.type = CALL_EVAL;
+            call.len = parse_hex(text, &call.data);
+            call.data = realloc(call.data, 8); // eval_msg() always gets 8 bytes, as by the harness
+            memset(call.data + call.len, 0, 8 - call.len);
+        } else if (!strcmp(word, "send") && fscanf(file, "%8190s", text) == 1) {
+            call.type = CALL_SEND;
+            call.len = parse_hex(text, &call.data);
+        } else {
+            break;
+        }
+        if (nr_of_calls == size) {
+            size *= 2;
+            calls = realloc(calls, size * sizeof(struct call));
+        }
+        calls[nr_of_calls++] = call;
+    }
+    if (!feof(file)) {
+        fprintf(stderr, "%s: invalid line after %d calls\n", file_name, nr_of_calls);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    return 0;
+}
+
+// answers a request with the first response whose request prefix matches, else with nothing
+static int find_response(const uint8_t *request, size_t request_len, uint8_t *send_buffer) {
+    for (int i = 0; i < nr_of_responses; i++) {
+        if (responses[i].request_len <= request_len && !memcmp(request, responses[i].request, responses[i].request_len)) {
+            memcpy(send_buffer, responses[i].response, responses[i].response_len);
+            return responses[i].response_len;
+        }
+    }
+    return 0;
+}
+
+static void c_send_frame(uint32_t can_id, uint8_t *data, size_t nr_of_bytes) {
+}
+
+static size_t c_uds_handler(unsigned char type, uint8_t *rx_data, size_t rx_size, uint8_t *tx_buffer) {
+    return find_response(rx_data, rx_size, tx_buffer);
+}
+
+static int cpp_uds_handler(void *user, int request_type, unsigned char *receive_buffer, int recv_len, unsigned char *send_buffer) {
+    return find_response(receive_buffer, recv_len, send_buffer);
+}
+
+static double seconds_since(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static double replay_c(void) {
+    IsoTpOptions options = {options_values[0], options_values[1], options_values[2], options_values[3], 0, options_values[4], c_send_frame, c_uds_handler};
+    struct Isotp_Listener *listener = malloc(c_size());
+    struct timespec start;
+    double seconds;
+
+    c_init(listener, &options);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < nr_of_calls; i++) {
+        if (calls[i].type == CALL_TICK) {
+            c_tick(listener, calls[i].value);
+        } else if (calls[i].type == CALL_EVAL) {
+            c_eval_msg(listener, calls[i].value, calls[i].data, calls[i].len);
+        } else {
+            c_send_telegram(listener, calls[i].data, calls[i].len);
+        }
+    }
+    seconds = seconds_since(&start);
+    free(listener);
+    return seconds;
+}
+
+// the sent frames are drained after each call, as isotp_listener_native.py does
+static double replay_cpp(void) {
+    isotp_handle *handle = cpp_create(options_values[0], options_values[1], options_values[2], options_values[3], options_values[4], cpp_uds_handler, NULL);
+    const int *pending_frames = cpp_pending_frames_ptr(handle);
+    static int ids[MAX_FRAMES_PER_TAKE];
+    static unsigned char data[8 * MAX_FRAMES_PER_TAKE];
+    static int lens[MAX_FRAMES_PER_TAKE];
+    struct timespec start;
+    double seconds;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < nr_of_calls; i++) {
+        if (calls[i].type == CALL_TICK) {
+            cpp_tick(handle, calls[i].value);
+        } else if (calls[i].type == CALL_EVAL) {
+            cpp_eval_msg(handle, calls[i].value, calls[i].data, calls[i].len);
+        } else {
+            cpp_send_telegram(handle, calls[i].data, calls[i].len);
+        }
+        while (*pending_frames) {
+            cpp_take_frames(handle, ids, data, lens, MAX_FRAMES_PER_TAKE);
+        }
+    }
+    seconds = seconds_since(&start);
+    cpp_destroy(handle);
+    return seconds;
+}
+
+int main(int argc, char *argv[]) {
+    void *lib;
+    int cpp;
+    int repeat;
+    int out;
+    double seconds = 0;
+
+    if (argc != 5 || (strcmp(argv[1], "c") && strcmp(argv[1], "c++"))) {
+        fprintf(stderr, "usage: %s c|c++ <library> <calls file> <repeat>\n", argv[0]);
+        return 2;
+    }
+    cpp = !strcmp(argv[1], "c++");
+    repeat = atoi(argv[4]);
+    lib = dlopen(argv[2], RTLD_NOW);
+    if (!lib) {
+        fprintf(stderr, "%s\n", dlerror());
+        return 1;
+    }
+    if (cpp) {
+        cpp_create = dlsym(lib, "isotp_create");
+        cpp_destroy = dlsym(lib, "isotp_destroy");
+        cpp_tick = dlsym(lib, "isotp_tick");
+        cpp_eval_msg = dlsym(lib, "isotp_eval_msg");
+        cpp_send_telegram = dlsym(lib, "isotp_send_telegram");
+        cpp_pending_frames_ptr = dlsym(lib, "isotp_pending_frames_ptr");
+        cpp_take_frames = dlsym(lib, "isotp_take_frames");
+        if (!cpp_create || !cpp_destroy || !cpp_tick || !cpp_eval_msg || !cpp_send_telegram || !cpp_pending_frames_ptr || !cpp_take_frames) {
+            fprintf(stderr, "%s: not the C ABI of the C++ engine\n", argv[2]);
+            return 1;
+        }
+    } else {
+        c_size = dlsym(lib, "isotp_listener_size");
+        c_init = dlsym(lib, "Isotp_Listener_init");
+        c_tick = dlsym(lib, "tick");
+        c_eval_msg = dlsym(lib, "eval_msg");
+        c_send_telegram = dlsym(lib, "send_telegram");
+        if (!c_size || !c_init || !c_tick || !c_eval_msg || !c_send_telegram) {
+            fprintf(stderr, "%s: not the C engine\n", argv[2]);
+            return 1;
+        }
+    }
+    if (read_calls(argv[3]) < 0) {
+        return 1;
+    }
+    // the engines print their DEBUG output to stdout, the result goes to the original one
+    fflush(stdout);
+    out = dup(1);
+    dup2(open("/dev/null", O_WRONLY), 1);
+    for (int i = 0; i < repeat; i++) {
+        seconds += cpp ? replay_cpp() : replay_c();
+    }
+    fflush(stdout);
+    dprintf(out, "%.9f\n", seconds);
+    return 0;
+}
@@ -55,6 +55,15 @@ class Service:
     ReadDTC= 0x19
 
 
+# converts a flow control stmin value into ms: 100us steps are below one tick, reserved values are the longest time
+def stmin_to_ms(stmin: int):
+    if stmin >= 0xF1 and stmin <= 0xF9:
+        return 0
+    if stmin > 127 or stmin < 0:
+        return 127
+    return stmin
+
+
 # the Isotp_Listener class
 class Isotp_Listener:
 
@@ -78,6 +87,7 @@ class Isotp_Listener:
         self.receive_flow_control_block_count=0
         self.consecutive_frame_delay=0
         self.last_frame_received_tick=0
+        self.last_frame_sent_tick=0
 
     def update_options(self, options: IsoTpOptions):
         self.options=options
@@ -88,13 +98,14 @@ class Isotp_Listener:
     def tick(self, time_ticks:int):
         self.this_tick = time_ticks
         if self.actual_state == ActualState.Consecutive:
-            if self.last_action_tick + self.consecutive_frame_delay < self.this_tick:
+            if self.last_action_tick + self.consecutive_frame_delay <= self.this_tick:
                 # it is time to send the next CF
                 self.send_cf_telegram()
             return False
         # are we waiting for something?
         if self.actual_state == ActualState.FlowControl or self.actual_state == ActualState.WaitConsecutive:
-            if self.last_frame_received_tick + self.options.frame_timeout < self.this_tick:
+            # the wait starts with the last frame received or sent, e.g. the last CF of a block before a flow control
+            if max(self.last_frame_received_tick, self.last_frame_sent_tick) + self.options.frame_timeout < self.this_tick:
             # waited too long
                 print("Tick Timeout")
                 self.actual_state = ActualState.Sleeping
@@ -136,6 +147,7 @@ class Isotp_Listener:
         self.actual_telegram_pos = 1 # the first byte is already used
         bytes_of_message = self.copy_to_telegram_buffer()
         nr_of_bytes = nr_of_bytes + bytes_of_message
+        self.last_frame_sent_tick = self.this_tick
         self.options.send_frame(self.options.target_address, self.telegrambuffer, 8)
         self.last_action_tick = self.this_tick # remember the time of this action
         if self.actual_send_pos >= self.actual_send_buffer_size:
@@ -167,15 +179,18 @@ class Isotp_Listener:
                 self.actual_telegram_pos = 1 # the first byte is already used
                 self.actual_send_pos = 0
                 nr_of_bytes = nr_of_bytes + self.copy_to_telegram_buffer()
+                self.last_frame_sent_tick = self.this_tick
                 self.options.send_frame(self.options.target_address, self.telegrambuffer, nr_of_bytes)
             else:
                 # generate first frame...
                 self.telegrambuffer[0] = 0x10 | self.actual_send_buffer_size >> 8
                 self.telegrambuffer[1] = self.actual_send_buffer_size & 0xFF
+                self.actual_cf_count = 1 # the sequence number continues over all blocks
                 nr_of_bytes = 2
                 self.actual_telegram_pos = 2 # the first two bytes are already used
                 self.actual_send_pos = 0
                 nr_of_bytes = nr_of_bytes + self.copy_to_telegram_buffer()
+                self.last_frame_sent_tick = self.this_tick
                 self.options.send_frame(self.options.target_address, self.telegrambuffer, nr_of_bytes)
                 self.actual_state = ActualState.FlowControl # wait for flow control
 
@@ -221,11 +236,13 @@ class Isotp_Listener:
             self.telegrambuffer[0] = 0x30          # FS Flow Status 0= CLear to Send
             self.telegrambuffer[1] = self.options.bs    # BS Block Size
             self.telegrambuffer[2] = self.options.stmin #  ST min. Separation Time
+            self.last_frame_sent_tick = self.this_tick
             self.options.send_frame(self.options.target_address, self.telegrambuffer, 3)
             self.receive_flow_control_block_count = self.options.bs
             if self.receive_flow_control_block_count == 0:
                 self.receive_flow_control_block_count = -1
             self.actual_state = ActualState.WaitConsecutive #  wait for Consecutive Frames
+            return MSG_UDS_OK
         if frametype == FrameType.FlowControl:
             flow_status = data[0] & 0x0F
             print("Flow Control\n")
@@ -246,8 +263,7 @@ class Isotp_Listener:
             if self.flow_control_block_size == 0:
                 # we use -1 as indicator that there's no block size given
                 self.flow_control_block_size = -1
-            self.consecutive_frame_delay = data[2] #  what's the time unit? For now assuming milliseconds..
-            self.actual_cf_count = 1
+            self.consecutive_frame_delay = stmin_to_ms(data[2])
             # and start sending with the next tick
             self.actual_state = ActualState.Consecutive
             return MSG_UDS_OK
@@ -267,6 +283,7 @@ class Isotp_Listener:
                     self.telegrambuffer[0] = 0x32 # FS Flow Status 2= Overflow
                     self.telegrambuffer[1] = 0
                     self.telegrambuffer[2] = 0
+                    self.last_frame_sent_tick = self.this_tick
                     self.options.send_frame(self.options.target_address, self.telegrambuffer, 3)
                     return MSG_UDS_UNEXPECTED_CF
                 self.receive_cf_count = (self.receive_cf_count +1) & 0x0F
@@ -285,11 +302,13 @@ class Isotp_Listener:
                             self.telegrambuffer[0] = 0x30          # FS Flow Status 0= CLear to Send
                             self.telegrambuffer[1] = self.options.bs    # BS Block Size
                             self.telegrambuffer[2] = self.options.stmin # ST min. Separation Time
+                            self.last_frame_sent_tick = self.this_tick
                             self.options.send_frame(self.options.target_address, self.telegrambuffer, 3)
                             self.receive_flow_control_block_count = self.options.bs
                             if self.receive_flow_control_block_count == 0:
                                 self.receive_flow_control_block_count = -1
                         return MSG_UDS_OK # message handled
+                    return MSG_UDS_OK # no block size limit, wait for the next CF
                 else: # something went wrong...
                     self.actual_state = ActualState.Sleeping # stop all activities
                     return MSG_UDS_WRONG_FORMAT          # illegal format
@@ -299,6 +318,7 @@ class Isotp_Listener:
                 self.telegrambuffer[0] = 0x32 # FS Flow Status 2= Overflow
                 self.telegrambuffer[1] = 0
                 self.telegrambuffer[2] = 0
+                self.last_frame_sent_tick = self.this_tick
                 self.options.send_frame(self.options.target_address, self.telegrambuffer, 3)
                 return MSG_UDS_UNEXPECTED_CF
         return MSG_UDS_ERROR # message handled
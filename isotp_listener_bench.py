@@ -0,0 +1,88 @@
+'''
+compares the throughput of the pure Python isotp_listener.py with the native isotp_listener_native.py
+
+each engine receives the same multi frame requests and answers them by a single frame, the native engine once
+frame by frame and once with batched eval_msgs()
+
+usage: python3 isotp_listener_bench.py [nr_of_messages] [message_size]
+'''
+
+import contextlib
+import os
+import sys
+import time
+
+import isotp_listener
+import isotp_listener_native
+
+
+# the frames of a multi frame request: first frame and consecutive frames
+def segment(message):
+    frames = [bytearray([0x10 | len(message) >> 8, len(message) & 0xFF]) + message[:6]]
+    pos = 6
+    sn = 1
+    while pos < len(message):
+        frames.append((bytearray([0x20 | sn]) + message[pos:pos + 7]).ljust(8, b"\0"))
+        pos += 7
+        sn = (sn + 1) & 0x0F
+    return frames
+
+
+def send_frame(can_id, data, len):
+    return 0
+
+
+def uds_handler(request_type, receive_buffer, receive_len, send_buffer):
+    send_buffer[0] = receive_buffer[0] + 0x40
+    return 1
+
+
+# silences the debug output of both engines, also the one written by the library directly into the file descriptors
+@contextlib.contextmanager
+def silenced():
+    sys.stdout.flush()
+    saved = os.dup(1), os.dup(2)
+    devnull = os.open(os.devnull, os.O_WRONLY)
+    os.dup2(devnull, 1)
+    os.dup2(devnull, 2)
+    try:
+        with open(os.devnull, "w") as null, contextlib.redirect_stdout(null):
+            yield
+    finally:
+        os.dup2(saved[0], 1)
+        os.dup2(saved[1], 2)
+        os.close(devnull)
+        os.close(saved[0])
+        os.close(saved[1])
+
+
+def run(name, module, messages, frames, batched=False):
+    options = isotp_listener.IsoTpOptions()
+    options.source_address = 0x7E1
+    options.target_address = 0x7E9
+    options.send_frame = send_frame
+    options.uds_handler = uds_handler
+    listener = module.Isotp_Listener(options)
+    batch = [(0x7E1, frame, 8) for frame in frames]
+    with silenced():
+        start = time.perf_counter()
+        for i in range(messages):
+            if batched:
+                listener.eval_msgs(batch)
+            else:
+                for frame in frames:
+                    listener.eval_msg(0x7E1, frame, 8)
+        seconds = time.perf_counter() - start
+    nr_of_frames = messages * len(frames)
+    print(f"{name:24} {nr_of_frames / seconds:12.0f} frames/s {messages / seconds:10.1f} msg/s")
+    return nr_of_frames / seconds
+
+
+messages = int(sys.argv[1]) if len(sys.argv) > 1 else 200
+message_size = int(sys.argv[2]) if len(sys.argv) > 2 else 4095
+frames = segment(bytearray([0x22] + [i & 0xFF for i in range(message_size - 1)]))
+print(f"{messages} requests of {message_size} bytes ({len(frames)} frames each)")
+pure = run("pure Python", isotp_listener, messages, frames)
+native = run("native", isotp_listener_native, messages, frames)
+batched = run("native, batched", isotp_listener_native, messages, frames, True)
+print(f"speedup: {native / pure:.1f}x frame by frame, {batched / pure:.1f}x batched")
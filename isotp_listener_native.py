@@ -0,0 +1,153 @@
+'''
+native drop-in replacement of isotp_listener.py
+
+this module has the same Isotp_Listener API as isotp_listener.py, but runs the C++ state machine of
+https://github.com/stko/isotp_listener, loaded by ctypes through its C ABI (c++/isotp_listener_capi.h)
+
+build the library first:
+
+  cd c++
+  g++ -std=c++17 -O2 -shared -fPIC isotp_listener.cpp isotp_listener_capi.cpp uds_service_registry.cpp uds_response_cache.cpp isotp_capture.cpp isotp_latency.cpp uds_ipc.cpp -o libisotp_listener.so
+
+the library is searched in c++/ next to this module or taken from the environment variable ISOTP_LISTENER_LIB
+
+Python is only called for complete UDS messages (options.uds_handler) and for the sent frames. These are
+handed over in batches: either all frames of one call at once to options.send_frames(frames) with a list
+of (can_id, data, len) tuples, or - if only options.send_frame is given - frame by frame as before.
+eval_msgs() takes a whole batch of received frames with one call into the library.
+'''
+
+import ctypes
+import os
+
+from isotp_listener import IsoTpOptions, RequestType, Service, UDS_BUFFER_SIZE
+from isotp_listener import MSG_NO_UDS, MSG_UDS_OK, MSG_UDS_WRONG_FORMAT, MSG_UDS_UNEXPECTED_CF, MSG_UDS_ERROR
+
+UDS_HANDLER = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_void_p, ctypes.c_int, ctypes.POINTER(ctypes.c_ubyte), ctypes.c_int, ctypes.POINTER(ctypes.c_ubyte))
+
+MAX_FRAMES_PER_TAKE = 256
+
+
+def load_library():
+    path = os.environ.get("ISOTP_LISTENER_LIB", os.path.join(os.path.dirname(os.path.abspath(__file__)), "c++", "libisotp_listener.so"))
+    lib = ctypes.CDLL(path)
+    lib.isotp_create.restype = ctypes.c_void_p
+    lib.isotp_create.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int, UDS_HANDLER, ctypes.c_void_p]
+    lib.isotp_destroy.argtypes = [ctypes.c_void_p]
+    lib.isotp_update_options.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int]
+    lib.isotp_eval_msg.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_char_p, ctypes.c_int]
+    lib.isotp_eval_msgs.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_int), ctypes.c_char_p, ctypes.POINTER(ctypes.c_int), ctypes.c_int, ctypes.POINTER(ctypes.c_int)]
+    lib.isotp_tick.argtypes = [ctypes.c_void_p, ctypes.c_uint64]
+    lib.isotp_send_telegram.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_int]
+    lib.isotp_busy.argtypes = [ctypes.c_void_p]
+    lib.isotp_pending_frames.argtypes = [ctypes.c_void_p]
+    lib.isotp_pending_frames_ptr.restype = ctypes.POINTER(ctypes.c_int)
+    lib.isotp_pending_frames_ptr.argtypes = [ctypes.c_void_p]
+    # the buffers are passed by their addresses: plain integers are converted much faster than ctypes arrays
+    lib.isotp_take_frames.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int]
+    return lib
+
+
+lib = load_library()
+
+
+# the Isotp_Listener class
+class Isotp_Listener:
+
+    def __init__(self, options: IsoTpOptions):
+        self.options = options
+        self.buffers = None # ctypes views on the receive and send buffer of the library, created with the first message
+        # keep a reference to the callback, otherways it's garbage collected while the library still uses it
+        self.c_uds_handler = UDS_HANDLER(self.call_uds_handler)
+        self.handle = lib.isotp_create(options.source_address, options.target_address, options.bs, options.stmin, options.frame_timeout, self.c_uds_handler, None)
+        # the number of sent frames waiting in the library, readable without a call
+        self.pending_frames = lib.isotp_pending_frames_ptr(self.handle).contents
+        # buffers to drain the sent frames
+        self.frame_ids = (ctypes.c_int * MAX_FRAMES_PER_TAKE)()
+        self.frame_data = (ctypes.c_ubyte * (8 * MAX_FRAMES_PER_TAKE))()
+        self.frame_lens = (ctypes.c_int * MAX_FRAMES_PER_TAKE)()
+        self.frame_buffers = (ctypes.addressof(self.frame_ids), ctypes.addressof(self.frame_data), ctypes.addressof(self.frame_lens))
+        self.frame_view = memoryview(self.frame_data).cast("B") # the frames are copied out of it without a call into ctypes
+
+    def __del__(self):
+        if getattr(self, "handle", None):
+            lib.isotp_destroy(self.handle)
+            self.handle = None
+
+    def update_options(self, options: IsoTpOptions):
+        self.options = options
+        lib.isotp_update_options(self.handle, options.source_address, options.target_address, options.bs, options.stmin, options.frame_timeout)
+
+    def get_options(self):
+        return self.options
+
+    # called by the library with each complete message
+    def call_uds_handler(self, user, request_type, receive_buffer, receive_len, send_buffer):
+        if not self.options.uds_handler:
+            return 0
+        if self.buffers is None: # the buffers are members of the listener, so their addresses never change
+            self.buffers = (
+                ctypes.cast(receive_buffer, ctypes.POINTER(ctypes.c_ubyte * UDS_BUFFER_SIZE)).contents,
+                ctypes.cast(send_buffer, ctypes.POINTER(ctypes.c_ubyte * UDS_BUFFER_SIZE)).contents,
+            )
+        try:
+            return self.options.uds_handler(request_type, self.buffers[0], receive_len, self.buffers[1])
+        except Exception as ex:
+            print("uds_handler failed:", ex)
+            return 0
+
+    # hands all frames sent by the library over to the application
+    def flush_frames(self):
+        while self.pending_frames.value:
+            ids, data, lens = self.frame_buffers
+            count = lib.isotp_take_frames(self.handle, ids, data, lens, MAX_FRAMES_PER_TAKE)
+            view = self.frame_view # only the taken frames are copied, not the whole buffer
+            frames = [(self.frame_ids[i], bytearray(view[i * 8:i * 8 + 8]), self.frame_lens[i]) for i in range(count)]
+            send_frames = getattr(self.options, "send_frames", None)
+            if send_frames:
+                send_frames(frames)
+            else:
+                for can_id, frame, length in frames:
+                    self.options.send_frame(can_id, frame, length)
+
+    def tick(self, time_ticks: int):
+        result = lib.isotp_tick(self.handle, int(time_ticks))
+        if self.pending_frames.value: # most calls send nothing, they don't need the method call
+            self.flush_frames()
+        return bool(result)
+
+    def send_telegram(self, data: bytearray, nr_of_bytes: int):
+        lib.isotp_send_telegram(self.handle, bytes(data[:nr_of_bytes]), nr_of_bytes)
+        if self.pending_frames.value:
+            self.flush_frames()
+
+    '''
+    checks, if the given can message is a isotp message.
+
+    returns MSG_xx error codes
+    '''
+    def eval_msg(self, can_id: int, data: bytearray, nr_of_bytes: int):
+        result = lib.isotp_eval_msg(self.handle, can_id, bytes(data[:8]), nr_of_bytes)
+        if self.pending_frames.value:
+            self.flush_frames()
+        return result
+
+    '''
+    evaluates a batch of received frames, given as list of (can_id, data, nr_of_bytes)
+
+    returns the list of the MSG_xx codes of all frames
+    '''
+    def eval_msgs(self, frames):
+        n = len(frames)
+        can_ids = (ctypes.c_int * n)(*[frame[0] for frame in frames])
+        lens = (ctypes.c_int * n)(*[frame[2] for frame in frames])
+        data = b"".join(bytes(frame[1][:8]).ljust(8, b"\0") for frame in frames)
+        results = (ctypes.c_int * n)()
+        lib.isotp_eval_msgs(self.handle, can_ids, data, lens, n, results)
+        if self.pending_frames.value:
+            self.flush_frames()
+        return list(results)
+
+    # True if a transfer is actual ongoing
+    def busy(self):
+        return bool(lib.isotp_busy(self.handle))